@@ -0,0 +1,295 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#include "archive.h"
+
+// maximal number of bytes of a variable-length integer
+static const size_t VARINT_MAX = 10;
+// initial size of the buffer for the encoded occupancies
+static const size_t BUFFER_INITIAL = 4096;
+
+/*
+ * Makes sure that 'needed' more bytes fit into the buffer of the archive.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+static int reserve_buffer(archive_t *archive, const size_t needed)
+{
+    if (archive->buffer_size + needed <= archive->capacity) return 0;
+
+    size_t capacity = archive->capacity == 0 ? BUFFER_INITIAL : archive->capacity;
+    while (capacity < archive->buffer_size + needed) capacity *= 2;
+
+    unsigned char *buffer = realloc(archive->buffer, capacity);
+    if (buffer == NULL) return 1;
+
+    archive->buffer = buffer;
+    archive->capacity = capacity;
+    return 0;
+}
+
+/*
+ * Appends a variable-length integer to the buffer. The buffer must have space for VARINT_MAX bytes.
+ */
+static inline void write_varint(archive_t *archive, uint64_t value)
+{
+    while (value >= 0x80) {
+        archive->buffer[archive->buffer_size++] = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    archive->buffer[archive->buffer_size++] = (unsigned char) value;
+}
+
+/*
+ * Reads a variable-length integer from the data, never reading past the end.
+ * Returns zero, if successful. Returns non-zero if the integer is not complete.
+ */
+static inline int read_varint(const unsigned char *data, const size_t size, size_t *position, uint64_t *value)
+{
+    *value = 0;
+    for (size_t shift = 0; shift < 7 * VARINT_MAX && *position < size; shift += 7) {
+        const unsigned char byte = data[(*position)++];
+        *value |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Adds the number of samples to a part of a tile.
+ */
+static inline void tile_add_count(tile_t *tile, const int part, const uint64_t count)
+{
+    tile_t sample = {{0}, {0}, {0}};
+    sample.count[part] = (uint32_t) count;
+    sample.count_high[part] = (uint32_t) (count >> 32);
+    tile_merge(tile, &sample);
+}
+
+archive_t *archive_create(
+        FILE *output,
+        const float dimx[2],
+        const float dimy[2],
+        const int tiles_per_nm,
+        const char **names,
+        const size_t n_channels,
+        const float height,
+        const char *program,
+        const char *version,
+        int argc,
+        char **argv)
+{
+    archive_t *archive = calloc(1, sizeof(archive_t));
+    if (archive == NULL) return NULL;
+
+    archive->file = output;
+    archive_header_t *header = &archive->header;
+    memcpy(header->magic, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC));
+    header->byte_order = MAP_BYTE_ORDER;
+    header->header_size = sizeof(archive_header_t);
+    memcpy(header->dimx, dimx, 2 * sizeof(float));
+    memcpy(header->dimy, dimy, 2 * sizeof(float));
+    header->tiles_per_nm = tiles_per_nm;
+    header->n_channels = n_channels;
+    header->n_rows = (uint64_t) roundf((dimy[1] - dimy[0]) * tiles_per_nm) + 1;
+    header->n_cols = (uint64_t) roundf((dimx[1] - dimx[0]) * tiles_per_nm) + 1;
+    header->height = height;
+    strncpy(header->program, program, sizeof(header->program) - 1);
+    strncpy(header->version, version, sizeof(header->version) - 1);
+
+    // command line as written into the maps
+    size_t command_length = 1;
+    for (int i = 0; i < argc; ++i) command_length += strlen(argv[i]) + 1;
+    header->command_length = command_length;
+
+    char *command_line = calloc(command_length, 1);
+    archive->names = calloc(n_channels, ARCHIVE_NAME_LENGTH);
+    archive->previous = calloc(n_channels * 2 * header->n_rows * header->n_cols, sizeof(uint64_t));
+    if (command_line == NULL || archive->names == NULL || archive->previous == NULL) {
+        free(command_line);
+        archive_destroy(archive);
+        return NULL;
+    }
+
+    for (int i = 0; i < argc; ++i) {
+        strcat(command_line, argv[i]);
+        strcat(command_line, " ");
+    }
+
+    for (size_t c = 0; c < n_channels; ++c) strncpy(archive->names[c], names[c], ARCHIVE_NAME_LENGTH - 1);
+
+    int error = fwrite(header, sizeof(archive_header_t), 1, archive->file) != 1 ||
+                fwrite(command_line, 1, command_length, archive->file) != command_length ||
+                fwrite(archive->names, ARCHIVE_NAME_LENGTH, n_channels, archive->file) != n_channels;
+    free(command_line);
+
+    if (error) {
+        archive_destroy(archive);
+        return NULL;
+    }
+
+    return archive;
+}
+
+archive_t *archive_open(FILE *input)
+{
+    archive_t *archive = calloc(1, sizeof(archive_t));
+    if (archive == NULL) return NULL;
+
+    archive->file = input;
+    archive_header_t *header = &archive->header;
+    if (fread(header, sizeof(archive_header_t), 1, archive->file) != 1 ||
+        memcmp(header->magic, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC)) != 0 ||
+        header->byte_order != MAP_BYTE_ORDER ||
+        header->header_size != sizeof(archive_header_t) ||
+        header->tiles_per_nm <= 0 ||
+        header->n_channels == 0 ||
+        memchr(header->program, '\0', sizeof(header->program)) == NULL ||
+        memchr(header->version, '\0', sizeof(header->version)) == NULL) {
+            archive_destroy(archive);
+            return NULL;
+        }
+
+    // the grid dimensions must reproduce the stored number of tiles
+    if (header->dimx[0] >= header->dimx[1] || header->dimy[0] >= header->dimy[1] ||
+        header->n_rows != (uint64_t) roundf((header->dimy[1] - header->dimy[0]) * header->tiles_per_nm) + 1 ||
+        header->n_cols != (uint64_t) roundf((header->dimx[1] - header->dimx[0]) * header->tiles_per_nm) + 1) {
+            archive_destroy(archive);
+            return NULL;
+        }
+
+    // the command line is not needed for reading
+    archive->names = calloc(header->n_channels, ARCHIVE_NAME_LENGTH);
+    if (archive->names == NULL || fseek(archive->file, header->command_length, SEEK_CUR) != 0 ||
+        fread(archive->names, ARCHIVE_NAME_LENGTH, header->n_channels, archive->file) != header->n_channels) {
+            archive_destroy(archive);
+            return NULL;
+        }
+
+    for (uint32_t c = 0; c < header->n_channels; ++c) archive->names[c][ARCHIVE_NAME_LENGTH - 1] = '\0';
+
+    return archive;
+}
+
+void archive_destroy(archive_t *archive)
+{
+    if (archive == NULL) return;
+
+    free(archive->names);
+    free(archive->previous);
+    free(archive->buffer);
+    free(archive);
+}
+
+int archive_write_frame(archive_t *archive, grid_t **grids, const size_t n_threads, const frame_t *frame, const int n_pores)
+{
+    const size_t n_rows = archive->header.n_rows;
+    const size_t n_cols = archive->header.n_cols;
+    const size_t n_tiles = n_rows * n_cols;
+    archive->buffer_size = 0;
+
+    for (size_t c = 0; c < archive->header.n_channels; ++c) {
+        grid_t **channel_grids = grids + c * n_threads;
+
+        for (int part = 0; part < 2; ++part) {
+            uint64_t *previous = archive->previous + (2 * c + part) * n_tiles;
+
+            // the number of non-empty tiles precedes the tiles, so it is written into a separate position
+            // once the tiles are encoded (the buffer always has space for the largest possible number)
+            if (reserve_buffer(archive, VARINT_MAX) != 0) return 1;
+            const size_t count_position = archive->buffer_size;
+            archive->buffer_size += VARINT_MAX;
+
+            uint64_t n_nonempty = 0, skipped = 0;
+            for (size_t y_index = 0; y_index < n_rows; ++y_index) {
+                for (size_t x_index = 0; x_index < n_cols; ++x_index) {
+                    uint64_t total = 0;
+                    for (size_t t = 0; t < n_threads; ++t) total += tile_count(grid_tile(channel_grids[t], x_index, y_index), part);
+
+                    const size_t index = y_index * n_cols + x_index;
+                    const uint64_t count = total - previous[index];
+                    previous[index] = total;
+
+                    if (count == 0) {
+                        ++skipped;
+                        continue;
+                    }
+
+                    if (reserve_buffer(archive, 2 * VARINT_MAX) != 0) return 1;
+                    write_varint(archive, skipped);
+                    write_varint(archive, count);
+                    skipped = 0;
+                    ++n_nonempty;
+                }
+            }
+
+            // move the encoded tiles right after the number of non-empty tiles
+            const size_t end = archive->buffer_size;
+            archive->buffer_size = count_position;
+            write_varint(archive, n_nonempty);
+            const size_t start = count_position + VARINT_MAX;
+            memmove(archive->buffer + archive->buffer_size, archive->buffer + start, end - start);
+            archive->buffer_size += end - start;
+        }
+    }
+
+    archive_frame_t record = { (uint32_t) archive->buffer_size, frame->step, frame->time, n_pores };
+    if (fwrite(&record, sizeof(archive_frame_t), 1, archive->file) != 1 ||
+        fwrite(archive->buffer, 1, archive->buffer_size, archive->file) != archive->buffer_size) {
+            return 1;
+        }
+
+    return 0;
+}
+
+int archive_read_frame(archive_t *archive)
+{
+    // the archive may only end between two frames
+    size_t n_read = fread(&archive->frame, 1, sizeof(archive_frame_t), archive->file);
+    if (n_read == 0 && feof(archive->file)) return 1;
+    if (n_read != sizeof(archive_frame_t)) return 2;
+
+    // every non-empty tile takes at most two variable-length integers
+    const uint64_t n_tiles = archive->header.n_rows * archive->header.n_cols;
+    const uint64_t max_size = 2 * archive->header.n_channels * (1 + 2 * n_tiles) * VARINT_MAX;
+    if (archive->frame.size > max_size) return 2;
+
+    archive->buffer_size = 0;
+    if (reserve_buffer(archive, archive->frame.size) != 0) return 2;
+    if (fread(archive->buffer, 1, archive->frame.size, archive->file) != archive->frame.size) return 2;
+    archive->buffer_size = archive->frame.size;
+
+    return 0;
+}
+
+int archive_add_frame(const archive_t *archive, grid_t **grids)
+{
+    const size_t n_cols = archive->header.n_cols;
+    const uint64_t n_tiles = archive->header.n_rows * n_cols;
+    const unsigned char *data = archive->buffer;
+    const size_t size = archive->buffer_size;
+    size_t position = 0;
+
+    for (size_t c = 0; c < archive->header.n_channels; ++c) {
+        for (int part = 0; part < 2; ++part) {
+            uint64_t n_nonempty = 0;
+            if (read_varint(data, size, &position, &n_nonempty) != 0 || n_nonempty > n_tiles) return 1;
+
+            uint64_t index = 0;
+            for (uint64_t i = 0; i < n_nonempty; ++i) {
+                uint64_t skipped = 0, count = 0;
+                if (read_varint(data, size, &position, &skipped) != 0 ||
+                    read_varint(data, size, &position, &count) != 0 ||
+                    skipped >= n_tiles - index) {
+                        return 1;
+                    }
+
+                index += skipped;
+                tile_add_count(grid_tile(grids[c], index % n_cols, index / n_cols), part, count);
+                ++index;
+            }
+        }
+    }
+
+    return position != size;
+}
@@ -0,0 +1,119 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "grid.h"
+#include "frame.h"
+
+// identifies archives of per-frame tile occupancies
+#define ARCHIVE_MAGIC "MEMDARC"
+// maximal length of the name of a mapped channel (including the terminating zero)
+#define ARCHIVE_NAME_LENGTH 32
+
+/*
+ * Header of an archive of per-frame tile occupancies. All numbers are stored in the native byte order
+ * (checked using MAP_BYTE_ORDER).
+ *
+ * The header is followed by the command line (a zero-terminated string), by the names of all mapped channels
+ * (n_channels times ARCHIVE_NAME_LENGTH bytes; the first channel is water) and then by the frames.
+ * Every frame starts with archive_frame_t followed by the encoded occupancies. For every channel and every part
+ * (upper and lower leaflet), the number of atoms assigned to each tile in this frame is stored as the number
+ * of non-empty tiles followed by a pair (number of skipped empty tiles, number of atoms) for every non-empty tile.
+ * The tiles are visited row by row and all numbers are written as variable-length integers
+ * (7 bits per byte, lowest bits first), so the sparse occupancies of a frame take a few bytes per non-empty tile.
+ */
+typedef struct archive_header {
+    char magic[8];              // ARCHIVE_MAGIC
+    uint32_t byte_order;        // MAP_BYTE_ORDER
+    uint32_t header_size;       // size of this structure
+    float dimx[2];              // grid dimensions (as used to create the grid)
+    float dimy[2];
+    int32_t tiles_per_nm;
+    uint32_t n_channels;
+    uint64_t n_rows;
+    uint64_t n_cols;
+    float height;               // height of the analyzed area around the membrane center
+    uint32_t command_length;    // length of the command line including the terminating zero
+    char program[64];
+    char version[32];
+} archive_header_t;
+
+/*
+ * Record preceding the encoded occupancies of a single frame.
+ */
+typedef struct archive_frame {
+    uint32_t size;              // size of the encoded occupancies following this record
+    int32_t step;
+    float time;
+    int32_t n_pores;            // number of water pores in the frame (-1 if pores were not detected)
+} archive_frame_t;
+
+/*
+ * Archive of per-frame tile occupancies opened for writing or for reading.
+ */
+typedef struct archive {
+    FILE *file;
+    archive_header_t header;
+    char (*names)[ARCHIVE_NAME_LENGTH]; // names of the channels
+    uint64_t *previous;         // occupancies collected in all previous frames (writing only)
+    unsigned char *buffer;      // encoded occupancies of the current frame
+    size_t buffer_size;
+    size_t capacity;
+    archive_frame_t frame;      // record of the current frame (reading only)
+} archive_t;
+
+/*
+ * Creates an archive for the channels mapped into grids with the specified dimensions and writes its header
+ * into the (binary) output file.
+ * Returns NULL if the header could not be written or the memory could not be allocated.
+ */
+archive_t *archive_create(
+        FILE *output,
+        const float dimx[2],
+        const float dimy[2],
+        const int tiles_per_nm,
+        const char **names,
+        const size_t n_channels,
+        const float height,
+        const char *program,
+        const char *version,
+        int argc,
+        char **argv);
+
+/*
+ * Reads the header of an archive from the (binary) input file and prepares the archive for reading.
+ * Returns NULL if the file is not a valid archive or the memory could not be allocated.
+ */
+archive_t *archive_open(FILE *input);
+
+/*
+ * Frees all memory associated with the archive. Does not close the file.
+ */
+void archive_destroy(archive_t *archive);
+
+/*
+ * Writes the occupancies collected in the current frame into the archive.
+ * The grids accumulate the data of all frames (n_threads grids for every channel, as used by wdmap);
+ * the occupancies of the current frame are the difference from the previously archived frame.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+int archive_write_frame(archive_t *archive, grid_t **grids, const size_t n_threads, const frame_t *frame, const int n_pores);
+
+/*
+ * Reads the next frame of the archive without decoding its occupancies.
+ * Returns zero, if successful. Returns 1 at the end of the archive and 2 if the archive is corrupted.
+ */
+int archive_read_frame(archive_t *archive);
+
+/*
+ * Decodes the occupancies of the last read frame and adds them to the grids (one grid for every channel).
+ * The grids must have been created with the dimensions stored in the header.
+ * Returns zero, if successful. Returns non-zero if the frame is corrupted.
+ */
+int archive_add_frame(const archive_t *archive, grid_t **grids);
+
+#endif /* ARCHIVE_H */
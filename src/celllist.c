@@ -0,0 +1,131 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#include "celllist.h"
+
+// maximal number of cells along each axis (cells of very small cutoffs are merged to keep the memory bounded)
+static const size_t MAX_CELLS = 128;
+
+cell_list_t *cell_list_create(const float cutoff, const int dimensions)
+{
+    cell_list_t *list = calloc(1, sizeof(cell_list_t));
+    if (list == NULL) return NULL;
+
+    list->cutoff = cutoff;
+    list->dimensions = dimensions;
+    return list;
+}
+
+void cell_list_destroy(cell_list_t *list)
+{
+    if (list == NULL) return;
+
+    free(list->atoms);
+    free(list->cell_start);
+    free(list->atom_cell);
+    free(list);
+}
+
+/*
+ * Returns the index of the cell along an axis periodic in the box.
+ */
+static inline size_t periodic_cell(const float coordinate, const float box, const float size, const size_t n_cells)
+{
+    float wrapped = coordinate - box * floorf(coordinate / box);
+    size_t index = (size_t) (wrapped / size);
+    return index >= n_cells ? n_cells - 1 : index;
+}
+
+/*
+ * Returns the index of the cell containing the position along each axis.
+ */
+static inline void cell_indices(const cell_list_t *list, const float *position, size_t indices[3])
+{
+    for (int dim = 0; dim < 3; ++dim) {
+        indices[dim] = list->n_cells[dim] == 1 ? 0 : periodic_cell(position[dim], list->box[dim], list->cell_size[dim], list->n_cells[dim]);
+    }
+}
+
+int cell_list_build(cell_list_t *list, const frame_t *frame, const size_t *ids, const size_t n_atoms)
+{
+    memcpy(list->box, frame->box, sizeof(box_t));
+    for (int dim = 0; dim < 3; ++dim) {
+        size_t n_cells = 1;
+        if (dim < list->dimensions && frame->box[dim] > 0) n_cells = (size_t) (frame->box[dim] / list->cutoff);
+        if (n_cells == 0) n_cells = 1;
+        if (n_cells > MAX_CELLS) n_cells = MAX_CELLS;
+
+        list->n_cells[dim] = n_cells;
+        list->cell_size[dim] = frame->box[dim] / n_cells;
+    }
+
+    const size_t n_cells = list->n_cells[0] * list->n_cells[1] * list->n_cells[2];
+    if (n_cells + 1 > list->cells_capacity) {
+        size_t *cell_start = realloc(list->cell_start, (n_cells + 1) * sizeof(size_t));
+        if (cell_start == NULL) return 1;
+        list->cell_start = cell_start;
+        list->cells_capacity = n_cells + 1;
+    }
+
+    if (n_atoms > list->atoms_capacity) {
+        size_t *atoms = realloc(list->atoms, n_atoms * sizeof(size_t));
+        if (atoms == NULL) return 1;
+        list->atoms = atoms;
+
+        size_t *atom_cell = realloc(list->atom_cell, n_atoms * sizeof(size_t));
+        if (atom_cell == NULL) return 1;
+        list->atom_cell = atom_cell;
+
+        list->atoms_capacity = n_atoms;
+    }
+
+    // count the atoms in every cell
+    memset(list->cell_start, 0, (n_cells + 1) * sizeof(size_t));
+    for (size_t i = 0; i < n_atoms; ++i) {
+        size_t indices[3] = {0};
+        cell_indices(list, frame->positions[ids[i]], indices);
+        size_t cell = (indices[2] * list->n_cells[1] + indices[1]) * list->n_cells[0] + indices[0];
+        list->atom_cell[i] = cell;
+        ++list->cell_start[cell + 1];
+    }
+
+    for (size_t cell = 0; cell < n_cells; ++cell) list->cell_start[cell + 1] += list->cell_start[cell];
+
+    // place the atoms into their cells (cell_start temporarily points to the end of the filled part of every cell)
+    for (size_t i = 0; i < n_atoms; ++i) list->atoms[list->cell_start[list->atom_cell[i]]++] = ids[i];
+    for (size_t cell = n_cells; cell > 0; --cell) list->cell_start[cell] = list->cell_start[cell - 1];
+    list->cell_start[0] = 0;
+
+    list->n_atoms = n_atoms;
+    return 0;
+}
+
+size_t cell_list_neighbors(const cell_list_t *list, const vec_t position, size_t cells[CELL_LIST_NEIGHBORS])
+{
+    size_t indices[3] = {0};
+    cell_indices(list, position, indices);
+
+    // neighboring indices along every axis (without duplicates)
+    size_t neighbors[3][3] = {{0}};
+    size_t n_neighbors[3] = {0};
+    for (int dim = 0; dim < 3; ++dim) {
+        const size_t n_cells = list->n_cells[dim];
+        const size_t candidates[3] = { (indices[dim] + n_cells - 1) % n_cells, indices[dim], (indices[dim] + 1) % n_cells };
+        for (int i = 0; i < 3; ++i) {
+            int duplicate = 0;
+            for (size_t j = 0; j < n_neighbors[dim]; ++j) duplicate |= neighbors[dim][j] == candidates[i];
+            if (!duplicate) neighbors[dim][n_neighbors[dim]++] = candidates[i];
+        }
+    }
+
+    size_t n = 0;
+    for (size_t k = 0; k < n_neighbors[2]; ++k) {
+        for (size_t j = 0; j < n_neighbors[1]; ++j) {
+            for (size_t i = 0; i < n_neighbors[0]; ++i) {
+                cells[n++] = (neighbors[2][k] * list->n_cells[1] + neighbors[1][j]) * list->n_cells[0] + neighbors[0][i];
+            }
+        }
+    }
+
+    return n;
+}
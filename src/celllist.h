@@ -0,0 +1,60 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#ifndef CELLLIST_H
+#define CELLLIST_H
+
+#include <groan.h>
+#include "frame.h"
+
+// maximal number of cells neighboring a position (including its own cell)
+#define CELL_LIST_NEIGHBORS 27
+
+/*
+ * Periodic cell list of atoms of a single frame.
+ * The box is split into cells at least 'cutoff' wide, so all atoms closer than the cutoff to a position
+ * are located in the cell of the position or in the neighboring cells.
+ * With two dimensions, the cells only split the xy-plane (each cell is a column spanning the whole box).
+ *
+ * The atoms are sorted by their cells using a counting sort; the memory is only reallocated
+ * if the list grows, so rebuilding the list in every frame does not allocate memory.
+ */
+typedef struct cell_list {
+    int dimensions;             // 2 or 3
+    float cutoff;               // minimal size of a cell
+    size_t n_cells[3];          // number of cells along each axis (1 along z for two dimensions)
+    vec_t cell_size;
+    box_t box;                  // box of the frame for which the list has been built
+    size_t n_atoms;
+    size_t *atoms;              // ids of the atoms in the frame sorted by cells
+    size_t *cell_start;         // index of the first atom of every cell in 'atoms' (followed by n_atoms)
+    size_t *atom_cell;          // cell of every atom in the order in which the atoms were provided
+    size_t atoms_capacity;
+    size_t cells_capacity;
+} cell_list_t;
+
+/*
+ * Prepares an empty cell list with the specified cutoff and number of dimensions (2 or 3).
+ * Returns NULL if the memory could not be allocated.
+ */
+cell_list_t *cell_list_create(const float cutoff, const int dimensions);
+
+/*
+ * Frees all memory associated with the cell list.
+ */
+void cell_list_destroy(cell_list_t *list);
+
+/*
+ * Sorts the atoms with the provided ids into the cells of the box of the frame.
+ * Returns zero, if successful. Returns non-zero if the memory could not be allocated.
+ */
+int cell_list_build(cell_list_t *list, const frame_t *frame, const size_t *ids, const size_t n_atoms);
+
+/*
+ * Writes the indices of the cells neighboring the position (including its own cell) into 'cells'.
+ * Every cell is only listed once, even if the box is only one or two cells wide.
+ * Returns the number of listed cells.
+ */
+size_t cell_list_neighbors(const cell_list_t *list, const vec_t position, size_t cells[CELL_LIST_NEIGHBORS]);
+
+#endif /* CELLLIST_H */
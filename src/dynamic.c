@@ -0,0 +1,169 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#include "dynamic.h"
+
+// keyword separating the static part of a dynamic selection from its radius and reference
+static const char WITHIN[] = " within ";
+
+/*
+ * Compares two atom ids (for qsort).
+ */
+static int compare_ids(const void *a, const void *b)
+{
+    const size_t id_a = *(const size_t *) a;
+    const size_t id_b = *(const size_t *) b;
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+int dynamic_query(const char *query)
+{
+    return strstr(query, WITHIN) != NULL;
+}
+
+atom_selection_t *dynamic_select(
+        atom_selection_t *all,
+        const char *query,
+        dict_t *ndx_groups,
+        atom_selection_t **reference,
+        float *radius)
+{
+    *reference = NULL;
+
+    const char *keyword = strstr(query, WITHIN);
+    if (keyword == NULL) return smart_select(all, query, ndx_groups);
+
+    // parse "SELECTION within RADIUS of REFERENCE"
+    char *end = NULL;
+    *radius = strtof(keyword + strlen(WITHIN), &end);
+    while (*end == ' ') ++end;
+    if (keyword == query || end == keyword + strlen(WITHIN) || *radius <= 0 ||
+        strncmp(end, "of ", 3) != 0 || end[3 + strspn(end + 3, " ")] == '\0') {
+            fprintf(stderr, "Could not understand dynamic selection '%s' (expected 'SELECTION within RADIUS of REFERENCE').\n", query);
+            return NULL;
+        }
+
+    char *static_query = strndup(query, keyword - query);
+    if (static_query == NULL) return NULL;
+
+    atom_selection_t *atoms = smart_select(all, static_query, ndx_groups);
+    *reference = smart_select(all, end + 3 + strspn(end + 3, " "), ndx_groups);
+    free(static_query);
+
+    if (*reference == NULL || (*reference)->n_atoms == 0) {
+        fprintf(stderr, "No reference atoms of dynamic selection '%s' detected.\n", query);
+        free(atoms);
+        free(*reference);
+        *reference = NULL;
+        return NULL;
+    }
+
+    return atoms;
+}
+
+dynamic_selection_t *dynamic_create(const subset_t *candidates, const subset_t *reference, const float radius)
+{
+    dynamic_selection_t *selection = calloc(1, sizeof(dynamic_selection_t));
+    if (selection == NULL) return NULL;
+
+    selection->radius = radius;
+    selection->candidates = candidates;
+    selection->reference = reference;
+    selection->selected = calloc(1, sizeof(subset_t) + candidates->n_atoms * sizeof(size_t));
+    if (selection->selected == NULL) {
+        free(selection);
+        return NULL;
+    }
+
+    return selection;
+}
+
+void dynamic_destroy(dynamic_selection_t *selection)
+{
+    if (selection == NULL) return;
+
+    free(selection->selected);
+    free(selection);
+}
+
+selector_t *selector_create(const frame_t *frame, dynamic_selection_t **selections, const size_t n_selections)
+{
+    if (n_selections == 0 || n_selections > DYNAMIC_MAX_SELECTIONS) return NULL;
+
+    selector_t *selector = calloc(1, sizeof(selector_t));
+    if (selector == NULL) return NULL;
+
+    // cells must be wide enough for the largest radius
+    float cutoff = 0.0f;
+    subset_t *candidates[DYNAMIC_MAX_SELECTIONS] = {NULL};
+    for (size_t s = 0; s < n_selections; ++s) {
+        selector->selections[s] = selections[s];
+        candidates[s] = (subset_t *) selections[s]->candidates;
+        if (selections[s]->radius > cutoff) cutoff = selections[s]->radius;
+    }
+    selector->n_selections = n_selections;
+
+    selector->masks = malloc(frame->n_atoms * sizeof(uint32_t));
+    selector->marks = calloc(frame->n_atoms, sizeof(uint32_t));
+    selector->list = cell_list_create(cutoff, 3);
+    if (selector->masks != NULL) selector->candidates = subset_union(frame, candidates, n_selections, selector->masks);
+
+    if (selector->masks == NULL || selector->marks == NULL || selector->list == NULL || selector->candidates == NULL) {
+        selector_destroy(selector);
+        return NULL;
+    }
+
+    return selector;
+}
+
+void selector_destroy(selector_t *selector)
+{
+    if (selector == NULL) return;
+
+    free(selector->candidates);
+    free(selector->masks);
+    free(selector->marks);
+    cell_list_destroy(selector->list);
+    free(selector);
+}
+
+int selector_update(selector_t *selector, const frame_t *frame)
+{
+    if (cell_list_build(selector->list, frame, selector->candidates->ids, selector->candidates->n_atoms) != 0) return 1;
+    const cell_list_t *list = selector->list;
+
+    for (size_t s = 0; s < selector->n_selections; ++s) {
+        dynamic_selection_t *selection = selector->selections[s];
+        subset_t *selected = selection->selected;
+        const subset_t *reference = selection->reference;
+        const uint32_t bit = (uint32_t) 1 << s;
+
+        // forget the atoms selected in the previous frame
+        for (size_t i = 0; i < selected->n_atoms; ++i) selector->marks[selected->ids[i]] &= ~bit;
+        selected->n_atoms = 0;
+
+        for (size_t i = 0; i < reference->n_atoms; ++i) {
+            const float *position = frame->positions[reference->ids[i]];
+
+            size_t cells[CELL_LIST_NEIGHBORS] = {0};
+            const size_t n_cells = cell_list_neighbors(list, position, cells);
+
+            for (size_t c = 0; c < n_cells; ++c) {
+                for (size_t k = list->cell_start[cells[c]]; k < list->cell_start[cells[c] + 1]; ++k) {
+                    const size_t id = list->atoms[k];
+                    if (!(selector->masks[id] & bit) || (selector->marks[id] & bit)) continue;
+                    if (distance3D(position, frame->positions[id], frame->box) >= selection->radius) continue;
+
+                    selector->marks[id] |= bit;
+                    selected->ids[selected->n_atoms++] = id;
+                }
+            }
+        }
+
+        // selected atoms are kept in the order of the frame, so that contiguous ranges can be streamed
+        qsort(selected->ids, selected->n_atoms, sizeof(size_t), compare_ids);
+        subset_find_ranges(selected);
+    }
+
+    return 0;
+}
@@ -0,0 +1,88 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#ifndef DYNAMIC_H
+#define DYNAMIC_H
+
+#include <stdint.h>
+#include <groan.h>
+#include "frame.h"
+#include "celllist.h"
+
+// maximal number of dynamic selections evaluated by a single selector
+#define DYNAMIC_MAX_SELECTIONS 32
+
+/*
+ * Selection re-evaluated in every frame, specified as "SELECTION within RADIUS of REFERENCE"
+ * (e.g. "name W within 1.0 of Protein"). Contains the atoms of the (static) selection located closer
+ * than the radius (in nm) to any atom of the (static) reference selection in the current frame.
+ */
+typedef struct dynamic_selection {
+    float radius;
+    const subset_t *candidates;     // atoms of the static part of the selection
+    const subset_t *reference;      // atoms of the reference
+    subset_t *selected;             // atoms selected in the current frame (in the order of the frame)
+} dynamic_selection_t;
+
+/*
+ * Evaluates all dynamic selections of a program in every frame.
+ * The candidates of all selections are sorted into a single periodic cell list (built once per frame)
+ * and only the candidates in the cells neighboring the reference atoms are tested against the radius,
+ * instead of testing every candidate against every reference atom.
+ */
+typedef struct selector {
+    size_t n_selections;
+    dynamic_selection_t *selections[DYNAMIC_MAX_SELECTIONS];
+    subset_t *candidates;           // union of the candidates of all selections
+    uint32_t *masks;                // selections for which each atom of the frame is a candidate
+    uint32_t *marks;                // selections which have selected each atom of the frame in the current frame
+    cell_list_t *list;              // cell list of all candidates
+} selector_t;
+
+/*
+ * Returns 1 if the query specifies a dynamic selection. Else returns 0.
+ */
+int dynamic_query(const char *query);
+
+/*
+ * Selects atoms using the query. If the query specifies a dynamic selection, only its static part is selected
+ * and the atoms of its reference are written into 'reference' together with the radius. Else 'reference' is NULL.
+ * Returns NULL if the query could not be understood or no atoms were selected.
+ */
+atom_selection_t *dynamic_select(
+        atom_selection_t *all,
+        const char *query,
+        dict_t *ndx_groups,
+        atom_selection_t **reference,
+        float *radius);
+
+/*
+ * Creates a dynamic selection from the subsets of its static part and of its reference.
+ * Returns NULL if the memory could not be allocated.
+ */
+dynamic_selection_t *dynamic_create(const subset_t *candidates, const subset_t *reference, const float radius);
+
+/*
+ * Frees all memory associated with the dynamic selection. Does not free the candidates and the reference.
+ */
+void dynamic_destroy(dynamic_selection_t *selection);
+
+/*
+ * Prepares the evaluation of the dynamic selections for the atoms of the frame.
+ * Returns NULL if the memory could not be allocated.
+ */
+selector_t *selector_create(const frame_t *frame, dynamic_selection_t **selections, const size_t n_selections);
+
+/*
+ * Frees all memory associated with the selector. Does not free the dynamic selections.
+ */
+void selector_destroy(selector_t *selector);
+
+/*
+ * Evaluates all dynamic selections in the current frame.
+ * Must be called before the frame is centered or fitted.
+ * Returns zero, if successful. Returns non-zero if the memory could not be allocated.
+ */
+int selector_update(selector_t *selector, const frame_t *frame);
+
+#endif /* DYNAMIC_H */
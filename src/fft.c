@@ -0,0 +1,116 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#include <math.h>
+#include "fft.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+fft_plan_t *fft_plan_create(const size_t n)
+{
+    if (n == 0 || (n & (n - 1)) != 0) return NULL;
+
+    fft_plan_t *plan = calloc(1, sizeof(fft_plan_t));
+    if (plan == NULL) return NULL;
+
+    plan->n = n;
+    plan->reversed = malloc(n * sizeof(size_t));
+    plan->cos_table = malloc((n / 2 + 1) * sizeof(double));
+    plan->sin_table = malloc((n / 2 + 1) * sizeof(double));
+    if (plan->reversed == NULL || plan->cos_table == NULL || plan->sin_table == NULL) {
+        fft_plan_destroy(plan);
+        return NULL;
+    }
+
+    size_t bits = 0;
+    while (((size_t) 1 << bits) < n) ++bits;
+
+    for (size_t i = 0; i < n; ++i) {
+        size_t reversed = 0;
+        for (size_t b = 0; b < bits; ++b) {
+            if (i & ((size_t) 1 << b)) reversed |= (size_t) 1 << (bits - 1 - b);
+        }
+        plan->reversed[i] = reversed;
+    }
+
+    for (size_t k = 0; k < n / 2; ++k) {
+        plan->cos_table[k] = cos(2 * M_PI * k / n);
+        plan->sin_table[k] = sin(2 * M_PI * k / n);
+    }
+
+    return plan;
+}
+
+void fft_plan_destroy(fft_plan_t *plan)
+{
+    if (plan == NULL) return;
+
+    free(plan->reversed);
+    free(plan->cos_table);
+    free(plan->sin_table);
+    free(plan);
+}
+
+/*
+ * Calculates the forward discrete Fourier transform of n complex values separated by stride (iterative radix-2).
+ */
+static void fft_1d(const fft_plan_t *plan, double *re, double *im, const size_t stride)
+{
+    const size_t n = plan->n;
+
+    for (size_t i = 0; i < n; ++i) {
+        size_t j = plan->reversed[i];
+        if (j <= i) continue;
+
+        double tmp = re[i * stride];
+        re[i * stride] = re[j * stride];
+        re[j * stride] = tmp;
+
+        tmp = im[i * stride];
+        im[i * stride] = im[j * stride];
+        im[j * stride] = tmp;
+    }
+
+    for (size_t half = 1; half < n; half *= 2) {
+        const size_t step = n / (2 * half);
+        for (size_t start = 0; start < n; start += 2 * half) {
+            for (size_t k = 0; k < half; ++k) {
+                const double w_re = plan->cos_table[k * step];
+                const double w_im = -plan->sin_table[k * step];
+                const size_t a = (start + k) * stride;
+                const size_t b = (start + k + half) * stride;
+
+                const double t_re = w_re * re[b] - w_im * im[b];
+                const double t_im = w_re * im[b] + w_im * re[b];
+                re[b] = re[a] - t_re;
+                im[b] = im[a] - t_im;
+                re[a] += t_re;
+                im[a] += t_im;
+            }
+        }
+    }
+}
+
+void fft_2d(const fft_plan_t *plan, double *re, double *im)
+{
+    const size_t n = plan->n;
+
+    for (size_t row = 0; row < n; ++row) fft_1d(plan, re + row * n, im + row * n, 1);
+    for (size_t col = 0; col < n; ++col) fft_1d(plan, re + col, im + col, n);
+}
+
+void fft_split_pair(const fft_plan_t *plan, const double *re, const double *im, const size_t index, double a[2], double b[2])
+{
+    const size_t n = plan->n;
+    const size_t row = index / n, col = index % n;
+    // index of the mode with the opposite wave vector
+    const size_t opposite = ((n - row) % n) * n + (n - col) % n;
+
+    // A(k) = (Z(k) + conj(Z(-k))) / 2, B(k) = (Z(k) - conj(Z(-k))) / 2i
+    a[0] = (re[index] + re[opposite]) / 2;
+    a[1] = (im[index] - im[opposite]) / 2;
+    b[0] = (im[index] + im[opposite]) / 2;
+    b[1] = (re[opposite] - re[index]) / 2;
+}
@@ -0,0 +1,44 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#ifndef FFT_H
+#define FFT_H
+
+#include <stdlib.h>
+
+/*
+ * Precomputed tables for fast Fourier transforms of square n x n grids (n must be a power of two).
+ * The tables are prepared once; the transforms work in place and never allocate memory.
+ */
+typedef struct fft_plan {
+    size_t n;                   // number of points along each axis
+    size_t *reversed;           // bit-reversed order of the indices
+    double *cos_table;          // cos(2 pi k / n) for k < n / 2
+    double *sin_table;          // sin(2 pi k / n) for k < n / 2
+} fft_plan_t;
+
+/*
+ * Prepares the tables for transforms of n x n grids.
+ * Returns NULL if n is not a power of two or if the memory could not be allocated.
+ */
+fft_plan_t *fft_plan_create(const size_t n);
+
+/*
+ * Frees all memory associated with the plan.
+ */
+void fft_plan_destroy(fft_plan_t *plan);
+
+/*
+ * Calculates the forward (unnormalized) discrete Fourier transform of a complex n x n grid in place.
+ * The real and the imaginary parts are stored in separate row-major arrays.
+ */
+void fft_2d(const fft_plan_t *plan, double *re, double *im);
+
+/*
+ * Two real grids a and b stored as the real and the imaginary part of a single complex grid
+ * are transformed using a single complex transform (fft_2d). This function then extracts the transforms
+ * of both real grids for the mode with the specified (row-major) index.
+ */
+void fft_split_pair(const fft_plan_t *plan, const double *re, const double *im, const size_t index, double a[2], double b[2]);
+
+#endif /* FFT_H */
@@ -0,0 +1,90 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#include "fit.h"
+
+fit_t *fit_create(const subset_t *reference, const int rotate)
+{
+    fit_t *fit = calloc(1, sizeof(fit_t));
+    if (fit == NULL) return NULL;
+
+    fit->reference = reference;
+    fit->rotate = rotate;
+    fit->cos_angle = 1.0f;
+    fit->sin_angle = 0.0f;
+
+    if (rotate) {
+        fit->initial = malloc(reference->n_atoms * sizeof(vec_t));
+        if (fit->initial == NULL) {
+            free(fit);
+            return NULL;
+        }
+    }
+
+    return fit;
+}
+
+fit_t *fit_clone(const fit_t *fit)
+{
+    fit_t *clone = fit_create(fit->reference, fit->rotate);
+    if (clone == NULL) return NULL;
+
+    vec_t *initial = clone->initial;
+    memcpy(clone, fit, sizeof(fit_t));
+    clone->initial = initial;
+    if (fit->rotate) memcpy(clone->initial, fit->initial, fit->reference->n_atoms * sizeof(vec_t));
+
+    return clone;
+}
+
+void fit_destroy(fit_t *fit)
+{
+    if (fit == NULL) return;
+
+    free(fit->initial);
+    free(fit);
+}
+
+void fit_frame(fit_t *fit, const frame_t *frame)
+{
+    vec_t center = {0.0f};
+    subset_center_of_geometry(frame, fit->reference, center);
+
+    for (int dim = 0; dim < 2; ++dim) {
+        fit->center[dim] = center[dim];
+        fit->box[dim] = frame->box[dim];
+
+        if (frame->precision > 0.0f) {
+            fit->box_fixed[dim] = llroundf(frame->box[dim] * frame->precision);
+            fit->shift_fixed[dim] = llroundf((frame->box[dim] / 2 - center[dim]) * frame->precision);
+        }
+    }
+
+    if (!fit->rotate) return;
+
+    // the orientation of the reference atoms in the first frame is used as the reference structure
+    if (!fit->initialized) {
+        for (size_t i = 0; i < fit->reference->n_atoms; ++i) {
+            fit->initial[i][0] = distance1D(frame->positions[fit->reference->ids[i]], center, x, frame->box);
+            fit->initial[i][1] = distance1D(frame->positions[fit->reference->ids[i]], center, y, frame->box);
+        }
+
+        fit->initialized = 1;
+        return;
+    }
+
+    // two-dimensional Kabsch algorithm: the optimal rotation angle is obtained directly
+    // from the sums of dot and cross products of the current and the reference positions
+    float sum_dot = 0.0f, sum_cross = 0.0f;
+    for (size_t i = 0; i < fit->reference->n_atoms; ++i) {
+        float rel_x = distance1D(frame->positions[fit->reference->ids[i]], center, x, frame->box);
+        float rel_y = distance1D(frame->positions[fit->reference->ids[i]], center, y, frame->box);
+
+        sum_dot += rel_x * fit->initial[i][0] + rel_y * fit->initial[i][1];
+        sum_cross += rel_x * fit->initial[i][1] - rel_y * fit->initial[i][0];
+    }
+
+    float angle = atan2f(sum_cross, sum_dot);
+    fit->cos_angle = cosf(angle);
+    fit->sin_angle = sinf(angle);
+}
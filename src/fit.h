@@ -0,0 +1,91 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#ifndef FIT_H
+#define FIT_H
+
+#include "frame.h"
+
+/*
+ * Per-frame centering (and optionally fitting) of the system in the xy-plane.
+ * The transformation is calculated from a reference selection and then
+ * applied only to the atoms that are actually analyzed.
+ */
+typedef struct fit {
+    const subset_t *reference;  // atoms used to calculate the transformation
+    int rotate;                 // 1 if the system should be also rotated around the z-axis
+    int initialized;            // 1 if the reference structure has been already obtained
+    vec_t *initial;             // reference atoms relative to their center in the first frame
+    float center[2];            // center of the reference atoms in the current frame
+    float box[2];               // box size in the current frame
+    float cos_angle;            // rotation for the current frame
+    float sin_angle;
+    int64_t shift_fixed[2];     // translation in fixed-point units (only valid if the frame is compressed)
+    int64_t box_fixed[2];       // box size in fixed-point units
+} fit_t;
+
+/*
+ * Prepares fitting on the reference subset.
+ * If 'rotate' is non-zero, the system is also rotated around the z-axis
+ * so that the reference atoms match their orientation in the first frame.
+ *
+ * Returns NULL if the memory could not be allocated.
+ */
+fit_t *fit_create(const subset_t *reference, const int rotate);
+
+/*
+ * Creates a copy of the fit (including the reference structure, if it has been already obtained).
+ * Allows several threads to fit different frames using the same reference structure.
+ * Returns NULL if the memory could not be allocated.
+ */
+fit_t *fit_clone(const fit_t *fit);
+
+/*
+ * Frees all memory associated with the fit. Does not free the reference subset.
+ */
+void fit_destroy(fit_t *fit);
+
+/*
+ * Calculates the transformation for the current frame.
+ * The reference atoms are moved to the center of the box in the xy-plane.
+ */
+void fit_frame(fit_t *fit, const frame_t *frame);
+
+/*
+ * Applies the transformation of the current frame to the position of an atom.
+ * The transformed position is written into 'fitted' and the pointer to it is returned.
+ */
+static inline const float *fit_apply(const fit_t *fit, const float *position, vec_t fitted)
+{
+    float rel[2] = {0.0f};
+    for (int dim = 0; dim < 2; ++dim) {
+        rel[dim] = position[dim] - fit->center[dim];
+        while (rel[dim] > fit->box[dim] / 2) rel[dim] -= fit->box[dim];
+        while (rel[dim] < -fit->box[dim] / 2) rel[dim] += fit->box[dim];
+    }
+
+    fitted[0] = fit->cos_angle * rel[0] - fit->sin_angle * rel[1] + fit->box[0] / 2;
+    fitted[1] = fit->sin_angle * rel[0] + fit->cos_angle * rel[1] + fit->box[1] / 2;
+    fitted[2] = position[2];
+    return fitted;
+}
+
+/*
+ * Applies the translation of the current frame to the fixed-point coordinates of an atom.
+ * Only usable if the system is not rotated. The atom is wrapped into the box.
+ * The transformed coordinates are written into 'fitted' and the pointer to them is returned.
+ */
+static inline const int *fit_apply_fixed(const fit_t *fit, const int *coordinates, int fitted[3])
+{
+    for (int dim = 0; dim < 2; ++dim) {
+        int64_t shifted = coordinates[dim] + fit->shift_fixed[dim];
+        while (shifted >= fit->box_fixed[dim]) shifted -= fit->box_fixed[dim];
+        while (shifted < 0) shifted += fit->box_fixed[dim];
+        fitted[dim] = (int) shifted;
+    }
+
+    fitted[2] = coordinates[2];
+    return fitted;
+}
+
+#endif /* FIT_H */
@@ -0,0 +1,390 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#include "frame.h"
+#include "grid.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// positions mapped onto a circle are summed as integers in units of 2^-30
+static const float CIRCLE_SCALE = 1073741824.0f;
+
+frame_t *frame_create(
+        const system_t *system,
+        atom_selection_t **selections,
+        const size_t n_selections,
+        subset_t **subsets)
+{
+    // map[i] is the index of the i-th system atom in the frame (or SIZE_MAX if the atom is not resident)
+    size_t *map = malloc(system->n_atoms * sizeof(size_t));
+    if (map == NULL) return NULL;
+    for (size_t i = 0; i < system->n_atoms; ++i) map[i] = SIZE_MAX;
+
+    // mark all atoms that are part of any selection
+    for (size_t s = 0; s < n_selections; ++s) {
+        for (size_t i = 0; i < selections[s]->n_atoms; ++i) {
+            map[selections[s]->atoms[i] - system->atoms] = 0;
+        }
+    }
+
+    size_t n_resident = 0;
+    for (size_t i = 0; i < system->n_atoms; ++i) {
+        if (map[i] == 0) map[i] = n_resident++;
+    }
+
+    frame_t *frame = calloc(1, sizeof(frame_t));
+    if (frame == NULL) {
+        free(map);
+        return NULL;
+    }
+
+    frame->n_atoms = n_resident;
+    frame->n_system_atoms = system->n_atoms;
+    frame->system_ids = malloc(n_resident * sizeof(size_t));
+    frame->positions = malloc(n_resident * sizeof(vec_t));
+    frame->coordinates = calloc(3 * n_resident, sizeof(int));
+    if (frame->system_ids == NULL || frame->positions == NULL || frame->coordinates == NULL) {
+        free(map);
+        frame_destroy(frame);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < system->n_atoms; ++i) {
+        if (map[i] == SIZE_MAX) continue;
+        frame->system_ids[map[i]] = i;
+        memcpy(frame->positions[map[i]], system->atoms[i].position, sizeof(vec_t));
+    }
+
+    memcpy(frame->box, system->box, sizeof(box_t));
+    frame->step = system->step;
+    frame->time = system->time;
+    frame->precision = 0.0f;
+
+    // convert selections to subsets
+    for (size_t s = 0; s < n_selections; ++s) {
+        subsets[s] = malloc(sizeof(subset_t) + selections[s]->n_atoms * sizeof(size_t));
+        if (subsets[s] == NULL) {
+            for (size_t j = 0; j < s; ++j) free(subsets[j]);
+            free(map);
+            frame_destroy(frame);
+            return NULL;
+        }
+
+        subsets[s]->n_atoms = selections[s]->n_atoms;
+        for (size_t i = 0; i < selections[s]->n_atoms; ++i) {
+            subsets[s]->ids[i] = map[selections[s]->atoms[i] - system->atoms];
+        }
+        subset_find_ranges(subsets[s]);
+    }
+
+    free(map);
+    return frame;
+}
+
+void frame_destroy(frame_t *frame)
+{
+    if (frame == NULL) return;
+
+    free(frame->system_ids);
+    free(frame->positions);
+    free(frame->coordinates);
+    free(frame);
+}
+
+frame_t *frame_copy(const frame_t *frame)
+{
+    frame_t *copy = calloc(1, sizeof(frame_t));
+    if (copy == NULL) return NULL;
+
+    copy->n_atoms = frame->n_atoms;
+    copy->n_system_atoms = frame->n_system_atoms;
+    copy->system_ids = malloc(frame->n_atoms * sizeof(size_t));
+    copy->positions = calloc(frame->n_atoms, sizeof(vec_t));
+    copy->coordinates = calloc(3 * frame->n_atoms, sizeof(int));
+    if (copy->system_ids == NULL || copy->positions == NULL || copy->coordinates == NULL) {
+        frame_destroy(copy);
+        return NULL;
+    }
+
+    memcpy(copy->system_ids, frame->system_ids, frame->n_atoms * sizeof(size_t));
+    memcpy(copy->box, frame->box, sizeof(box_t));
+    return copy;
+}
+
+subset_t *subset_copy(const subset_t *subset)
+{
+    size_t size = sizeof(subset_t) + subset->n_atoms * sizeof(size_t);
+    subset_t *copy = malloc(size);
+    if (copy == NULL) return NULL;
+
+    memcpy(copy, subset, size);
+    return copy;
+}
+
+void subset_find_ranges(subset_t *subset)
+{
+    subset->n_ranges = 0;
+
+    for (size_t i = 0; i < subset->n_atoms; ++i) {
+        id_range_t *last = subset->n_ranges > 0 ? &subset->ranges[subset->n_ranges - 1] : NULL;
+        if (last != NULL && subset->ids[i] == last->start + last->n_atoms) {
+            ++last->n_atoms;
+            continue;
+        }
+
+        // too many ranges, the subset must be processed atom by atom
+        if (subset->n_ranges == SUBSET_MAX_RANGES) {
+            subset->n_ranges = 0;
+            return;
+        }
+
+        id_range_t range = { i, subset->ids[i], 1 };
+        subset->ranges[subset->n_ranges++] = range;
+    }
+}
+
+subset_t *subset_union(const frame_t *frame, subset_t **subsets, const size_t n_subsets, uint32_t *masks)
+{
+    uint32_t *membership = masks != NULL ? masks : malloc(frame->n_atoms * sizeof(uint32_t));
+    if (membership == NULL) return NULL;
+    memset(membership, 0, frame->n_atoms * sizeof(uint32_t));
+
+    size_t n_atoms = 0;
+    for (size_t s = 0; s < n_subsets; ++s) {
+        for (size_t i = 0; i < subsets[s]->n_atoms; ++i) {
+            uint32_t *mask = &membership[subsets[s]->ids[i]];
+            if (*mask == 0) ++n_atoms;
+            // without masks, any nonzero value marks the atom
+            *mask |= masks != NULL ? (uint32_t) 1 << s : 1;
+        }
+    }
+
+    subset_t *subset = malloc(sizeof(subset_t) + n_atoms * sizeof(size_t));
+    if (subset == NULL) {
+        if (masks == NULL) free(membership);
+        return NULL;
+    }
+
+    subset->n_atoms = 0;
+    for (size_t id = 0; id < frame->n_atoms; ++id) {
+        if (membership[id] != 0) subset->ids[subset->n_atoms++] = id;
+    }
+    subset_find_ranges(subset);
+
+    if (masks == NULL) free(membership);
+    return subset;
+}
+
+/*
+ * Converts a coordinate to fixed-point units.
+ * Values that differ from a whole fixed-point unit only due to the float representation are snapped to it.
+ */
+static double to_fixed_point(const float coordinate, const int64_t precision)
+{
+    double scaled = (double) coordinate * precision;
+    double rounded = round(scaled);
+    return fabs(scaled - rounded) < 1e-3 ? rounded : scaled;
+}
+
+void int_grid_prepare(
+        int_grid_t *grid,
+        const frame_t *frame,
+        const float dimx[2],
+        const float dimy[2],
+        const int tiles_per_nm)
+{
+    if (grid->precision == frame->precision) return;
+
+    grid->precision = frame->precision;
+    grid->enabled = 0;
+
+    // uncompressed coordinates or precision that is not compatible with the grid
+    if (frame->precision <= 0.0f) return;
+    int64_t precision = llroundf(frame->precision);
+    if (precision != frame->precision || precision % tiles_per_nm != 0) return;
+
+    grid->tile = precision / tiles_per_nm;
+
+    const float *dims[2] = {dimx, dimy};
+    for (int dim = 0; dim < 2; ++dim) {
+        double min = to_fixed_point(dims[dim][0], precision);
+        double max = to_fixed_point(dims[dim][1], precision);
+
+        // coordinates are integers, so the bounds can be rounded inwards
+        grid->min[dim] = (int64_t) ceil(min);
+        grid->max[dim] = (int64_t) floor(max);
+        // floor((x - min) / tile + 1/2) is equal to floor((x - origin) / tile) for any integer x
+        grid->origin[dim] = (int64_t) ceil(min - 0.5 * grid->tile);
+    }
+
+    grid->enabled = 1;
+}
+
+/*
+ * Adds the position of a single atom mapped onto a circle to the sums.
+ */
+static inline void add_circular(const frame_t *frame, const size_t id, int64_t sum_xi[3], int64_t sum_zeta[3])
+{
+    const float *position = frame->positions[id];
+    for (int dim = 0; dim < 3; ++dim) {
+        float theta = position[dim] / frame->box[dim] * 2.0f * M_PI;
+        sum_xi[dim] += llroundf(cosf(theta) * CIRCLE_SCALE);
+        sum_zeta[dim] += llroundf(sinf(theta) * CIRCLE_SCALE);
+    }
+}
+
+/*
+ * Sums the positions of atoms start to end-1 of the subset mapped onto a circle.
+ * Atoms are mapped onto a circle for every dimension and the center
+ * is then obtained from the average angle (Bai & Breen, 2008).
+ * The sums are exact, so the center does not depend on how the atoms are split between threads.
+ */
+static void sum_circular(
+        const frame_t *frame,
+        const subset_t *subset,
+        const size_t start,
+        const size_t end,
+        int64_t sum_xi[3],
+        int64_t sum_zeta[3])
+{
+    if (subset->n_ranges > 0) {
+        for (size_t r = 0; r < subset->n_ranges; ++r) {
+            size_t from = 0, to = 0;
+            if (!subset_range_window(subset, r, start, end, &from, &to)) continue;
+            for (size_t id = from; id < to; ++id) add_circular(frame, id, sum_xi, sum_zeta);
+        }
+        return;
+    }
+
+    for (size_t i = start; i < end; ++i) add_circular(frame, subset->ids[i], sum_xi, sum_zeta);
+}
+
+/*
+ * Converts sums of the positions mapped onto a circle into the center of geometry.
+ */
+static void center_from_sums(
+        const frame_t *frame,
+        const subset_t *subset,
+        const int64_t sum_xi[3],
+        const int64_t sum_zeta[3],
+        vec_t center)
+{
+    for (int dim = 0; dim < 3; ++dim) {
+        float xi = (double) sum_xi[dim] / CIRCLE_SCALE / subset->n_atoms;
+        float zeta = (double) sum_zeta[dim] / CIRCLE_SCALE / subset->n_atoms;
+        float theta = atan2f(-zeta, -xi) + M_PI;
+        center[dim] = frame->box[dim] * theta / (2.0f * M_PI);
+    }
+}
+
+void subset_center_of_geometry(const frame_t *frame, const subset_t *subset, vec_t center)
+{
+    int64_t sum_xi[3] = {0};
+    int64_t sum_zeta[3] = {0};
+
+    sum_circular(frame, subset, 0, subset->n_atoms, sum_xi, sum_zeta);
+    center_from_sums(frame, subset, sum_xi, sum_zeta, center);
+}
+
+/*
+ * Partial sums calculated by a single thread.
+ * Padded to a cache line so that the threads do not share it.
+ */
+typedef struct circular_sums {
+    int64_t xi[3];
+    int64_t zeta[3];
+    int64_t padding[2];
+} circular_sums_t;
+
+/*
+ * Data for the parallel calculation of the center of geometry.
+ */
+typedef struct center_task {
+    const frame_t *frame;
+    const subset_t *subset;
+    circular_sums_t *sums;
+} center_task_t;
+
+static void center_task(void *data, const size_t thread, const size_t n_threads)
+{
+    center_task_t *task = data;
+
+    size_t start = 0, end = 0;
+    pool_range(task->subset->n_atoms, thread, n_threads, &start, &end);
+    sum_circular(task->frame, task->subset, start, end, task->sums[thread].xi, task->sums[thread].zeta);
+}
+
+void subset_center_of_geometry_parallel(const frame_t *frame, const subset_t *subset, pool_t *pool, vec_t center)
+{
+    circular_sums_t *sums = NULL;
+    if (pool->n_threads == 1 || (sums = calloc(pool->n_threads, sizeof(circular_sums_t))) == NULL) {
+        subset_center_of_geometry(frame, subset, center);
+        return;
+    }
+
+    center_task_t task = { frame, subset, sums };
+    pool_run(pool, center_task, &task);
+
+    int64_t sum_xi[3] = {0};
+    int64_t sum_zeta[3] = {0};
+    for (size_t i = 0; i < pool->n_threads; ++i) {
+        for (int dim = 0; dim < 3; ++dim) {
+            sum_xi[dim] += sums[i].xi[dim];
+            sum_zeta[dim] += sums[i].zeta[dim];
+        }
+    }
+
+    center_from_sums(frame, subset, sum_xi, sum_zeta, center);
+    free(sums);
+}
+
+void subset_sort_by_tile(const frame_t *frame, subset_t *subset, const int tiles_per_nm)
+{
+    if (subset->n_atoms < 2) return;
+
+    // Z-order requires a square number of tiles with a power of two side
+    size_t side = 1;
+    for (int dim = 0; dim < 2; ++dim) {
+        while (side < frame->box[dim] * tiles_per_nm) side <<= 1;
+    }
+    while (side > 1 && side * side > 4 * subset->n_atoms) side >>= 1;
+
+    size_t n_keys = side * side;
+    uint32_t *keys = malloc(subset->n_atoms * sizeof(uint32_t));
+    size_t *offsets = calloc(n_keys + 1, sizeof(size_t));
+    size_t *sorted = malloc(subset->n_atoms * sizeof(size_t));
+    if (keys == NULL || offsets == NULL || sorted == NULL) {
+        free(keys);
+        free(offsets);
+        free(sorted);
+        return;
+    }
+
+    for (size_t i = 0; i < subset->n_atoms; ++i) {
+        const float *position = frame->positions[subset->ids[i]];
+
+        size_t cell[2] = {0};
+        for (int dim = 0; dim < 2; ++dim) {
+            // wrap the atom into the box
+            float rel = position[dim] / frame->box[dim];
+            rel -= floorf(rel);
+            cell[dim] = (size_t) (rel * side);
+            if (cell[dim] >= side) cell[dim] = side - 1;
+        }
+
+        keys[i] = (uint32_t) (spread_bits(cell[0]) | (spread_bits(cell[1]) << 1));
+        ++offsets[keys[i] + 1];
+    }
+
+    // counting sort (stable, so atoms in the same tile keep their relative order)
+    for (size_t k = 0; k < n_keys; ++k) offsets[k + 1] += offsets[k];
+    for (size_t i = 0; i < subset->n_atoms; ++i) sorted[offsets[keys[i]]++] = subset->ids[i];
+    memcpy(subset->ids, sorted, subset->n_atoms * sizeof(size_t));
+    subset_find_ranges(subset);
+
+    free(keys);
+    free(offsets);
+    free(sorted);
+}
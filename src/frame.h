@@ -0,0 +1,190 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdint.h>
+#include <groan.h>
+#include "pool.h"
+
+/*
+ * Coordinates of the atoms that are kept in memory during the analysis.
+ * Only the union of the atoms actually used by the analysis is stored,
+ * in the same order as in the gro file. Atom names, residues and velocities
+ * are not kept at all.
+ */
+typedef struct frame {
+    size_t n_atoms;             // number of resident atoms
+    size_t n_system_atoms;      // number of atoms in the full system (and in the trajectory)
+    size_t *system_ids;         // index of every resident atom in the full system (ascending)
+    vec_t *positions;           // coordinates of the resident atoms
+    int *coordinates;           // fixed-point coordinates of the resident atoms as stored in the xtc file
+                                // (x, y, z for every atom; only valid if precision is not 0)
+    box_t box;
+    int step;
+    float time;
+    float precision;            // precision of the coordinates (0 if the coordinates were not compressed)
+} frame_t;
+
+// maximal number of contiguous ranges for which a subset is processed range by range
+#define SUBSET_MAX_RANGES 16
+
+/*
+ * Range of consecutive atoms of a frame which are also consecutive in a subset.
+ */
+typedef struct id_range {
+    size_t first;               // index of the first atom of the range in the subset
+    size_t start;               // index of the first atom of the range in the frame
+    size_t n_atoms;
+} id_range_t;
+
+/*
+ * Selection of atoms expressed as indices into the positions of a frame.
+ * Most selections (e.g. all water or all lipids) consist of one or a few contiguous ranges of atoms.
+ * Such selections are additionally described by these ranges, so they can be streamed without indirection.
+ */
+typedef struct subset {
+    size_t n_atoms;
+    size_t n_ranges;                        // number of contiguous ranges (0 if there are more than SUBSET_MAX_RANGES)
+    id_range_t ranges[SUBSET_MAX_RANGES];
+    size_t ids[];
+} subset_t;
+
+/*
+ * Creates a frame containing the union of the atoms of all the provided selections.
+ * For every selection, a subset pointing into the frame is written into 'subsets'.
+ * The positions of the atoms and the box are copied from the system.
+ *
+ * Once the frame is created, the system and the selections are no longer needed
+ * and can be freed.
+ *
+ * Returns NULL if the memory could not be allocated.
+ */
+frame_t *frame_create(
+        const system_t *system,
+        atom_selection_t **selections,
+        const size_t n_selections,
+        subset_t **subsets);
+
+/*
+ * Creates a frame with the same resident atoms as the provided frame.
+ * The positions of the atoms are not copied.
+ * Returns NULL if the memory could not be allocated.
+ */
+frame_t *frame_copy(const frame_t *frame);
+
+/*
+ * Creates a copy of the subset.
+ * Returns NULL if the memory could not be allocated.
+ */
+subset_t *subset_copy(const subset_t *subset);
+
+/*
+ * Finds the contiguous ranges of atoms of a subset.
+ * Must be called whenever the ids of the subset change.
+ */
+void subset_find_ranges(subset_t *subset);
+
+/*
+ * Creates a subset containing the union of the atoms of all the provided subsets (in the order of the frame).
+ * If 'masks' is not NULL, it must have space for every atom of the frame: bit i of masks[id] is then set
+ * if the atom 'id' is part of the i-th subset (at most 32 subsets) and all other masks are zero.
+ * Returns NULL if the memory could not be allocated.
+ */
+subset_t *subset_union(const frame_t *frame, subset_t **subsets, const size_t n_subsets, uint32_t *masks);
+
+/*
+ * Gets the atoms of the r-th range of the subset that are also among the atoms start to end-1 of the subset.
+ * The atoms are written as a half-open interval [from, to) of indices into the frame.
+ * Returns 1 if there are any such atoms. Else returns 0.
+ */
+static inline int subset_range_window(
+        const subset_t *subset,
+        const size_t r,
+        const size_t start,
+        const size_t end,
+        size_t *from,
+        size_t *to)
+{
+    const id_range_t *range = &subset->ranges[r];
+    size_t first = start > range->first ? start : range->first;
+    size_t last = end < range->first + range->n_atoms ? end : range->first + range->n_atoms;
+    if (first >= last) return 0;
+
+    *from = range->start + (first - range->first);
+    *to = range->start + (last - range->first);
+    return 1;
+}
+
+/*
+ * Grid of tiles expressed in the fixed-point coordinates of a compressed trajectory.
+ * Allows assigning atoms to tiles using integer arithmetic only.
+ */
+typedef struct int_grid {
+    int enabled;                // 1 if the grid can be used for the current precision
+    float precision;            // precision for which the grid was prepared
+    int64_t min[2];             // lower bounds of the grid (inclusive)
+    int64_t max[2];             // upper bounds of the grid (inclusive)
+    int64_t origin[2];          // coordinates at which the first tile starts
+    int64_t tile;               // size of a grid tile
+} int_grid_t;
+
+/*
+ * Prepares the integer grid for the precision of the frame.
+ * The grid is only enabled if the size of a grid tile is a whole multiple of the fixed-point unit.
+ * Otherwise, the float coordinates must be used.
+ * Only does any work if the precision has changed since the last call.
+ */
+void int_grid_prepare(
+        int_grid_t *grid,
+        const frame_t *frame,
+        const float dimx[2],
+        const float dimy[2],
+        const int tiles_per_nm);
+
+/*
+ * Gets the indices of the tile to which an atom with the given fixed-point coordinates belongs.
+ * Returns 1 if the atom lies inside the grid. Else returns 0.
+ */
+static inline int int_grid_index(const int_grid_t *grid, const int *coordinates, size_t *x_index, size_t *y_index)
+{
+    if (coordinates[0] < grid->min[0] || coordinates[0] > grid->max[0] ||
+        coordinates[1] < grid->min[1] || coordinates[1] > grid->max[1]) {
+            return 0;
+        }
+
+    // tiles are centered at the grid points (origin is shifted by half of the tile)
+    *x_index = (size_t) ((coordinates[0] - grid->origin[0]) / grid->tile);
+    *y_index = (size_t) ((coordinates[1] - grid->origin[1]) / grid->tile);
+    return 1;
+}
+
+/*
+ * Frees all memory associated with the frame.
+ */
+void frame_destroy(frame_t *frame);
+
+/*
+ * Calculates center of geometry of the atoms of a subset.
+ * Takes periodic boundary conditions into account (same approach as in groan).
+ */
+void subset_center_of_geometry(const frame_t *frame, const subset_t *subset, vec_t center);
+
+/*
+ * Calculates center of geometry of the atoms of a subset using all threads of the pool.
+ * Gives the same result as subset_center_of_geometry up to the float rounding.
+ */
+void subset_center_of_geometry_parallel(const frame_t *frame, const subset_t *subset, pool_t *pool, vec_t center);
+
+/*
+ * Reorders the atoms of the subset by the Z-order index of the xy-tile they are currently located in,
+ * so that consecutive atoms of the subset are also close to each other in space.
+ * Tiles have the size of 1/tiles_per_nm but are made coarser if there are many more tiles than atoms.
+ * Only the order of the atoms changes. If the memory can not be allocated, the order is kept.
+ * The contiguous ranges are recalculated for the new order (a sorted subset usually has too many
+ * ranges and is then processed atom by atom in the sorted order).
+ */
+void subset_sort_by_tile(const frame_t *frame, subset_t *subset, const int tiles_per_nm);
+
+#endif /* FRAME_H */
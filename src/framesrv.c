@@ -0,0 +1,242 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#include <stdio.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <groan.h>
+#include "frame.h"
+#include "xtc.h"
+#include "ring.h"
+
+const char VERSION[] = "v2023/10/02";
+
+// frequency of printing during the calculation
+const int PROGRESS_FREQ = 10000;
+
+// name of the shared memory object removed if the server is interrupted
+static const char *served_ring = NULL;
+
+/*
+ * Removes the ring and terminates the server (handler of SIGINT and SIGTERM).
+ */
+static void remove_ring(int signal_number)
+{
+    if (served_ring != NULL) shm_unlink(served_ring);
+    _exit(128 + signal_number);
+}
+
+/*
+ * Parses command line arguments.
+ * Returns zero, if parsing has been successful. Else returns non-zero.
+ */
+int get_arguments(
+        int argc,
+        char **argv,
+        char **gro_file,
+        char **xtc_file,
+        char **ring_name,
+        int   *n_consumers,
+        int   *n_slots,
+        int   *attach_timeout)
+{
+    int gro_specified = 0, xtc_specified = 0, ring_specified = 0;
+
+    int opt = 0;
+    while((opt = getopt(argc, argv, "c:f:o:k:s:w:h")) != -1) {
+        switch (opt) {
+        // help
+        case 'h':
+            return 1;
+        // gro file to read
+        case 'c':
+            *gro_file = optarg;
+            gro_specified = 1;
+            break;
+        // xtc file to read
+        case 'f':
+            *xtc_file = optarg;
+            xtc_specified = 1;
+            break;
+        // name of the ring
+        case 'o':
+            *ring_name = optarg;
+            ring_specified = 1;
+            break;
+        // number of consumers
+        case 'k':
+            sscanf(optarg, "%d", n_consumers);
+            break;
+        // number of frames in the ring
+        case 's':
+            sscanf(optarg, "%d", n_slots);
+            break;
+        // maximal time to wait for the consumers to attach
+        case 'w':
+            sscanf(optarg, "%d", attach_timeout);
+            break;
+        default:
+            //fprintf(stderr, "Unknown command line option: %c.\n", opt);
+            return 1;
+        }
+    }
+
+    if (!gro_specified || !xtc_specified || !ring_specified) {
+        fprintf(stderr, "Gro file, xtc file and name of the ring must always be supplied.\n");
+        return 1;
+    }
+
+    if (*n_consumers <= 0 || *n_consumers > RING_MAX_CONSUMERS) {
+        fprintf(stderr, "Number of consumers must be between 1 and %d.\n", RING_MAX_CONSUMERS);
+        return 1;
+    }
+
+    if (*n_slots <= 0) {
+        fprintf(stderr, "Number of frames in the ring must be higher than 0.\n");
+        return 1;
+    }
+
+    if (*attach_timeout < 0) {
+        fprintf(stderr, "Time to wait for the consumers must be >=0, not %d.\n", *attach_timeout);
+        return 1;
+    }
+    return 0;
+}
+
+void print_usage(const char *program_name)
+{
+    printf("Usage: %s -c GRO_FILE -f XTC_FILE -o NAME -k CONSUMERS [OPTION]...\n", program_name);
+    printf("\nOPTIONS\n");
+    printf("-h               print this message and exit\n");
+    printf("-c STRING        gro file to read\n");
+    printf("-f STRING        xtc file to read (\"-\" for standard input)\n");
+    printf("-o STRING        name of the ring (other programs read the frames from \"%sNAME\")\n", RING_PREFIX);
+    printf("-k INTEGER       number of programs reading the frames\n");
+    printf("-s INTEGER       number of frames stored in the ring (default: 8)\n");
+    printf("-w INTEGER       stop waiting for programs that do not start reading within INTEGER seconds\n");
+    printf("                 (default: 60 s, 0 = wait forever)\n");
+    printf("\n");
+}
+
+/*
+ * Prints parameters that the program will use for serving the frames.
+ */
+void print_arguments(
+        FILE *stream,
+        const char *gro_file,
+        const char *xtc_file,
+        const char *ring_name,
+        const int n_consumers,
+        const int n_slots,
+        const int attach_timeout)
+{
+    fprintf(stream, "Parameters for Frame Server:\n");
+    fprintf(stream, ">>> gro file:         %s\n", gro_file);
+    fprintf(stream, ">>> xtc file:         %s\n", xtc_file);
+    fprintf(stream, ">>> ring:             %s%s\n", RING_PREFIX, ring_name);
+    fprintf(stream, ">>> consumers:        %d\n", n_consumers);
+    fprintf(stream, ">>> ring frames:      %d\n", n_slots);
+    if (attach_timeout > 0) fprintf(stream, ">>> attach timeout:   %d s\n", attach_timeout);
+    else fprintf(stream, ">>> attach timeout:   none\n");
+    fprintf(stream, "\n");
+}
+
+int main(int argc, char **argv)
+{
+    printf("\n");
+    // get command line arguments
+    char *gro_file = NULL;
+    char *xtc_file = NULL;
+    char *ring_name = NULL;
+    int n_consumers = 0;
+    int n_slots = 8;
+    int attach_timeout = 60;
+    if (get_arguments(argc, argv, &gro_file, &xtc_file, &ring_name, &n_consumers, &n_slots, &attach_timeout) != 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    print_arguments(stdout, gro_file, xtc_file, ring_name, n_consumers, n_slots, attach_timeout);
+
+    // read gro file
+    system_t *system = load_gro(gro_file);
+    if (system == NULL) return 1;
+
+    // open xtc file for reading
+    xtc_reader_t *xtc = xtc_open(xtc_file);
+    if (xtc == NULL) {
+        fprintf(stderr, "File %s could not be read as an xtc file.\n", xtc_file);
+        free(system);
+        return 1;
+    }
+
+    // check that the gro file and the xtc file match each other
+    int xtc_atoms = 0;
+    if (xtc_peek_atoms(xtc, &xtc_atoms) != 0 || (size_t) xtc_atoms != system->n_atoms) {
+        fprintf(stderr, "Number of atoms in %s does not match %s.\n", xtc_file, gro_file);
+        xtc_close(xtc);
+        free(system);
+        return 1;
+    }
+
+    // all atoms are decoded and published, every consumer copies the atoms it needs
+    atom_selection_t *all = select_system(system);
+    subset_t *all_subset = NULL;
+    frame_t *frame = frame_create(system, &all, 1, &all_subset);
+    free(all);
+    free(all_subset);
+
+    ring_t *ring = frame == NULL ? NULL : ring_create(ring_name, system->n_atoms, n_slots, n_consumers, attach_timeout);
+    free(system);
+
+    if (frame == NULL || ring == NULL) {
+        fprintf(stderr, "Ring %s could not be created (is it already being served?).\n", ring_name);
+        xtc_close(xtc);
+        frame_destroy(frame);
+        return 1;
+    }
+
+    // the ring must not be left behind if the server is interrupted
+    served_ring = ring->name;
+    struct sigaction action = {0};
+    action.sa_handler = remove_ring;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    printf("Serving frames as %s%s.\n", RING_PREFIX, ring_name);
+
+    size_t n_frames = 0;
+    int status = 0;
+    while ((status = xtc_read_frame(xtc, frame)) == 0) {
+
+        // print info about the progress of reading
+        if ((int) frame->time % PROGRESS_FREQ == 0) {
+            printf("Step: %d. Time: %.0f ps\r", frame->step, frame->time);
+            fflush(stdout);
+        }
+
+        // waits for the slowest consumer, if the ring is full
+        ring_publish(ring, frame);
+        ++n_frames;
+    }
+
+    // consumers must not treat a partially read trajectory as complete
+    if (status != 1) {
+        fprintf(stderr, "Could not read the trajectory after %zu frames. Stopping all consumers...\n", n_frames);
+        ring_fail(ring);
+        xtc_close(xtc);
+        frame_destroy(frame);
+        return 1;
+    }
+
+    printf("\nPublished %zu frames. Waiting for all consumers to finish...\n", n_frames);
+
+    // waits until all consumers have read all frames
+    ring_close(ring);
+    xtc_close(xtc);
+    frame_destroy(frame);
+
+    return 0;
+}
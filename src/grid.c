@@ -0,0 +1,448 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#include "grid.h"
+
+// grids occupying more memory than this are stored in Z-order (if that does not waste too much memory)
+static const size_t MORTON_THRESHOLD = 1 << 20;
+
+// tiles are aligned to a cache line, so that no tile is split between two cache lines
+static const size_t TILES_ALIGNMENT = 64;
+
+/*
+ * Allocates zeroed, aligned memory for n_tiles tiles of the grid.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+static int allocate_tiles(grid_t *grid)
+{
+    void *tiles = NULL;
+    if (posix_memalign(&tiles, TILES_ALIGNMENT, grid->n_tiles * sizeof(tile_t)) != 0) return 1;
+
+    grid->tiles = tiles;
+    memset(grid->tiles, 0, grid->n_tiles * sizeof(tile_t));
+    return 0;
+}
+
+grid_t *grid_create(const float dimx[2], const float dimy[2], const int tiles_per_nm)
+{
+    grid_t *grid = calloc(1, sizeof(grid_t));
+    if (grid == NULL) return NULL;
+
+    grid->n_rows = (size_t) roundf((dimy[1] - dimy[0]) * tiles_per_nm) + 1;
+    grid->n_cols = (size_t) roundf((dimx[1] - dimx[0]) * tiles_per_nm) + 1;
+    grid->origin[0] = dimx[0];
+    grid->origin[1] = dimy[0];
+    grid->tiles_per_nm = tiles_per_nm;
+    grid->coarsening = 1;
+
+    // Z-order requires a square grid with a power of two side
+    size_t side = 1;
+    while (side < grid->n_rows || side < grid->n_cols) side <<= 1;
+
+    grid->n_tiles = grid->n_rows * grid->n_cols;
+    if (grid->n_tiles * sizeof(tile_t) > MORTON_THRESHOLD && side * side <= 2 * grid->n_tiles) {
+        grid->morton = 1;
+        grid->n_tiles = side * side;
+    }
+
+    if (allocate_tiles(grid) != 0) {
+        free(grid);
+        return NULL;
+    }
+
+    return grid;
+}
+
+void grid_destroy(grid_t *grid)
+{
+    if (grid == NULL) return;
+
+    free(grid->tiles);
+    free(grid);
+}
+
+grid_t **grids_create(const size_t n, const float dimx[2], const float dimy[2], const int tiles_per_nm)
+{
+    grid_t **grids = calloc(n, sizeof(grid_t *));
+    if (grids == NULL) return NULL;
+
+    for (size_t i = 0; i < n; ++i) {
+        grids[i] = grid_create(dimx, dimy, tiles_per_nm);
+        if (grids[i] == NULL) {
+            grids_destroy(grids, n);
+            return NULL;
+        }
+    }
+
+    return grids;
+}
+
+void grids_destroy(grid_t **grids, const size_t n)
+{
+    if (grids == NULL) return;
+
+    for (size_t i = 0; i < n; ++i) grid_destroy(grids[i]);
+    free(grids);
+}
+
+void grids_merge(grid_t **grids, const size_t n)
+{
+    for (size_t i = 1; i < n; ++i) {
+        for (size_t j = 0; j < grids[0]->n_tiles; ++j) {
+            tile_t *target = &grids[0]->tiles[j];
+            tile_merge(target, &grids[i]->tiles[j]);
+        }
+    }
+}
+
+void grid_clear(grid_t *grid)
+{
+    memset(grid->tiles, 0, grid->n_tiles * sizeof(tile_t));
+}
+
+grid_t *grid_coarsen(const grid_t *grid, const int factor)
+{
+    grid_t *coarse = calloc(1, sizeof(grid_t));
+    if (coarse == NULL) return NULL;
+
+    coarse->n_rows = (grid->n_rows + factor - 1) / factor;
+    coarse->n_cols = (grid->n_cols + factor - 1) / factor;
+    coarse->tiles_per_nm = grid->tiles_per_nm;
+    coarse->coarsening = grid->coarsening * factor;
+    coarse->n_tiles = coarse->n_rows * coarse->n_cols;
+
+    // grid point of a coarse tile is located in the center of the merged tiles
+    for (int dim = 0; dim < 2; ++dim) {
+        coarse->origin[dim] = grid->origin[dim] + (float) ((factor - 1) * grid->coarsening) / (2 * grid->tiles_per_nm);
+    }
+
+    if (allocate_tiles(coarse) != 0) {
+        free(coarse);
+        return NULL;
+    }
+
+    for (size_t y_index = 0; y_index < grid->n_rows; ++y_index) {
+        for (size_t x_index = 0; x_index < grid->n_cols; ++x_index) {
+            tile_merge(grid_tile(coarse, x_index / factor, y_index / factor), grid_tile(grid, x_index, y_index));
+        }
+    }
+
+    return coarse;
+}
+
+/*
+ * Running sums of a grid used to sum the data of rectangular windows of tiles.
+ */
+typedef struct window_sum {
+    int64_t sum[2];
+    uint64_t count[2];
+} window_sum_t;
+
+grid_t *grid_smooth(const grid_t *grid, const int radius)
+{
+    grid_t *smooth = calloc(1, sizeof(grid_t));
+    if (smooth == NULL) return NULL;
+
+    *smooth = *grid;
+    smooth->tiles = NULL;
+    if (allocate_tiles(smooth) != 0) {
+        free(smooth);
+        return NULL;
+    }
+
+    // table[(y + 1) * stride + x + 1] contains the summed data of all tiles with indices <= x and <= y
+    const size_t stride = grid->n_cols + 1;
+    window_sum_t *table = calloc((grid->n_rows + 1) * stride, sizeof(window_sum_t));
+    if (table == NULL) {
+        grid_destroy(smooth);
+        return NULL;
+    }
+
+    for (size_t y_index = 0; y_index < grid->n_rows; ++y_index) {
+        for (size_t x_index = 0; x_index < grid->n_cols; ++x_index) {
+            const tile_t *tile = grid_tile(grid, x_index, y_index);
+            window_sum_t *entry = &table[(y_index + 1) * stride + x_index + 1];
+            const window_sum_t *left = entry - 1, *below = entry - stride, *corner = entry - stride - 1;
+
+            for (int part = 0; part < 2; ++part) {
+                entry->sum[part] = tile->sum[part] + left->sum[part] + below->sum[part] - corner->sum[part];
+                entry->count[part] = tile_count(tile, part) + left->count[part] + below->count[part] - corner->count[part];
+            }
+        }
+    }
+
+    for (size_t y_index = 0; y_index < grid->n_rows; ++y_index) {
+        const size_t y_low = y_index < (size_t) radius ? 0 : y_index - radius;
+        const size_t y_high = y_index + radius >= grid->n_rows ? grid->n_rows - 1 : y_index + radius;
+
+        for (size_t x_index = 0; x_index < grid->n_cols; ++x_index) {
+            const size_t x_low = x_index < (size_t) radius ? 0 : x_index - radius;
+            const size_t x_high = x_index + radius >= grid->n_cols ? grid->n_cols - 1 : x_index + radius;
+
+            const window_sum_t *high = &table[(y_high + 1) * stride + x_high + 1];
+            const window_sum_t *left = &table[(y_high + 1) * stride + x_low];
+            const window_sum_t *below = &table[y_low * stride + x_high + 1];
+            const window_sum_t *corner = &table[y_low * stride + x_low];
+
+            tile_t *tile = grid_tile(smooth, x_index, y_index);
+            for (int part = 0; part < 2; ++part) {
+                tile->sum[part] = high->sum[part] - left->sum[part] - below->sum[part] + corner->sum[part];
+                uint64_t count = high->count[part] - left->count[part] - below->count[part] + corner->count[part];
+                tile->count[part] = (uint32_t) count;
+                tile->count_high[part] = (uint32_t) (count >> 32);
+            }
+        }
+    }
+
+    free(table);
+    return smooth;
+}
+
+grid_t **grid_pyramid(const grid_t *grid, const int n_levels)
+{
+    grid_t **levels = calloc(n_levels, sizeof(grid_t *));
+    if (levels == NULL) return NULL;
+
+    for (int i = 0; i < n_levels; ++i) {
+        levels[i] = grid_coarsen(i == 0 ? grid : levels[i - 1], 2);
+        if (levels[i] == NULL) {
+            grids_destroy(levels, n_levels);
+            return NULL;
+        }
+    }
+
+    return levels;
+}
+
+char *map_suffixed_name(const char *file_name, const char *suffix)
+{
+    char *name = calloc(strlen(file_name) + strlen(suffix) + 2, 1);
+    if (name == NULL) return NULL;
+
+    // only a dot in the last component of the path starts an extension
+    const char *dot = strrchr(file_name, '.');
+    const char *slash = strrchr(file_name, '/');
+    if (dot == NULL || dot == file_name || (slash != NULL && dot < slash + 2)) {
+        sprintf(name, "%s_%s", file_name, suffix);
+    } else {
+        sprintf(name, "%.*s_%s%s", (int) (dot - file_name), file_name, suffix, dot);
+    }
+
+    return name;
+}
+
+char *map_level_name(const char *file_name, const int coarsening)
+{
+    char suffix[16] = {0};
+    sprintf(suffix, "x%d", coarsening);
+    return map_suffixed_name(file_name, suffix);
+}
+
+void map_write_text(FILE *output, const map_file_header_t *header, const char *command_line, const float *values)
+{
+    fprintf(output, "# Generated with %s %s\n", header->program, header->version);
+    fprintf(output, "# Command line: %s\n", command_line);
+    if (header->note[0] != '\0') fprintf(output, "# %s\n", header->note);
+
+    fprintf(output, "@ xlabel x coordinate [nm]\n@ ylabel y coordinate [nm]\n@ zlabel %s\n", header->zlabel);
+    if (header->grid_lines) fprintf(output, "@ grid --\n");
+    fprintf(output, "$ type colorbar\n$ colormap %s\n", header->colormap);
+
+    for (size_t y_index = 0; y_index < header->n_rows; ++y_index) {
+        for (size_t x_index = 0; x_index < header->n_cols; ++x_index) {
+            float coor_x = (float) (x_index * header->coarsening) / header->tiles_per_nm + header->origin[0];
+            float coor_y = (float) (y_index * header->coarsening) / header->tiles_per_nm + header->origin[1];
+            float value = values[y_index * header->n_cols + x_index];
+
+            if (isnan(value)) fprintf(output, "%f %f nan\n", coor_x, coor_y);
+            else fprintf(output, "%f %f %.*f\n", coor_x, coor_y, header->precision, value);
+        }
+    }
+
+    if (header->footer[0] != '\0') fprintf(output, "%s\n", header->footer);
+}
+
+/*
+ * Copies a string into a fixed-size field of the binary header (truncating it, if needed).
+ */
+static void copy_field(char *field, const size_t size, const char *string)
+{
+    if (string == NULL) return;
+    strncpy(field, string, size - 1);
+    field[size - 1] = '\0';
+}
+
+/*
+ * Rounds the offset up to a multiple of MAP_ALIGNMENT.
+ */
+static inline uint64_t align_offset(const uint64_t offset)
+{
+    return (offset + MAP_ALIGNMENT - 1) / MAP_ALIGNMENT * MAP_ALIGNMENT;
+}
+
+/*
+ * Writes zero bytes until the specified offset is reached.
+ */
+static void write_padding(FILE *output, uint64_t written, const uint64_t offset)
+{
+    for (; written < offset; ++written) fputc(0, output);
+}
+
+/*
+ * Writes the map in the binary format.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+static int write_binary(
+        FILE *output,
+        const grid_t *grid,
+        const map_file_header_t *header,
+        const char *command_line,
+        const float *values)
+{
+    uint64_t values_end = header->values_offset + header->n_rows * header->n_cols * sizeof(float);
+
+    if (fwrite(header, sizeof(map_file_header_t), 1, output) != 1) return 1;
+    if (fwrite(command_line, 1, header->command_length, output) != header->command_length) return 1;
+    write_padding(output, sizeof(map_file_header_t) + header->command_length, header->values_offset);
+
+    if (fwrite(values, sizeof(float), header->n_rows * header->n_cols, output) != header->n_rows * header->n_cols) return 1;
+    write_padding(output, values_end, header->counts_offset);
+
+    for (size_t y_index = 0; y_index < grid->n_rows; ++y_index) {
+        for (size_t x_index = 0; x_index < grid->n_cols; ++x_index) {
+            const tile_t *tile = grid_tile(grid, x_index, y_index);
+            uint64_t counts[2] = { tile_count(tile, GRID_UPPER), tile_count(tile, GRID_LOWER) };
+            if (fwrite(counts, sizeof(uint64_t), 2, output) != 2) return 1;
+        }
+    }
+
+    return ferror(output);
+}
+
+int grid_write_map(
+        FILE *output,
+        const grid_t *grid,
+        const map_header_t *header,
+        int argc,
+        char **argv,
+        tile_value_t value,
+        const void *data,
+        const map_format_t format,
+        float *average)
+{
+    // command line as written into the text file
+    size_t command_length = 1;
+    for (int i = 0; i < argc; ++i) command_length += strlen(argv[i]) + 1;
+
+    char *command_line = calloc(command_length, 1);
+    float *values = malloc(grid->n_rows * grid->n_cols * sizeof(float));
+    if (command_line == NULL || values == NULL) {
+        free(command_line);
+        free(values);
+        return 1;
+    }
+
+    for (int i = 0; i < argc; ++i) {
+        strcat(command_line, argv[i]);
+        strcat(command_line, " ");
+    }
+
+    // calculate the values of all tiles
+    float sum = 0.0f;
+    size_t n_samples = 0;
+    for (size_t y_index = 0; y_index < grid->n_rows; ++y_index) {
+        for (size_t x_index = 0; x_index < grid->n_cols; ++x_index) {
+            double tile_value = 0.0;
+            float *stored = &values[y_index * grid->n_cols + x_index];
+
+            if (!value(grid_tile(grid, x_index, y_index), data, &tile_value)) {
+                *stored = NAN;
+                continue;
+            }
+
+            *stored = (float) tile_value;
+            sum += *stored;
+            ++n_samples;
+        }
+    }
+    *average = sum / n_samples;
+
+    map_file_header_t file_header;
+    memset(&file_header, 0, sizeof(map_file_header_t));
+    memcpy(file_header.magic, MAP_MAGIC, sizeof(MAP_MAGIC));
+    file_header.byte_order = MAP_BYTE_ORDER;
+    file_header.header_size = sizeof(map_file_header_t);
+    file_header.values_offset = align_offset(sizeof(map_file_header_t) + command_length);
+    file_header.counts_offset = align_offset(file_header.values_offset + grid->n_rows * grid->n_cols * sizeof(float));
+    file_header.file_size = file_header.counts_offset + grid->n_rows * grid->n_cols * 2 * sizeof(uint64_t);
+    file_header.n_rows = grid->n_rows;
+    file_header.n_cols = grid->n_cols;
+    file_header.n_frames = header->n_frames;
+    file_header.origin[0] = grid->origin[0];
+    file_header.origin[1] = grid->origin[1];
+    file_header.spacing = (float) grid->coarsening / grid->tiles_per_nm;
+    file_header.tiles_per_nm = grid->tiles_per_nm;
+    file_header.coarsening = grid->coarsening;
+    file_header.average = *average;
+    file_header.precision = header->precision;
+    file_header.grid_lines = header->grid_lines;
+    file_header.command_length = command_length;
+    copy_field(file_header.program, sizeof(file_header.program), header->program);
+    copy_field(file_header.version, sizeof(file_header.version), header->version);
+    copy_field(file_header.note, sizeof(file_header.note), header->note);
+    copy_field(file_header.zlabel, sizeof(file_header.zlabel), header->zlabel);
+    copy_field(file_header.colormap, sizeof(file_header.colormap), header->colormap);
+    if (header->footer != NULL) snprintf(file_header.footer, sizeof(file_header.footer), header->footer, *average);
+
+    int return_code = 0;
+    if (format == MAP_BINARY) {
+        return_code = write_binary(output, grid, &file_header, command_line, values);
+    } else {
+        map_write_text(output, &file_header, command_line, values);
+        return_code = ferror(output);
+    }
+
+    free(command_line);
+    free(values);
+    return return_code;
+}
+
+int grid_write_file(
+        const char *file_name,
+        const grid_t *grid,
+        const map_header_t *header,
+        int argc,
+        char **argv,
+        tile_value_t value,
+        const void *data,
+        const map_format_t format,
+        float *average)
+{
+    FILE *output = fopen(file_name, "w");
+    if (output == NULL) return 1;
+
+    int return_code = grid_write_map(output, grid, header, argc, argv, value, data, format, average);
+
+    fclose(output);
+    return return_code;
+}
+
+int grid_write_level(
+        const grid_t *level,
+        const char *file_name,
+        const map_header_t *header,
+        int argc,
+        char **argv,
+        tile_value_t value,
+        const void *data,
+        const map_format_t format)
+{
+    char *level_name = map_level_name(file_name, level->coarsening);
+    if (level_name == NULL) return 1;
+
+    float average = 0.0f;
+    int return_code = grid_write_file(level_name, level, header, argc, argv, value, data, format, &average);
+
+    free(level_name);
+    return return_code;
+}
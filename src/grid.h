@@ -0,0 +1,302 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#ifndef GRID_H
+#define GRID_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <groan.h>
+
+// parts of a grid tile
+#define GRID_UPPER 0
+#define GRID_LOWER 1
+
+/*
+ * Data collected in a single grid tile.
+ * Both parts of the tile (upper and lower leaflet) are stored together and the record
+ * is aligned to 32 bytes, so updating a tile always touches a single cache line.
+ */
+typedef struct tile {
+    int64_t sum[2];             // sums of the collected values in fixed-point units
+    uint32_t count[2];          // number of collected samples (lower 32 bits)
+    uint32_t count_high[2];     // number of collected samples (upper 32 bits, only used after overflow)
+} tile_t;
+
+/*
+ * Grid of tiles covering a rectangular area in the xy-plane.
+ */
+typedef struct grid {
+    size_t n_rows;
+    size_t n_cols;
+    float origin[2];            // coordinates of the first grid point (x, y)
+    int tiles_per_nm;           // tiles per nm of the original (finest) grid
+    int coarsening;             // number of original tiles along each side of a tile (1 for the original grid)
+    int morton;                 // 1 if the tiles are stored in Z-order (Morton order)
+    size_t n_tiles;             // number of stored tiles (including padding of the Z-order layout)
+    tile_t *tiles;
+} grid_t;
+
+/*
+ * Format of an output file containing a map.
+ */
+typedef enum map_format {
+    MAP_TEXT,                   // plottable text file, one line per tile
+    MAP_BINARY                  // binary file that can be memory-mapped (see map_file_header_t)
+} map_format_t;
+
+/*
+ * Header of an output file containing a map.
+ */
+typedef struct map_header {
+    const char *program;        // name and description of the program
+    const char *version;
+    const char *note;           // additional comment written after the command line (can be NULL)
+    const char *zlabel;
+    const char *colormap;
+    int grid_lines;             // 1 if the lines of the grid should be drawn
+    int precision;              // number of decimal places of the values
+    const char *footer;         // printf format of the last line of the file; gets the average value (can be NULL)
+    size_t n_frames;            // number of analyzed frames
+} map_header_t;
+
+// maximal number of coarser maps (pyramid levels) written in addition to the original map
+#define MAP_MAX_LEVELS 16
+
+// identifies binary map files
+#define MAP_MAGIC "MEMDMAP"
+// used to detect binary map files written on a machine with a different byte order
+#define MAP_BYTE_ORDER 0x01020304u
+// offsets of all parts of a binary map file are multiples of this value
+#define MAP_ALIGNMENT 64
+
+/*
+ * Header of a binary map file. All numbers are stored in the native byte order.
+ *
+ * The header is followed by the command line (a zero-terminated string)
+ * and then, at the specified offsets, by:
+ *   - values: n_rows * n_cols floats (row by row, NaN if the value is not available),
+ *   - counts: n_rows * n_cols pairs of uint64_t with the number of samples
+ *             collected in the upper and the lower part of each tile.
+ */
+typedef struct map_file_header {
+    char magic[8];              // MAP_MAGIC
+    uint32_t byte_order;        // MAP_BYTE_ORDER
+    uint32_t header_size;       // size of this structure
+    uint64_t values_offset;     // offset of the values from the start of the file
+    uint64_t counts_offset;     // offset of the counts from the start of the file
+    uint64_t file_size;
+    uint64_t n_rows;
+    uint64_t n_cols;
+    uint64_t n_frames;
+    float origin[2];            // coordinates of the first grid point (x, y)
+    float spacing;              // distance between two grid points
+    int32_t tiles_per_nm;       // tiles per nm of the original grid
+    int32_t coarsening;         // number of original tiles along each side of a tile
+    float average;              // average of all available values
+    int32_t precision;          // number of decimal places of the values in the text format
+    int32_t grid_lines;
+    uint32_t command_length;    // length of the command line including the terminating zero
+    char program[64];
+    char version[32];
+    char note[64];
+    char zlabel[64];
+    char colormap[32];
+    char footer[128];           // last line of the text file (already formatted)
+} map_file_header_t;
+
+/*
+ * Calculates the value of a tile for the output.
+ * Returns 1 if the value is available. Returns 0 if it is not (nan is written instead).
+ */
+typedef int (*tile_value_t)(const tile_t *tile, const void *data, double *value);
+
+/*
+ * Creates an empty grid spanning the specified area.
+ * Large, roughly square grids are stored in Z-order to improve locality of updates.
+ * Returns NULL if the memory could not be allocated.
+ */
+grid_t *grid_create(const float dimx[2], const float dimy[2], const int tiles_per_nm);
+
+/*
+ * Frees all memory associated with the grid.
+ */
+void grid_destroy(grid_t *grid);
+
+/*
+ * Creates a separate grid for each of n threads.
+ * Returns NULL if the memory could not be allocated.
+ */
+grid_t **grids_create(const size_t n, const float dimx[2], const float dimy[2], const int tiles_per_nm);
+
+/*
+ * Frees n grids.
+ */
+void grids_destroy(grid_t **grids, const size_t n);
+
+/*
+ * Adds the contents of all n grids into the first grid.
+ */
+void grids_merge(grid_t **grids, const size_t n);
+
+/*
+ * Removes all data from the grid.
+ */
+void grid_clear(grid_t *grid);
+
+/*
+ * Creates a grid 'factor' times coarser than the provided grid.
+ * Each tile of the new grid contains the summed data of 'factor' x 'factor' tiles of the provided grid.
+ * Returns NULL if the memory could not be allocated.
+ */
+grid_t *grid_coarsen(const grid_t *grid, const int factor);
+
+/*
+ * Creates a grid with the same layout as the provided grid, in which every tile contains the summed data
+ * of all tiles of the provided grid that are at most 'radius' tiles away along x and y (a square window).
+ * Returns NULL if the memory could not be allocated.
+ */
+grid_t *grid_smooth(const grid_t *grid, const int radius);
+
+/*
+ * Creates n_levels grids, each two times coarser than the previous one (the first one is two times coarser than the provided grid).
+ * All levels are calculated from the sums and counts of the original tiles, not from the averaged values.
+ * Returns NULL if the memory could not be allocated. The levels can be freed using grids_destroy.
+ */
+grid_t **grid_pyramid(const grid_t *grid, const int n_levels);
+
+/*
+ * Returns the file name with '_{suffix}' inserted before its extension.
+ * The returned string must be freed by the caller. Returns NULL if the memory could not be allocated.
+ */
+char *map_suffixed_name(const char *file_name, const char *suffix);
+
+/*
+ * Returns the name of the file for a map 'coarsening' times coarser than the original map.
+ * Suffix '_x{coarsening}' is inserted before the extension of the original file name.
+ * The returned string must be freed by the caller. Returns NULL if the memory could not be allocated.
+ */
+char *map_level_name(const char *file_name, const int coarsening);
+
+/*
+ * Writes the map into an output file in the specified format.
+ * The average of all available values is written into 'average'.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+int grid_write_map(
+        FILE *output,
+        const grid_t *grid,
+        const map_header_t *header,
+        int argc,
+        char **argv,
+        tile_value_t value,
+        const void *data,
+        const map_format_t format,
+        float *average);
+
+/*
+ * Opens a file with the specified name and writes the map into it in the specified format.
+ * The average of all available values is written into 'average'.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+int grid_write_file(
+        const char *file_name,
+        const grid_t *grid,
+        const map_header_t *header,
+        int argc,
+        char **argv,
+        tile_value_t value,
+        const void *data,
+        const map_format_t format,
+        float *average);
+
+/*
+ * Writes a coarser map (one level of the pyramid) into a file named using map_level_name.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+int grid_write_level(
+        const grid_t *level,
+        const char *file_name,
+        const map_header_t *header,
+        int argc,
+        char **argv,
+        tile_value_t value,
+        const void *data,
+        const map_format_t format);
+
+/*
+ * Writes the map described by the header of a binary map file in the text format.
+ */
+void map_write_text(FILE *output, const map_file_header_t *header, const char *command_line, const float *values);
+
+/*
+ * Spreads bits of a 32-bit integer into the even bits of a 64-bit integer.
+ */
+static inline uint64_t spread_bits(uint64_t value)
+{
+    value &= 0xffffffffULL;
+    value = (value | (value << 16)) & 0x0000ffff0000ffffULL;
+    value = (value | (value << 8))  & 0x00ff00ff00ff00ffULL;
+    value = (value | (value << 4))  & 0x0f0f0f0f0f0f0f0fULL;
+    value = (value | (value << 2))  & 0x3333333333333333ULL;
+    value = (value | (value << 1))  & 0x5555555555555555ULL;
+    return value;
+}
+
+/*
+ * Returns the tile with the given indices.
+ */
+static inline tile_t *grid_tile(const grid_t *grid, const size_t x_index, const size_t y_index)
+{
+    if (grid->morton) return &grid->tiles[spread_bits(x_index) | (spread_bits(y_index) << 1)];
+    return &grid->tiles[y_index * grid->n_cols + x_index];
+}
+
+/*
+ * Adds a sample to a part of a tile.
+ */
+static inline void tile_add(tile_t *tile, const int part, const int64_t value)
+{
+    tile->sum[part] += value;
+    if (++tile->count[part] == 0) ++tile->count_high[part];
+}
+
+/*
+ * Returns the number of samples in a part of a tile.
+ */
+static inline uint64_t tile_count(const tile_t *tile, const int part)
+{
+    return ((uint64_t) tile->count_high[part] << 32) | tile->count[part];
+}
+
+/*
+ * Adds the data of the source tile to the target tile.
+ */
+static inline void tile_merge(tile_t *target, const tile_t *source)
+{
+    for (int part = 0; part < 2; ++part) {
+        target->sum[part] += source->sum[part];
+
+        uint64_t count = tile_count(target, part) + tile_count(source, part);
+        target->count[part] = (uint32_t) count;
+        target->count_high[part] = (uint32_t) (count >> 32);
+    }
+}
+
+/*
+ * Converts coordinate to the index of a grid tile.
+ */
+static inline size_t grid_coor2index(const grid_t *grid, const float coor, const int dim)
+{
+    return (size_t) roundf((coor - grid->origin[dim]) * grid->tiles_per_nm);
+}
+
+/*
+ * Converts index of a grid tile to coordinate.
+ */
+static inline float grid_index2coor(const grid_t *grid, const size_t index, const int dim)
+{
+    return (float) index / grid->tiles_per_nm + grid->origin[dim];
+}
+
+#endif /* GRID_H */
@@ -4,13 +4,27 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <groan.h>
+#include "frame.h"
+#include "xtc.h"
+#include "fit.h"
+#include "pool.h"
+#include "grid.h"
+#include "species.h"
+#include "undulation.h"
+#include "dynamic.h"
+#include "profile.h"
 
 const char VERSION[] = "v2023/04/20";
 
 // frequency of printing during the calculation
 const int PROGRESS_FREQ = 10000;
+// frequency of reordering the analyzed atoms by their position in the xy-plane (in frames)
+const int SORT_FREQ = 100;
 // inverse size of a grid tile for membrane thickness calculation
 const int GRID_TILE = 10;
+// positions of phosphates are summed as integers in units of 1e-6 nm
+// (the sums are exact and do not depend on the order of summation)
+const double Z_SCALE = 1000000.0;
 
 /*
  * Parses command line arguments.
@@ -28,13 +42,21 @@ int get_arguments(
         char **phosphates,
         float *array_dimx,
         float *array_dimy,
-        int   *nan_limit
-        ) 
+        int   *nan_limit,
+        char **reference,
+        int   *rotate,
+        int   *n_threads,
+        int   *binary,
+        int   *n_levels,
+        int   *decompose,
+        char **spectrum_file,
+        int   *field_size,
+        int   *profiling) 
 {
     int gro_specified = 0, xtc_specified = 0;
 
     int opt = 0;
-    while((opt = getopt(argc, argv, "c:f:n:o:l:p:x:y:a:h")) != -1) {
+    while((opt = getopt(argc, argv, "c:f:n:o:l:p:x:y:a:r:zt:bm:du:g:Ph")) != -1) {
         switch (opt) {
         // help
         case 'h':
@@ -90,6 +112,42 @@ int get_arguments(
         case 'a':
             sscanf(optarg, "%d", nan_limit);
             break;
+        // reference selection for centering
+        case 'r':
+            *reference = optarg;
+            break;
+        // fit rotation around the z-axis
+        case 'z':
+            *rotate = 1;
+            break;
+        // number of threads
+        case 't':
+            sscanf(optarg, "%d", n_threads);
+            break;
+        // binary output
+        case 'b':
+            *binary = 1;
+            break;
+        // number of coarser overview maps
+        case 'm':
+            sscanf(optarg, "%d", n_levels);
+            break;
+        // separate maps for lipid species
+        case 'd':
+            *decompose = 1;
+            break;
+        // output file for the undulation spectrum
+        case 'u':
+            *spectrum_file = optarg;
+            break;
+        // size of the height fields
+        case 'g':
+            sscanf(optarg, "%d", field_size);
+            break;
+        // report the time spent in the phases of the analysis
+        case 'P':
+            *profiling = 1;
+            break;
         default:
             //fprintf(stderr, "Unknown command line option: %c.\n", opt);
             return 1;
@@ -100,6 +158,11 @@ int get_arguments(
         fprintf(stderr, "Gro file and xtc file must always be supplied.\n");
         return 1;
     }
+
+    if (*rotate && *reference == NULL) {
+        fprintf(stderr, "Reference selection must be supplied for fitting.\n");
+        return 1;
+    }
     return 0;
 }
 
@@ -109,15 +172,25 @@ void print_usage(const char *program_name)
     printf("\nOPTIONS\n");
     printf("-h               print this message and exit\n");
     printf("-c STRING        gro file to read\n");
-    printf("-f STRING        xtc file to read\n");
+    printf("-f STRING        xtc file to read (\"-\" for standard input)\n");
     printf("-n STRING        ndx file to read (optional, default: index.ndx)\n");
     printf("-o STRING        pattern for the output files (default: thickness)\n");
     printf("-l STRING        specification of membrane lipids (default: Membrane)\n");
     printf("-p STRING        specification of lipid phosphates (default: name PO4)\n");
+    printf("                 (-l and -p can be dynamic, e.g. \"name PO4 within 2.0 of Protein\")\n");
     printf("-x FLOAT-FLOAT   grid dimensions in x axis (default: box size from gro file)\n");
     printf("-y FLOAT-FLOAT   grid dimensions in y axis (default: box size from gro file)\n");
     printf("-a INTEGER       NAN limit: how many phosphates must be detected in a grid tile\n");
     printf("                 to calculate leaflet thickness for this tile (default: 30)\n");
+    printf("-r STRING        reference selection centered in the xy-plane in every frame (default: none)\n");
+    printf("-z               also rotate the system around the z-axis to fit the reference (requires -r)\n");
+    printf("-t INTEGER       number of threads used to analyze every frame (default: 1)\n");
+    printf("-b               write the output in binary format (can be converted to text using mapconv)\n");
+    printf("-m INTEGER       number of overview maps, each two times coarser than the previous one (default: 0)\n");
+    printf("-d               also write separate maps for every residue name of the phosphates\n");
+    printf("-u STRING        output file for the undulation spectrum of the membrane (default: none)\n");
+    printf("-g INTEGER       number of cells of the height fields along x and y, power of two (default: 16)\n");
+    printf("-P               report the time spent in the phases of the analysis and the locality of binning\n");
     printf("\n");
 }
 
@@ -135,7 +208,16 @@ void print_arguments(
         const char *phosphates,
         const float *array_dimx,
         const float *array_dimy,
-        const int nan_limit)
+        const int nan_limit,
+        const char *reference,
+        const int rotate,
+        const int n_threads,
+        const int binary,
+        const int n_levels,
+        const int decompose,
+        const char *spectrum_file,
+        const int field_size,
+        const int profiling)
 {
     fprintf(stream, "Parameters for Leaflet Thickness calculation:\n");
     fprintf(stream, ">>> gro file:         %s\n", gro_file);
@@ -145,68 +227,171 @@ void print_arguments(
     fprintf(stream, ">>> lipids:           %s\n", lipids);
     fprintf(stream, ">>> phosphates:       %s\n", phosphates);
     fprintf(stream, ">>> grid dimensions:  x: %.1f - %.1f nm, y: %.1f - %.1f nm\n", array_dimx[0], array_dimx[1], array_dimy[0], array_dimy[1]);
-    fprintf(stream, ">>> NAN limit:        %d\n\n", nan_limit);
+    fprintf(stream, ">>> NAN limit:        %d\n", nan_limit);
+    if (reference != NULL) fprintf(stream, ">>> reference:        %s (centered in xy%s)\n", reference, rotate ? ", fitted around z" : "");
+    fprintf(stream, ">>> threads:          %d\n", n_threads);
+    if (binary) fprintf(stream, ">>> output format:    binary\n");
+    if (n_levels > 0) fprintf(stream, ">>> overview maps:    %d (up to %dx coarser)\n", n_levels, 1 << n_levels);
+    if (decompose) fprintf(stream, ">>> lipid species:    separate maps for every residue name\n");
+    if (spectrum_file != NULL) fprintf(stream, ">>> undulations:      %s (%dx%d height fields)\n", spectrum_file, field_size, field_size);
+    if (profiling) fprintf(stream, ">>> profiling:        enabled\n");
+    fprintf(stream, "\n");
 }
 
-/* 
- * Converts index of an array to coordinate.
+/*
+ * Data needed to assign the phosphates of a single frame to grid tiles.
+ */
+typedef struct frame_task {
+    const frame_t *frame;
+    const subset_t *phosphate_subset;
+    const fit_t *fit;
+    const int_grid_t *grid;
+    int use_fixed;              // 1 if the fixed-point coordinates should be used
+    const float *center_mem;
+    const float *array_dimx;
+    const float *array_dimy;
+    const species_t *species;   // lipid species of the phosphates (NULL if the maps are not decomposed)
+    size_t n_threads;
+    grid_t **grids;             // one grid for every thread (followed by the same for every lipid species)
+} frame_task_t;
+
+/*
+ * Assigns a single phosphate to a leaflet and adds its z position relative to the membrane center to the grid
+ * (and to the grid of its lipid species).
  */
-static inline float index2coor(int x, float minx)
+static inline void assign_phosphate(const frame_task_t *task, const size_t thread, const size_t id)
 {
-    return (float) x / GRID_TILE + minx;
+    grid_t *thread_grid = task->grids[thread];
+    const frame_t *frame = task->frame;
+    const fit_t *fit = task->fit;
+    const float *array_dimx = task->array_dimx;
+    const float *array_dimy = task->array_dimy;
+
+    const float *position = frame->positions[id];
+    float rel_pos_z = distance1D(position, task->center_mem, z, frame->box);
+
+    // get index of the tile to which the atom should be assigned
+    // (ignoring atoms that are outside of the specified grid)
+    size_t x_index = 0, y_index = 0;
+    if (task->use_fixed) {
+        const int *coordinates = frame->coordinates + 3 * id;
+        int fitted[3] = {0};
+        if (fit != NULL) coordinates = fit_apply_fixed(fit, coordinates, fitted);
+
+        if (!int_grid_index(task->grid, coordinates, &x_index, &y_index)) return;
+    } else {
+        vec_t fitted = {0.0f};
+        if (fit != NULL) position = fit_apply(fit, position, fitted);
+
+        if (position[0] < array_dimx[0] || position[0] > array_dimx[1] ||
+            position[1] < array_dimy[0] || position[1] > array_dimy[1]) {
+                return;
+            }
+
+        x_index = grid_coor2index(thread_grid, position[0], 0);
+        y_index = grid_coor2index(thread_grid, position[1], 1);
+    }
+
+    const int part = rel_pos_z > 0 ? GRID_UPPER : GRID_LOWER;
+    const int64_t value = llround((double) rel_pos_z * Z_SCALE);
+    tile_add(grid_tile(thread_grid, x_index, y_index), part, value);
+
+    if (task->species != NULL) {
+        grid_t *species_grid = task->grids[(1 + task->species->of_atom[id]) * task->n_threads + thread];
+        tile_add(grid_tile(species_grid, x_index, y_index), part, value);
+    }
 }
 
 /*
- * Converts coordinate to an index array.
+ * Assigns phosphates to leaflets and gets their z positions relative to the membrane center.
+ * Every thread processes a part of the phosphates and writes into its own grid.
  */
-static inline size_t coor2index(float x, float minx)
+static void assign_phosphates(void *data, const size_t thread, const size_t n_threads)
 {
-    return (size_t) roundf((x - minx) * GRID_TILE);
+    const frame_task_t *task = data;
+    const subset_t *phosphate_subset = task->phosphate_subset;
+
+    size_t start = 0, end = 0;
+    pool_range(phosphate_subset->n_atoms, thread, n_threads, &start, &end);
+
+    // contiguous ranges of phosphates are streamed directly
+    if (phosphate_subset->n_ranges > 0) {
+        for (size_t r = 0; r < phosphate_subset->n_ranges; ++r) {
+            size_t from = 0, to = 0;
+            if (!subset_range_window(phosphate_subset, r, start, end, &from, &to)) continue;
+            for (size_t id = from; id < to; ++id) assign_phosphate(task, thread, id);
+        }
+        return;
+    }
+
+    for (size_t i = start; i < end; ++i) assign_phosphate(task, thread, phosphate_subset->ids[i]);
 }
 
 /*
- * Writes leaflet thickness for a specified leaflet.
+ * Leaflet for which the thickness is calculated and the minimal number of samples.
  */
-void write_output(
-        FILE *output, 
-        float *leaflet,
-        int *leaflet_counts,
-        size_t n_rows, 
-        size_t n_cols,
-        int nan_limit,
-        float array_dimx[2],
-        float array_dimy[2],
-        char **argv,
-        int argc)
+typedef struct leaflet_output {
+    int leaflet;
+    int nan_limit;
+} leaflet_output_t;
+
+/*
+ * Calculates thickness of a leaflet in a grid tile.
+ * Returns 0 if there is not enough data for this tile.
+ */
+static int leaflet_thickness(const tile_t *tile, const void *data, double *thickness)
 {
-    fprintf(output, "# Generated with leafthick (C Leaflet Thickness Calculator) %s\n", VERSION);
-    fprintf(output, "# Command line: ");
-    for (int i = 0; i < argc; ++i) {
-        fprintf(output, "%s ", argv[i]);
-    }
-    fprintf(output, "\n");
-    fprintf(output, "@ xlabel x coordinate [nm]\n");
-    fprintf(output, "@ ylabel y coordinate [nm]\n");
-    fprintf(output, "@ zlabel leaflet thickness [nm]\n");
-    fprintf(output, "@ grid --\n");
-    fprintf(output, "$ type colorbar\n");
-    fprintf(output, "$ colormap rainbow\n");
-
-    for (size_t y = 0; y < n_rows; ++y) {
-        for (size_t x = 0; x < n_cols; ++x) {
-
-            // check that we have enough data for this grid tile
-            if (leaflet_counts[y * n_cols + x] < nan_limit) {
-                fprintf(output, "%f %f nan\n", index2coor(x, array_dimx[0]), index2coor(y, array_dimy[0]));
-                continue;
-            }
+    const leaflet_output_t *output = data;
+
+    // check that we have enough data for this grid tile
+    uint64_t count = tile_count(tile, output->leaflet);
+    if (count < (uint64_t) output->nan_limit) return 0;
 
-            fprintf(output, "%f %f %.4f\n", 
-                index2coor(x, array_dimx[0]), 
-                index2coor(y, array_dimy[0]), 
-                fabsf(leaflet[y * n_cols + x] / leaflet_counts[y * n_cols + x]));
+    *thickness = fabs(tile->sum[output->leaflet] / Z_SCALE / count);
+    return 1;
+}
+
+/*
+ * Writes the maps of both leaflets (and their coarser overview maps) into files.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+static int write_leaflet_maps(
+        const grid_t *grid,
+        FILE *output_u,
+        FILE *output_l,
+        const char *output_upper,
+        const char *output_lower,
+        const int n_levels,
+        const map_header_t *header,
+        int argc,
+        char **argv,
+        const int nan_limit,
+        const map_format_t format)
+{
+    const leaflet_output_t upper = { GRID_UPPER, nan_limit };
+    const leaflet_output_t lower = { GRID_LOWER, nan_limit };
+    float average = 0.0f;
+    if (grid_write_map(output_u, grid, header, argc, argv, leaflet_thickness, &upper, format, &average) != 0 ||
+        grid_write_map(output_l, grid, header, argc, argv, leaflet_thickness, &lower, format, &average) != 0) {
+            return 1;
         }
+
+    // write coarser overview maps
+    if (n_levels <= 0) return 0;
+
+    int return_code = 0;
+    grid_t **levels = grid_pyramid(grid, n_levels);
+    for (int i = 0; i < n_levels; ++i) {
+        if (levels == NULL ||
+            grid_write_level(levels[i], output_upper, header, argc, argv, leaflet_thickness, &upper, format) != 0 ||
+            grid_write_level(levels[i], output_lower, header, argc, argv, leaflet_thickness, &lower, format) != 0) {
+                return_code = 1;
+                break;
+            }
     }
+    grids_destroy(levels, n_levels);
+
+    return return_code;
 }
 
 int main(int argc, char **argv)
@@ -222,12 +407,39 @@ int main(int argc, char **argv)
     char *phosphates = "name PO4";
     float array_dimx[2] = {0.};
     float array_dimy[2] = {0.};
+    char *reference = NULL;
+    int rotate = 0;
+    int n_threads = 1;
+    int binary = 0;
+    int n_levels = 0;
+    int decompose = 0;
+    char *spectrum_file = NULL;
+    int field_size = 16;
+    int profiling = 0;
     int nan_limit = 30;
-    if (get_arguments(argc, argv, &gro_file, &xtc_file, &ndx_file, &output_upper, &output_lower, &lipids, &phosphates, array_dimx, array_dimy, &nan_limit) != 0) {
+    if (get_arguments(argc, argv, &gro_file, &xtc_file, &ndx_file, &output_upper, &output_lower, &lipids, &phosphates, array_dimx, array_dimy, &nan_limit, &reference, &rotate, &n_threads, &binary, &n_levels, &decompose, &spectrum_file, &field_size, &profiling) != 0) {
         print_usage(argv[0]);
         return 1;
     }
 
+    // check that the number of threads is > 0
+    if (n_threads <= 0) {
+        fprintf(stderr, "Number of threads must be higher than 0.\n");
+        return 1;
+    }
+
+    // check that the number of overview maps is sensible
+    if (n_levels < 0 || n_levels > MAP_MAX_LEVELS) {
+        fprintf(stderr, "Number of overview maps must be between 0 and %d.\n", MAP_MAX_LEVELS);
+        return 1;
+    }
+
+    // check that the height fields can be transformed
+    if (field_size < 4 || (field_size & (field_size - 1)) != 0) {
+        fprintf(stderr, "Size of the height fields must be a power of two and at least 4.\n");
+        return 1;
+    }
+
     if (output_upper == NULL) {
         output_upper = malloc(50);
         strncpy(output_upper, "thickness_upper.dat", 50);
@@ -262,6 +474,14 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    FILE *spectrum_output = spectrum_file == NULL ? NULL : fopen(spectrum_file, "w");
+    if (spectrum_file != NULL && spectrum_output == NULL) {
+        fprintf(stderr, "Output file '%s' could not be opened.\n", spectrum_file);
+        free(output_upper);
+        free(output_lower);
+        return 1;
+    }
+
     // read gro file
     system_t *system = load_gro(gro_file);
     if (system == NULL) {
@@ -287,10 +507,10 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    print_arguments(stdout, gro_file, xtc_file, ndx_file, output_upper, output_lower, lipids, phosphates, array_dimx, array_dimy, nan_limit);
+    print_arguments(stdout, gro_file, xtc_file, ndx_file, output_upper, output_lower, lipids, phosphates, array_dimx, array_dimy, nan_limit, reference, rotate, n_threads, binary, n_levels, decompose, spectrum_file, field_size, profiling);
 
     // open xtc file for reading
-    XDRFILE *xtc = xdrfile_open(xtc_file, "r");
+    xtc_reader_t *xtc = xtc_open(xtc_file);
     if (xtc == NULL) {
         fprintf(stderr, "File %s could not be read as an xtc file.\n", xtc_file);
         free(system);
@@ -299,13 +519,12 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    // set all velocities of all particles to zero (xtc does not contain velocities)
-    reset_velocities(system);
-
     // check that the gro file and the xtc file match each other
-    if (!validate_xtc(xtc_file, (int) system->n_atoms)) {
+    // (only the header of the first frame is read, so the xtc file can also be a pipe)
+    int xtc_atoms = 0;
+    if (xtc_peek_atoms(xtc, &xtc_atoms) != 0 || (size_t) xtc_atoms != system->n_atoms) {
         fprintf(stderr, "Number of atoms in %s does not match %s.\n", xtc_file, gro_file);
-        xdrfile_close(xtc);
+        xtc_close(xtc);
         free(system);
         free(output_upper);
         free(output_lower);
@@ -318,128 +537,320 @@ int main(int argc, char **argv)
     // select all atoms
     atom_selection_t *all = select_system(system);
 
-    // select membrane
-    atom_selection_t *membrane_atoms = smart_select(all, lipids, ndx_groups);
+    // select membrane (the selection can be re-evaluated in every frame)
+    atom_selection_t *membrane_reference = NULL;
+    float membrane_radius = 0.0f;
+    atom_selection_t *membrane_atoms = dynamic_select(all, lipids, ndx_groups, &membrane_reference, &membrane_radius);
     if (membrane_atoms == NULL || membrane_atoms->n_atoms == 0) {
         fprintf(stderr, "No lipid atoms detected.\n");
         dict_destroy(ndx_groups);
-        xdrfile_close(xtc);
+        xtc_close(xtc);
         free(all);
         free(membrane_atoms);
+        free(membrane_reference);
         free(system);
         free(output_upper);
         free(output_lower);
         return 1;
     }
 
-    // select phosphates
-    atom_selection_t *phosphate_atoms = smart_select(all, phosphates, ndx_groups);
+    // select phosphates (the selection can be re-evaluated in every frame)
+    atom_selection_t *phosphate_reference = NULL;
+    float phosphate_radius = 0.0f;
+    atom_selection_t *phosphate_atoms = dynamic_select(all, phosphates, ndx_groups, &phosphate_reference, &phosphate_radius);
     if (phosphate_atoms == NULL || phosphate_atoms->n_atoms == 0) {
         fprintf(stderr, "No phosphate atoms detected.\n");
         dict_destroy(ndx_groups);
-        xdrfile_close(xtc);
+        xtc_close(xtc);
         free(all);
         free(membrane_atoms);
+        free(membrane_reference);
         free(phosphate_atoms);
+        free(phosphate_reference);
         free(system);
         free(output_upper);
         free(output_lower);
         return 1;
     }
 
-    // prepare arrays
-    size_t n_rows = (size_t) roundf( (array_dimy[1] - array_dimy[0]) * GRID_TILE ) + 1;
-    size_t n_cols = (size_t) roundf( (array_dimx[1] - array_dimx[0]) * GRID_TILE ) + 1;
-    size_t n_tiles = n_rows * n_cols;
-
-    float *upper_leaflet        = calloc(n_tiles, sizeof(float));
-    int   *upper_leaflet_counts = calloc(n_tiles, sizeof(int));
-    float *lower_leaflet        = calloc(n_tiles, sizeof(float));
-    int   *lower_leaflet_counts = calloc(n_tiles, sizeof(int));
-
-    if (upper_leaflet == NULL || upper_leaflet_counts == NULL || lower_leaflet == NULL || lower_leaflet_counts == NULL) {
-        fprintf(stderr, "Could not allocate memory (grid too large?)\n");
+    // select reference atoms
+    atom_selection_t *reference_atoms = NULL;
+    if (reference != NULL) reference_atoms = smart_select(all, reference, ndx_groups);
+    if (reference != NULL && (reference_atoms == NULL || reference_atoms->n_atoms == 0)) {
+        fprintf(stderr, "No reference atoms detected.\n");
         dict_destroy(ndx_groups);
-        xdrfile_close(xtc);
-        fclose(output_u);
-        fclose(output_l);
-
+        xtc_close(xtc);
         free(all);
         free(membrane_atoms);
+        free(membrane_reference);
         free(phosphate_atoms);
+        free(phosphate_reference);
+        free(reference_atoms);
         free(system);
         free(output_upper);
         free(output_lower);
         return 1;
     }
 
+    // only keep the lipid, phosphate (and reference) atoms and the references of dynamic selections in memory
+    atom_selection_t *selections[5] = {membrane_atoms, phosphate_atoms, reference_atoms, membrane_reference, phosphate_reference};
+    subset_t *subsets[5] = {NULL};
+    size_t n_selections = 2;
+    if (reference_atoms != NULL) ++n_selections;
+    const size_t membrane_reference_index = n_selections;
+    if (membrane_reference != NULL) selections[n_selections++] = membrane_reference;
+    const size_t phosphate_reference_index = n_selections;
+    if (phosphate_reference != NULL) selections[n_selections++] = phosphate_reference;
+    frame_t *frame = frame_create(system, selections, n_selections, subsets);
+
+    // split the phosphates into lipid species by their residue names
+    species_t *species = NULL;
+    if (frame != NULL && decompose) species = species_create(system, frame, subsets[1]);
+
+    dict_destroy(ndx_groups);
+    free(all);
+    free(membrane_atoms);
+    free(membrane_reference);
+    free(phosphate_atoms);
+    free(phosphate_reference);
+    free(reference_atoms);
+    free(system);
+
+    if (frame == NULL) {
+        fprintf(stderr, "Could not allocate memory.\n");
+        xtc_close(xtc);
+        fclose(output_u);
+        fclose(output_l);
+        if (spectrum_output != NULL) fclose(spectrum_output);
+        free(output_upper);
+        free(output_lower);
+        return 1;
+    }
+
+    if (decompose && species == NULL) {
+        fprintf(stderr, "Could not split phosphates into lipid species (more than %d residue names?).\n", SPECIES_MAX);
+        xtc_close(xtc);
+        fclose(output_u);
+        fclose(output_l);
+        if (spectrum_output != NULL) fclose(spectrum_output);
+        frame_destroy(frame);
+        for (int i = 0; i < 5; ++i) free(subsets[i]);
+        free(output_upper);
+        free(output_lower);
+        return 1;
+    }
+
+    subset_t *membrane_subset = subsets[0];
+    subset_t *phosphate_subset = subsets[1];
+    subset_t *reference_subset = reference_atoms != NULL ? subsets[2] : NULL;
+    subset_t *membrane_reference_subset = membrane_reference != NULL ? subsets[membrane_reference_index] : NULL;
+    subset_t *phosphate_reference_subset = phosphate_reference != NULL ? subsets[phosphate_reference_index] : NULL;
+
+    // prepare centering (and fitting) on the reference atoms
+    fit_t *fit = reference_subset == NULL ? NULL : fit_create(reference_subset, rotate);
+
+    // every thread collects the data into its own grid and the grids are merged at the end of the analysis
+    // (the same set of grids is used for every lipid species)
+    const size_t n_sets = 1 + (species == NULL ? 0 : species->n_species);
+    grid_t **grids = grids_create(n_sets * n_threads, array_dimx, array_dimy, GRID_TILE);
+    pool_t *pool = pool_create(n_threads);
+
+    // undulation spectrum is collected from height fields covering the whole box
+    undulation_t *undulation = spectrum_file != NULL ? undulation_create(field_size) : NULL;
+
+    // dynamic selections are re-evaluated in every frame using a cell list shared by both of them
+    dynamic_selection_t *dynamic_membrane = membrane_reference_subset == NULL ? NULL :
+            dynamic_create(membrane_subset, membrane_reference_subset, membrane_radius);
+    dynamic_selection_t *dynamic_phosphates = phosphate_reference_subset == NULL ? NULL :
+            dynamic_create(phosphate_subset, phosphate_reference_subset, phosphate_radius);
+    dynamic_selection_t *dynamic[2] = {NULL};
+    size_t n_dynamic = 0;
+    if (dynamic_membrane != NULL) dynamic[n_dynamic++] = dynamic_membrane;
+    if (dynamic_phosphates != NULL) dynamic[n_dynamic++] = dynamic_phosphates;
+    selector_t *selector = n_dynamic > 0 ? selector_create(frame, dynamic, n_dynamic) : NULL;
+
+    // the locality of binning is only measured for a fixed set of phosphates
+    profile_t *profile = profiling ? profile_create(dynamic_phosphates == NULL ? phosphate_subset : NULL, GRID_TILE) : NULL;
+
+    if (grids == NULL || pool == NULL ||
+        (reference_subset != NULL && fit == NULL) ||
+        (spectrum_file != NULL && undulation == NULL) ||
+        (membrane_reference_subset != NULL && dynamic_membrane == NULL) ||
+        (phosphate_reference_subset != NULL && dynamic_phosphates == NULL) ||
+        (n_dynamic > 0 && selector == NULL) ||
+        (profiling && profile == NULL)) {
+        fprintf(stderr, "Could not allocate memory (grid too large?)\n");
+        xtc_close(xtc);
+        fclose(output_u);
+        fclose(output_l);
+        if (spectrum_output != NULL) fclose(spectrum_output);
+
+        frame_destroy(frame);
+        free(membrane_subset);
+        free(phosphate_subset);
+        free(reference_subset);
+        fit_destroy(fit);
+        species_destroy(species);
+        grids_destroy(grids, n_sets * n_threads);
+        pool_destroy(pool);
+        undulation_destroy(undulation);
+        selector_destroy(selector);
+        dynamic_destroy(dynamic_membrane);
+        dynamic_destroy(dynamic_phosphates);
+        free(membrane_reference_subset);
+        free(phosphate_reference_subset);
+        profile_destroy(profile);
+        free(output_upper);
+        free(output_lower);
+        return 1;
+    }
+
+    // atoms analyzed in the current frame
+    const subset_t *frame_membrane = dynamic_membrane != NULL ? dynamic_membrane->selected : membrane_subset;
+    const subset_t *frame_phosphates = dynamic_phosphates != NULL ? dynamic_phosphates->selected : phosphate_subset;
+
     float av_membrane_center_z = 0.0;
+    // grid in fixed-point coordinates (used if the trajectory precision allows it)
+    int_grid_t grid = {0};
+    frame_task_t task = { frame, frame_phosphates, fit, &grid, 0, NULL, array_dimx, array_dimy, species, n_threads, grids };
+
     size_t frames = 0;
-    while (read_xtc_step(xtc, system) == 0) {
+    size_t n_skipped = 0;
+    int return_code = 0, status = 0;
+    profile_start(profile);
+    while ((status = xtc_read_frame(xtc, frame)) == 0) {
+        profile_mark(profile, PROFILE_READ);
 
         // print info about the progress of reading
-        if ((int) system->time % PROGRESS_FREQ == 0) {
-            printf("Step: %d. Time: %.0f ps\r", system->step, system->time);
+        if ((int) frame->time % PROGRESS_FREQ == 0) {
+            printf("Step: %d. Time: %.0f ps\r", frame->step, frame->time);
             fflush(stdout);
         }
 
+        // evaluate dynamic selections before the system is centered (frames without any lipids selected are skipped)
+        if (selector != NULL && selector_update(selector, frame) != 0) {
+            fprintf(stderr, "\nCould not allocate memory.\n");
+            return_code = 1;
+            break;
+        }
+        if (selector != NULL) profile_mark(profile, PROFILE_SELECT);
+        if (frame_membrane->n_atoms == 0) {
+            ++n_skipped;
+            continue;
+        }
+
         // get membrane center
         vec_t center_mem = {0};
-        center_of_geometry(membrane_atoms, center_mem, system->box);
-        av_membrane_center_z += center_mem[2];
+        subset_center_of_geometry_parallel(frame, frame_membrane, pool, center_mem);
+        int_grid_prepare(&grid, frame, array_dimx, array_dimy, GRID_TILE);
 
-        // loop through phosphates, assign them to leaflets... 
-        // ...and get their z positions relative to center_mem
-        for (size_t i = 0; i < phosphate_atoms->n_atoms; ++i) {
-            atom_t *atom = phosphate_atoms->atoms[i];
-            float rel_pos_z = distance1D(atom->position, center_mem, z, system->box);
-
-            // ignore atoms that are outside of the specified grid
-            if (atom->position[0] < array_dimx[0] || atom->position[0] > array_dimx[1] ||
-                atom->position[1] < array_dimy[0] || atom->position[1] > array_dimy[1]) {
-                    continue;
-                }
-            
-            // get index of the tile to which the atom should be assigned
-            size_t x_index = coor2index(atom->position[0], array_dimx[0]);
-            size_t y_index = coor2index(atom->position[1], array_dimy[0]);
-
-            if (rel_pos_z > 0) {
-                upper_leaflet[y_index * n_cols + x_index] += rel_pos_z;
-                ++upper_leaflet_counts[y_index * n_cols + x_index];
-            } else {
-                lower_leaflet[y_index * n_cols + x_index] += rel_pos_z;
-                ++lower_leaflet_counts[y_index * n_cols + x_index];
-            }
-        }
+        // center (and fit) the system using the reference atoms
+        if (fit != NULL) fit_frame(fit, frame);
+        av_membrane_center_z += center_mem[2];
+        profile_mark(profile, PROFILE_CENTER);
+
+        // phosphates move little between frames, so keeping them sorted by tile
+        // makes the consecutive updates of the grid hit neighboring tiles
+        // (dynamically selected phosphates are kept in the order of the frame instead)
+        if (dynamic_phosphates == NULL && frames % SORT_FREQ == 0) subset_sort_by_tile(frame, phosphate_subset, GRID_TILE);
+        profile_mark(profile, PROFILE_SORT);
+        profile_count(profile, frame, frame_phosphates);
+
+        // assign phosphates to leaflets using all threads
+        // (fixed-point coordinates can not be used if the system is rotated)
+        task.use_fixed = grid.enabled && (fit == NULL || !fit->rotate);
+        task.center_mem = center_mem;
+        pool_run(pool, assign_phosphates, &task);
+        profile_mark(profile, PROFILE_BIN);
+
+        // add the spectrum of the height fields of this frame
+        if (undulation != NULL) undulation_add_frame(undulation, frame, frame_phosphates, center_mem);
+        profile_mark(profile, PROFILE_OTHER);
 
         ++frames;
 
     }
     printf("\n");
+    if (status == 2) return_code = 1;
+
+    // maps are never written from an incomplete analysis
+    if (return_code != 0) {
+        fprintf(stderr, "Analysis stopped, no maps were written.\n");
+        goto analysis_end;
+    }
+
+    if (n_skipped > 0) printf("Skipped %zu frames without any lipid atoms selected.\n", n_skipped);
+    profile_write(profile, stdout, frames);
+
+    // merge the grids of all threads
+    for (size_t s = 0; s < n_sets; ++s) grids_merge(grids + s * n_threads, n_threads);
 
     // write output files
-    write_output(output_u, upper_leaflet, upper_leaflet_counts, n_rows, n_cols, nan_limit, array_dimx, array_dimy, argv, argc);
-    write_output(output_l, lower_leaflet, lower_leaflet_counts, n_rows, n_cols, nan_limit, array_dimx, array_dimy, argv, argc);
+    const map_header_t header = {
+        "leafthick (C Leaflet Thickness Calculator)", VERSION, NULL,
+        "leaflet thickness [nm]", "rainbow", 1, 4, NULL, frames };
+    const map_format_t format = binary ? MAP_BINARY : MAP_TEXT;
+    if (write_leaflet_maps(grids[0], output_u, output_l, output_upper, output_lower, n_levels, &header, argc, argv, nan_limit, format) != 0) {
+        fprintf(stderr, "Could not write output files.\n");
+        return_code = 1;
+    }
 
-    dict_destroy(ndx_groups);
-    xdrfile_close(xtc);
+    // write maps of the individual lipid species
+    for (size_t s = 0; species != NULL && s < species->n_species; ++s) {
+        char *species_upper = map_suffixed_name(output_upper, species->names[s]);
+        char *species_lower = map_suffixed_name(output_lower, species->names[s]);
+        FILE *species_u = species_upper == NULL ? NULL : fopen(species_upper, "w");
+        FILE *species_l = species_lower == NULL ? NULL : fopen(species_lower, "w");
+
+        if (species_u == NULL || species_l == NULL ||
+            write_leaflet_maps(grids[(s + 1) * n_threads], species_u, species_l, species_upper, species_lower, n_levels, &header, argc, argv, nan_limit, format) != 0) {
+                fprintf(stderr, "Could not write output files for lipid species %s.\n", species->names[s]);
+                return_code = 1;
+            }
+
+        if (species_u != NULL) fclose(species_u);
+        if (species_l != NULL) fclose(species_l);
+        free(species_upper);
+        free(species_lower);
+    }
+
+    // write the undulation spectrum
+    if (undulation != NULL) {
+        double kappa = 0.0;
+        if (undulation_write(undulation, spectrum_output, header.program, argc, argv, &kappa) != 0) {
+            fprintf(stderr, "Could not write output file %s.\n", spectrum_file);
+            return_code = 1;
+        } else {
+            printf("Bending modulus estimated from undulations: %.4f kT\n", kappa);
+        }
+    }
+
+    analysis_end:
+    if (spectrum_output != NULL) fclose(spectrum_output);
+    xtc_close(xtc);
     fclose(output_u);
     fclose(output_l);
     
     
-    free(all);
-    free(membrane_atoms);
-    free(phosphate_atoms);
-    free(system);
-
-    free(upper_leaflet);
-    free(upper_leaflet_counts);
-    free(lower_leaflet);
-    free(lower_leaflet_counts);
+    frame_destroy(frame);
+    free(membrane_subset);
+    free(phosphate_subset);
+    free(reference_subset);
+    fit_destroy(fit);
+    species_destroy(species);
+
+    grids_destroy(grids, n_sets * n_threads);
+    pool_destroy(pool);
+    undulation_destroy(undulation);
+    selector_destroy(selector);
+    dynamic_destroy(dynamic_membrane);
+    dynamic_destroy(dynamic_phosphates);
+    free(membrane_reference_subset);
+    free(phosphate_reference_subset);
+    profile_destroy(profile);
 
     free(output_upper);
     free(output_lower);
 
-    return 0;
+    return return_code;
 }
\ No newline at end of file
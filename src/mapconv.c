@@ -0,0 +1,170 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "grid.h"
+
+/*
+ * Parses command line arguments.
+ * Returns zero, if parsing has been successful. Else returns non-zero.
+ */
+int get_arguments(
+        int argc,
+        char **argv,
+        char **input_file,
+        char **output_file)
+{
+    int input_specified = 0;
+
+    int opt = 0;
+    while((opt = getopt(argc, argv, "i:o:h")) != -1) {
+        switch (opt) {
+        // help
+        case 'h':
+            return 1;
+        // binary map to read
+        case 'i':
+            *input_file = optarg;
+            input_specified = 1;
+            break;
+        // output file name
+        case 'o':
+            *output_file = optarg;
+            break;
+        default:
+            //fprintf(stderr, "Unknown command line option: %c.\n", opt);
+            return 1;
+        }
+    }
+
+    if (!input_specified) {
+        fprintf(stderr, "Binary map file must always be supplied.\n");
+        return 1;
+    }
+    return 0;
+}
+
+void print_usage(const char *program_name)
+{
+    printf("Usage: %s -i BINARY_MAP [OPTION]...\n", program_name);
+    printf("\nOPTIONS\n");
+    printf("-h               print this message and exit\n");
+    printf("-i STRING        binary map written by memthick, leafthick or wdmap (flag -b)\n");
+    printf("-o STRING        output text file name (default: standard output)\n");
+    printf("\n");
+}
+
+/*
+ * Checks that the memory-mapped file is a valid binary map.
+ * Returns zero, if the map is valid. Else returns non-zero.
+ */
+static int check_map(const unsigned char *data, const size_t size)
+{
+    const map_file_header_t *header = (const map_file_header_t *) data;
+
+    if (size < sizeof(map_file_header_t) || memcmp(header->magic, MAP_MAGIC, sizeof(MAP_MAGIC)) != 0) {
+        fprintf(stderr, "File is not a binary map.\n");
+        return 1;
+    }
+
+    if (header->byte_order != MAP_BYTE_ORDER) {
+        fprintf(stderr, "Binary map was written on a machine with a different byte order.\n");
+        return 1;
+    }
+
+    // every tile occupies more than a byte, so the number of tiles can not exceed the size of the file
+    if (header->n_rows == 0 || header->n_cols == 0 || header->n_cols > size / header->n_rows) {
+        fprintf(stderr, "Binary map is corrupted.\n");
+        return 1;
+    }
+
+    uint64_t n_tiles = header->n_rows * header->n_cols;
+    if (header->header_size != sizeof(map_file_header_t) ||
+        header->file_size != size ||
+        header->tiles_per_nm <= 0 ||
+        header->coarsening <= 0 ||
+        header->values_offset > size ||
+        header->counts_offset > size ||
+        header->command_length == 0 ||
+        sizeof(map_file_header_t) + header->command_length > header->values_offset ||
+        data[sizeof(map_file_header_t) + header->command_length - 1] != '\0' ||
+        header->values_offset % MAP_ALIGNMENT != 0 ||
+        header->values_offset + n_tiles * sizeof(float) > header->counts_offset ||
+        header->counts_offset + n_tiles * 2 * sizeof(uint64_t) > size) {
+            fprintf(stderr, "Binary map is corrupted.\n");
+            return 1;
+        }
+
+    // fixed-size strings must be terminated
+    const char *fields[] = { header->program, header->version, header->note, header->zlabel, header->colormap, header->footer };
+    const size_t sizes[] = { sizeof(header->program), sizeof(header->version), sizeof(header->note),
+                             sizeof(header->zlabel), sizeof(header->colormap), sizeof(header->footer) };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(size_t); ++i) {
+        if (memchr(fields[i], '\0', sizes[i]) == NULL) {
+            fprintf(stderr, "Binary map is corrupted.\n");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    // get command line arguments
+    char *input_file = NULL;
+    char *output_file = NULL;
+    if (get_arguments(argc, argv, &input_file, &output_file) != 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    // map the binary file into memory
+    int fd = open(input_file, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0 || info.st_size == 0) {
+        fprintf(stderr, "File %s could not be read.\n", input_file);
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+
+    size_t size = (size_t) info.st_size;
+    unsigned char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "File %s could not be read.\n", input_file);
+        return 1;
+    }
+
+    if (check_map(data, size) != 0) {
+        munmap(data, size);
+        return 1;
+    }
+
+    FILE *output = output_file == NULL ? stdout : fopen(output_file, "w");
+    if (output == NULL) {
+        fprintf(stderr, "Output file could not be opened.\n");
+        munmap(data, size);
+        return 1;
+    }
+
+    const map_file_header_t *header = (const map_file_header_t *) data;
+    const char *command_line = (const char *) (data + sizeof(map_file_header_t));
+    const float *values = (const float *) (data + header->values_offset);
+    map_write_text(output, header, command_line, values);
+
+    int return_code = 0;
+    if (ferror(output)) {
+        fprintf(stderr, "Could not write output file.\n");
+        return_code = 1;
+    }
+
+    if (output != stdout) fclose(output);
+    munmap(data, size);
+
+    return return_code;
+}
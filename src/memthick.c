@@ -4,13 +4,32 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <groan.h>
+#include "frame.h"
+#include "xtc.h"
+#include "fit.h"
+#include "pool.h"
+#include "grid.h"
+#include "species.h"
+#include "undulation.h"
+#include "celllist.h"
+#include "dynamic.h"
+#include "profile.h"
 
 const char VERSION[] = "v2022/06/25";
 
 // frequency of printing during the calculation
 const int PROGRESS_FREQ = 10000;
+// frequency of reordering the analyzed atoms by their position in the xy-plane (in frames)
+const int SORT_FREQ = 100;
+// number of consecutive frames of a replica analyzed as a single job in batch mode
+const int BATCH_CHUNK = 50;
 // inverse size of a grid tile for membrane thickness calculation
 const int GRID_TILE = 10;
+// positions of phosphates are summed as integers in units of 1e-6 nm
+// (the sums are exact and do not depend on the order of summation)
+const double Z_SCALE = 1000000.0;
+// identifies binary time series of the local thickness of every phosphate
+#define LOCAL_MAGIC "MEMDLOC"
 
 /*
  * Parses command line arguments.
@@ -27,13 +46,24 @@ int get_arguments(
         char **phosphates,
         float *array_dimx,
         float *array_dimy,
-        int   *nan_limit
-        ) 
+        int   *nan_limit,
+        char **reference,
+        int   *rotate,
+        int   *n_threads,
+        int   *binary,
+        int   *n_levels,
+        int   *decompose,
+        char **replicas_file,
+        char **spectrum_file,
+        int   *field_size,
+        char **local_file,
+        float *local_cutoff,
+        int   *profiling) 
 {
     int gro_specified = 0, xtc_specified = 0;
 
     int opt = 0;
-    while((opt = getopt(argc, argv, "c:f:n:o:l:p:x:y:a:h")) != -1) {
+    while((opt = getopt(argc, argv, "c:f:n:o:l:p:x:y:a:r:zt:bm:dR:u:g:L:k:Ph")) != -1) {
         switch (opt) {
         // help
         case 'h':
@@ -86,14 +116,95 @@ int get_arguments(
         case 'a':
             sscanf(optarg, "%d", nan_limit);
             break;
+        // reference selection for centering
+        case 'r':
+            *reference = optarg;
+            break;
+        // fit rotation around the z-axis
+        case 'z':
+            *rotate = 1;
+            break;
+        // number of threads
+        case 't':
+            sscanf(optarg, "%d", n_threads);
+            break;
+        // binary output
+        case 'b':
+            *binary = 1;
+            break;
+        // number of coarser overview maps
+        case 'm':
+            sscanf(optarg, "%d", n_levels);
+            break;
+        // separate maps for lipid species
+        case 'd':
+            *decompose = 1;
+            break;
+        // list of replica trajectories
+        case 'R':
+            *replicas_file = optarg;
+            break;
+        // output file for the undulation spectrum
+        case 'u':
+            *spectrum_file = optarg;
+            break;
+        // size of the height fields
+        case 'g':
+            sscanf(optarg, "%d", field_size);
+            break;
+        // binary output file for the local thickness of every phosphate
+        case 'L':
+            *local_file = optarg;
+            break;
+        // lateral cutoff for the local thickness (also enables the map of local thickness)
+        case 'k':
+            *local_cutoff = atof(optarg);
+            if (*local_cutoff <= 0) {
+                fprintf(stderr, "Local thickness cutoff must be >0, not %f.\n", *local_cutoff);
+                return 1;
+            }
+            break;
+        // report the time spent in the phases of the analysis
+        case 'P':
+            *profiling = 1;
+            break;
         default:
             //fprintf(stderr, "Unknown command line option: %c.\n", opt);
             return 1;
         }
     }
 
-    if (!gro_specified || !xtc_specified) {
-        fprintf(stderr, "Gro file and xtc file must always be supplied.\n");
+    if (!gro_specified || (!xtc_specified && *replicas_file == NULL)) {
+        fprintf(stderr, "Gro file and xtc file (or list of replicas) must always be supplied.\n");
+        return 1;
+    }
+
+    if (xtc_specified && *replicas_file != NULL) {
+        fprintf(stderr, "Xtc file and list of replicas can not be supplied together.\n");
+        return 1;
+    }
+
+    if (*rotate && *reference == NULL) {
+        fprintf(stderr, "Reference selection must be supplied for fitting.\n");
+        return 1;
+    }
+
+    // the per-phosphate output requires the local thickness
+    if (*local_file != NULL && *local_cutoff == 0) *local_cutoff = 1.0f;
+
+    if (*local_cutoff > 0 && *replicas_file != NULL) {
+        fprintf(stderr, "Local thickness can not be calculated for a list of replicas.\n");
+        return 1;
+    }
+
+    if (*profiling && *replicas_file != NULL) {
+        fprintf(stderr, "Phases of the analysis can not be timed for a list of replicas.\n");
+        return 1;
+    }
+
+    // replicas are analyzed by independent workers and local thickness requires a fixed set of phosphates
+    if ((*replicas_file != NULL || *local_cutoff > 0) && (dynamic_query(*lipids) || dynamic_query(*phosphates))) {
+        fprintf(stderr, "Dynamic selections can not be used with a list of replicas or local thickness.\n");
         return 1;
     }
     return 0;
@@ -105,15 +216,29 @@ void print_usage(const char *program_name)
     printf("\nOPTIONS\n");
     printf("-h               print this message and exit\n");
     printf("-c STRING        gro file to read\n");
-    printf("-f STRING        xtc file to read\n");
+    printf("-f STRING        xtc file to read (\"-\" for standard input)\n");
     printf("-n STRING        ndx file to read (optional, default: index.ndx)\n");
     printf("-o STRING        output file name (default: membrane_thickness.dat)\n");
     printf("-l STRING        specification of membrane lipids (default: Membrane)\n");
     printf("-p STRING        specification of lipid phosphates (default: name PO4)\n");
+    printf("                 (-l and -p can be dynamic, e.g. \"name PO4 within 2.0 of Protein\")\n");
     printf("-x FLOAT-FLOAT   grid dimensions in x axis (default: box size from gro file)\n");
     printf("-y FLOAT-FLOAT   grid dimensions in y axis (default: box size from gro file)\n");
     printf("-a INTEGER       NAN limit: how many phosphates must be detected in a grid tile\n");
     printf("                 to calculate membrane thickness for this tile (default: 30)\n");
+    printf("-r STRING        reference selection centered in the xy-plane in every frame (default: none)\n");
+    printf("-z               also rotate the system around the z-axis to fit the reference (requires -r)\n");
+    printf("-t INTEGER       number of threads used to analyze every frame (default: 1)\n");
+    printf("-b               write the output in binary format (can be converted to text using mapconv)\n");
+    printf("-m INTEGER       number of overview maps, each two times coarser than the previous one (default: 0)\n");
+    printf("-d               also write a separate map for every residue name of the phosphates\n");
+    printf("-R STRING        file listing replica xtc files (one per line) analyzed in a single run instead of -f\n");
+    printf("-u STRING        output file for the undulation spectrum of the membrane (default: none)\n");
+    printf("-g INTEGER       number of cells of the height fields along x and y, power of two (default: 16)\n");
+    printf("-k FLOAT         calculate the map of local thickness using this lateral cutoff for the opposite phosphates\n");
+    printf("                 (default: 1.0 nm with -L, otherwise local thickness is not calculated)\n");
+    printf("-L STRING        binary output file for the per-frame local thickness of every phosphate (default: none)\n");
+    printf("-P               report the time spent in the phases of the analysis and the locality of binning\n");
     printf("\n");
 }
 
@@ -130,33 +255,796 @@ void print_arguments(
         const char *phosphates,
         const float *array_dimx,
         const float *array_dimy,
-        const int nan_limit)
+        const int nan_limit,
+        const char *reference,
+        const int rotate,
+        const int n_threads,
+        const int binary,
+        const int n_levels,
+        const int decompose,
+        const char *replicas_file,
+        const char *spectrum_file,
+        const int field_size,
+        const char *local_file,
+        const float local_cutoff,
+        const int profiling)
 {
     fprintf(stream, "Parameters for Membrane Thickness calculation:\n");
     fprintf(stream, ">>> gro file:         %s\n", gro_file);
-    fprintf(stream, ">>> xtc file:         %s\n", xtc_file);
+    if (replicas_file != NULL) fprintf(stream, ">>> replicas:         %s\n", replicas_file);
+    else fprintf(stream, ">>> xtc file:         %s\n", xtc_file);
     fprintf(stream, ">>> ndx file:         %s\n", ndx_file);
     fprintf(stream, ">>> output file:      %s\n", output_file);
     fprintf(stream, ">>> lipids:           %s\n", lipids);
     fprintf(stream, ">>> phosphates:       %s\n", phosphates);
     fprintf(stream, ">>> grid dimensions:  x: %.1f - %.1f nm, y: %.1f - %.1f nm\n", array_dimx[0], array_dimx[1], array_dimy[0], array_dimy[1]);
-    fprintf(stream, ">>> NAN limit:        %d\n\n", nan_limit);
+    fprintf(stream, ">>> NAN limit:        %d\n", nan_limit);
+    if (reference != NULL) fprintf(stream, ">>> reference:        %s (centered in xy%s)\n", reference, rotate ? ", fitted around z" : "");
+    fprintf(stream, ">>> threads:          %d\n", n_threads);
+    if (binary) fprintf(stream, ">>> output format:    binary\n");
+    if (n_levels > 0) fprintf(stream, ">>> overview maps:    %d (up to %dx coarser)\n", n_levels, 1 << n_levels);
+    if (decompose) fprintf(stream, ">>> lipid species:    separate map for every residue name\n");
+    if (spectrum_file != NULL) fprintf(stream, ">>> undulations:      %s (%dx%d height fields)\n", spectrum_file, field_size, field_size);
+    if (local_cutoff > 0) fprintf(stream, ">>> local thickness:  cutoff: %.3f nm%s%s\n", local_cutoff, local_file != NULL ? ", per-phosphate output: " : "", local_file != NULL ? local_file : "");
+    if (profiling) fprintf(stream, ">>> profiling:        enabled\n");
+    fprintf(stream, "\n");
+}
+
+/*
+ * Data needed to assign the phosphates of a single frame to grid tiles.
+ */
+typedef struct frame_task {
+    const frame_t *frame;
+    const subset_t *phosphate_subset;
+    const fit_t *fit;
+    const int_grid_t *grid;
+    int use_fixed;              // 1 if the fixed-point coordinates should be used
+    const float *center_mem;
+    const float *array_dimx;
+    const float *array_dimy;
+    const species_t *species;   // lipid species of the phosphates (NULL if the maps are not decomposed)
+    size_t n_threads;
+    grid_t **grids;             // one grid for every thread (followed by the same for every lipid species)
+} frame_task_t;
+
+/*
+ * Assigns a single phosphate to a leaflet and adds its z position relative to the membrane center to the grid
+ * (and to the grid of its lipid species).
+ */
+static inline void assign_phosphate(const frame_task_t *task, const size_t thread, const size_t id)
+{
+    grid_t *thread_grid = task->grids[thread];
+    const frame_t *frame = task->frame;
+    const fit_t *fit = task->fit;
+    const float *array_dimx = task->array_dimx;
+    const float *array_dimy = task->array_dimy;
+
+    const float *position = frame->positions[id];
+    float rel_pos_z = distance1D(position, task->center_mem, z, frame->box);
+
+    // get index of the tile to which the atom should be assigned
+    // (ignoring atoms that are outside of the specified grid)
+    size_t x_index = 0, y_index = 0;
+    if (task->use_fixed) {
+        const int *coordinates = frame->coordinates + 3 * id;
+        int fitted[3] = {0};
+        if (fit != NULL) coordinates = fit_apply_fixed(fit, coordinates, fitted);
+
+        if (!int_grid_index(task->grid, coordinates, &x_index, &y_index)) return;
+    } else {
+        vec_t fitted = {0.0f};
+        if (fit != NULL) position = fit_apply(fit, position, fitted);
+
+        if (position[0] < array_dimx[0] || position[0] > array_dimx[1] ||
+            position[1] < array_dimy[0] || position[1] > array_dimy[1]) {
+                return;
+            }
+
+        x_index = grid_coor2index(thread_grid, position[0], 0);
+        y_index = grid_coor2index(thread_grid, position[1], 1);
+    }
+
+    const int part = rel_pos_z > 0 ? GRID_UPPER : GRID_LOWER;
+    const int64_t value = llround((double) rel_pos_z * Z_SCALE);
+    tile_add(grid_tile(thread_grid, x_index, y_index), part, value);
+
+    if (task->species != NULL) {
+        grid_t *species_grid = task->grids[(1 + task->species->of_atom[id]) * task->n_threads + thread];
+        tile_add(grid_tile(species_grid, x_index, y_index), part, value);
+    }
+}
+
+/*
+ * Assigns phosphates to leaflets and gets their z positions relative to the membrane center.
+ * Every thread processes a part of the phosphates and writes into its own grid.
+ */
+static void assign_phosphates(void *data, const size_t thread, const size_t n_threads)
+{
+    const frame_task_t *task = data;
+    const subset_t *phosphate_subset = task->phosphate_subset;
+
+    size_t start = 0, end = 0;
+    pool_range(phosphate_subset->n_atoms, thread, n_threads, &start, &end);
+
+    // contiguous ranges of phosphates are streamed directly
+    if (phosphate_subset->n_ranges > 0) {
+        for (size_t r = 0; r < phosphate_subset->n_ranges; ++r) {
+            size_t from = 0, to = 0;
+            if (!subset_range_window(phosphate_subset, r, start, end, &from, &to)) continue;
+            for (size_t id = from; id < to; ++id) assign_phosphate(task, thread, id);
+        }
+        return;
+    }
+
+    for (size_t i = start; i < end; ++i) assign_phosphate(task, thread, phosphate_subset->ids[i]);
+}
+
+/*
+ * Calculates membrane thickness in a grid tile.
+ * Returns 0 if there is not enough data for this tile.
+ */
+static int membrane_thickness(const tile_t *tile, const void *data, double *thickness)
+{
+    const int nan_limit = *(const int *) data;
+
+    // check that we have enough data for this grid tile
+    uint64_t upper_count = tile_count(tile, GRID_UPPER);
+    uint64_t lower_count = tile_count(tile, GRID_LOWER);
+    if (upper_count < (uint64_t) nan_limit || lower_count < (uint64_t) nan_limit) return 0;
+
+    float value = (tile->sum[GRID_UPPER] / Z_SCALE / upper_count) -
+                  (tile->sum[GRID_LOWER] / Z_SCALE / lower_count);
+    *thickness = value;
+    return 1;
+}
+
+/*
+ * Writes coarser overview maps of membrane thickness.
+ * Returns 0 if successful, else returns 1.
+ */
+static int write_overview_maps(
+        const grid_t *grid,
+        const int n_levels,
+        const char *output_file,
+        const map_header_t *header,
+        int argc,
+        char **argv,
+        const int *nan_limit,
+        const map_format_t format)
+{
+    if (n_levels <= 0) return 0;
+
+    int return_code = 0;
+    grid_t **levels = grid_pyramid(grid, n_levels);
+    for (int i = 0; i < n_levels; ++i) {
+        if (levels == NULL || grid_write_level(levels[i], output_file, header, argc, argv, membrane_thickness, nan_limit, format) != 0) {
+            fprintf(stderr, "Could not write overview maps.\n");
+            return_code = 1;
+            break;
+        }
+    }
+    grids_destroy(levels, n_levels);
+    return return_code;
+}
+
+/*
+ * Writes maps of membrane thickness for the individual lipid species (and their overview maps).
+ * The grid of the s-th species is grids[(s + 1) * stride]. 'label' (can be NULL) is printed with the averages.
+ * Returns 0 if all maps were written, else returns 1.
+ */
+static int write_species_maps(
+        grid_t **grids,
+        const size_t stride,
+        const species_t *species,
+        const char *output_file,
+        const char *label,
+        const int n_levels,
+        const map_header_t *header,
+        int argc,
+        char **argv,
+        const int *nan_limit,
+        const map_format_t format)
+{
+    int return_code = 0;
+    for (size_t s = 0; species != NULL && s < species->n_species; ++s) {
+        const grid_t *species_grid = grids[(s + 1) * stride];
+        char *species_file = map_suffixed_name(output_file, species->names[s]);
+        float av_species = 0.0f;
+
+        if (species_file == NULL || grid_write_file(species_file, species_grid, header, argc, argv, membrane_thickness, nan_limit, format, &av_species) != 0) {
+            fprintf(stderr, "Could not write output file for lipid species %s.\n", species->names[s]);
+            return_code = 1;
+        } else {
+            return_code |= write_overview_maps(species_grid, n_levels, species_file, header, argc, argv, nan_limit, format);
+            if (label != NULL) printf("Average membrane thickness (%s, %s): %.4f nm\n", label, species->names[s], av_species);
+            else printf("Average membrane thickness (%s): %.4f nm\n", species->names[s], av_species);
+        }
+
+        free(species_file);
+    }
+
+    return return_code;
+}
+
+/*
+ * Local membrane thickness of every phosphate calculated in every frame from the phosphates of the opposite leaflet
+ * that are laterally closer than the cutoff. Both leaflets are sorted into 2D periodic cell lists in every frame,
+ * so the cost of a frame is proportional to the number of phosphates.
+ */
+typedef struct local {
+    float cutoff;
+    const subset_t *phosphates;     // phosphates in the order of the columns of the output (never reordered)
+    size_t *leaflet_ids[2];         // phosphates of the upper and the lower leaflet in the current frame
+    cell_list_t *lists[2];          // cell lists of the upper and the lower leaflet
+    float *values;                  // local thickness of every phosphate in the current frame (NaN if not available)
+    grid_t *grid;                   // local thickness collected in grid tiles (both leaflets)
+    const float *array_dimx;        // dimensions of the grid
+    const float *array_dimy;
+    FILE *output;                   // binary time series of the local thickness of every phosphate (NULL if not written)
+    const frame_t *frame;           // frame and membrane center used by the threads
+    const float *center_mem;
+} local_t;
+
+/*
+ * Header of the binary time series of the local thickness of every phosphate. All numbers are stored
+ * in the native byte order (checked using MAP_BYTE_ORDER).
+ *
+ * The header is followed by the command line (a zero-terminated string), by the atom numbers of the phosphates
+ * (n_phosphates 32-bit integers) and then by the frames. Every frame consists of the simulation time in ps
+ * and the local thickness of every phosphate in nm (1 + n_phosphates 32-bit floats; NaN if not available).
+ */
+typedef struct local_header {
+    char magic[8];              // LOCAL_MAGIC
+    uint32_t byte_order;        // MAP_BYTE_ORDER
+    uint32_t header_size;       // size of this structure
+    uint64_t n_phosphates;
+    float cutoff;               // lateral cutoff for the opposite phosphates
+    uint32_t command_length;    // length of the command line including the terminating zero
+} local_header_t;
+
+/*
+ * Frees all memory associated with the local thickness. Does not close the output file.
+ */
+static void local_destroy(local_t *local)
+{
+    if (local == NULL) return;
+
+    for (int i = 0; i < 2; ++i) {
+        free(local->leaflet_ids[i]);
+        cell_list_destroy(local->lists[i]);
+    }
+    free(local->values);
+    grid_destroy(local->grid);
+    free(local);
+}
+
+/*
+ * Prepares the calculation of the local thickness of the phosphates and writes the header of the output file (if any).
+ * Returns NULL if the memory could not be allocated or if the header could not be written.
+ */
+static local_t *local_create(
+        const float cutoff,
+        const frame_t *frame,
+        const subset_t *phosphates,
+        const float *array_dimx,
+        const float *array_dimy,
+        FILE *output,
+        int argc,
+        char **argv)
+{
+    local_t *local = calloc(1, sizeof(local_t));
+    if (local == NULL) return NULL;
+
+    local->cutoff = cutoff;
+    local->phosphates = phosphates;
+    local->output = output;
+    local->array_dimx = array_dimx;
+    local->array_dimy = array_dimy;
+    for (int i = 0; i < 2; ++i) {
+        local->leaflet_ids[i] = malloc(phosphates->n_atoms * sizeof(size_t));
+        local->lists[i] = cell_list_create(cutoff, 2);
+    }
+    local->values = malloc(phosphates->n_atoms * sizeof(float));
+    local->grid = grid_create(array_dimx, array_dimy, GRID_TILE);
+
+    if (local->leaflet_ids[0] == NULL || local->leaflet_ids[1] == NULL ||
+        local->lists[0] == NULL || local->lists[1] == NULL ||
+        local->values == NULL || local->grid == NULL) {
+            local_destroy(local);
+            return NULL;
+        }
+
+    if (output == NULL) return local;
+
+    local_header_t header = {{0}, MAP_BYTE_ORDER, sizeof(local_header_t), phosphates->n_atoms, cutoff, 1};
+    memcpy(header.magic, LOCAL_MAGIC, sizeof(LOCAL_MAGIC));
+    for (int i = 0; i < argc; ++i) header.command_length += strlen(argv[i]) + 1;
+
+    int error = fwrite(&header, sizeof(local_header_t), 1, output) != 1;
+    for (int i = 0; i < argc && !error; ++i) error = fprintf(output, "%s ", argv[i]) < 0;
+    error |= fputc('\0', output) == EOF;
+
+    for (size_t i = 0; i < phosphates->n_atoms && !error; ++i) {
+        const uint32_t number = frame->system_ids[phosphates->ids[i]] + 1;
+        error = fwrite(&number, sizeof(uint32_t), 1, output) != 1;
+    }
+
+    if (error) {
+        local_destroy(local);
+        return NULL;
+    }
+
+    return local;
+}
+
+/*
+ * Calculates the local thickness of a part of the phosphates. Every thread processes a different part.
+ */
+static void local_thickness_part(void *data, const size_t thread, const size_t n_threads)
+{
+    local_t *local = data;
+    const frame_t *frame = local->frame;
+    const float cutoff = local->cutoff;
+
+    size_t start = 0, end = 0;
+    pool_range(local->phosphates->n_atoms, thread, n_threads, &start, &end);
+
+    for (size_t i = start; i < end; ++i) {
+        const float *position = frame->positions[local->phosphates->ids[i]];
+        const float rel_pos_z = distance1D(position, local->center_mem, z, frame->box);
+        const cell_list_t *opposite = local->lists[rel_pos_z > 0 ? 1 : 0];
+
+        size_t cells[CELL_LIST_NEIGHBORS] = {0};
+        const size_t n_cells = cell_list_neighbors(opposite, position, cells);
+
+        float sum = 0.0f;
+        size_t count = 0;
+        for (size_t c = 0; c < n_cells; ++c) {
+            for (size_t k = opposite->cell_start[cells[c]]; k < opposite->cell_start[cells[c] + 1]; ++k) {
+                const float *other = frame->positions[opposite->atoms[k]];
+                if (distance2D(position, other, xy, frame->box) >= cutoff) continue;
+
+                sum += distance1D(other, local->center_mem, z, frame->box);
+                ++count;
+            }
+        }
+
+        local->values[i] = count == 0 ? NAN : fabsf(rel_pos_z - sum / count);
+    }
+}
+
+/*
+ * Calculates the local thickness of every phosphate in the frame
+ * and adds it to the grid tiles at the (fitted) positions of the phosphates.
+ * Returns zero, if successful. Returns non-zero if the memory could not be allocated.
+ */
+static int local_frame(local_t *local, const frame_t *frame, const float *center_mem, const fit_t *fit, pool_t *pool)
+{
+    const subset_t *phosphates = local->phosphates;
+
+    // split the phosphates into leaflets
+    size_t n_leaflet[2] = {0};
+    for (size_t i = 0; i < phosphates->n_atoms; ++i) {
+        const size_t id = phosphates->ids[i];
+        const int leaflet = distance1D(frame->positions[id], center_mem, z, frame->box) > 0 ? 0 : 1;
+        local->leaflet_ids[leaflet][n_leaflet[leaflet]++] = id;
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        if (cell_list_build(local->lists[i], frame, local->leaflet_ids[i], n_leaflet[i]) != 0) return 1;
+    }
+
+    local->frame = frame;
+    local->center_mem = center_mem;
+    pool_run(pool, local_thickness_part, local);
+
+    // collect the local thickness in the grid tiles
+    for (size_t i = 0; i < phosphates->n_atoms; ++i) {
+        if (isnan(local->values[i])) continue;
+
+        const float *position = frame->positions[phosphates->ids[i]];
+        const int part = distance1D(position, center_mem, z, frame->box) > 0 ? GRID_UPPER : GRID_LOWER;
+
+        vec_t fitted = {0.0f};
+        if (fit != NULL) position = fit_apply(fit, position, fitted);
+        if (position[0] < local->array_dimx[0] || position[0] > local->array_dimx[1] ||
+            position[1] < local->array_dimy[0] || position[1] > local->array_dimy[1]) {
+                continue;
+            }
+
+        const grid_t *grid = local->grid;
+        tile_t *tile = grid_tile(grid, grid_coor2index(grid, position[0], 0), grid_coor2index(grid, position[1], 1));
+        tile_add(tile, part, llround((double) local->values[i] * Z_SCALE));
+    }
+
+    return 0;
+}
+
+/*
+ * Writes the local thickness of every phosphate calculated for the frame into the output file (if any).
+ * Returns zero, if successful. Returns non-zero if the data could not be written.
+ */
+static int local_write_frame(const local_t *local, const frame_t *frame)
+{
+    if (local->output == NULL) return 0;
+
+    const size_t n_phosphates = local->phosphates->n_atoms;
+    return fwrite(&frame->time, sizeof(float), 1, local->output) != 1 ||
+           fwrite(local->values, sizeof(float), n_phosphates, local->output) != n_phosphates;
+}
+
+/*
+ * Calculates the average local thickness of both leaflets in a (smoothed) grid tile.
+ * Returns 0 if there is not enough data for this tile.
+ */
+static int local_thickness(const tile_t *tile, const void *data, double *thickness)
+{
+    const int nan_limit = *(const int *) data;
+
+    // check that we have enough data for this grid tile
+    uint64_t count = tile_count(tile, GRID_UPPER) + tile_count(tile, GRID_LOWER);
+    if (count < (uint64_t) nan_limit) return 0;
+
+    float value = (tile->sum[GRID_UPPER] + tile->sum[GRID_LOWER]) / Z_SCALE / count;
+    *thickness = value;
+    return 1;
+}
+
+/*
+ * Chunk of consecutive frames of a single replica analyzed as one job in batch mode.
+ */
+typedef struct batch_job {
+    size_t replica;
+    size_t first;               // index of the first frame of the chunk
+    size_t n_frames;
+} batch_job_t;
+
+/*
+ * State of a single thread analyzing the replicas in batch mode.
+ * The thread collects the data of consecutive jobs of the same replica into its own grids
+ * and moves them into the grids of the replica once it switches to another replica.
+ */
+typedef struct batch_worker {
+    frame_t *frame;
+    subset_t *phosphate_subset; // own copy of the phosphates (the order of the atoms changes during the analysis)
+    fit_t *fit;
+    int_grid_t grid;
+    undulation_t *undulation;   // undulation spectrum collected by the thread (NULL if not calculated)
+    xtc_reader_t *xtc;          // trajectory of the replica analyzed by the last job of the thread
+    size_t replica;             // replica analyzed by the last job of the thread (SIZE_MAX if none)
+    size_t n_frames;            // number of frames in the grids of the thread
+} batch_worker_t;
+
+/*
+ * Replica trajectories analyzed in a single run, sharing the topology and the selections.
+ */
+typedef struct batch {
+    size_t n_replicas;
+    char **replicas;            // names of the replica trajectories
+    xtc_index_t **indices;      // offsets of the frames of every replica
+    size_t n_jobs;
+    batch_job_t *jobs;
+    batch_worker_t *workers;    // one for every thread
+    size_t n_threads;
+    size_t n_sets;              // number of grids for every replica (all phosphates + lipid species)
+    grid_t **grids;             // grids of the threads (same layout as in the analysis of a single trajectory)
+    grid_t **replica_grids;     // n_sets grids for every replica
+    size_t *replica_frames;     // number of analyzed frames of every replica
+    size_t n_analyzed;          // number of analyzed frames of all replicas
+    size_t n_total;             // number of indexed frames of all replicas
+    int failed;                 // 1 if any frames of the replicas could not be read
+    pthread_mutex_t mutex;      // guards replica grids, frame counts and the error flag
+    undulation_t *undulation;   // undulation spectrum of all replicas (NULL if not calculated)
+    const subset_t *membrane_subset;
+    const species_t *species;
+    const float *array_dimx;
+    const float *array_dimy;
+} batch_t;
+
+/*
+ * Reads the names of the replica trajectories (one per line, empty lines and lines starting with '#' are ignored).
+ * Returns NULL if the file could not be read or if it does not contain any trajectory.
+ */
+static char **read_replicas(const char *file_name, size_t *n_replicas)
+{
+    FILE *file = fopen(file_name, "r");
+    if (file == NULL) return NULL;
+
+    char **replicas = NULL;
+    size_t capacity = 0;
+    *n_replicas = 0;
+
+    char *line = NULL;
+    size_t line_size = 0;
+    while (getline(&line, &line_size, file) != -1) {
+        size_t length = strlen(line);
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r' || line[length - 1] == ' ' || line[length - 1] == '\t')) line[--length] = '\0';
+        char *name = line;
+        while (*name == ' ' || *name == '\t') ++name;
+        if (*name == '\0' || *name == '#') continue;
+
+        if (*n_replicas == capacity) {
+            capacity = capacity == 0 ? 16 : 2 * capacity;
+            char **new_replicas = realloc(replicas, capacity * sizeof(char *));
+            if (new_replicas == NULL) break;
+            replicas = new_replicas;
+        }
+
+        replicas[*n_replicas] = strdup(name);
+        if (replicas[*n_replicas] == NULL) break;
+        ++*n_replicas;
+    }
+
+    int complete = feof(file);
+    free(line);
+    fclose(file);
+
+    if (!complete || *n_replicas == 0) {
+        for (size_t i = 0; i < *n_replicas; ++i) free(replicas[i]);
+        free(replicas);
+        *n_replicas = 0;
+        return NULL;
+    }
+
+    return replicas;
 }
 
-/* 
- * Converts index of an array to coordinate.
+/*
+ * Frees all memory associated with the batch. Does not free the grids of the threads.
  */
-static inline float index2coor(int x, float minx)
+static void batch_destroy(batch_t *batch)
 {
-    return (float) x / GRID_TILE + minx;
+    if (batch == NULL) return;
+
+    for (size_t i = 0; i < batch->n_replicas; ++i) {
+        free(batch->replicas[i]);
+        if (batch->indices != NULL) xtc_index_destroy(batch->indices[i]);
+    }
+
+    for (size_t i = 0; batch->workers != NULL && i < batch->n_threads; ++i) {
+        frame_destroy(batch->workers[i].frame);
+        free(batch->workers[i].phosphate_subset);
+        fit_destroy(batch->workers[i].fit);
+        undulation_destroy(batch->workers[i].undulation);
+        xtc_close(batch->workers[i].xtc);
+    }
+
+    pthread_mutex_destroy(&batch->mutex);
+    free(batch->replicas);
+    free(batch->indices);
+    free(batch->jobs);
+    free(batch->workers);
+    grids_destroy(batch->replica_grids, batch->n_replicas * batch->n_sets);
+    free(batch->replica_frames);
+    free(batch);
 }
 
 /*
- * Converts coordinate to an index array.
+ * Reads the list of replicas, indexes their frames and splits them into jobs.
+ * Every thread gets its own copy of the frame, the phosphates and the fit (and its own undulation spectrum).
+ * If the system is rotated, the reference structure is obtained from the first frame of the first replica.
+ * Returns NULL if the batch could not be prepared (an error message is printed).
  */
-static inline size_t coor2index(float x, float minx)
+static batch_t *batch_create(
+        const char *replicas_file,
+        frame_t *frame,
+        const subset_t *membrane_subset,
+        const subset_t *phosphate_subset,
+        fit_t *fit,
+        const species_t *species,
+        const float *array_dimx,
+        const float *array_dimy,
+        grid_t **grids,
+        const size_t n_sets,
+        const size_t n_threads,
+        undulation_t *undulation)
 {
-    return (size_t) roundf((x - minx) * GRID_TILE);
+    batch_t *batch = calloc(1, sizeof(batch_t));
+    if (batch == NULL) {
+        fprintf(stderr, "Could not allocate memory.\n");
+        return NULL;
+    }
+
+    pthread_mutex_init(&batch->mutex, NULL);
+    batch->n_threads = n_threads;
+    batch->n_sets = n_sets;
+    batch->grids = grids;
+    batch->undulation = undulation;
+    batch->membrane_subset = membrane_subset;
+    batch->species = species;
+    batch->array_dimx = array_dimx;
+    batch->array_dimy = array_dimy;
+
+    batch->replicas = read_replicas(replicas_file, &batch->n_replicas);
+    if (batch->replicas == NULL) {
+        fprintf(stderr, "Could not read list of replicas from %s.\n", replicas_file);
+        batch_destroy(batch);
+        return NULL;
+    }
+
+    // index all replicas and check that they match the system
+    batch->indices = calloc(batch->n_replicas, sizeof(xtc_index_t *));
+    if (batch->indices == NULL) {
+        fprintf(stderr, "Could not allocate memory.\n");
+        batch_destroy(batch);
+        return NULL;
+    }
+
+    for (size_t r = 0; r < batch->n_replicas; ++r) {
+        batch->indices[r] = xtc_index_create(batch->replicas[r]);
+        if (batch->indices[r] == NULL) {
+            fprintf(stderr, "File %s could not be indexed as an xtc file (replicas must be regular files).\n", batch->replicas[r]);
+            batch_destroy(batch);
+            return NULL;
+        }
+
+        if (batch->indices[r]->n_frames > 0 && (size_t) batch->indices[r]->n_atoms != frame->n_system_atoms) {
+            fprintf(stderr, "Number of atoms in %s does not match the gro file.\n", batch->replicas[r]);
+            batch_destroy(batch);
+            return NULL;
+        }
+
+        batch->n_total += batch->indices[r]->n_frames;
+        batch->n_jobs += (batch->indices[r]->n_frames + BATCH_CHUNK - 1) / BATCH_CHUNK;
+    }
+
+    // split the replicas into chunks of frames (consecutive jobs belong to the same replica)
+    batch->jobs = malloc(batch->n_jobs * sizeof(batch_job_t));
+    batch->workers = calloc(n_threads, sizeof(batch_worker_t));
+    batch->replica_frames = calloc(batch->n_replicas, sizeof(size_t));
+    batch->replica_grids = grids_create(batch->n_replicas * n_sets, array_dimx, array_dimy, GRID_TILE);
+    if ((batch->jobs == NULL && batch->n_jobs > 0) || batch->workers == NULL || batch->replica_frames == NULL || batch->replica_grids == NULL) {
+        fprintf(stderr, "Could not allocate memory (grid too large?)\n");
+        batch_destroy(batch);
+        return NULL;
+    }
+
+    size_t job = 0;
+    for (size_t r = 0; r < batch->n_replicas; ++r) {
+        for (size_t first = 0; first < batch->indices[r]->n_frames; first += BATCH_CHUNK) {
+            size_t remaining = batch->indices[r]->n_frames - first;
+            batch_job_t chunk = { r, first, remaining < (size_t) BATCH_CHUNK ? remaining : (size_t) BATCH_CHUNK };
+            batch->jobs[job++] = chunk;
+        }
+    }
+
+    // the reference structure must be the same for all threads
+    if (fit != NULL && fit->rotate && batch->n_total > 0) {
+        size_t r = 0;
+        while (batch->indices[r]->n_frames == 0) ++r;
+
+        xtc_reader_t *xtc = xtc_open(batch->replicas[r]);
+        if (xtc == NULL || xtc_read_frame(xtc, frame) != 0) {
+            fprintf(stderr, "Could not read the first frame of %s.\n", batch->replicas[r]);
+            xtc_close(xtc);
+            batch_destroy(batch);
+            return NULL;
+        }
+
+        fit_frame(fit, frame);
+        xtc_close(xtc);
+    }
+
+    for (size_t i = 0; i < n_threads; ++i) {
+        batch_worker_t *worker = &batch->workers[i];
+        worker->replica = SIZE_MAX;
+        worker->frame = frame_copy(frame);
+        worker->phosphate_subset = subset_copy(phosphate_subset);
+        worker->fit = fit == NULL ? NULL : fit_clone(fit);
+        worker->undulation = undulation == NULL ? NULL : undulation_create(undulation->n);
+        if (worker->frame == NULL || worker->phosphate_subset == NULL || (fit != NULL && worker->fit == NULL) ||
+            (undulation != NULL && worker->undulation == NULL)) {
+            fprintf(stderr, "Could not allocate memory.\n");
+            batch_destroy(batch);
+            return NULL;
+        }
+    }
+
+    return batch;
+}
+
+/*
+ * Moves the data collected by the thread into the grids of the replica it has analyzed.
+ */
+static void batch_flush(batch_t *batch, const size_t thread)
+{
+    batch_worker_t *worker = &batch->workers[thread];
+    if (worker->replica == SIZE_MAX) return;
+
+    pthread_mutex_lock(&batch->mutex);
+    for (size_t s = 0; s < batch->n_sets; ++s) {
+        grid_t *pair[2] = { batch->replica_grids[worker->replica * batch->n_sets + s], batch->grids[s * batch->n_threads + thread] };
+        grids_merge(pair, 2);
+    }
+    batch->replica_frames[worker->replica] += worker->n_frames;
+    pthread_mutex_unlock(&batch->mutex);
+
+    for (size_t s = 0; s < batch->n_sets; ++s) grid_clear(batch->grids[s * batch->n_threads + thread]);
+    worker->n_frames = 0;
+}
+
+/*
+ * Analyzes a chunk of frames of a single replica.
+ * Every frame is analyzed by a single thread; the threads work on different chunks at the same time.
+ */
+static void analyze_chunk(void *data, const size_t job, const size_t thread)
+{
+    batch_t *batch = data;
+    batch_worker_t *worker = &batch->workers[thread];
+    const batch_job_t *chunk = &batch->jobs[job];
+
+    // the trajectory is kept open for consecutive chunks of the same replica
+    if (worker->replica != chunk->replica) {
+        batch_flush(batch, thread);
+        xtc_close(worker->xtc);
+        worker->xtc = xtc_open(batch->replicas[chunk->replica]);
+        worker->replica = chunk->replica;
+    }
+
+    // chunks are not analyzed once the results are known to be incomplete
+    pthread_mutex_lock(&batch->mutex);
+    int failed = batch->failed;
+    pthread_mutex_unlock(&batch->mutex);
+    if (failed) return;
+
+    if (worker->xtc == NULL || xtc_seek(worker->xtc, batch->indices[chunk->replica], chunk->first) != 0) {
+        fprintf(stderr, "\nCould not read frames of %s.\n", batch->replicas[chunk->replica]);
+        pthread_mutex_lock(&batch->mutex);
+        batch->failed = 1;
+        pthread_mutex_unlock(&batch->mutex);
+        return;
+    }
+
+    frame_t *frame = worker->frame;
+    fit_t *fit = worker->fit;
+    // grids of the thread (and of its lipid species) are grids[thread + s * n_threads]
+    frame_task_t task = { frame, worker->phosphate_subset, fit, &worker->grid, 0, NULL,
+                          batch->array_dimx, batch->array_dimy, batch->species, batch->n_threads, batch->grids + thread };
+
+    size_t n_frames = 0;
+    for (; n_frames < chunk->n_frames; ++n_frames) {
+        if (xtc_read_frame(worker->xtc, frame) != 0) break;
+
+        vec_t center_mem = {0};
+        subset_center_of_geometry(frame, batch->membrane_subset, center_mem);
+        int_grid_prepare(&worker->grid, frame, batch->array_dimx, batch->array_dimy, GRID_TILE);
+
+        if (fit != NULL) fit_frame(fit, frame);
+        if (n_frames % SORT_FREQ == 0) subset_sort_by_tile(frame, worker->phosphate_subset, GRID_TILE);
+
+        task.use_fixed = worker->grid.enabled && (fit == NULL || !fit->rotate);
+        task.center_mem = center_mem;
+        assign_phosphates(&task, 0, 1);
+
+        if (worker->undulation != NULL) undulation_add_frame(worker->undulation, frame, worker->phosphate_subset, center_mem);
+    }
+
+    worker->n_frames += n_frames;
+    if (n_frames < chunk->n_frames) {
+        fprintf(stderr, "\nCould not read frame %zu of %s.\n", chunk->first + n_frames, batch->replicas[chunk->replica]);
+    }
+
+    pthread_mutex_lock(&batch->mutex);
+    if (n_frames < chunk->n_frames) batch->failed = 1;
+    batch->n_analyzed += n_frames;
+    printf("Analyzed frames: %zu/%zu\r", batch->n_analyzed, batch->n_total);
+    fflush(stdout);
+    pthread_mutex_unlock(&batch->mutex);
+}
+
+/*
+ * Analyzes all replicas using all threads of the pool.
+ * Returns zero, if successful. Else returns non-zero (batch->failed is set if any frames could not be read).
+ */
+static int batch_run(batch_t *batch, pool_t *pool)
+{
+    if (pool_run_jobs(pool, analyze_chunk, batch->n_jobs, batch) != 0 || batch->failed) return 1;
+
+    for (size_t i = 0; i < batch->n_threads; ++i) {
+        batch_flush(batch, i);
+        if (batch->undulation != NULL) undulation_merge(batch->undulation, batch->workers[i].undulation);
+    }
+    return 0;
 }
 
 int main(int argc, char **argv)
@@ -171,22 +1059,54 @@ int main(int argc, char **argv)
     char *phosphates = "name PO4";
     float array_dimx[2] = {0.};
     float array_dimy[2] = {0.};
+    char *reference = NULL;
+    int rotate = 0;
+    int n_threads = 1;
+    int binary = 0;
+    int n_levels = 0;
+    int decompose = 0;
+    char *replicas_file = NULL;
+    char *spectrum_file = NULL;
+    int field_size = 16;
+    char *local_file = NULL;
+    float local_cutoff = 0.0f;
+    int profiling = 0;
     int nan_limit = 30;
-    if (get_arguments(argc, argv, &gro_file, &xtc_file, &ndx_file, &output_file, &lipids, &phosphates, array_dimx, array_dimy, &nan_limit) != 0) {
+    if (get_arguments(argc, argv, &gro_file, &xtc_file, &ndx_file, &output_file, &lipids, &phosphates, array_dimx, array_dimy, &nan_limit, &reference, &rotate, &n_threads, &binary, &n_levels, &decompose, &replicas_file, &spectrum_file, &field_size, &local_file, &local_cutoff, &profiling) != 0) {
         print_usage(argv[0]);
         return 1;
     }
 
+    // check that the number of threads is > 0
+    if (n_threads <= 0) {
+        fprintf(stderr, "Number of threads must be higher than 0.\n");
+        return 1;
+    }
+
+    // check that the number of overview maps is sensible
+    if (n_levels < 0 || n_levels > MAP_MAX_LEVELS) {
+        fprintf(stderr, "Number of overview maps must be between 0 and %d.\n", MAP_MAX_LEVELS);
+        return 1;
+    }
+
     // check that the nan limit is > 0
     if (nan_limit <= 0) {
         fprintf(stderr, "NAN limit must be higher than 0.\n");
         return 1;
     }
 
+    // check that the height fields can be transformed
+    if (field_size < 4 || (field_size & (field_size - 1)) != 0) {
+        fprintf(stderr, "Size of the height fields must be a power of two and at least 4.\n");
+        return 1;
+    }
+
     // we open the output file quite early to check that it can actually be opened
     // we do not want to calculate everything and then find out that the output file is unreachable
     FILE *output = fopen(output_file, "w");
-    if (output == NULL) {
+    FILE *spectrum_output = spectrum_file == NULL ? NULL : fopen(spectrum_file, "w");
+    FILE *local_output = local_file == NULL ? NULL : fopen(local_file, "wb");
+    if (output == NULL || (spectrum_file != NULL && spectrum_output == NULL) || (local_file != NULL && local_output == NULL)) {
         fprintf(stderr, "Output file could not be opened.\n");
         return 1;
     }
@@ -211,23 +1131,22 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    print_arguments(stdout, gro_file, xtc_file, ndx_file, output_file, lipids, phosphates, array_dimx, array_dimy, nan_limit);
+    print_arguments(stdout, gro_file, xtc_file, ndx_file, output_file, lipids, phosphates, array_dimx, array_dimy, nan_limit, reference, rotate, n_threads, binary, n_levels, decompose, replicas_file, spectrum_file, field_size, local_file, local_cutoff, profiling);
 
-    // open xtc file for reading
-    XDRFILE *xtc = xdrfile_open(xtc_file, "r");
-    if (xtc == NULL) {
+    // open xtc file for reading (replicas are opened later by the individual threads)
+    xtc_reader_t *xtc = replicas_file != NULL ? NULL : xtc_open(xtc_file);
+    if (replicas_file == NULL && xtc == NULL) {
         fprintf(stderr, "File %s could not be read as an xtc file.\n", xtc_file);
         free(system);
         return 1;
     }
 
-    // set all velocities of all particles to zero (xtc does not contain velocities)
-    reset_velocities(system);
-
     // check that the gro file and the xtc file match each other
-    if (!validate_xtc(xtc_file, (int) system->n_atoms)) {
+    // (only the header of the first frame is read, so the xtc file can also be a pipe)
+    int xtc_atoms = 0;
+    if (xtc != NULL && (xtc_peek_atoms(xtc, &xtc_atoms) != 0 || (size_t) xtc_atoms != system->n_atoms)) {
         fprintf(stderr, "Number of atoms in %s does not match %s.\n", xtc_file, gro_file);
-        xdrfile_close(xtc);
+        xtc_close(xtc);
         free(system);
         return 1;
     }
@@ -238,145 +1157,387 @@ int main(int argc, char **argv)
     // select all atoms
     atom_selection_t *all = select_system(system);
 
-    // select membrane
-    atom_selection_t *membrane_atoms = smart_select(all, lipids, ndx_groups);
+    // select membrane (the selection can be re-evaluated in every frame)
+    atom_selection_t *membrane_reference = NULL;
+    float membrane_radius = 0.0f;
+    atom_selection_t *membrane_atoms = dynamic_select(all, lipids, ndx_groups, &membrane_reference, &membrane_radius);
     if (membrane_atoms == NULL || membrane_atoms->n_atoms == 0) {
         fprintf(stderr, "No lipid atoms detected.\n");
         dict_destroy(ndx_groups);
-        xdrfile_close(xtc);
+        xtc_close(xtc);
         free(all);
         free(membrane_atoms);
+        free(membrane_reference);
         free(system);
         return 1;
     }
 
-    // select phosphates
-    atom_selection_t *phosphate_atoms = smart_select(all, phosphates, ndx_groups);
+    // select phosphates (the selection can be re-evaluated in every frame)
+    atom_selection_t *phosphate_reference = NULL;
+    float phosphate_radius = 0.0f;
+    atom_selection_t *phosphate_atoms = dynamic_select(all, phosphates, ndx_groups, &phosphate_reference, &phosphate_radius);
     if (phosphate_atoms == NULL || phosphate_atoms->n_atoms == 0) {
         fprintf(stderr, "No phosphate atoms detected.\n");
         dict_destroy(ndx_groups);
-        xdrfile_close(xtc);
+        xtc_close(xtc);
         free(all);
         free(membrane_atoms);
+        free(membrane_reference);
         free(phosphate_atoms);
+        free(phosphate_reference);
         free(system);
         return 1;
     }
 
-    // prepare arrays
-    size_t n_rows = (size_t) roundf( (array_dimy[1] - array_dimy[0]) * GRID_TILE ) + 1;
-    size_t n_cols = (size_t) roundf( (array_dimx[1] - array_dimx[0]) * GRID_TILE ) + 1;
-    size_t n_tiles = n_rows * n_cols;
-
-    float *upper_leaflet        = calloc(n_tiles, sizeof(float));
-    int   *upper_leaflet_counts = calloc(n_tiles, sizeof(int));
-    float *lower_leaflet        = calloc(n_tiles, sizeof(float));
-    int   *lower_leaflet_counts = calloc(n_tiles, sizeof(int));
-
-    if (upper_leaflet == NULL || upper_leaflet_counts == NULL || lower_leaflet == NULL || lower_leaflet_counts == NULL) {
-        fprintf(stderr, "Could not allocate memory (grid too large?)\n");
+    // select reference atoms
+    atom_selection_t *reference_atoms = NULL;
+    if (reference != NULL) reference_atoms = smart_select(all, reference, ndx_groups);
+    if (reference != NULL && (reference_atoms == NULL || reference_atoms->n_atoms == 0)) {
+        fprintf(stderr, "No reference atoms detected.\n");
         dict_destroy(ndx_groups);
-        xdrfile_close(xtc);
-        fclose(output);
+        xtc_close(xtc);
         free(all);
         free(membrane_atoms);
+        free(membrane_reference);
         free(phosphate_atoms);
+        free(phosphate_reference);
+        free(reference_atoms);
         free(system);
         return 1;
     }
 
-    while (read_xtc_step(xtc, system) == 0) {
+    // only keep the lipid, phosphate (and reference) atoms and the references of dynamic selections in memory
+    atom_selection_t *selections[5] = {membrane_atoms, phosphate_atoms, reference_atoms, membrane_reference, phosphate_reference};
+    subset_t *subsets[5] = {NULL};
+    size_t n_selections = 2;
+    if (reference_atoms != NULL) ++n_selections;
+    const size_t membrane_reference_index = n_selections;
+    if (membrane_reference != NULL) selections[n_selections++] = membrane_reference;
+    const size_t phosphate_reference_index = n_selections;
+    if (phosphate_reference != NULL) selections[n_selections++] = phosphate_reference;
+    frame_t *frame = frame_create(system, selections, n_selections, subsets);
+
+    // split the phosphates into lipid species by their residue names
+    species_t *species = NULL;
+    if (frame != NULL && decompose) species = species_create(system, frame, subsets[1]);
+
+    dict_destroy(ndx_groups);
+    free(all);
+    free(membrane_atoms);
+    free(membrane_reference);
+    free(phosphate_atoms);
+    free(phosphate_reference);
+    free(reference_atoms);
+    free(system);
+
+    if (frame == NULL) {
+        fprintf(stderr, "Could not allocate memory.\n");
+        xtc_close(xtc);
+        fclose(output);
+        if (spectrum_output != NULL) fclose(spectrum_output);
+        if (local_output != NULL) fclose(local_output);
+        return 1;
+    }
+
+    if (decompose && species == NULL) {
+        fprintf(stderr, "Could not split phosphates into lipid species (more than %d residue names?).\n", SPECIES_MAX);
+        xtc_close(xtc);
+        fclose(output);
+        if (spectrum_output != NULL) fclose(spectrum_output);
+        if (local_output != NULL) fclose(local_output);
+        frame_destroy(frame);
+        for (int i = 0; i < 5; ++i) free(subsets[i]);
+        return 1;
+    }
+
+    subset_t *membrane_subset = subsets[0];
+    subset_t *phosphate_subset = subsets[1];
+    subset_t *reference_subset = reference_atoms != NULL ? subsets[2] : NULL;
+    subset_t *membrane_reference_subset = membrane_reference != NULL ? subsets[membrane_reference_index] : NULL;
+    subset_t *phosphate_reference_subset = phosphate_reference != NULL ? subsets[phosphate_reference_index] : NULL;
+
+    // prepare centering (and fitting) on the reference atoms
+    fit_t *fit = reference_subset == NULL ? NULL : fit_create(reference_subset, rotate);
+
+    // every thread collects the data into its own grid and the grids are merged at the end of the analysis
+    // (the same set of grids is used for every lipid species)
+    const size_t n_sets = 1 + (species == NULL ? 0 : species->n_species);
+    grid_t **grids = grids_create(n_sets * n_threads, array_dimx, array_dimy, GRID_TILE);
+    pool_t *pool = pool_create(n_threads);
+
+    // undulation spectrum is collected from height fields covering the whole box
+    undulation_t *undulation = spectrum_file != NULL ? undulation_create(field_size) : NULL;
+
+    // local thickness keeps its own copy of the phosphates, since the phosphate subset gets sorted by tiles
+    subset_t *local_subset = local_cutoff > 0 ? subset_copy(phosphate_subset) : NULL;
+    local_t *local = local_subset != NULL ? local_create(local_cutoff, frame, local_subset, array_dimx, array_dimy, local_output, argc, argv) : NULL;
+
+    // dynamic selections are re-evaluated in every frame using a cell list shared by both of them
+    dynamic_selection_t *dynamic_membrane = membrane_reference_subset == NULL ? NULL :
+            dynamic_create(membrane_subset, membrane_reference_subset, membrane_radius);
+    dynamic_selection_t *dynamic_phosphates = phosphate_reference_subset == NULL ? NULL :
+            dynamic_create(phosphate_subset, phosphate_reference_subset, phosphate_radius);
+    dynamic_selection_t *dynamic[2] = {NULL};
+    size_t n_dynamic = 0;
+    if (dynamic_membrane != NULL) dynamic[n_dynamic++] = dynamic_membrane;
+    if (dynamic_phosphates != NULL) dynamic[n_dynamic++] = dynamic_phosphates;
+    selector_t *selector = n_dynamic > 0 ? selector_create(frame, dynamic, n_dynamic) : NULL;
+
+    // the locality of binning is only measured for a fixed set of phosphates
+    profile_t *profile = profiling ? profile_create(dynamic_phosphates == NULL ? phosphate_subset : NULL, GRID_TILE) : NULL;
+
+    if (grids == NULL || pool == NULL ||
+        (reference_subset != NULL && fit == NULL) ||
+        (spectrum_file != NULL && undulation == NULL) ||
+        (local_cutoff > 0 && local == NULL) ||
+        (membrane_reference_subset != NULL && dynamic_membrane == NULL) ||
+        (phosphate_reference_subset != NULL && dynamic_phosphates == NULL) ||
+        (n_dynamic > 0 && selector == NULL) ||
+        (profiling && profile == NULL)) {
+        fprintf(stderr, "Could not allocate memory (grid too large?)\n");
+        xtc_close(xtc);
+        fclose(output);
+        if (spectrum_output != NULL) fclose(spectrum_output);
+        if (local_output != NULL) fclose(local_output);
+        frame_destroy(frame);
+        free(membrane_subset);
+        free(phosphate_subset);
+        free(reference_subset);
+        fit_destroy(fit);
+        species_destroy(species);
+        grids_destroy(grids, n_sets * n_threads);
+        pool_destroy(pool);
+        undulation_destroy(undulation);
+        free(local_subset);
+        local_destroy(local);
+        selector_destroy(selector);
+        dynamic_destroy(dynamic_membrane);
+        dynamic_destroy(dynamic_phosphates);
+        free(membrane_reference_subset);
+        free(phosphate_reference_subset);
+        profile_destroy(profile);
+        return 1;
+    }
+
+    // atoms analyzed in the current frame
+    const subset_t *frame_membrane = dynamic_membrane != NULL ? dynamic_membrane->selected : membrane_subset;
+    const subset_t *frame_phosphates = dynamic_phosphates != NULL ? dynamic_phosphates->selected : phosphate_subset;
+
+    // grid in fixed-point coordinates (used if the trajectory precision allows it)
+    int_grid_t grid = {0};
+    frame_task_t task = { frame, frame_phosphates, fit, &grid, 0, NULL, array_dimx, array_dimy, species, n_threads, grids };
+
+    // analyze all replicas at once, every thread analyzes different frames
+    batch_t *batch = NULL;
+    if (replicas_file != NULL) {
+        batch = batch_create(replicas_file, frame, membrane_subset, phosphate_subset, fit, species, array_dimx, array_dimy, grids, n_sets, n_threads, undulation);
+        if (batch == NULL || batch_run(batch, pool) != 0) {
+            if (batch != NULL && !batch->failed) fprintf(stderr, "Could not allocate memory.\n");
+            else if (batch != NULL) fprintf(stderr, "\nReplicas could not be analyzed completely, no maps were written.\n");
+            fclose(output);
+            if (spectrum_output != NULL) fclose(spectrum_output);
+            frame_destroy(frame);
+            free(membrane_subset);
+            free(phosphate_subset);
+            free(reference_subset);
+            fit_destroy(fit);
+            species_destroy(species);
+            grids_destroy(grids, n_sets * n_threads);
+            pool_destroy(pool);
+            batch_destroy(batch);
+            undulation_destroy(undulation);
+            return 1;
+        }
+    }
+
+    size_t n_frames = 0;
+    size_t n_skipped = 0;
+    int return_code = 0, status = 0;
+    profile_start(profile);
+    while (xtc != NULL && (status = xtc_read_frame(xtc, frame)) == 0) {
+        profile_mark(profile, PROFILE_READ);
 
         // print info about the progress of reading
-        if ((int) system->time % PROGRESS_FREQ == 0) {
-            printf("Step: %d. Time: %.0f ps\r", system->step, system->time);
+        if ((int) frame->time % PROGRESS_FREQ == 0) {
+            printf("Step: %d. Time: %.0f ps\r", frame->step, frame->time);
             fflush(stdout);
         }
 
+        // evaluate dynamic selections before the system is centered (frames without any lipids selected are skipped)
+        if (selector != NULL && selector_update(selector, frame) != 0) {
+            fprintf(stderr, "\nCould not allocate memory.\n");
+            return_code = 1;
+            break;
+        }
+        if (selector != NULL) profile_mark(profile, PROFILE_SELECT);
+        if (frame_membrane->n_atoms == 0) {
+            ++n_skipped;
+            continue;
+        }
+
         // get membrane center
         vec_t center_mem = {0};
-        center_of_geometry(membrane_atoms, center_mem, system->box);
-
-        // loop through phosphates, assign them to leaflets... 
-        // ...and get their z positions relative to center_mem
-        for (size_t i = 0; i < phosphate_atoms->n_atoms; ++i) {
-            atom_t *atom = phosphate_atoms->atoms[i];
-            float rel_pos_z = distance1D(atom->position, center_mem, z, system->box);
-
-            // ignore atoms that are outside of the specified grid
-            if (atom->position[0] < array_dimx[0] || atom->position[0] > array_dimx[1] ||
-                atom->position[1] < array_dimy[0] || atom->position[1] > array_dimy[1]) {
-                    continue;
-                }
-            
-            // get index of the tile to which the atom should be assigned
-            size_t x_index = coor2index(atom->position[0], array_dimx[0]);
-            size_t y_index = coor2index(atom->position[1], array_dimy[0]);
-
-            if (rel_pos_z > 0) {
-                upper_leaflet[y_index * n_cols + x_index] += rel_pos_z;
-                ++upper_leaflet_counts[y_index * n_cols + x_index];
-            } else {
-                lower_leaflet[y_index * n_cols + x_index] += rel_pos_z;
-                ++lower_leaflet_counts[y_index * n_cols + x_index];
-            }
+        subset_center_of_geometry_parallel(frame, frame_membrane, pool, center_mem);
+        int_grid_prepare(&grid, frame, array_dimx, array_dimy, GRID_TILE);
+
+        // center (and fit) the system using the reference atoms
+        if (fit != NULL) fit_frame(fit, frame);
+        profile_mark(profile, PROFILE_CENTER);
+
+        // phosphates move little between frames, so keeping them sorted by tile
+        // makes the consecutive updates of the grid hit neighboring tiles
+        // (dynamically selected phosphates are kept in the order of the frame instead)
+        if (dynamic_phosphates == NULL && n_frames % SORT_FREQ == 0) subset_sort_by_tile(frame, phosphate_subset, GRID_TILE);
+        profile_mark(profile, PROFILE_SORT);
+        profile_count(profile, frame, frame_phosphates);
+
+        // assign phosphates to leaflets using all threads
+        // (fixed-point coordinates can not be used if the system is rotated)
+        task.use_fixed = grid.enabled && (fit == NULL || !fit->rotate);
+        task.center_mem = center_mem;
+        pool_run(pool, assign_phosphates, &task);
+        profile_mark(profile, PROFILE_BIN);
+
+        // add the spectrum of the height fields of this frame
+        if (undulation != NULL) undulation_add_frame(undulation, frame, frame_phosphates, center_mem);
+
+        // calculate the local thickness of every phosphate
+        if (local != NULL && local_frame(local, frame, center_mem, fit, pool) != 0) {
+            fprintf(stderr, "\nCould not allocate memory.\n");
+            return_code = 1;
+            break;
+        }
+        if (local != NULL && local_write_frame(local, frame) != 0) {
+            fprintf(stderr, "\nCould not write the local thickness into %s.\n", local_file);
+            return_code = 1;
+            break;
         }
+        profile_mark(profile, PROFILE_OTHER);
 
+        ++n_frames;
     }
+    if (status == 2) return_code = 1;
 
-    // write header for the output file
-    fprintf(output, "# Generated with memthick (C Membrane Thickness Calculator) %s\n", VERSION);
-    fprintf(output, "# Command line: ");
-    for (int i = 0; i < argc; ++i) {
-        fprintf(output, "%s ", argv[i]);
+    // maps are never written from an incomplete analysis
+    if (return_code != 0) {
+        fprintf(stderr, "Analysis stopped, no maps were written.\n");
+        goto analysis_end;
     }
-    fprintf(output, "\n# See average membrane thickness at the end of this file.\n");
-    fprintf(output, "@ xlabel x coordinate [nm]\n");
-    fprintf(output, "@ ylabel y coordinate [nm]\n");
-    fprintf(output, "@ zlabel membrane thickness [nm]\n");
-    fprintf(output, "@ grid --\n");
-    fprintf(output, "$ type colorbar\n");
-    fprintf(output, "$ colormap rainbow\n");
 
-    float av_thickness = 0;
-    int n_samples = 0;
+    if (n_skipped > 0) printf("\nSkipped %zu frames without any lipid atoms selected.", n_skipped);
+    profile_write(profile, stdout, n_frames);
+
+    // merge the grids of all threads
+    for (size_t s = 0; s < n_sets; ++s) grids_merge(grids + s * n_threads, n_threads);
 
     // calculate final thickness and write it into the output file
-    for (size_t y = 0; y < n_rows; ++y) {
-        for (size_t x = 0; x < n_cols; ++x) {
+    map_header_t header = {
+        "memthick (C Membrane Thickness Calculator)", VERSION,
+        "See average membrane thickness at the end of this file.",
+        "membrane thickness [nm]", "rainbow", 1, 4,
+        "# Average membrane thickness: %.4f nm", n_frames };
+    const map_format_t format = binary ? MAP_BINARY : MAP_TEXT;
 
-            // check that we have enough data for this grid tile
-            if (upper_leaflet_counts[y * n_cols + x] < nan_limit || lower_leaflet_counts[y * n_cols + x] < nan_limit ) {
-                fprintf(output, "%f %f nan\n", index2coor(x, array_dimx[0]), index2coor(y, array_dimy[0]));
-                continue;
-            }
+    // write the maps of the individual replicas and pool them into the grids of the first thread
+    if (batch != NULL) printf("\n");
+    for (size_t r = 0; batch != NULL && r < batch->n_replicas; ++r) {
+        grid_t **replica_grids = batch->replica_grids + r * n_sets;
+        char label[32] = {0};
+        sprintf(label, "rep%zu", r + 1);
+        char *replica_file = map_suffixed_name(output_file, label);
+        float av_replica = 0.0f;
 
-            float thickness = (upper_leaflet[y * n_cols + x] / upper_leaflet_counts[y * n_cols + x]) - 
-                              (lower_leaflet[y * n_cols + x] / lower_leaflet_counts[y * n_cols + x]);
-            
-            av_thickness += thickness;
-            ++n_samples;
+        header.n_frames = batch->replica_frames[r];
+        if (replica_file == NULL || grid_write_file(replica_file, replica_grids[0], &header, argc, argv, membrane_thickness, &nan_limit, format, &av_replica) != 0) {
+            fprintf(stderr, "Could not write output file for replica %s.\n", batch->replicas[r]);
+            return_code = 1;
+        } else {
+            return_code |= write_overview_maps(replica_grids[0], n_levels, replica_file, &header, argc, argv, &nan_limit, format);
+            printf("Average membrane thickness (%s, %s): %.4f nm\n", label, batch->replicas[r], av_replica);
+            return_code |= write_species_maps(replica_grids, 1, species, replica_file, label, n_levels, &header, argc, argv, &nan_limit, format);
+        }
 
-            fprintf(output, "%f %f %.4f\n", index2coor(x, array_dimx[0]), index2coor(y, array_dimy[0]), thickness);
+        for (size_t s = 0; s < n_sets; ++s) {
+            grid_t *pair[2] = { grids[s * n_threads], replica_grids[s] };
+            grids_merge(pair, 2);
         }
+
+        n_frames += batch->replica_frames[r];
+        free(replica_file);
     }
 
-    av_thickness = av_thickness / n_samples;
-    printf("\nAverage membrane thickness: %.4f nm\n", av_thickness);
-    fprintf(output, "# Average membrane thickness: %.4f nm\n", av_thickness);
+    header.n_frames = n_frames;
+    float av_thickness = 0.0f;
+    if (grid_write_map(output, grids[0], &header, argc, argv, membrane_thickness, &nan_limit, format, &av_thickness) != 0) {
+        fprintf(stderr, "Could not write output file.\n");
+        return_code = 1;
+    }
 
-    dict_destroy(ndx_groups);
-    xdrfile_close(xtc);
+    return_code |= write_overview_maps(grids[0], n_levels, output_file, &header, argc, argv, &nan_limit, format);
+    printf("\nAverage membrane thickness%s: %.4f nm\n", batch != NULL ? " (all replicas)" : "", av_thickness);
+
+    // write maps of the individual lipid species
+    return_code |= write_species_maps(grids, n_threads, species, output_file, NULL, n_levels, &header, argc, argv, &nan_limit, format);
+
+    // write the undulation spectrum
+    if (undulation != NULL) {
+        double kappa = 0.0;
+        if (undulation_write(undulation, spectrum_output, header.program, argc, argv, &kappa) != 0) {
+            fprintf(stderr, "Could not write output file %s.\n", spectrum_file);
+            return_code = 1;
+        } else {
+            printf("Bending modulus estimated from undulations: %.4f kT\n", kappa);
+        }
+    }
+
+    // write the map of the local thickness smoothed over the cutoff
+    if (local != NULL) {
+        grid_t *smoothed = grid_smooth(local->grid, (int) lroundf(local_cutoff * GRID_TILE / 2));
+        char *local_map_file = map_suffixed_name(output_file, "local");
+        header.note = "See average local membrane thickness at the end of this file.";
+        header.zlabel = "local membrane thickness [nm]";
+        header.footer = "# Average local membrane thickness: %.4f nm";
+
+        float av_local = 0.0f;
+        if (smoothed == NULL || local_map_file == NULL ||
+            grid_write_file(local_map_file, smoothed, &header, argc, argv, local_thickness, &nan_limit, format, &av_local) != 0) {
+            fprintf(stderr, "Could not write the map of local thickness.\n");
+            return_code = 1;
+        } else {
+            printf("Average local membrane thickness: %.4f nm\n", av_local);
+        }
+
+        grid_destroy(smoothed);
+        free(local_map_file);
+    }
+
+    analysis_end:
+    if (spectrum_output != NULL) fclose(spectrum_output);
+    if (local_output != NULL && fclose(local_output) != 0) {
+        fprintf(stderr, "Could not write the local thickness into %s.\n", local_file);
+        return_code = 1;
+    }
+    xtc_close(xtc);
     fclose(output);
-    free(all);
-    free(membrane_atoms);
-    free(phosphate_atoms);
-    free(system);
+    frame_destroy(frame);
+    free(membrane_subset);
+    free(phosphate_subset);
+    free(reference_subset);
+    fit_destroy(fit);
+    species_destroy(species);
 
-    free(upper_leaflet);
-    free(upper_leaflet_counts);
-    free(lower_leaflet);
-    free(lower_leaflet_counts);
+    grids_destroy(grids, n_sets * n_threads);
+    pool_destroy(pool);
+    batch_destroy(batch);
+    undulation_destroy(undulation);
+    free(local_subset);
+    local_destroy(local);
+    selector_destroy(selector);
+    dynamic_destroy(dynamic_membrane);
+    dynamic_destroy(dynamic_phosphates);
+    free(membrane_reference_subset);
+    free(phosphate_reference_subset);
+    profile_destroy(profile);
 
-    return 0;
+    return return_code;
 }
\ No newline at end of file
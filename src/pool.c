@@ -0,0 +1,216 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#include "pool.h"
+
+/*
+ * Main function of a worker thread: waits for a task, executes it and reports back.
+ */
+static void *worker_main(void *arg)
+{
+    pool_worker_t *worker = arg;
+    pool_t *pool = worker->pool;
+    size_t seen = 0;
+
+    while (1) {
+        pthread_mutex_lock(&pool->mutex);
+        while (!pool->stop && pool->generation == seen) {
+            pthread_cond_wait(&pool->start, &pool->mutex);
+        }
+
+        if (pool->stop) {
+            pthread_mutex_unlock(&pool->mutex);
+            return NULL;
+        }
+
+        seen = pool->generation;
+        pool_task_t task = pool->task;
+        void *data = pool->data;
+        pthread_mutex_unlock(&pool->mutex);
+
+        task(data, worker->index, pool->n_threads);
+
+        pthread_mutex_lock(&pool->mutex);
+        if (--pool->n_running == 0) pthread_cond_signal(&pool->done);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+pool_t *pool_create(const size_t n_threads)
+{
+    if (n_threads == 0) return NULL;
+
+    pool_t *pool = calloc(1, sizeof(pool_t));
+    if (pool == NULL) return NULL;
+
+    pool->n_threads = n_threads;
+    if (n_threads == 1) return pool;
+
+    pool->threads = malloc((n_threads - 1) * sizeof(pthread_t));
+    pool->workers = malloc((n_threads - 1) * sizeof(pool_worker_t));
+    if (pool->threads == NULL || pool->workers == NULL) {
+        free(pool->threads);
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (size_t i = 0; i < n_threads - 1; ++i) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i + 1;
+        if (pthread_create(&pool->threads[i], NULL, worker_main, &pool->workers[i]) != 0) {
+            // only use the threads that were successfully created
+            pool->n_threads = i + 1;
+            break;
+        }
+    }
+
+    return pool;
+}
+
+void pool_run(pool_t *pool, pool_task_t task, void *data)
+{
+    if (pool->n_threads == 1) {
+        task(data, 0, 1);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->task = task;
+    pool->data = data;
+    pool->n_running = pool->n_threads - 1;
+    ++pool->generation;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mutex);
+
+    task(data, 0, pool->n_threads);
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->n_running > 0) {
+        pthread_cond_wait(&pool->done, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/*
+ * Jobs [next, end) remaining in the block of a single thread.
+ */
+typedef struct job_queue {
+    pthread_mutex_t mutex;
+    size_t next;
+    size_t end;
+} job_queue_t;
+
+/*
+ * Batch of jobs executed by pool_run_jobs.
+ */
+typedef struct job_batch {
+    pool_job_t job;
+    void *data;
+    job_queue_t *queues;        // one queue for every thread
+} job_batch_t;
+
+/*
+ * Takes the next job from the start of the queue of the thread.
+ * Returns 1 if a job was taken. Returns 0 if the queue is empty.
+ */
+static int take_job(job_queue_t *queue, size_t *job)
+{
+    pthread_mutex_lock(&queue->mutex);
+    int taken = queue->next < queue->end;
+    if (taken) *job = queue->next++;
+    pthread_mutex_unlock(&queue->mutex);
+
+    return taken;
+}
+
+/*
+ * Steals a job from the end of the queue with the most remaining jobs.
+ * Returns 1 if a job was stolen. Returns 0 if all queues are empty.
+ */
+static int steal_job(job_queue_t *queues, const size_t n_threads, size_t *job)
+{
+    while (1) {
+        // the sizes of the queues are only estimated, the chosen queue is checked again when locked
+        size_t victim = 0, most = 0;
+        for (size_t i = 0; i < n_threads; ++i) {
+            pthread_mutex_lock(&queues[i].mutex);
+            size_t remaining = queues[i].end - queues[i].next;
+            pthread_mutex_unlock(&queues[i].mutex);
+
+            if (remaining > most) {
+                most = remaining;
+                victim = i;
+            }
+        }
+
+        if (most == 0) return 0;
+
+        job_queue_t *queue = &queues[victim];
+        pthread_mutex_lock(&queue->mutex);
+        int stolen = queue->next < queue->end;
+        if (stolen) *job = --queue->end;
+        pthread_mutex_unlock(&queue->mutex);
+
+        if (stolen) return 1;
+    }
+}
+
+/*
+ * Processes the jobs of the thread and then steals jobs of the other threads.
+ */
+static void process_jobs(void *data, const size_t thread, const size_t n_threads)
+{
+    job_batch_t *batch = data;
+    size_t job = 0;
+
+    while (take_job(&batch->queues[thread], &job) || steal_job(batch->queues, n_threads, &job)) {
+        batch->job(batch->data, job, thread);
+    }
+}
+
+int pool_run_jobs(pool_t *pool, pool_job_t job, const size_t n_jobs, void *data)
+{
+    job_queue_t *queues = malloc(pool->n_threads * sizeof(job_queue_t));
+    if (queues == NULL) return 1;
+
+    for (size_t i = 0; i < pool->n_threads; ++i) {
+        pthread_mutex_init(&queues[i].mutex, NULL);
+        pool_range(n_jobs, i, pool->n_threads, &queues[i].next, &queues[i].end);
+    }
+
+    job_batch_t batch = { job, data, queues };
+    pool_run(pool, process_jobs, &batch);
+
+    for (size_t i = 0; i < pool->n_threads; ++i) pthread_mutex_destroy(&queues[i].mutex);
+    free(queues);
+    return 0;
+}
+
+void pool_destroy(pool_t *pool)
+{
+    if (pool == NULL) return;
+
+    if (pool->threads != NULL) {
+        pthread_mutex_lock(&pool->mutex);
+        pool->stop = 1;
+        pthread_cond_broadcast(&pool->start);
+        pthread_mutex_unlock(&pool->mutex);
+
+        for (size_t i = 0; i < pool->n_threads - 1; ++i) {
+            pthread_join(pool->threads[i], NULL);
+        }
+
+        pthread_mutex_destroy(&pool->mutex);
+        pthread_cond_destroy(&pool->start);
+        pthread_cond_destroy(&pool->done);
+    }
+
+    free(pool->threads);
+    free(pool->workers);
+    free(pool);
+}
@@ -0,0 +1,85 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdlib.h>
+#include <pthread.h>
+
+/*
+ * Function executed by every thread of the pool.
+ * 'thread' is the index of the thread (0 to n_threads - 1).
+ */
+typedef void (*pool_task_t)(void *data, const size_t thread, const size_t n_threads);
+
+/*
+ * Function processing a single job of a batch.
+ * 'thread' is the index of the thread executing the job.
+ */
+typedef void (*pool_job_t)(void *data, const size_t job, const size_t thread);
+
+struct pool;
+
+/*
+ * Information passed to a single worker thread.
+ */
+typedef struct pool_worker {
+    struct pool *pool;
+    size_t index;
+} pool_worker_t;
+
+/*
+ * Pool of threads that repeatedly execute a task in parallel.
+ * The thread that submits the task also works on it (as thread 0),
+ * so a pool with a single thread does not create any threads at all.
+ */
+typedef struct pool {
+    size_t n_threads;
+    pthread_t *threads;         // worker threads (n_threads - 1)
+    pool_worker_t *workers;
+    pthread_mutex_t mutex;
+    pthread_cond_t start;       // signaled when a new task is submitted
+    pthread_cond_t done;        // signaled when all workers have finished the task
+    pool_task_t task;
+    void *data;
+    size_t generation;          // number of tasks submitted so far
+    size_t n_running;           // number of workers still executing the current task
+    int stop;
+} pool_t;
+
+/*
+ * Creates a pool with the specified number of threads (including the calling thread).
+ * Returns NULL if the pool could not be created.
+ */
+pool_t *pool_create(const size_t n_threads);
+
+/*
+ * Executes the task on all threads of the pool and waits until all threads finish it.
+ */
+void pool_run(pool_t *pool, pool_task_t task, void *data);
+
+/*
+ * Executes jobs 0 to n_jobs - 1 on all threads of the pool and waits until all jobs are finished.
+ * Every thread gets a contiguous block of jobs which it processes from the start.
+ * Once a thread finishes its own block, it steals jobs from the end of the block
+ * of the thread with the most remaining jobs, so threads with short jobs help the others.
+ * Returns zero, if successful. Returns non-zero if the memory could not be allocated (no job is executed).
+ */
+int pool_run_jobs(pool_t *pool, pool_job_t job, const size_t n_jobs, void *data);
+
+/*
+ * Stops all threads of the pool and frees the memory.
+ */
+void pool_destroy(pool_t *pool);
+
+/*
+ * Gets the part [start, end) of n items that should be processed by the given thread.
+ */
+static inline void pool_range(const size_t n, const size_t thread, const size_t n_threads, size_t *start, size_t *end)
+{
+    *start = n * thread / n_threads;
+    *end = n * (thread + 1) / n_threads;
+}
+
+#endif /* POOL_H */
@@ -0,0 +1,269 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#include "pore.h"
+
+// marks voxels of the central layer that do not belong to any pore
+static const uint32_t NO_PORE = UINT32_MAX;
+// the bottom and the top layer of voxels reached by a cluster
+static const uint8_t SPANS_BOTTOM = 1;
+static const uint8_t SPANS_TOP = 2;
+
+pore_grid_t *pore_grid_create(const float voxel, const float half_height)
+{
+    pore_grid_t *grid = calloc(1, sizeof(pore_grid_t));
+    if (grid == NULL) return NULL;
+
+    grid->voxel = voxel;
+    grid->half_height = half_height;
+    grid->nz = (size_t) ceilf(2 * half_height / voxel);
+    if (grid->nz == 0) grid->nz = 1;
+    grid->size[2] = 2 * half_height / grid->nz;
+
+    return grid;
+}
+
+void pore_grid_destroy(pore_grid_t *grid)
+{
+    if (grid == NULL) return;
+
+    free(grid->occupied);
+    free(grid->spans);
+    free(grid->parent);
+    free(grid->layer_parent);
+    free(grid->area);
+    free(grid);
+}
+
+/*
+ * Splits the box into whole voxels and makes sure that the grid is large enough.
+ * The memory is only reallocated if the grid grows, so fluctuations of the box are cheap.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+static int pore_grid_resize(pore_grid_t *grid, const box_t box)
+{
+    for (int dim = 0; dim < 2; ++dim) {
+        size_t n_voxels = (size_t) (box[dim] / grid->voxel);
+        if (n_voxels == 0) n_voxels = 1;
+        grid->size[dim] = box[dim] / n_voxels;
+        if (dim == 0) grid->nx = n_voxels;
+        else grid->ny = n_voxels;
+    }
+
+    size_t n_voxels = grid->nx * grid->ny * grid->nz;
+    if (n_voxels <= grid->capacity) return 0;
+    if (n_voxels >= UINT32_MAX) return 1;
+
+    // some space is left for the box to grow
+    size_t capacity = n_voxels + n_voxels / 8;
+    if (capacity >= UINT32_MAX) capacity = n_voxels;
+    size_t layer_capacity = capacity / grid->nz;
+
+    free(grid->occupied);
+    free(grid->spans);
+    free(grid->parent);
+    free(grid->layer_parent);
+    free(grid->area);
+
+    grid->occupied = malloc(capacity);
+    grid->spans = malloc(capacity);
+    grid->parent = malloc(capacity * sizeof(uint32_t));
+    grid->layer_parent = malloc(layer_capacity * sizeof(uint32_t));
+    grid->area = malloc(layer_capacity * sizeof(uint32_t));
+
+    if (grid->occupied == NULL || grid->spans == NULL || grid->parent == NULL ||
+        grid->layer_parent == NULL || grid->area == NULL) {
+            grid->capacity = 0;
+            return 1;
+        }
+
+    grid->capacity = capacity;
+    return 0;
+}
+
+/*
+ * Returns the index of the voxel along an axis periodic in the box.
+ */
+static inline size_t periodic_index(const float coordinate, const float box, const float size, const size_t n_voxels)
+{
+    float wrapped = coordinate - box * floorf(coordinate / box);
+    size_t index = (size_t) (wrapped / size);
+    return index >= n_voxels ? n_voxels - 1 : index;
+}
+
+/*
+ * Marks the voxel occupied by the atom, if the atom is located in the slab.
+ */
+static inline void pore_grid_add(pore_grid_t *grid, const frame_t *frame, const size_t id, const vec_t center)
+{
+    const float *position = frame->positions[id];
+
+    float rel_pos_z = distance1D(position, center, z, frame->box);
+    if (fabsf(rel_pos_z) >= grid->half_height) return;
+
+    size_t z_index = (size_t) ((rel_pos_z + grid->half_height) / grid->size[2]);
+    if (z_index >= grid->nz) z_index = grid->nz - 1;
+    size_t y_index = periodic_index(position[1], frame->box[1], grid->size[1], grid->ny);
+    size_t x_index = periodic_index(position[0], frame->box[0], grid->size[0], grid->nx);
+
+    grid->occupied[(z_index * grid->ny + y_index) * grid->nx + x_index] = 1;
+}
+
+int pore_grid_fill(pore_grid_t *grid, const frame_t *frame, const subset_t *atoms, const uint32_t *masks, const vec_t center)
+{
+    if (pore_grid_resize(grid, frame->box) != 0) return 1;
+    memset(grid->occupied, 0, grid->nx * grid->ny * grid->nz);
+
+    // contiguous ranges of atoms are streamed directly
+    if (atoms->n_ranges > 0) {
+        for (size_t r = 0; r < atoms->n_ranges; ++r) {
+            for (size_t id = atoms->ranges[r].start; id < atoms->ranges[r].start + atoms->ranges[r].n_atoms; ++id) {
+                if (masks == NULL || (masks[id] & 1)) pore_grid_add(grid, frame, id, center);
+            }
+        }
+    } else {
+        for (size_t i = 0; i < atoms->n_atoms; ++i) {
+            const size_t id = atoms->ids[i];
+            if (masks == NULL || (masks[id] & 1)) pore_grid_add(grid, frame, id, center);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Returns the root of the cluster to which the element belongs (halving the path on the way).
+ */
+static inline uint32_t find_root(uint32_t *parent, uint32_t element)
+{
+    while (parent[element] != element) {
+        parent[element] = parent[parent[element]];
+        element = parent[element];
+    }
+
+    return element;
+}
+
+/*
+ * Merges the clusters of two elements. The root with the lower index becomes the root of the merged cluster.
+ */
+static inline void unite(uint32_t *parent, const uint32_t a, const uint32_t b)
+{
+    uint32_t root_a = find_root(parent, a);
+    uint32_t root_b = find_root(parent, b);
+
+    if (root_a < root_b) parent[root_b] = root_a;
+    else if (root_b < root_a) parent[root_a] = root_b;
+}
+
+/*
+ * Labels the clusters of occupied voxels in the whole grid (26-connected, periodic in x and y).
+ */
+static void label_clusters(pore_grid_t *grid)
+{
+    const size_t nx = grid->nx, ny = grid->ny, nz = grid->nz;
+    const uint8_t *occupied = grid->occupied;
+    uint32_t *parent = grid->parent;
+
+    // every occupied voxel starts as a separate cluster
+    for (size_t v = 0; v < nx * ny * nz; ++v) {
+        if (!occupied[v]) continue;
+        parent[v] = v;
+        grid->spans[v] = 0;
+    }
+
+    // every pair of neighboring voxels is visited once: a voxel is connected to the next voxel in its row,
+    // to three voxels in the next row and to nine voxels in the next layer
+    for (size_t z_index = 0; z_index < nz; ++z_index) {
+        for (size_t y_index = 0; y_index < ny; ++y_index) {
+            const size_t rows[3] = { y_index == 0 ? ny - 1 : y_index - 1, y_index, y_index + 1 == ny ? 0 : y_index + 1 };
+
+            for (size_t x_index = 0; x_index < nx; ++x_index) {
+                const size_t v = (z_index * ny + y_index) * nx + x_index;
+                if (!occupied[v]) continue;
+
+                const size_t cols[3] = { x_index == 0 ? nx - 1 : x_index - 1, x_index, x_index + 1 == nx ? 0 : x_index + 1 };
+
+                size_t neighbor = (z_index * ny + y_index) * nx + cols[2];
+                if (occupied[neighbor]) unite(parent, v, neighbor);
+
+                for (int c = 0; c < 3; ++c) {
+                    neighbor = (z_index * ny + rows[2]) * nx + cols[c];
+                    if (occupied[neighbor]) unite(parent, v, neighbor);
+                }
+
+                if (z_index + 1 == nz) continue;
+                for (int r = 0; r < 3; ++r) {
+                    for (int c = 0; c < 3; ++c) {
+                        neighbor = ((z_index + 1) * ny + rows[r]) * nx + cols[c];
+                        if (occupied[neighbor]) unite(parent, v, neighbor);
+                    }
+                }
+            }
+        }
+    }
+
+    // mark the clusters reaching the bottom and the top layer
+    const size_t top = (nz - 1) * nx * ny;
+    for (size_t i = 0; i < nx * ny; ++i) {
+        if (occupied[i]) grid->spans[find_root(parent, i)] |= SPANS_BOTTOM;
+        if (occupied[top + i]) grid->spans[find_root(parent, top + i)] |= SPANS_TOP;
+    }
+}
+
+void pore_grid_label(pore_grid_t *grid, pore_stats_t *stats)
+{
+    memset(stats, 0, sizeof(pore_stats_t));
+
+    label_clusters(grid);
+
+    // a spanning cluster must pass through every layer, so pores are labeled in the central layer only
+    // (8-connected, periodic in x and y)
+    const size_t nx = grid->nx, ny = grid->ny;
+    const size_t central = grid->nz / 2 * nx * ny;
+    uint32_t *layer_parent = grid->layer_parent;
+
+    for (size_t i = 0; i < nx * ny; ++i) {
+        const size_t v = central + i;
+        int spanning = grid->occupied[v] && grid->spans[find_root(grid->parent, v)] == (SPANS_BOTTOM | SPANS_TOP);
+        layer_parent[i] = spanning ? i : NO_PORE;
+    }
+
+    for (size_t y_index = 0; y_index < ny; ++y_index) {
+        const size_t next_row = y_index + 1 == ny ? 0 : y_index + 1;
+
+        for (size_t x_index = 0; x_index < nx; ++x_index) {
+            const size_t i = y_index * nx + x_index;
+            if (layer_parent[i] == NO_PORE) continue;
+
+            const size_t cols[3] = { x_index == 0 ? nx - 1 : x_index - 1, x_index, x_index + 1 == nx ? 0 : x_index + 1 };
+
+            size_t neighbor = y_index * nx + cols[2];
+            if (layer_parent[neighbor] != NO_PORE) unite(layer_parent, i, neighbor);
+
+            for (int c = 0; c < 3; ++c) {
+                neighbor = next_row * nx + cols[c];
+                if (layer_parent[neighbor] != NO_PORE) unite(layer_parent, i, neighbor);
+            }
+        }
+    }
+
+    // measure the cross-section of every pore
+    for (size_t i = 0; i < nx * ny; ++i) {
+        if (layer_parent[i] != NO_PORE) grid->area[i] = 0;
+    }
+
+    for (size_t i = 0; i < nx * ny; ++i) {
+        if (layer_parent[i] != NO_PORE) ++grid->area[find_root(layer_parent, i)];
+    }
+
+    const float voxel_area = grid->size[0] * grid->size[1];
+    for (size_t i = 0; i < nx * ny; ++i) {
+        if (layer_parent[i] != i) continue;
+
+        float area = grid->area[i] * voxel_area;
+        ++stats->n_pores;
+        stats->total_area += area;
+        if (area > stats->max_area) stats->max_area = area;
+    }
+}
@@ -0,0 +1,64 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#ifndef PORE_H
+#define PORE_H
+
+#include <stdint.h>
+#include <groan.h>
+#include "frame.h"
+
+/*
+ * Binary voxel grid of water atoms located in a slab centered at the membrane center.
+ * The grid covers the whole box in the xy-plane (and is periodic in x and y) and the slab along z.
+ *
+ * Water atoms in neighboring voxels (including diagonal neighbors) are connected.
+ * A connected cluster of water atoms reaching both the top and the bottom layer of voxels spans the membrane.
+ * Pores are the separate cross-sections of the spanning clusters in the central layer of voxels.
+ */
+typedef struct pore_grid {
+    float voxel;                // requested size of a voxel
+    float half_height;          // half of the height of the slab
+    size_t nx, ny, nz;          // number of voxels along each axis (nx and ny are updated for every frame)
+    vec_t size;                 // actual size of a voxel (the box is split into whole voxels)
+    size_t capacity;            // number of allocated voxels
+    uint8_t *occupied;          // 1 if the voxel contains at least one water atom
+    uint8_t *spans;             // layers reached by the cluster (only valid for the roots of the clusters)
+    uint32_t *parent;           // union-find parent of every occupied voxel
+    uint32_t *layer_parent;     // union-find parent of every spanning voxel in the central layer
+    uint32_t *area;             // number of voxels of every pore in the central layer (only valid for the roots)
+} pore_grid_t;
+
+/*
+ * Pores detected in a single frame.
+ */
+typedef struct pore_stats {
+    size_t n_pores;
+    float total_area;           // summed cross-section of all pores at the membrane center [nm^2]
+    float max_area;             // cross-section of the largest pore [nm^2]
+} pore_stats_t;
+
+/*
+ * Prepares a voxel grid for a slab with the specified half-height.
+ * Returns NULL if the memory could not be allocated.
+ */
+pore_grid_t *pore_grid_create(const float voxel, const float half_height);
+
+/*
+ * Frees all memory associated with the voxel grid.
+ */
+void pore_grid_destroy(pore_grid_t *grid);
+
+/*
+ * Fits the voxel grid to the box of the frame and marks the voxels occupied by the atoms located in the slab.
+ * If masks is not NULL, only atoms with bit 0 set (water) are used.
+ * Returns zero, if successful. Returns non-zero if the memory could not be allocated.
+ */
+int pore_grid_fill(pore_grid_t *grid, const frame_t *frame, const subset_t *atoms, const uint32_t *masks, const vec_t center);
+
+/*
+ * Labels the clusters of occupied voxels and finds the pores spanning the slab.
+ */
+void pore_grid_label(pore_grid_t *grid, pore_stats_t *stats);
+
+#endif /* PORE_H */
@@ -0,0 +1,128 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#include "profile.h"
+
+// names of the phases written into the report
+static const char *PHASE_NAMES[PROFILE_PHASES] = {
+    "reading", "dynamic selections", "centering", "reordering", "binning", "other"
+};
+
+/*
+ * Returns the number of seconds between two points in time.
+ */
+static inline double elapsed(const struct timespec *start, const struct timespec *end)
+{
+    return (double) (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+/*
+ * Calculates the indices of the grid tile in which the atom is located (wrapped into the box).
+ */
+static inline void atom_tile(const frame_t *frame, const size_t id, const int tiles_per_nm, long index[2])
+{
+    for (int dim = 0; dim < 2; ++dim) {
+        float rel = frame->positions[id][dim] / frame->box[dim];
+        rel -= floorf(rel);
+        index[dim] = (long) (rel * frame->box[dim] * tiles_per_nm);
+    }
+}
+
+/*
+ * Returns the summed distance (in tiles) between the tiles of consecutive atoms of the subset.
+ */
+static double sum_distances(const frame_t *frame, const subset_t *subset, const int tiles_per_nm)
+{
+    double sum = 0.0;
+    long previous[2] = {0};
+    atom_tile(frame, subset->ids[0], tiles_per_nm, previous);
+
+    for (size_t i = 1; i < subset->n_atoms; ++i) {
+        long current[2] = {0};
+        atom_tile(frame, subset->ids[i], tiles_per_nm, current);
+        const double dx = (double) (current[0] - previous[0]);
+        const double dy = (double) (current[1] - previous[1]);
+        sum += sqrt(dx * dx + dy * dy);
+        memcpy(previous, current, sizeof(previous));
+    }
+
+    return sum;
+}
+
+profile_t *profile_create(const subset_t *subset, const int tiles_per_nm)
+{
+    profile_t *profile = calloc(1, sizeof(profile_t));
+    if (profile == NULL) return NULL;
+
+    profile->tiles_per_nm = tiles_per_nm;
+    if (subset == NULL) return profile;
+
+    profile->file_order = subset_copy(subset);
+    if (profile->file_order == NULL) {
+        free(profile);
+        return NULL;
+    }
+
+    return profile;
+}
+
+void profile_destroy(profile_t *profile)
+{
+    if (profile == NULL) return;
+
+    free(profile->file_order);
+    free(profile);
+}
+
+void profile_start(profile_t *profile)
+{
+    if (profile == NULL) return;
+
+    clock_gettime(CLOCK_MONOTONIC, &profile->mark);
+}
+
+void profile_mark(profile_t *profile, const profile_phase_t phase)
+{
+    if (profile == NULL) return;
+
+    struct timespec now = {0};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    profile->seconds[phase] += elapsed(&profile->mark, &now);
+    profile->mark = now;
+}
+
+void profile_count(profile_t *profile, const frame_t *frame, const subset_t *binned)
+{
+    if (profile == NULL || profile->file_order == NULL || binned->n_atoms < 2) return;
+
+    profile->n_pairs += binned->n_atoms - 1;
+    profile->distance += sum_distances(frame, binned, profile->tiles_per_nm);
+    profile->distance_file += sum_distances(frame, profile->file_order, profile->tiles_per_nm);
+
+    // counting is not a part of the analysis
+    clock_gettime(CLOCK_MONOTONIC, &profile->mark);
+}
+
+void profile_write(const profile_t *profile, FILE *stream, const size_t n_frames)
+{
+    if (profile == NULL) return;
+
+    double total = 0.0;
+    for (int p = 0; p < PROFILE_PHASES; ++p) total += profile->seconds[p];
+
+    fprintf(stream, "\nTime spent in the phases of the analysis (%zu frames):\n", n_frames);
+    for (int p = 0; p < PROFILE_PHASES; ++p) {
+        if (profile->seconds[p] == 0.0) continue;
+
+        char label[32] = {0};
+        sprintf(label, "%s:", PHASE_NAMES[p]);
+        fprintf(stream, ">>> %-19s %9.3f s (%8.3f ms per frame, %5.1f %%)\n", label, profile->seconds[p],
+                n_frames > 0 ? 1000.0 * profile->seconds[p] / n_frames : 0.0,
+                total > 0.0 ? 100.0 * profile->seconds[p] / total : 0.0);
+    }
+
+    if (profile->n_pairs > 0) {
+        fprintf(stream, "Average distance between the tiles of consecutive binned atoms: %.2f tiles (%.2f tiles in the order of the input file)\n",
+                profile->distance / profile->n_pairs, profile->distance_file / profile->n_pairs);
+    }
+}
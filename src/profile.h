@@ -0,0 +1,77 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include "frame.h"
+
+/*
+ * Phases of the analysis of a single frame.
+ */
+typedef enum profile_phase {
+    PROFILE_READ,               // reading and decoding the frame
+    PROFILE_SELECT,             // evaluating dynamic selections
+    PROFILE_CENTER,             // calculating the membrane center, centering and fitting
+    PROFILE_SORT,               // reordering the binned atoms by tiles
+    PROFILE_BIN,                // assigning the atoms to grid tiles
+    PROFILE_OTHER,              // everything else (e.g. pores, spectra, archive)
+    PROFILE_PHASES              // number of phases
+} profile_phase_t;
+
+/*
+ * Opt-in report of the wall time spent in the individual phases of the analysis.
+ * Additionally measures the average distance (in grid tiles) between the tiles of two consecutively binned atoms,
+ * both in the order in which they are binned and in the order of the input file, so the effect
+ * of reordering the atoms on the locality of the grid updates can be checked.
+ *
+ * All functions do nothing if the profile is NULL, so they can be called unconditionally.
+ */
+typedef struct profile {
+    double seconds[PROFILE_PHASES];
+    struct timespec mark;       // end of the previously measured phase
+    int tiles_per_nm;
+    subset_t *file_order;       // binned atoms in the order of the input file
+    uint64_t n_pairs;           // number of pairs of consecutive binned atoms (over all frames)
+    double distance;            // summed distance between the tiles of the pairs (binned order)
+    double distance_file;       // summed distance between the tiles of the pairs (order of the input file)
+} profile_t;
+
+/*
+ * Creates a profile for the binned atoms of the subset (which must still be in the order of the input file).
+ * If the subset is NULL (e.g. the binned atoms change in every frame), the distances are not measured.
+ * Returns NULL if the memory could not be allocated.
+ */
+profile_t *profile_create(const subset_t *subset, const int tiles_per_nm);
+
+/*
+ * Frees all memory associated with the profile.
+ */
+void profile_destroy(profile_t *profile);
+
+/*
+ * Starts measuring the time of the first phase.
+ */
+void profile_start(profile_t *profile);
+
+/*
+ * Adds the time elapsed since the end of the previous phase to the phase.
+ */
+void profile_mark(profile_t *profile, const profile_phase_t phase);
+
+/*
+ * Measures the distances between the tiles of consecutive binned atoms in the current frame.
+ * The binned subset contains the same atoms as the subset used to create the profile, possibly reordered.
+ * The time spent counting is not added to any phase.
+ */
+void profile_count(profile_t *profile, const frame_t *frame, const subset_t *binned);
+
+/*
+ * Writes the time spent in every phase and the average distances between the tiles of consecutive binned atoms.
+ */
+void profile_write(const profile_t *profile, FILE *stream, const size_t n_frames);
+
+#endif /* PROFILE_H */
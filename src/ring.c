@@ -0,0 +1,441 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ring.h"
+
+// identifies ring buffers of frames
+static const char RING_MAGIC[8] = "MEMDRNG";
+// slots are aligned to a cache line
+static const size_t SLOT_ALIGNMENT = 64;
+// marks a consumer that no longer reads frames
+static const uint64_t DETACHED = UINT64_MAX;
+// interval of checking whether the other processes using the ring are still alive (in seconds)
+static const int LIVENESS_INTERVAL = 1;
+
+/*
+ * Rounds the size up to a multiple of SLOT_ALIGNMENT.
+ */
+static inline size_t align_size(const size_t size)
+{
+    return (size + SLOT_ALIGNMENT - 1) / SLOT_ALIGNMENT * SLOT_ALIGNMENT;
+}
+
+/*
+ * Returns the header of a slot.
+ */
+static inline ring_slot_t *ring_slot(const ring_t *ring, const uint64_t index)
+{
+    unsigned char *slots = (unsigned char *) ring->shared + align_size(sizeof(ring_shared_t));
+    return (ring_slot_t *) (slots + (index % ring->shared->n_slots) * ring->shared->slot_size);
+}
+
+/*
+ * Returns the positions of all atoms stored in a slot.
+ */
+static inline vec_t *slot_positions(ring_slot_t *slot)
+{
+    return (vec_t *) ((unsigned char *) slot + align_size(sizeof(ring_slot_t)));
+}
+
+/*
+ * Returns the fixed-point coordinates of all atoms stored in a slot.
+ */
+static inline int *slot_coordinates(ring_slot_t *slot, const uint64_t n_atoms)
+{
+    return (int *) ((unsigned char *) slot_positions(slot) + align_size(n_atoms * sizeof(vec_t)));
+}
+
+/*
+ * Converts the name of a ring to the name of its shared memory object.
+ * Returns zero, if successful. Returns non-zero if the name is too long or contains a slash.
+ */
+static int shm_name(const char *name, char object_name[RING_NAME_LENGTH])
+{
+    if (name[0] == '\0' || strchr(name, '/') != NULL || strlen(name) + 2 > RING_NAME_LENGTH) return 1;
+
+    sprintf(object_name, "/%s", name);
+    return 0;
+}
+
+/*
+ * Returns the number of frames read by the slowest attached consumer.
+ * Consumers that have not attached yet have not read anything. Must be called with the mutex locked.
+ */
+static uint64_t slowest_consumer(const ring_shared_t *shared)
+{
+    uint64_t slowest = shared->produced;
+    for (uint64_t i = 0; i < shared->n_consumers; ++i) {
+        if (shared->consumed[i] != DETACHED && shared->consumed[i] < slowest) slowest = shared->consumed[i];
+    }
+
+    return slowest;
+}
+
+/*
+ * Returns the current time of CLOCK_MONOTONIC in seconds.
+ */
+static time_t monotonic_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+/*
+ * Returns 1 if the process exists and has not terminated. Returns 0 otherwise.
+ */
+static int process_alive(const pid_t pid)
+{
+    if (pid <= 0 || (kill(pid, 0) != 0 && errno == ESRCH)) return 0;
+
+    // a terminated process still exists until its parent collects it (state 'Z' on Linux)
+    char path[64] = {0}, line[512] = {0};
+    sprintf(path, "/proc/%ld/stat", (long) pid);
+    FILE *stat_file = fopen(path, "r");
+    if (stat_file == NULL) return 1;
+
+    const char *state = fgets(line, sizeof(line), stat_file) == NULL ? NULL : strrchr(line, ')');
+    fclose(stat_file);
+    return state == NULL || state[1] == '\0' || state[2] != 'Z';
+}
+
+/*
+ * Locks the mutex of the ring. If the previous owner of the mutex died while holding it,
+ * the mutex is made consistent (the shared counters are always left in a valid state).
+ */
+static void ring_lock(ring_shared_t *shared)
+{
+    if (pthread_mutex_lock(&shared->mutex) == EOWNERDEAD) pthread_mutex_consistent(&shared->mutex);
+}
+
+/*
+ * Unlocks the mutex and waits until the semaphore is posted or until LIVENESS_INTERVAL passes.
+ * The mutex is locked again before returning. Must be called with the mutex locked.
+ */
+static void ring_wait(ring_shared_t *shared, sem_t *wakeup)
+{
+    pthread_mutex_unlock(&shared->mutex);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += LIVENESS_INTERVAL;
+    while (sem_timedwait(wakeup, &deadline) != 0 && errno == EINTR);
+
+    ring_lock(shared);
+}
+
+/*
+ * Wakes up a process waiting on the semaphore. Posts are not accumulated, waiting processes always check the ring anyway.
+ */
+static void ring_notify(sem_t *wakeup)
+{
+    int value = 0;
+    if (sem_getvalue(wakeup, &value) == 0 && value > 0) return;
+    sem_post(wakeup);
+}
+
+/*
+ * Wakes up all consumers that have attached and not detached yet. Must be called with the mutex locked.
+ */
+static void notify_consumers(ring_shared_t *shared)
+{
+    for (uint64_t i = 0; i < shared->attached; ++i) {
+        if (shared->consumed[i] != DETACHED) ring_notify(&shared->consumer_wakeups[i]);
+    }
+}
+
+/*
+ * Detaches consumers whose processes have terminated and, once the attach deadline passes,
+ * all consumers that have not attached yet. Must be called by the producer with the mutex locked.
+ */
+static void check_consumers(ring_t *ring)
+{
+    ring_shared_t *shared = ring->shared;
+    for (uint64_t i = 0; i < shared->attached; ++i) {
+        if (shared->consumed[i] != DETACHED && !process_alive(shared->consumer_pids[i])) {
+            fprintf(stderr, "\nConsumer %lu of the ring (process %ld) terminated without detaching.\n", (unsigned long) i + 1, (long) shared->consumer_pids[i]);
+            shared->consumed[i] = DETACHED;
+        }
+    }
+
+    if (ring->attach_deadline > 0 && shared->attached < shared->n_consumers && monotonic_seconds() >= ring->attach_deadline) {
+        fprintf(stderr, "\n%lu consumer(s) did not attach to the ring in time.\n", (unsigned long) (shared->n_consumers - shared->attached));
+        for (uint64_t i = shared->attached; i < shared->n_consumers; ++i) shared->consumed[i] = DETACHED;
+        shared->attached = shared->n_consumers;
+    }
+}
+
+/*
+ * Removes the shared memory object of a ring whose producer no longer runs.
+ * Returns zero, if the object has been removed. Returns non-zero otherwise.
+ */
+static int remove_stale(const char *object_name)
+{
+    int fd = shm_open(object_name, O_RDONLY, 0);
+    if (fd < 0) return 1;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t) info.st_size < sizeof(ring_shared_t)) {
+        close(fd);
+        return 1;
+    }
+
+    void *memory = mmap(NULL, sizeof(ring_shared_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) return 1;
+
+    const ring_shared_t *shared = memory;
+    int stale = memcmp(shared->magic, RING_MAGIC, sizeof(RING_MAGIC)) == 0 && !process_alive(shared->producer_pid);
+    munmap(memory, sizeof(ring_shared_t));
+
+    if (!stale) return 1;
+    return shm_unlink(object_name);
+}
+
+ring_t *ring_create(const char *name, const size_t n_atoms, const size_t n_slots, const size_t n_consumers, const int attach_timeout)
+{
+    if (n_slots == 0 || n_consumers == 0 || n_consumers > RING_MAX_CONSUMERS) return NULL;
+
+    ring_t *ring = calloc(1, sizeof(ring_t));
+    if (ring == NULL) return NULL;
+
+    if (shm_name(name, ring->name) != 0) {
+        free(ring);
+        return NULL;
+    }
+
+    size_t slot_size = align_size(sizeof(ring_slot_t)) + align_size(n_atoms * sizeof(vec_t)) + align_size(3 * n_atoms * sizeof(int));
+    ring->size = align_size(sizeof(ring_shared_t)) + n_slots * slot_size;
+    ring->producer = 1;
+
+    // the ring must not exist yet, so that two servers never share one (unless it was left behind by a dead server)
+    int fd = shm_open(ring->name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0 && errno == EEXIST && remove_stale(ring->name) == 0) {
+        fprintf(stderr, "Removed stale ring %s left behind by a terminated frame server.\n", name);
+        fd = shm_open(ring->name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    }
+    if (fd < 0) {
+        free(ring);
+        return NULL;
+    }
+
+    if (ftruncate(fd, ring->size) != 0) {
+        close(fd);
+        shm_unlink(ring->name);
+        free(ring);
+        return NULL;
+    }
+
+    void *memory = mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        shm_unlink(ring->name);
+        free(ring);
+        return NULL;
+    }
+
+    ring_shared_t *shared = memory;
+    shared->n_atoms = n_atoms;
+    shared->n_slots = n_slots;
+    shared->n_consumers = n_consumers;
+    shared->slot_size = slot_size;
+    shared->producer_pid = getpid();
+    ring->attach_deadline = attach_timeout > 0 ? monotonic_seconds() + attach_timeout : 0;
+
+    pthread_mutexattr_t mutex_attr;
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&shared->mutex, &mutex_attr);
+    pthread_mutexattr_destroy(&mutex_attr);
+
+    sem_init(&shared->producer_wakeup, 1, 0);
+    for (size_t i = 0; i < n_consumers; ++i) sem_init(&shared->consumer_wakeups[i], 1, 0);
+
+    // the magic is written last, consumers can not attach to a half-initialized ring
+    memcpy(shared->magic, RING_MAGIC, sizeof(RING_MAGIC));
+    ring->shared = shared;
+
+    return ring;
+}
+
+ring_t *ring_attach(const char *name)
+{
+    char object_name[RING_NAME_LENGTH] = {0};
+    if (shm_name(name, object_name) != 0) return NULL;
+
+    int fd = shm_open(object_name, O_RDWR, 0);
+    if (fd < 0) return NULL;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t) info.st_size < sizeof(ring_shared_t)) {
+        close(fd);
+        return NULL;
+    }
+
+    void *memory = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) return NULL;
+
+    ring_shared_t *shared = memory;
+    if (memcmp(shared->magic, RING_MAGIC, sizeof(RING_MAGIC)) != 0 ||
+        align_size(sizeof(ring_shared_t)) + shared->n_slots * shared->slot_size > (size_t) info.st_size) {
+            munmap(memory, info.st_size);
+            return NULL;
+        }
+
+    ring_lock(shared);
+    if (shared->attached == shared->n_consumers) {
+        pthread_mutex_unlock(&shared->mutex);
+        munmap(memory, info.st_size);
+        return NULL;
+    }
+    size_t consumer = shared->attached++;
+    shared->consumer_pids[consumer] = getpid();
+    pthread_mutex_unlock(&shared->mutex);
+
+    ring_t *ring = calloc(1, sizeof(ring_t));
+    if (ring == NULL) {
+        // the consumer must not block the producer
+        ring_lock(shared);
+        shared->consumed[consumer] = DETACHED;
+        ring_notify(&shared->producer_wakeup);
+        pthread_mutex_unlock(&shared->mutex);
+        munmap(memory, info.st_size);
+        return NULL;
+    }
+
+    ring->shared = shared;
+    ring->size = info.st_size;
+    ring->consumer = consumer;
+    strcpy(ring->name, object_name);
+
+    return ring;
+}
+
+void ring_publish(ring_t *ring, const frame_t *frame)
+{
+    ring_shared_t *shared = ring->shared;
+
+    // wait until the slot is free
+    ring_lock(shared);
+    while (shared->produced - slowest_consumer(shared) >= shared->n_slots) {
+        ring_wait(shared, &shared->producer_wakeup);
+        check_consumers(ring);
+    }
+    uint64_t index = shared->produced;
+    pthread_mutex_unlock(&shared->mutex);
+
+    // no consumer reads the slot while it is being written
+    ring_slot_t *slot = ring_slot(ring, index);
+    slot->step = frame->step;
+    slot->time = frame->time;
+    slot->precision = frame->precision;
+    memcpy(slot->box, frame->box, sizeof(box_t));
+    memcpy(slot_positions(slot), frame->positions, shared->n_atoms * sizeof(vec_t));
+    memcpy(slot_coordinates(slot, shared->n_atoms), frame->coordinates, 3 * shared->n_atoms * sizeof(int));
+
+    ring_lock(shared);
+    ++shared->produced;
+    notify_consumers(shared);
+    pthread_mutex_unlock(&shared->mutex);
+}
+
+int ring_read(ring_t *ring, frame_t *frame)
+{
+    ring_shared_t *shared = ring->shared;
+    uint64_t *consumed = &shared->consumed[ring->consumer];
+
+    if (frame->n_system_atoms != shared->n_atoms) {
+        fprintf(stderr, "\nNumber of atoms in the frame server (%lu) does not match the system (%zu).\n", (unsigned long) shared->n_atoms, frame->n_system_atoms);
+        return 2;
+    }
+
+    // wait for the next frame
+    ring_lock(shared);
+    while (*consumed == shared->produced && !shared->finished) {
+        ring_wait(shared, &shared->consumer_wakeups[ring->consumer]);
+        if (*consumed == shared->produced && !shared->finished && !process_alive(shared->producer_pid)) {
+            pthread_mutex_unlock(&shared->mutex);
+            fprintf(stderr, "\nFrame server terminated before publishing all frames.\n");
+            return 2;
+        }
+    }
+    // the frames published before the failure do not form a complete trajectory
+    if (shared->failed) {
+        pthread_mutex_unlock(&shared->mutex);
+        fprintf(stderr, "\nFrame server could not read all frames of the trajectory.\n");
+        return 2;
+    }
+    int end = *consumed == shared->produced;
+    uint64_t index = *consumed;
+    pthread_mutex_unlock(&shared->mutex);
+
+    if (end) return 1;
+
+    // the producer does not overwrite the slot until this consumer reads it
+    ring_slot_t *slot = ring_slot(ring, index);
+    vec_t *positions = slot_positions(slot);
+    const int *coordinates = slot_coordinates(slot, shared->n_atoms);
+
+    frame->step = slot->step;
+    frame->time = slot->time;
+    frame->precision = slot->precision;
+    memcpy(frame->box, slot->box, sizeof(box_t));
+    for (size_t i = 0; i < frame->n_atoms; ++i) {
+        const size_t id = frame->system_ids[i];
+        memcpy(frame->positions[i], positions[id], sizeof(vec_t));
+        memcpy(frame->coordinates + 3 * i, coordinates + 3 * id, 3 * sizeof(int));
+    }
+
+    ring_lock(shared);
+    ++*consumed;
+    ring_notify(&shared->producer_wakeup);
+    pthread_mutex_unlock(&shared->mutex);
+
+    return 0;
+}
+
+void ring_close(ring_t *ring)
+{
+    if (ring == NULL) return;
+
+    ring_shared_t *shared = ring->shared;
+    ring_lock(shared);
+    if (ring->producer) {
+        // wait until every consumer attaches and detaches (or terminates)
+        shared->finished = 1;
+        notify_consumers(shared);
+        for (uint64_t i = 0; i < shared->n_consumers; ++i) {
+            while (shared->consumed[i] != DETACHED) {
+                ring_wait(shared, &shared->producer_wakeup);
+                check_consumers(ring);
+            }
+        }
+    } else {
+        shared->consumed[ring->consumer] = DETACHED;
+        ring_notify(&shared->producer_wakeup);
+    }
+    pthread_mutex_unlock(&shared->mutex);
+
+    if (ring->producer) shm_unlink(ring->name);
+    munmap(ring->shared, ring->size);
+    free(ring);
+}
+
+void ring_fail(ring_t *ring)
+{
+    if (ring == NULL) return;
+
+    ring_lock(ring->shared);
+    ring->shared->failed = 1;
+    pthread_mutex_unlock(&ring->shared->mutex);
+
+    ring_close(ring);
+}
@@ -0,0 +1,115 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/types.h>
+#include "frame.h"
+
+// prefix of the trajectory name which makes the memdian programs read frames from a frame server
+#define RING_PREFIX "shm:"
+// maximal number of consumers reading frames from a single ring
+#define RING_MAX_CONSUMERS 64
+// maximal length of the name of the shared memory object (including the leading slash and the terminating zero)
+#define RING_NAME_LENGTH 256
+
+/*
+ * Shared part of a ring buffer of frames. Placed at the start of a POSIX shared memory object
+ * and followed by n_slots slots, each containing the header of a frame (ring_slot_t),
+ * the positions of all atoms and their fixed-point coordinates.
+ *
+ * The producer only overwrites a slot once every consumer has read it, so the slowest
+ * consumer throttles the producer.
+ *
+ * The mutex is robust and all processes wait on their own semaphores with a timeout, checking whether
+ * the other processes are still alive. (Process-shared condition variables can block forever once a waiting process dies.)
+ * A consumer that terminates without detaching is detached by the producer and consumers stop reading
+ * once the producer terminates, so no process waits for a dead one.
+ */
+typedef struct ring_shared {
+    char magic[8];
+    uint64_t n_atoms;           // number of atoms in every frame
+    uint64_t n_slots;
+    uint64_t n_consumers;       // number of consumers the producer waits for
+    uint64_t slot_size;         // size of a single slot in bytes
+    pthread_mutex_t mutex;      // process-shared and robust
+    sem_t producer_wakeup;      // posted whenever a frame is read or a consumer detaches
+    sem_t consumer_wakeups[RING_MAX_CONSUMERS];  // posted whenever a frame is published or the ring is finished
+    uint64_t produced;          // number of frames published so far
+    int finished;               // 1 if no more frames will be published
+    int failed;                 // 1 if the producer could not read all frames of the trajectory
+    uint64_t attached;          // number of consumers that have attached to the ring so far
+    uint64_t consumed[RING_MAX_CONSUMERS];  // number of frames read by every consumer (UINT64_MAX once detached)
+    pid_t producer_pid;         // process publishing the frames
+    pid_t consumer_pids[RING_MAX_CONSUMERS];  // processes of the attached consumers
+} ring_shared_t;
+
+/*
+ * Header of a frame stored in a slot of the ring.
+ */
+typedef struct ring_slot {
+    int step;
+    float time;
+    float precision;
+    box_t box;
+} ring_slot_t;
+
+/*
+ * Process-local handle of a ring buffer.
+ */
+typedef struct ring {
+    ring_shared_t *shared;
+    size_t size;                // size of the mapped memory
+    char name[RING_NAME_LENGTH];  // name of the shared memory object
+    int producer;               // 1 if this process publishes the frames
+    size_t consumer;            // index of the consumer (if not the producer)
+    time_t attach_deadline;     // time (CLOCK_MONOTONIC) after which the producer stops waiting for new consumers (0 = never)
+} ring_t;
+
+/*
+ * Creates a ring of frames with the specified number of slots in a new shared memory object.
+ * The name of the ring must not contain slashes (the shared memory object is called '/name').
+ * Consumers that do not attach within attach_timeout seconds are no longer waited for (0 = wait forever).
+ * A ring left behind by a producer that no longer runs is replaced.
+ * Returns NULL if the ring could not be created (e.g. if a ring with the same name is being served).
+ */
+ring_t *ring_create(const char *name, const size_t n_atoms, const size_t n_slots, const size_t n_consumers, const int attach_timeout);
+
+/*
+ * Attaches to an existing ring as a new consumer. Every consumer reads all frames of the ring from the start.
+ * Returns NULL if the ring does not exist or if all consumers have already attached.
+ */
+ring_t *ring_attach(const char *name);
+
+/*
+ * Publishes the frame (which must contain all atoms of the system) into the ring.
+ * Waits until the slowest consumer has read the frame previously stored in the slot.
+ */
+void ring_publish(ring_t *ring, const frame_t *frame);
+
+/*
+ * Reads the next frame from the ring into the frame (only the resident atoms are copied).
+ * Returns 0 if successful and 1 once all frames have been read. Returns 2 if the producer failed
+ * or terminated before publishing all frames (in that case, an error message is also printed).
+ */
+int ring_read(ring_t *ring, frame_t *frame);
+
+/*
+ * Closes the ring.
+ * The producer marks the end of the trajectory, waits until all consumers detach and removes the shared memory object.
+ * A consumer detaches, so that the producer no longer waits for it.
+ */
+void ring_close(ring_t *ring);
+
+/*
+ * Closes the ring after the producer failed to read the trajectory.
+ * Consumers stop reading with an error instead of reaching the end of the trajectory.
+ */
+void ring_fail(ring_t *ring);
+
+#endif /* RING_H */
@@ -0,0 +1,119 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#include "slab.h"
+
+slab_list_t *slab_list_create(const subset_t *atoms, const float half_height, const float skin, const int rebuild_freq)
+{
+    slab_list_t *list = calloc(1, sizeof(slab_list_t));
+    if (list == NULL) return NULL;
+
+    // atoms are identified by their index in the frame
+    size_t n_ids = 0;
+    for (size_t i = 0; i < atoms->n_atoms; ++i) {
+        if (atoms->ids[i] + 1 > n_ids) n_ids = atoms->ids[i] + 1;
+    }
+
+    list->candidates = malloc(sizeof(subset_t) + atoms->n_atoms * sizeof(size_t));
+    list->reference_z = malloc((atoms->n_atoms > 0 ? atoms->n_atoms : 1) * sizeof(float));
+    list->listed = calloc(n_ids > 0 ? n_ids : 1, sizeof(int));
+    if (list->candidates == NULL || list->reference_z == NULL || list->listed == NULL) {
+        free(list->candidates);
+        free(list->reference_z);
+        free(list->listed);
+        free(list);
+        return NULL;
+    }
+
+    list->atoms = atoms;
+    list->half_height = half_height;
+    list->skin = skin;
+    list->rebuild_freq = rebuild_freq;
+    list->since_rebuild = -1;
+    list->candidates->n_atoms = 0;
+    list->candidates->n_ranges = 0;
+
+    return list;
+}
+
+void slab_list_destroy(slab_list_t *list)
+{
+    if (list == NULL) return;
+
+    free(list->candidates);
+    free(list->reference_z);
+    free(list->listed);
+    free(list);
+}
+
+/*
+ * Returns the largest displacement of a listed atom along the z-axis since the last rebuild.
+ */
+static float max_displacement(const slab_list_t *list, const frame_t *frame)
+{
+    float max_dz = 0.0f;
+    const subset_t *candidates = list->candidates;
+    for (size_t i = 0; i < candidates->n_atoms; ++i) {
+        vec_t reference = { 0.0f, 0.0f, list->reference_z[i] };
+        const float dz = fabsf(distance1D(frame->positions[candidates->ids[i]], reference, z, frame->box));
+        if (dz > max_dz) max_dz = dz;
+    }
+
+    return max_dz;
+}
+
+const subset_t *slab_list_update(slab_list_t *list, const frame_t *frame, const vec_t center)
+{
+    // atoms outside the list could not have reached the slab yet
+    if (list->since_rebuild >= 0 && list->since_rebuild < list->rebuild_freq &&
+        fabsf(distance1D(center, list->center, z, frame->box)) + max_displacement(list, frame) <= list->skin / 2) {
+            ++list->since_rebuild;
+            return list->candidates;
+        }
+
+    // rebuild the list (contiguous ranges of atoms are streamed directly)
+    // atoms inside the slab that were not in the previous list may have been missed since the last rebuild
+    const float limit = list->half_height + list->skin;
+    const int previous = list->n_rebuilds;
+    const int current = ++list->n_rebuilds;
+    const subset_t *atoms = list->atoms;
+    size_t n_candidates = 0, n_missed = 0;
+    if (atoms->n_ranges > 0) {
+        for (size_t r = 0; r < atoms->n_ranges; ++r) {
+            for (size_t id = atoms->ranges[r].start; id < atoms->ranges[r].start + atoms->ranges[r].n_atoms; ++id) {
+                const float dz = fabsf(distance1D(frame->positions[id], center, z, frame->box));
+                if (dz <= limit) {
+                    n_missed += dz <= list->half_height && list->listed[id] != previous;
+                    list->listed[id] = current;
+                    list->reference_z[n_candidates] = frame->positions[id][2];
+                    list->candidates->ids[n_candidates++] = id;
+                }
+            }
+        }
+    } else {
+        for (size_t i = 0; i < atoms->n_atoms; ++i) {
+            const size_t id = atoms->ids[i];
+            const float dz = fabsf(distance1D(frame->positions[id], center, z, frame->box));
+            if (dz <= limit) {
+                n_missed += dz <= list->half_height && list->listed[id] != previous;
+                list->listed[id] = current;
+                list->reference_z[n_candidates] = frame->positions[id][2];
+                list->candidates->ids[n_candidates++] = id;
+            }
+        }
+    }
+
+    // nothing could have been missed if there was no previous list or it was built in the previous frame
+    if (list->since_rebuild <= 1) n_missed = 0;
+    list->n_missed += n_missed;
+
+    list->candidates->n_atoms = n_candidates;
+    subset_find_ranges(list->candidates);
+    memcpy(list->center, center, sizeof(vec_t));
+    list->since_rebuild = 1;
+
+    // the atoms may have been missed in the frames since the previous rebuild
+    if (n_missed > 0) return NULL;
+
+    return list->candidates;
+}
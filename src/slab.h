@@ -0,0 +1,53 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include "frame.h"
+
+/*
+ * Verlet-style list of atoms located close to a slab centered at the membrane center.
+ * Only the atoms in the list have to be tested against the slab in every frame.
+ *
+ * The list contains all atoms closer than half of the slab height plus skin to the membrane center (along z).
+ * The z-coordinates of the listed atoms are stored at every rebuild. The list is rebuilt once the largest
+ * displacement of a listed atom along z plus the displacement of the membrane center could exceed half of the skin
+ * (the listed atoms bound the displacements of the atoms outside the list, which move the same way)
+ * and at the latest after 'rebuild_freq' frames.
+ *
+ * Every rebuild checks that no atom located inside the slab was missing from the previous list.
+ * Such an atom may have been missed in the preceding frames and the list can no longer be trusted.
+ */
+typedef struct slab_list {
+    const subset_t *atoms;      // all atoms that can be located in the slab
+    float half_height;          // half of the height of the slab
+    float skin;                 // additional distance covered by the list
+    int rebuild_freq;           // maximal number of frames between two rebuilds
+    int since_rebuild;          // number of frames since the last rebuild (-1 if the list has not been built yet)
+    vec_t center;               // membrane center at the last rebuild
+    subset_t *candidates;       // atoms close to the slab
+    float *reference_z;         // z-coordinate of every candidate at the last rebuild
+    int *listed;                // for every atom, index of the last rebuild that put it into the list
+    int n_rebuilds;             // number of rebuilds performed so far
+    size_t n_missed;            // number of atoms found inside the slab that were not in the previous list
+} slab_list_t;
+
+/*
+ * Prepares a list of atoms close to the slab.
+ * Returns NULL if the memory could not be allocated.
+ */
+slab_list_t *slab_list_create(const subset_t *atoms, const float half_height, const float skin, const int rebuild_freq);
+
+/*
+ * Frees all memory associated with the list. Does not free the subset of all atoms.
+ */
+void slab_list_destroy(slab_list_t *list);
+
+/*
+ * Rebuilds the list if needed and returns the atoms that must be tested against the slab in this frame.
+ * Returns NULL if an atom has entered the slab without being in the list (the skin is too small).
+ */
+const subset_t *slab_list_update(slab_list_t *list, const frame_t *frame, const vec_t center);
+
+#endif /* SLAB_H */
@@ -0,0 +1,47 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#include "species.h"
+
+species_t *species_create(const system_t *system, const frame_t *frame, const subset_t *subset)
+{
+    species_t *species = calloc(1, sizeof(species_t));
+    if (species == NULL) return NULL;
+
+    species->of_atom = calloc(frame->n_atoms, sizeof(uint8_t));
+    if (species->of_atom == NULL) {
+        free(species);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < subset->n_atoms; ++i) {
+        const size_t id = subset->ids[i];
+        const char *name = system->atoms[frame->system_ids[id]].residue_name;
+
+        size_t s = 0;
+        while (s < species->n_species && strncmp(species->names[s], name, sizeof(species->names[s]) - 1) != 0) ++s;
+
+        // new species
+        if (s == species->n_species) {
+            if (species->n_species == SPECIES_MAX) {
+                species_destroy(species);
+                return NULL;
+            }
+
+            strncpy(species->names[s], name, sizeof(species->names[s]) - 1);
+            ++species->n_species;
+        }
+
+        species->of_atom[id] = (uint8_t) s;
+    }
+
+    return species;
+}
+
+void species_destroy(species_t *species)
+{
+    if (species == NULL) return;
+
+    free(species->of_atom);
+    free(species);
+}
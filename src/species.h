@@ -0,0 +1,36 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#ifndef SPECIES_H
+#define SPECIES_H
+
+#include <stdint.h>
+#include <groan.h>
+#include "frame.h"
+
+// maximal number of species into which a subset can be split
+#define SPECIES_MAX 64
+
+/*
+ * Split of a subset of atoms into species identified by residue names (e.g. lipid types).
+ * The species of every atom is looked up directly using its index in the frame.
+ */
+typedef struct species {
+    size_t n_species;
+    char names[SPECIES_MAX][8];     // residue name of every species (in the order of the first occurrence)
+    uint8_t *of_atom;               // species of every resident atom of the frame (only valid for atoms of the subset)
+} species_t;
+
+/*
+ * Splits the atoms of a subset into species according to their residue names in the system.
+ * Must be called before the system is freed.
+ * Returns NULL if the memory could not be allocated or if there are more than SPECIES_MAX species.
+ */
+species_t *species_create(const system_t *system, const frame_t *frame, const subset_t *subset);
+
+/*
+ * Frees all memory associated with the species.
+ */
+void species_destroy(species_t *species);
+
+#endif /* SPECIES_H */
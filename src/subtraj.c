@@ -0,0 +1,520 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#include <stdio.h>
+#include <unistd.h>
+#include <groan.h>
+#include "frame.h"
+#include "xtc.h"
+
+const char VERSION[] = "v2023/09/01";
+
+// frequency of printing during the calculation
+const int PROGRESS_FREQ = 10000;
+// maximal number of extracted selections
+#define MAX_SELECTIONS 32
+
+/*
+ * Parses command line arguments.
+ * Returns zero, if parsing has been successful. Else returns non-zero.
+ */
+int get_arguments(
+        int argc,
+        char **argv,
+        char **gro_file,
+        char **xtc_file,
+        char **ndx_file,
+        char **output_pattern,
+        char **selections,
+        size_t *n_selections,
+        char **lipids,
+        char **slab_atoms,
+        float *height)
+{
+    int gro_specified = 0, xtc_specified = 0;
+
+    int opt = 0;
+    while((opt = getopt(argc, argv, "c:f:n:o:s:l:w:e:h")) != -1) {
+        switch (opt) {
+        // help
+        case 'h':
+            return 1;
+        // gro file to read
+        case 'c':
+            *gro_file = optarg;
+            gro_specified = 1;
+            break;
+        // xtc file to read
+        case 'f':
+            *xtc_file = optarg;
+            xtc_specified = 1;
+            break;
+        // ndx file to read
+        case 'n':
+            *ndx_file = optarg;
+            break;
+        // pattern for the output files
+        case 'o':
+            *output_pattern = optarg;
+            break;
+        // specification of the extracted atoms
+        case 's':
+            if (*n_selections >= MAX_SELECTIONS) {
+                fprintf(stderr, "At most %d selections can be extracted.\n", MAX_SELECTIONS);
+                return 1;
+            }
+            selections[(*n_selections)++] = optarg;
+            break;
+        // specification of the lipids
+        case 'l':
+            *lipids = optarg;
+            break;
+        // specification of the atoms extracted only inside the membrane slab
+        case 'w':
+            *slab_atoms = optarg;
+            break;
+        // height of the membrane slab
+        case 'e':
+            *height = atof(optarg);
+            if (*height <= 0) {
+                fprintf(stderr, "Slab height must be >0, not %f.\n", *height);
+                return 1;
+            }
+            break;
+        default:
+            //fprintf(stderr, "Unknown command line option: %c.\n", opt);
+            return 1;
+        }
+    }
+
+    if (!gro_specified || !xtc_specified) {
+        fprintf(stderr, "Gro file and xtc file must always be supplied.\n");
+        return 1;
+    }
+
+    if (*n_selections == 0 && *slab_atoms == NULL) {
+        fprintf(stderr, "At least one selection to extract must be supplied.\n");
+        return 1;
+    }
+    return 0;
+}
+
+void print_usage(const char *program_name)
+{
+    printf("Usage: %s -c GRO_FILE -f XTC_FILE -s SELECTION [OPTION]...\n", program_name);
+    printf("\nOPTIONS\n");
+    printf("-h               print this message and exit\n");
+    printf("-c STRING        gro file to read\n");
+    printf("-f STRING        xtc file to read (\"-\" for standard input)\n");
+    printf("-n STRING        ndx file to read (optional, default: index.ndx)\n");
+    printf("-o STRING        pattern for the output files (default: subset)\n");
+    printf("-s STRING        specification of atoms to extract (can be used multiple times)\n");
+    printf("-w STRING        specification of atoms to extract if they are ever located\n");
+    printf("                 inside the membrane slab (optional)\n");
+    printf("-l STRING        specification of membrane lipids (default: Membrane)\n");
+    printf("-e FLOAT         height of the membrane slab (default: 4 nm)\n");
+    printf("\n");
+}
+
+/*
+ * Prints parameters that the program will use for the extraction.
+ */
+void print_arguments(
+        FILE *stream,
+        const char *gro_file,
+        const char *xtc_file,
+        const char *ndx_file,
+        const char *output_pattern,
+        char **selections,
+        const size_t n_selections,
+        const char *lipids,
+        const char *slab_atoms,
+        const float height)
+{
+    fprintf(stream, "Parameters for Trajectory Extraction:\n");
+    fprintf(stream, ">>> gro file:         %s\n", gro_file);
+    fprintf(stream, ">>> xtc file:         %s\n", xtc_file);
+    fprintf(stream, ">>> ndx file:         %s\n", ndx_file);
+    fprintf(stream, ">>> output files:     %s.gro, %s.xtc, %s.ndx\n", output_pattern, output_pattern, output_pattern);
+    for (size_t i = 0; i < n_selections; ++i) {
+        fprintf(stream, ">>> selection:        %s\n", selections[i]);
+    }
+    if (slab_atoms != NULL) {
+        fprintf(stream, ">>> slab atoms:       %s\n", slab_atoms);
+        fprintf(stream, ">>> lipids:           %s\n", lipids);
+        fprintf(stream, ">>> slab height:      %f\n", height);
+    }
+    fprintf(stream, "\n");
+}
+
+/*
+ * Finds atoms of the slab subset that are located inside the membrane slab in at least one frame.
+ * Marks these atoms in 'inside' (indexed by frame atoms).
+ * Reads all remaining frames of the trajectory.
+ * Returns zero, if the whole trajectory was read. Else returns non-zero.
+ */
+static int find_slab_atoms(
+        xtc_reader_t *xtc,
+        frame_t *frame,
+        const subset_t *membrane_subset,
+        const subset_t *slab_subset,
+        const float half_height,
+        unsigned char *inside)
+{
+    printf("Searching for atoms inside the membrane slab...\n");
+    int status = 0;
+    while ((status = xtc_read_frame(xtc, frame)) == 0) {
+        // print info about the progress of reading
+        if ((int) frame->time % PROGRESS_FREQ == 0) {
+            printf("Step: %d. Time: %.0f ps\r", frame->step, frame->time);
+            fflush(stdout);
+        }
+
+        vec_t center_mem = {0};
+        subset_center_of_geometry(frame, membrane_subset, center_mem);
+
+        for (size_t i = 0; i < slab_subset->n_atoms; ++i) {
+            size_t id = slab_subset->ids[i];
+            if (fabsf(distance1D(frame->positions[id], center_mem, z, frame->box)) <= half_height) inside[id] = 1;
+        }
+    }
+    printf("\n");
+
+    return status == 2;
+}
+
+/*
+ * Writes the extracted atoms into a gro file.
+ * The atoms are renumbered from 1.
+ */
+static void write_subset_gro(FILE *output, const char *gro_file, const system_t *system, const size_t *system_ids, const size_t n_atoms)
+{
+    fprintf(output, "Extracted with subtraj %s from %s\n", VERSION, gro_file);
+    fprintf(output, "%zu\n", n_atoms);
+    for (size_t i = 0; i < n_atoms; ++i) {
+        const atom_t *atom = &system->atoms[system_ids[i]];
+        fprintf(output, "%5d%-5s%5s%5d%8.3f%8.3f%8.3f\n",
+                (int) (atom->residue_number % 100000),
+                atom->residue_name,
+                atom->atom_name,
+                (int) ((i + 1) % 100000),
+                atom->position[0], atom->position[1], atom->position[2]);
+    }
+    fprintf(output, "%10.5f%10.5f%10.5f\n", system->box[0], system->box[1], system->box[2]);
+}
+
+/*
+ * Rewrites the groups of the original ndx file so that they refer to the extracted atoms.
+ * Atoms that were not extracted are dropped from the groups. Empty groups are not written.
+ * map[i] is the new (1-based) number of the i-th atom of the original system or 0, if the atom was not extracted.
+ */
+static void write_subset_ndx(FILE *input, FILE *output, const size_t *map, const size_t n_system_atoms)
+{
+    char line[1024];
+    char group[1024] = "";
+    size_t *members = NULL;
+    size_t n_members = 0, allocated = 0;
+    int in_group = 0;
+
+    for (;;) {
+        int eof = fgets(line, sizeof(line), input) == NULL;
+        char name[1024] = "";
+
+        if (eof || sscanf(line, " [ %1023[^]] ]", name) == 1) {
+            // write the previous group
+            if (in_group && n_members > 0) {
+                fprintf(output, "[ %s ]\n", group);
+                for (size_t i = 0; i < n_members; ++i) {
+                    fprintf(output, "%zu%c", members[i], (i + 1) % 15 == 0 || i + 1 == n_members ? '\n' : ' ');
+                }
+            }
+            if (eof) break;
+
+            // remove trailing whitespace from the group name
+            size_t len = strlen(name);
+            while (len > 0 && (name[len - 1] == ' ' || name[len - 1] == '\t')) name[--len] = '\0';
+            strcpy(group, name);
+            n_members = 0;
+            in_group = 1;
+            continue;
+        }
+
+        if (!in_group) continue;
+
+        char *token = strtok(line, " \t\n");
+        while (token != NULL) {
+            size_t number = strtoul(token, NULL, 10);
+            token = strtok(NULL, " \t\n");
+            if (number == 0 || number > n_system_atoms || map[number - 1] == 0) continue;
+
+            if (n_members >= allocated) {
+                allocated = allocated == 0 ? 1024 : allocated * 2;
+                size_t *new_members = realloc(members, allocated * sizeof(size_t));
+                if (new_members == NULL) {
+                    fprintf(stderr, "Could not allocate memory.\n");
+                    free(members);
+                    return;
+                }
+                members = new_members;
+            }
+            members[n_members++] = map[number - 1];
+        }
+    }
+
+    free(members);
+}
+
+int main(int argc, char **argv)
+{
+    printf("\n");
+    // get command line arguments
+    char *gro_file = NULL;
+    char *xtc_file = NULL;
+    char *ndx_file = "index.ndx";
+    char *output_pattern = "subset";
+    char *selections[MAX_SELECTIONS] = {NULL};
+    size_t n_selections = 0;
+    char *lipids = "Membrane";
+    char *slab_atoms = NULL;
+    float height = 4.0f;
+    if (get_arguments(argc, argv, &gro_file, &xtc_file, &ndx_file, &output_pattern, selections, &n_selections, &lipids, &slab_atoms, &height) != 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    // get the names of the output files
+    char *output_gro = calloc(strlen(output_pattern) + 5, 1);
+    char *output_xtc = calloc(strlen(output_pattern) + 5, 1);
+    char *output_ndx = calloc(strlen(output_pattern) + 5, 1);
+
+    sprintf(output_gro, "%s.gro", output_pattern);
+    sprintf(output_xtc, "%s.xtc", output_pattern);
+    sprintf(output_ndx, "%s.ndx", output_pattern);
+
+    print_arguments(stdout, gro_file, xtc_file, ndx_file, output_pattern, selections, n_selections, lipids, slab_atoms, height);
+
+    // read gro file
+    system_t *system = load_gro(gro_file);
+    if (system == NULL) {
+        free(output_gro);
+        free(output_xtc);
+        free(output_ndx);
+        return 1;
+    }
+
+    // searching for the slab atoms requires an additional pass through the trajectory
+    if (slab_atoms != NULL && xtc_is_stream(xtc_file)) {
+        fprintf(stderr, "Option -w can not be used when reading the trajectory from a pipe.\n");
+        free(system);
+        free(output_gro);
+        free(output_xtc);
+        free(output_ndx);
+        return 1;
+    }
+
+    // open xtc file for reading
+    xtc_reader_t *xtc = xtc_open(xtc_file);
+    if (xtc == NULL) {
+        fprintf(stderr, "File %s could not be read as an xtc file.\n", xtc_file);
+        free(system);
+        free(output_gro);
+        free(output_xtc);
+        free(output_ndx);
+        return 1;
+    }
+
+    // check that the gro file and the xtc file match each other
+    int xtc_atoms = 0;
+    if (xtc_peek_atoms(xtc, &xtc_atoms) != 0 || (size_t) xtc_atoms != system->n_atoms) {
+        fprintf(stderr, "Number of atoms in %s does not match %s.\n", xtc_file, gro_file);
+        xtc_close(xtc);
+        free(system);
+        free(output_gro);
+        free(output_xtc);
+        free(output_ndx);
+        return 1;
+    }
+
+    // read ndx file
+    dict_t *ndx_groups = read_ndx(ndx_file, system);
+
+    // select all atoms
+    atom_selection_t *all = select_system(system);
+
+    // the extracted selections are followed by the slab atoms and lipids
+    atom_selection_t *atoms[MAX_SELECTIONS + 2] = {NULL};
+    size_t n_atom_selections = n_selections + (slab_atoms != NULL ? 2 : 0);
+    int return_code = 0;
+
+    for (size_t i = 0; i < n_atom_selections; ++i) {
+        const char *query = i < n_selections ? selections[i] : (i == n_selections ? slab_atoms : lipids);
+        atoms[i] = smart_select(all, query, ndx_groups);
+        if (atoms[i] == NULL || atoms[i]->n_atoms == 0) {
+            fprintf(stderr, "No atoms detected for selection '%s'.\n", query);
+            return_code = 1;
+        }
+    }
+
+    if (return_code != 0) {
+        xtc_close(xtc);
+        dict_destroy(ndx_groups);
+        free(all);
+        for (size_t i = 0; i < n_atom_selections; ++i) free(atoms[i]);
+        free(system);
+        free(output_gro);
+        free(output_xtc);
+        free(output_ndx);
+        return 1;
+    }
+
+    subset_t *subsets[MAX_SELECTIONS + 2] = {NULL};
+    frame_t *frame = frame_create(system, atoms, n_atom_selections, subsets);
+
+    dict_destroy(ndx_groups);
+    free(all);
+    for (size_t i = 0; i < n_atom_selections; ++i) free(atoms[i]);
+
+    // extract[i] is non-zero if the i-th frame atom will be written into the output
+    unsigned char *extract = frame == NULL ? NULL : calloc(frame->n_atoms, 1);
+    if (extract == NULL) {
+        fprintf(stderr, "Could not allocate memory.\n");
+        xtc_close(xtc);
+        frame_destroy(frame);
+        for (size_t i = 0; i < n_atom_selections; ++i) free(subsets[i]);
+        free(system);
+        free(output_gro);
+        free(output_xtc);
+        free(output_ndx);
+        return 1;
+    }
+
+    for (size_t s = 0; s < n_selections; ++s) {
+        for (size_t i = 0; i < subsets[s]->n_atoms; ++i) extract[subsets[s]->ids[i]] = 1;
+    }
+
+    // the slab atoms are only extracted if they enter the membrane slab in any frame
+    // (the trajectory is then read again from the start for the extraction)
+    if (slab_atoms != NULL) {
+        if (find_slab_atoms(xtc, frame, subsets[n_selections + 1], subsets[n_selections], height / 2, extract) != 0) {
+            fprintf(stderr, "Could not search the whole trajectory for atoms inside the membrane slab.\n");
+            return_code = 1;
+            goto function_end;
+        }
+        xtc_close(xtc);
+
+        xtc = xtc_open(xtc_file);
+        if (xtc == NULL) {
+            fprintf(stderr, "File %s could not be read as an xtc file.\n", xtc_file);
+            return_code = 1;
+            goto function_end;
+        }
+    }
+
+    size_t n_extracted = 0;
+    for (size_t i = 0; i < frame->n_atoms; ++i) n_extracted += extract[i];
+
+    // prepare the list of extracted atoms
+    size_t *extracted_ids = malloc(n_extracted * sizeof(size_t));
+    size_t *system_ids = malloc(n_extracted * sizeof(size_t));
+    rvec *coordinates = malloc(n_extracted * sizeof(rvec));
+    size_t *map = calloc(frame->n_system_atoms, sizeof(size_t));
+    if (extracted_ids == NULL || system_ids == NULL || coordinates == NULL || map == NULL) {
+        fprintf(stderr, "Could not allocate memory.\n");
+        free(extracted_ids);
+        free(system_ids);
+        free(coordinates);
+        free(map);
+        return_code = 1;
+        goto function_end;
+    }
+
+    for (size_t i = 0, j = 0; i < frame->n_atoms; ++i) {
+        if (!extract[i]) continue;
+        extracted_ids[j] = i;
+        system_ids[j] = frame->system_ids[i];
+        map[frame->system_ids[i]] = ++j;
+    }
+
+    // write reduced topology
+    FILE *gro = fopen(output_gro, "w");
+    if (gro == NULL) {
+        fprintf(stderr, "Output file '%s' could not be opened.\n", output_gro);
+        return_code = 1;
+        goto extraction_end;
+    }
+    write_subset_gro(gro, gro_file, system, system_ids, n_extracted);
+    fclose(gro);
+
+    FILE *ndx_input = fopen(ndx_file, "r");
+    if (ndx_input != NULL) {
+        FILE *ndx = fopen(output_ndx, "w");
+        if (ndx == NULL) {
+            fprintf(stderr, "Output file '%s' could not be opened.\n", output_ndx);
+            fclose(ndx_input);
+            return_code = 1;
+            goto extraction_end;
+        }
+        write_subset_ndx(ndx_input, ndx, map, frame->n_system_atoms);
+        fclose(ndx);
+        fclose(ndx_input);
+    }
+
+    // extract the trajectory
+    XDRFILE *output = xdrfile_open(output_xtc, "w");
+    if (output == NULL) {
+        fprintf(stderr, "Output file '%s' could not be opened.\n", output_xtc);
+        return_code = 1;
+        goto extraction_end;
+    }
+
+    size_t n_frames = 0;
+    int status = 0;
+    while ((status = xtc_read_frame(xtc, frame)) == 0) {
+        // print info about the progress of reading
+        if ((int) frame->time % PROGRESS_FREQ == 0) {
+            printf("Step: %d. Time: %.0f ps\r", frame->step, frame->time);
+            fflush(stdout);
+        }
+
+        for (size_t i = 0; i < n_extracted; ++i) {
+            memcpy(coordinates[i], frame->positions[extracted_ids[i]], sizeof(rvec));
+        }
+
+        matrix box = {{frame->box[0], 0.0f, 0.0f}, {0.0f, frame->box[1], 0.0f}, {0.0f, 0.0f, frame->box[2]}};
+        // keep the precision of the input trajectory so that no further information is lost
+        float precision = frame->precision > 0.0f ? frame->precision : 1000.0f;
+        if (write_xtc(output, (int) n_extracted, frame->step, frame->time, box, coordinates, precision) != 0) {
+            fprintf(stderr, "\nCould not write frame into '%s'.\n", output_xtc);
+            return_code = 1;
+            break;
+        }
+        ++n_frames;
+    }
+
+    if (status == 2) {
+        fprintf(stderr, "Could not read the whole trajectory, '%s' is incomplete.\n", output_xtc);
+        return_code = 1;
+    }
+
+    printf("\nExtracted %zu atoms from %zu frames.\n", n_extracted, n_frames);
+
+    xdrfile_close(output);
+
+    extraction_end:
+    free(extracted_ids);
+    free(system_ids);
+    free(coordinates);
+    free(map);
+
+    function_end:
+    xtc_close(xtc);
+    frame_destroy(frame);
+    for (size_t i = 0; i < n_atom_selections; ++i) free(subsets[i]);
+    free(extract);
+    free(system);
+    free(output_gro);
+    free(output_xtc);
+    free(output_ndx);
+
+    return return_code;
+}
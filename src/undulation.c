@@ -0,0 +1,232 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#include "undulation.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+undulation_t *undulation_create(const size_t n)
+{
+    undulation_t *undulation = calloc(1, sizeof(undulation_t));
+    if (undulation == NULL) return NULL;
+
+    const size_t n_cells = n * n;
+    undulation->n = n;
+    undulation->plan = fft_plan_create(n);
+    for (int i = 0; i < 2; ++i) {
+        undulation->sum_z[i] = malloc(n_cells * sizeof(double));
+        undulation->count[i] = malloc(n_cells * sizeof(uint32_t));
+    }
+    undulation->re = malloc(n_cells * sizeof(double));
+    undulation->im = malloc(n_cells * sizeof(double));
+    undulation->q = calloc(n_cells, sizeof(double));
+    for (int i = 0; i < 3; ++i) undulation->spectrum[i] = calloc(n_cells, sizeof(double));
+
+    if (undulation->plan == NULL ||
+        undulation->sum_z[0] == NULL || undulation->sum_z[1] == NULL ||
+        undulation->count[0] == NULL || undulation->count[1] == NULL ||
+        undulation->re == NULL || undulation->im == NULL || undulation->q == NULL ||
+        undulation->spectrum[0] == NULL || undulation->spectrum[1] == NULL || undulation->spectrum[2] == NULL) {
+            undulation_destroy(undulation);
+            return NULL;
+        }
+
+    return undulation;
+}
+
+void undulation_destroy(undulation_t *undulation)
+{
+    if (undulation == NULL) return;
+
+    fft_plan_destroy(undulation->plan);
+    for (int i = 0; i < 2; ++i) {
+        free(undulation->sum_z[i]);
+        free(undulation->count[i]);
+    }
+    free(undulation->re);
+    free(undulation->im);
+    free(undulation->q);
+    for (int i = 0; i < 3; ++i) free(undulation->spectrum[i]);
+    free(undulation);
+}
+
+/*
+ * Returns the index of the cell along an axis periodic in the box.
+ */
+static inline size_t periodic_cell(const float coordinate, const float box, const size_t n)
+{
+    float wrapped = coordinate - box * floorf(coordinate / box);
+    size_t index = (size_t) (wrapped / box * n);
+    return index >= n ? n - 1 : index;
+}
+
+/*
+ * Adds a phosphate to the cell of the height field of its leaflet.
+ */
+static inline void add_phosphate(undulation_t *undulation, const frame_t *frame, const size_t id, const vec_t center)
+{
+    const float *position = frame->positions[id];
+    const float rel_pos_z = distance1D(position, center, z, frame->box);
+    const int leaflet = rel_pos_z > 0 ? 0 : 1;
+
+    const size_t n = undulation->n;
+    const size_t cell = periodic_cell(position[1], frame->box[1], n) * n + periodic_cell(position[0], frame->box[0], n);
+    undulation->sum_z[leaflet][cell] += rel_pos_z;
+    ++undulation->count[leaflet][cell];
+}
+
+/*
+ * Returns the wave number (in units of 2 pi / box) of a row or column of the transformed grid.
+ */
+static inline int wave_number(const size_t index, const size_t n)
+{
+    return index <= n / 2 ? (int) index : (int) index - (int) n;
+}
+
+void undulation_add_frame(undulation_t *undulation, const frame_t *frame, const subset_t *phosphates, const vec_t center)
+{
+    const size_t n = undulation->n;
+    const size_t n_cells = n * n;
+
+    for (int i = 0; i < 2; ++i) {
+        memset(undulation->sum_z[i], 0, n_cells * sizeof(double));
+        memset(undulation->count[i], 0, n_cells * sizeof(uint32_t));
+    }
+
+    // contiguous ranges of phosphates are streamed directly
+    if (phosphates->n_ranges > 0) {
+        for (size_t r = 0; r < phosphates->n_ranges; ++r) {
+            for (size_t id = phosphates->ranges[r].start; id < phosphates->ranges[r].start + phosphates->ranges[r].n_atoms; ++id) {
+                add_phosphate(undulation, frame, id, center);
+            }
+        }
+    } else {
+        for (size_t i = 0; i < phosphates->n_atoms; ++i) add_phosphate(undulation, frame, phosphates->ids[i], center);
+    }
+
+    // height fields relative to the average position of the leaflet
+    // (empty cells are placed at the average position)
+    double *fields[2] = { undulation->re, undulation->im };
+    for (int leaflet = 0; leaflet < 2; ++leaflet) {
+        double sum = 0.0;
+        size_t count = 0;
+        for (size_t c = 0; c < n_cells; ++c) {
+            sum += undulation->sum_z[leaflet][c];
+            count += undulation->count[leaflet][c];
+        }
+        const double average = count == 0 ? 0.0 : sum / count;
+
+        for (size_t c = 0; c < n_cells; ++c) {
+            const uint32_t cell_count = undulation->count[leaflet][c];
+            fields[leaflet][c] = cell_count == 0 ? 0.0 : undulation->sum_z[leaflet][c] / cell_count - average;
+        }
+    }
+
+    // both real fields are transformed at once
+    fft_2d(undulation->plan, undulation->re, undulation->im);
+
+    // h(q) = FFT / n_cells, so A |h(q)|^2 = A |FFT|^2 / n_cells^2
+    const double area = (double) frame->box[0] * frame->box[1];
+    const double norm = area / ((double) n_cells * n_cells);
+    for (size_t index = 0; index < n_cells; ++index) {
+        const double qx = 2 * M_PI * wave_number(index % n, n) / frame->box[0];
+        const double qy = 2 * M_PI * wave_number(index / n, n) / frame->box[1];
+
+        double upper[2] = {0.0}, lower[2] = {0.0};
+        fft_split_pair(undulation->plan, undulation->re, undulation->im, index, upper, lower);
+        const double membrane[2] = { (upper[0] + lower[0]) / 2, (upper[1] + lower[1]) / 2 };
+
+        undulation->q[index] += sqrt(qx * qx + qy * qy);
+        undulation->spectrum[0][index] += norm * (membrane[0] * membrane[0] + membrane[1] * membrane[1]);
+        undulation->spectrum[1][index] += norm * (upper[0] * upper[0] + upper[1] * upper[1]);
+        undulation->spectrum[2][index] += norm * (lower[0] * lower[0] + lower[1] * lower[1]);
+    }
+
+    ++undulation->n_frames;
+}
+
+void undulation_merge(undulation_t *target, const undulation_t *source)
+{
+    const size_t n_cells = target->n * target->n;
+    for (size_t index = 0; index < n_cells; ++index) {
+        target->q[index] += source->q[index];
+        for (int i = 0; i < 3; ++i) target->spectrum[i][index] += source->spectrum[i][index];
+    }
+
+    target->n_frames += source->n_frames;
+}
+
+/*
+ * Returns 1 if the mode is used in the spectrum.
+ * The constant mode and the modes at the Nyquist frequency (which can not be resolved by the height fields) are skipped.
+ */
+static inline int mode_used(const size_t index, const size_t n)
+{
+    const int wave_x = wave_number(index % n, n);
+    const int wave_y = wave_number(index / n, n);
+    return (wave_x != 0 || wave_y != 0) && abs(wave_x) * 2 != (int) n && abs(wave_y) * 2 != (int) n;
+}
+
+int undulation_write(const undulation_t *undulation, FILE *output, const char *program, int argc, char **argv, double *kappa)
+{
+    const size_t n = undulation->n;
+    const double n_frames = undulation->n_frames;
+    *kappa = NAN;
+
+    // modes are averaged in shells with the width of the smallest wave vector
+    double *shells[5] = { NULL };
+    for (int i = 0; i < 5; ++i) shells[i] = calloc(n + 1, sizeof(double));
+    if (shells[0] == NULL || shells[1] == NULL || shells[2] == NULL || shells[3] == NULL || shells[4] == NULL) {
+        for (int i = 0; i < 5; ++i) free(shells[i]);
+        return 1;
+    }
+
+    double width = INFINITY;
+    if (n_frames > 0 && n > 1) width = fmin(undulation->q[1], undulation->q[n]) / n_frames;
+
+    double inverse_kappa = 0.0;
+    size_t n_fitted = 0;
+    for (size_t index = 0; n_frames > 0 && index < n * n; ++index) {
+        if (!mode_used(index, n)) continue;
+
+        const double q = undulation->q[index] / n_frames;
+        size_t shell = (size_t) lround(q / width);
+        if (shell > n) shell = n;
+
+        shells[0][shell] += q;
+        for (int i = 0; i < 3; ++i) shells[1 + i][shell] += undulation->spectrum[i][index] / n_frames;
+        shells[4][shell] += 1;
+
+        // <A |h(q)|^2> = kT / (kappa q^4)
+        if (q < UNDULATION_Q_MAX) {
+            inverse_kappa += q * q * q * q * undulation->spectrum[0][index] / n_frames;
+            ++n_fitted;
+        }
+    }
+
+    if (n_fitted > 0 && inverse_kappa > 0) *kappa = n_fitted / inverse_kappa;
+
+    fprintf(output, "# Generated with %s\n", program);
+    fprintf(output, "# Command line: ");
+    for (int i = 0; i < argc; ++i) fprintf(output, "%s ", argv[i]);
+    fprintf(output, "\n# Undulation spectrum from %zux%zu height fields of the leaflets (%zu frames), averaged over modes with similar q.\n", n, n, undulation->n_frames);
+    fprintf(output, "# The membrane surface is the average of both leaflets; kappa = kT / (q^4 <A |h(q)|^2>).\n");
+    fprintf(output, "# q [nm^-1] membrane [nm^4] upper [nm^4] lower [nm^4] kappa [kT] modes\n");
+
+    for (size_t shell = 0; shell <= n; ++shell) {
+        const double n_modes = shells[4][shell];
+        if (n_modes == 0) continue;
+
+        const double q = shells[0][shell] / n_modes;
+        const double membrane = shells[1][shell] / n_modes;
+        fprintf(output, "%f %.6e %.6e %.6e %.4f %.0f\n", q, membrane, shells[2][shell] / n_modes, shells[3][shell] / n_modes,
+                1.0 / (q * q * q * q * membrane), n_modes);
+    }
+
+    fprintf(output, "# Bending modulus (q < %.2f nm^-1): %.4f kT\n", UNDULATION_Q_MAX, *kappa);
+
+    for (int i = 0; i < 5; ++i) free(shells[i]);
+    return ferror(output);
+}
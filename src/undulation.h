@@ -0,0 +1,65 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#ifndef UNDULATION_H
+#define UNDULATION_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <groan.h>
+#include "frame.h"
+#include "fft.h"
+
+// maximal magnitude of the wave vector used to estimate the bending modulus [nm^-1]
+#define UNDULATION_Q_MAX 1.0
+
+/*
+ * Spectrum of membrane undulations accumulated over the trajectory.
+ *
+ * In every frame, the phosphates of each leaflet are binned into a coarse n x n height field covering the whole box,
+ * both fields are transformed using a single complex FFT and A |h(q)|^2 is summed for every mode
+ * (A is the area of the box and h(q) the Fourier coefficient of the height field).
+ * The membrane surface is the average of the upper and the lower leaflet.
+ */
+typedef struct undulation {
+    size_t n;                   // number of cells of the height fields along x and y (power of two)
+    fft_plan_t *plan;
+    double *sum_z[2];           // summed positions of phosphates in every cell (upper and lower leaflet)
+    uint32_t *count[2];         // number of phosphates in every cell
+    double *re;                 // height field of the upper leaflet (transformed in place)
+    double *im;                 // height field of the lower leaflet (transformed in place)
+    double *q;                  // summed magnitude of the wave vector of every mode
+    double *spectrum[3];        // summed A |h(q)|^2 of every mode (membrane, upper leaflet, lower leaflet)
+    size_t n_frames;
+} undulation_t;
+
+/*
+ * Prepares the accumulation of the spectrum using n x n height fields.
+ * Returns NULL if n is not a power of two or if the memory could not be allocated.
+ */
+undulation_t *undulation_create(const size_t n);
+
+/*
+ * Frees all memory associated with the spectrum.
+ */
+void undulation_destroy(undulation_t *undulation);
+
+/*
+ * Builds the height fields of both leaflets from the phosphates of the frame and adds their spectra.
+ * Phosphates above the membrane center belong to the upper leaflet. Does not allocate any memory.
+ */
+void undulation_add_frame(undulation_t *undulation, const frame_t *frame, const subset_t *phosphates, const vec_t center);
+
+/*
+ * Adds the spectrum collected in source to the target (both must use the same size of the height fields).
+ */
+void undulation_merge(undulation_t *target, const undulation_t *source);
+
+/*
+ * Writes the radially averaged spectrum into a file and estimates the bending modulus
+ * from the modes with q below UNDULATION_Q_MAX.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+int undulation_write(const undulation_t *undulation, FILE *output, const char *program, int argc, char **argv, double *kappa);
+
+#endif /* UNDULATION_H */
@@ -3,9 +3,26 @@
 
 #include <unistd.h>
 #include <groan.h>
+#include "frame.h"
+#include "xtc.h"
+#include "slab.h"
+#include "grid.h"
+#include "dynamic.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
 
 // frequency of printing during the calculation
 const int PROGRESS_FREQ = 10000;
+// default maximal number of frames between two rebuilds of the list of water atoms close to the membrane
+const int LIST_FREQ = 10;
+// number of bins per nm of the cylindrical maps (both r and z)
+const int CYLINDER_BINS = 10;
+// positions of phosphates are summed as integers in units of 1e-6 nm
+const double Z_SCALE = 1000000.0;
+// number of atoms whose distances from the protein axis are calculated at once
+#define CYLINDER_BLOCK 256
 
 /*
  * Parses command line arguments.
@@ -21,13 +38,19 @@ int get_arguments(
         char **protein,
         char **water,
         float *radius,
-        float *height
+        float *height,
+        float *skin,
+        int   *list_freq,
+        char **output_file,
+        char **phosphates,
+        float *max_radius,
+        float *max_dz
         ) 
 {
     int gro_specified = 0;
 
     int opt = 0;
-    while((opt = getopt(argc, argv, "c:f:l:n:r:e:p:w:h")) != -1) {
+    while((opt = getopt(argc, argv, "c:f:l:n:r:e:s:u:p:w:o:q:m:d:h")) != -1) {
         switch (opt) {
         // help
         case 'h':
@@ -73,6 +96,46 @@ int get_arguments(
                 return 1;
             }
             break;
+        // skin of the list of water atoms close to the membrane
+        case 's':
+            *skin = atof(optarg);
+            if (*skin < 0) {
+                fprintf(stderr, "Skin must be >=0, not %f.\n", *skin);
+                return 1;
+            }
+            break;
+        // maximal number of frames between two rebuilds of the list
+        case 'u':
+            *list_freq = atoi(optarg);
+            if (*list_freq <= 0) {
+                fprintf(stderr, "List update frequency must be >0, not %d.\n", *list_freq);
+                return 1;
+            }
+            break;
+        // output file for the cylindrical maps
+        case 'o':
+            *output_file = optarg;
+            break;
+        // specification of the phosphates for the cylindrical maps
+        case 'q':
+            *phosphates = optarg;
+            break;
+        // maximal distance from the protein axis in the cylindrical maps
+        case 'm':
+            *max_radius = atof(optarg);
+            if (*max_radius <= 0) {
+                fprintf(stderr, "Maximal radial distance must be >0, not %f.\n", *max_radius);
+                return 1;
+            }
+            break;
+        // maximal distance from the membrane center in the cylindrical maps
+        case 'd':
+            *max_dz = atof(optarg);
+            if (*max_dz <= 0) {
+                fprintf(stderr, "Maximal distance from the membrane center must be >0, not %f.\n", *max_dz);
+                return 1;
+            }
+            break;
         default:
             //fprintf(stderr, "Unknown command line option: %c.\n", opt);
             return 1;
@@ -92,13 +155,22 @@ void print_usage(const char *program_name)
     printf("\nOPTIONS\n");
     printf("-h          print this message and exit\n");
     printf("-c STRING   gro file to read\n");
-    printf("-f STRING   xtc file to read (optional)\n");
+    printf("-f STRING   xtc file to read (optional, \"-\" for standard input)\n");
     printf("-n STRING   ndx file to read (optional, default: index.ndx)\n");
     printf("-l STRING   specification of membrane lipids (default: Membrane) \n");
     printf("-p STRING   specification of protein; use \"no\" if there is no protein (default: Protein)\n");
     printf("-w STRING   specification of water (default: name W)\n");
+    printf("            (-l and -w can be dynamic, e.g. \"name W within 1.0 of Protein\")\n");
     printf("-r FLOAT    radius of the water defect cylinder in nm (default: 2.5)\n");
     printf("-e FLOAT    height of the water defect cylinder in nm (default: 4.0)\n");
+    printf("-s FLOAT    only test water atoms closer than height/2 + skin to the membrane center\n");
+    printf("            (default: 0 nm, all atoms are tested)\n");
+    printf("-u INTEGER  update the list of water atoms at least every INTEGER frames (default: %d)\n", LIST_FREQ);
+    printf("-o STRING   write cylindrical r-z maps of water and phosphates around the protein axis\n");
+    printf("            into this file and the radial thickness profile into OUTPUT_thickness (default: none)\n");
+    printf("-q STRING   specification of lipid phosphates for the cylindrical maps (default: name PO4)\n");
+    printf("-m FLOAT    maximal distance from the protein axis in the cylindrical maps in nm (default: 5.0)\n");
+    printf("-d FLOAT    maximal distance from the membrane center along z in the cylindrical maps in nm (default: 4.0)\n");
     printf("\n");
 }
 
@@ -113,7 +185,13 @@ void print_arguments(
         const char *protein,
         const char *water,
         const float radius,
-        const float height)
+        const float height,
+        const float skin,
+        const int list_freq,
+        const char *output_file,
+        const char *phosphates,
+        const float max_radius,
+        const float max_dz)
 {
     printf("Parameters for Water Defect calculation:\n");
     printf(">>> gro file:        %s\n", gro_file);
@@ -124,44 +202,261 @@ void print_arguments(
     else printf(">>> protein:         ---\n");
     printf(">>> water:           %s\n", water);
     printf(">>> cylinder radius: %f nm\n", radius);
-    printf(">>> cylinder height: %f nm\n\n", height);
+    printf(">>> cylinder height: %f nm\n", height);
+    if (skin > 0) printf(">>> list skin:       %f nm (updated every %d frames)\n", skin, list_freq);
+    if (output_file != NULL) {
+        printf(">>> r-z maps:        %s\n", output_file);
+        printf(">>> phosphates:      %s\n", phosphates);
+        printf(">>> maximal r:       %f nm\n", max_radius);
+        printf(">>> maximal dz:      %f nm\n", max_dz);
+    }
+    printf("\n");
 }
 
-void calc_wd_frame(
-        system_t *system,
-        const atom_selection_t *membrane_atoms,
-        const atom_selection_t *protein_atoms,
-        const atom_selection_t *water_atoms,
+/*
+ * Cylindrical (r, z) maps of water and phosphates around the protein axis.
+ * Atoms are binned by their distance from the axis passing through the protein center along z
+ * and by their distance from the membrane center along z. The centers are obtained in every frame,
+ * so the trajectory does not have to be centered.
+ */
+typedef struct cylinder {
+    const subset_t *phosphates;
+    float max_radius;
+    float max_dz;
+    size_t n_r;                 // number of radial bins
+    size_t n_z;                 // number of bins along z
+    uint64_t *water_counts;     // number of water atoms in every bin (r is the fastest changing index)
+    uint64_t *phosphate_counts; // number of phosphates in every bin
+    tile_t *profile;            // z positions of phosphates in every radial bin (upper and lower leaflet)
+} cylinder_t;
+
+/*
+ * Prepares empty cylindrical maps.
+ * Returns NULL if the memory could not be allocated.
+ */
+static cylinder_t *cylinder_create(const subset_t *phosphates, const float max_radius, const float max_dz)
+{
+    cylinder_t *cylinder = calloc(1, sizeof(cylinder_t));
+    if (cylinder == NULL) return NULL;
+
+    cylinder->phosphates = phosphates;
+    cylinder->max_radius = max_radius;
+    cylinder->max_dz = max_dz;
+    cylinder->n_r = (size_t) ceilf(max_radius * CYLINDER_BINS);
+    cylinder->n_z = (size_t) ceilf(2 * max_dz * CYLINDER_BINS);
+
+    cylinder->water_counts = calloc(cylinder->n_r * cylinder->n_z, sizeof(uint64_t));
+    cylinder->phosphate_counts = calloc(cylinder->n_r * cylinder->n_z, sizeof(uint64_t));
+    cylinder->profile = calloc(cylinder->n_r, sizeof(tile_t));
+    if (cylinder->water_counts == NULL || cylinder->phosphate_counts == NULL || cylinder->profile == NULL) {
+        free(cylinder->water_counts);
+        free(cylinder->phosphate_counts);
+        free(cylinder->profile);
+        free(cylinder);
+        return NULL;
+    }
+
+    return cylinder;
+}
+
+/*
+ * Frees all memory associated with the cylindrical maps. Does not free the phosphates.
+ */
+static void cylinder_destroy(cylinder_t *cylinder)
+{
+    if (cylinder == NULL) return;
+
+    free(cylinder->water_counts);
+    free(cylinder->phosphate_counts);
+    free(cylinder->profile);
+    free(cylinder);
+}
+
+/*
+ * Bins the atoms of a subset by their distance from the protein axis and from the membrane center.
+ * Distances of a block of atoms are calculated at once in a branchless loop that the compiler can vectorize;
+ * only the atoms inside the cylinder are then assigned to bins.
+ * If 'profile' is not NULL, z positions of the atoms are also added to the radial profile.
+ */
+static void cylinder_add(
+        const cylinder_t *cylinder,
+        const frame_t *frame,
+        const subset_t *subset,
+        const vec_t center_mem,
+        const vec_t center_prot,
+        uint64_t *counts,
+        tile_t *profile)
+{
+    const float box[3] = { frame->box[0], frame->box[1], frame->box[2] };
+    const float inv_box[3] = { 1.0f / box[0], 1.0f / box[1], 1.0f / box[2] };
+    const float max_r2 = cylinder->max_radius * cylinder->max_radius;
+    const float max_dz = cylinder->max_dz;
+
+    float rel_x[CYLINDER_BLOCK], rel_y[CYLINDER_BLOCK], rel_z[CYLINDER_BLOCK], r2[CYLINDER_BLOCK];
+
+    for (size_t start = 0; start < subset->n_atoms; start += CYLINDER_BLOCK) {
+        const size_t n = subset->n_atoms - start < CYLINDER_BLOCK ? subset->n_atoms - start : CYLINDER_BLOCK;
+
+        for (size_t i = 0; i < n; ++i) {
+            const float *position = frame->positions[subset->ids[start + i]];
+            rel_x[i] = position[0] - center_prot[0];
+            rel_y[i] = position[1] - center_prot[1];
+            rel_z[i] = position[2] - center_mem[2];
+        }
+
+        // minimum image convention and squared distance from the axis
+        for (size_t i = 0; i < n; ++i) {
+            rel_x[i] -= box[0] * rintf(rel_x[i] * inv_box[0]);
+            rel_y[i] -= box[1] * rintf(rel_y[i] * inv_box[1]);
+            rel_z[i] -= box[2] * rintf(rel_z[i] * inv_box[2]);
+            r2[i] = rel_x[i] * rel_x[i] + rel_y[i] * rel_y[i];
+        }
+
+        for (size_t i = 0; i < n; ++i) {
+            if (r2[i] >= max_r2 || fabsf(rel_z[i]) >= max_dz) continue;
+
+            size_t r_index = (size_t) (sqrtf(r2[i]) * CYLINDER_BINS);
+            size_t z_index = (size_t) ((rel_z[i] + max_dz) * CYLINDER_BINS);
+            if (r_index >= cylinder->n_r) r_index = cylinder->n_r - 1;
+            if (z_index >= cylinder->n_z) z_index = cylinder->n_z - 1;
+
+            ++counts[z_index * cylinder->n_r + r_index];
+            if (profile != NULL) tile_add(&profile[r_index], rel_z[i] > 0 ? GRID_UPPER : GRID_LOWER, llround((double) rel_z[i] * Z_SCALE));
+        }
+    }
+}
+
+/*
+ * Writes the header shared by both files with cylindrical maps.
+ */
+static void write_cylinder_header(FILE *output, int argc, char **argv, const char *description)
+{
+    fprintf(output, "# Generated with wdcalc (C Water Defect Calculator)\n");
+    fprintf(output, "# Command line: ");
+    for (int i = 0; i < argc; ++i) fprintf(output, "%s ", argv[i]);
+    fprintf(output, "\n# %s\n", description);
+}
+
+/*
+ * Writes the r-z maps of water and phosphate number densities and the radial profile of membrane thickness.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+static int cylinder_write(const cylinder_t *cylinder, FILE *output, const char *output_file, const size_t n_frames, int argc, char **argv)
+{
+    const float bin = 1.0f / CYLINDER_BINS;
+
+    write_cylinder_header(output, argc, argv, "Number densities [nm^-3] around the protein axis, dz is the distance from the membrane center.");
+    fprintf(output, "# r [nm] dz [nm] water phosphates\n");
+    for (size_t z_index = 0; z_index < cylinder->n_z; ++z_index) {
+        for (size_t r_index = 0; r_index < cylinder->n_r; ++r_index) {
+            // volume of the annular bin
+            double volume = M_PI * bin * bin * ((r_index + 1) * (r_index + 1) - r_index * r_index) * bin * n_frames;
+            size_t index = z_index * cylinder->n_r + r_index;
+            fprintf(output, "%f %f %.6f %.6f\n", (r_index + 0.5f) * bin, (z_index + 0.5f) * bin - cylinder->max_dz,
+                    cylinder->water_counts[index] / volume, cylinder->phosphate_counts[index] / volume);
+        }
+    }
+
+    char *profile_file = map_suffixed_name(output_file, "thickness");
+    FILE *profile_output = profile_file == NULL ? NULL : fopen(profile_file, "w");
+    free(profile_file);
+    if (profile_output == NULL) return 1;
+
+    write_cylinder_header(profile_output, argc, argv, "Average positions of phosphates relative to the membrane center and membrane thickness.");
+    fprintf(profile_output, "# r [nm] upper [nm] lower [nm] thickness [nm]\n");
+    for (size_t r_index = 0; r_index < cylinder->n_r; ++r_index) {
+        const tile_t *tile = &cylinder->profile[r_index];
+        uint64_t upper_count = tile_count(tile, GRID_UPPER);
+        uint64_t lower_count = tile_count(tile, GRID_LOWER);
+        double upper = upper_count == 0 ? NAN : tile->sum[GRID_UPPER] / Z_SCALE / upper_count;
+        double lower = lower_count == 0 ? NAN : tile->sum[GRID_LOWER] / Z_SCALE / lower_count;
+
+        fprintf(profile_output, "%f %.4f %.4f %.4f\n", (r_index + 0.5f) * bin, upper, lower, upper - lower);
+    }
+
+    int error = ferror(output) || ferror(profile_output);
+    fclose(profile_output);
+    return error;
+}
+
+/*
+ * Counts a water atom as water defect, if it is located inside the water defect cylinder.
+ */
+static inline void test_water(
+        const frame_t *frame,
+        const size_t id,
+        const vec_t center_mem,
+        const vec_t center_prot,
+        const float half_height,
+        const float radius,
+        size_t *upp_w_defect,
+        size_t *low_w_defect)
+{
+    const float *position = frame->positions[id];
+
+    float dist = distance1D(position, center_mem, z, frame->box);
+    if ((fabsf(dist) < half_height) && 
+        (distance2D(position, center_prot, xy, frame->box) < radius)) {
+            // upper leaflet water defect
+            if (dist > 0) ++(*upp_w_defect);
+            else ++(*low_w_defect);
+    }
+}
+
+/*
+ * Calculates water defect (and the cylindrical maps) for a single frame.
+ * Returns zero, if successful. Returns non-zero if water atoms entered the slab without being in the list.
+ */
+int calc_wd_frame(
+        const frame_t *frame,
+        const subset_t *membrane_subset,
+        const subset_t *protein_subset,
+        const subset_t *water_subset,
         const float half_height,
         const float radius,
+        slab_list_t *list,
+        cylinder_t *cylinder,
         size_t *upp_w_defect,
         size_t *low_w_defect)
 {
     // get membrane center
     vec_t center_mem = {0};
-    center_of_geometry(membrane_atoms, center_mem, system->box);
+    subset_center_of_geometry(frame, membrane_subset, center_mem);
 
     // get protein center
     vec_t center_prot = {0};
-    if (protein_atoms == NULL) {
-        center_prot[0] = system->box[0] / 2;
-        center_prot[1] = system->box[1] / 2;
+    if (protein_subset == NULL) {
+        center_prot[0] = frame->box[0] / 2;
+        center_prot[1] = frame->box[1] / 2;
     } else {
-        center_of_geometry(protein_atoms, center_prot, system->box);
+        subset_center_of_geometry(frame, protein_subset, center_prot);
     }
 
-    // calculate water defect
-    for (size_t i = 0; i < water_atoms->n_atoms; ++i) {
-        atom_t *atom = water_atoms->atoms[i];
+    // only test water atoms close to the membrane (if the list is used)
+    if (list != NULL && (water_subset = slab_list_update(list, frame, center_mem)) == NULL) return 1;
+
+    // bin water and phosphates by their distances from the protein axis and the membrane center
+    if (cylinder != NULL) {
+        cylinder_add(cylinder, frame, water_subset, center_mem, center_prot, cylinder->water_counts, NULL);
+        cylinder_add(cylinder, frame, cylinder->phosphates, center_mem, center_prot, cylinder->phosphate_counts, cylinder->profile);
+    }
 
-        float dist = distance1D(atom->position, center_mem, z, system->box);
-        if ((fabsf(dist) < half_height) && 
-            (distance2D(atom->position, center_prot, xy, system->box) < radius)) {
-                // upper leaflet water defect
-                if (dist > 0) ++(*upp_w_defect);
-                else ++(*low_w_defect);
+    // calculate water defect (contiguous ranges of water atoms are streamed directly)
+    if (water_subset->n_ranges > 0) {
+        for (size_t r = 0; r < water_subset->n_ranges; ++r) {
+            const id_range_t *range = &water_subset->ranges[r];
+            for (size_t id = range->start; id < range->start + range->n_atoms; ++id) {
+                test_water(frame, id, center_mem, center_prot, half_height, radius, upp_w_defect, low_w_defect);
+            }
         }
+        return 0;
+    }
+
+    for (size_t i = 0; i < water_subset->n_atoms; ++i) {
+        test_water(frame, water_subset->ids[i], center_mem, center_prot, half_height, radius, upp_w_defect, low_w_defect);
     }
+
+    return 0;
 }
 
 int main(int argc, char **argv)
@@ -176,14 +471,20 @@ int main(int argc, char **argv)
     char *water    = "name W";
     float radius   = 2.5;
     float height   = 4.0;
-    if (get_arguments(argc, argv, &gro_file, &xtc_file, &ndx_file, &lipids, &protein, &water, &radius, &height) != 0) {
+    float skin     = 0.0;
+    int list_freq  = LIST_FREQ;
+    char *output_file = NULL;
+    char *phosphates = "name PO4";
+    float max_radius = 5.0;
+    float max_dz   = 4.0;
+    if (get_arguments(argc, argv, &gro_file, &xtc_file, &ndx_file, &lipids, &protein, &water, &radius, &height, &skin, &list_freq, &output_file, &phosphates, &max_radius, &max_dz) != 0) {
         print_usage(argv[0]);
         return 1;
     }
     // get half the height of the cylinder which will later be used for calculation
     float half_height = height / 2;
 
-    print_arguments(gro_file, xtc_file, ndx_file, lipids, protein, water, radius, height);
+    print_arguments(gro_file, xtc_file, ndx_file, lipids, protein, water, radius, height, skin, list_freq, output_file, phosphates, max_radius, max_dz);
 
     // read gro file
     system_t *system = load_gro(gro_file);
@@ -195,13 +496,16 @@ int main(int argc, char **argv)
     // select all atoms
     atom_selection_t *all = select_system(system);
 
-    // select membrane
-    atom_selection_t *membrane_atoms = smart_select(all, lipids, ndx_groups);
+    // select membrane (the selection can be re-evaluated in every frame)
+    atom_selection_t *membrane_reference = NULL;
+    float membrane_radius = 0.0f;
+    atom_selection_t *membrane_atoms = dynamic_select(all, lipids, ndx_groups, &membrane_reference, &membrane_radius);
     if (membrane_atoms == NULL || membrane_atoms->n_atoms == 0) {
         fprintf(stderr, "No lipid atoms detected.\n");
         dict_destroy(ndx_groups);
         free(all);
         free(membrane_atoms);
+        free(membrane_reference);
         free(system);
         return 1;
     }
@@ -215,38 +519,166 @@ int main(int argc, char **argv)
             dict_destroy(ndx_groups);
             free(all);
             free(membrane_atoms);
+            free(membrane_reference);
             free(protein_atoms);
             free(system);
             return 1;
         }
     }
 
-    // select water
-    atom_selection_t *water_atoms = smart_select(all, water, ndx_groups);
+    // select water (the selection can be re-evaluated in every frame)
+    atom_selection_t *water_reference = NULL;
+    float water_radius = 0.0f;
+    atom_selection_t *water_atoms = dynamic_select(all, water, ndx_groups, &water_reference, &water_radius);
     if (water_atoms == NULL || water_atoms->n_atoms == 0) {
         fprintf(stderr, "No water atoms detected.\n");
         dict_destroy(ndx_groups);
         free(all);
         free(membrane_atoms);
+        free(membrane_reference);
         free(protein_atoms);
         free(water_atoms);
+        free(water_reference);
         free(system);
         return 1;
     }
 
-    
+    // the list of water atoms close to the membrane is built from all water atoms
+    if (water_reference != NULL && skin > 0) {
+        fprintf(stderr, "Skin can not be used with a dynamic water selection.\n");
+        dict_destroy(ndx_groups);
+        free(all);
+        free(membrane_atoms);
+        free(membrane_reference);
+        free(protein_atoms);
+        free(water_atoms);
+        free(water_reference);
+        free(system);
+        return 1;
+    }
+
+    // select phosphates (only for the cylindrical maps)
+    atom_selection_t *phosphate_atoms = NULL;
+    if (output_file != NULL) {
+        phosphate_atoms = smart_select(all, phosphates, ndx_groups);
+        if (phosphate_atoms == NULL || phosphate_atoms->n_atoms == 0) {
+            fprintf(stderr, "No phosphate atoms detected.\n");
+            dict_destroy(ndx_groups);
+            free(all);
+            free(membrane_atoms);
+            free(membrane_reference);
+            free(protein_atoms);
+            free(water_atoms);
+            free(water_reference);
+            free(phosphate_atoms);
+            free(system);
+            return 1;
+        }
+    }
+
+    // only keep the lipid, water, protein and phosphate atoms (and the references of dynamic selections) in memory
+    atom_selection_t *selections[6] = {membrane_atoms, water_atoms, protein_atoms, phosphate_atoms, membrane_reference, water_reference};
+    subset_t *subsets[6] = {NULL};
+    size_t n_selections = 2;
+    if (protein_atoms != NULL) ++n_selections;
+    if (phosphate_atoms != NULL) selections[n_selections++] = phosphate_atoms;
+    const size_t membrane_reference_index = n_selections;
+    if (membrane_reference != NULL) selections[n_selections++] = membrane_reference;
+    const size_t water_reference_index = n_selections;
+    if (water_reference != NULL) selections[n_selections++] = water_reference;
+    frame_t *frame = frame_create(system, selections, n_selections, subsets);
+
+    dict_destroy(ndx_groups);
+    free(all);
+    free(membrane_atoms);
+    free(membrane_reference);
+    free(protein_atoms);
+    free(water_atoms);
+    free(water_reference);
+    free(phosphate_atoms);
+    free(system);
+
+    if (frame == NULL) {
+        fprintf(stderr, "Could not allocate memory.\n");
+        return 1;
+    }
+
+    subset_t *membrane_subset = subsets[0];
+    subset_t *water_subset = subsets[1];
+    subset_t *protein_subset = protein_atoms != NULL ? subsets[2] : NULL;
+    subset_t *phosphate_subset = phosphate_atoms != NULL ? subsets[membrane_reference_index - 1] : NULL;
+    subset_t *membrane_reference_subset = membrane_reference != NULL ? subsets[membrane_reference_index] : NULL;
+    subset_t *water_reference_subset = water_reference != NULL ? subsets[water_reference_index] : NULL;
+
     size_t n_frames = 0;
     size_t upp_w_defect = 0;
     size_t low_w_defect = 0;
     int return_code = 0;
 
+    // dynamic selections are re-evaluated in every frame using a cell list shared by both of them
+    dynamic_selection_t *dynamic_membrane = NULL, *dynamic_water = NULL;
+    selector_t *selector = NULL;
+
+    // cylindrical maps are only calculated if the output file is provided
+    FILE *output = NULL;
+    cylinder_t *cylinder = NULL;
+    if (output_file != NULL) {
+        output = fopen(output_file, "w");
+        if (output == NULL) {
+            fprintf(stderr, "Output file could not be opened.\n");
+            return_code = 1;
+            goto function_end;
+        }
+
+        cylinder = cylinder_create(phosphate_subset, max_radius, max_dz);
+        if (cylinder == NULL) {
+            fprintf(stderr, "Could not allocate memory.\n");
+            return_code = 1;
+            goto function_end;
+        }
+    }
+
+    // prepare the dynamic selections
+    dynamic_selection_t *dynamic[2] = {NULL};
+    size_t n_dynamic = 0;
+    if (membrane_reference_subset != NULL) {
+        dynamic_membrane = dynamic_create(membrane_subset, membrane_reference_subset, membrane_radius);
+        dynamic[n_dynamic++] = dynamic_membrane;
+    }
+    if (water_reference_subset != NULL) {
+        dynamic_water = dynamic_create(water_subset, water_reference_subset, water_radius);
+        dynamic[n_dynamic++] = dynamic_water;
+    }
+    if (n_dynamic > 0) {
+        if ((membrane_reference_subset != NULL && dynamic_membrane == NULL) ||
+            (water_reference_subset != NULL && dynamic_water == NULL) ||
+            (selector = selector_create(frame, dynamic, n_dynamic)) == NULL) {
+                fprintf(stderr, "Could not allocate memory.\n");
+                return_code = 1;
+                goto function_end;
+            }
+    }
+    const subset_t *frame_membrane = dynamic_membrane != NULL ? dynamic_membrane->selected : membrane_subset;
+    const subset_t *frame_water = dynamic_water != NULL ? dynamic_water->selected : water_subset;
+    size_t n_skipped = 0;
+
     // if there is no xtc file provided, analyze the gro file
     if (xtc_file == NULL) {
-        ++n_frames;
-        calc_wd_frame(system, membrane_atoms, protein_atoms, water_atoms, half_height, radius, &upp_w_defect, &low_w_defect);
+        if (selector != NULL && selector_update(selector, frame) != 0) {
+            fprintf(stderr, "Could not allocate memory.\n");
+            return_code = 1;
+            goto function_end;
+        }
+
+        if (frame_membrane->n_atoms == 0) {
+            ++n_skipped;
+        } else {
+            ++n_frames;
+            calc_wd_frame(frame, frame_membrane, protein_subset, frame_water, half_height, radius, NULL, cylinder, &upp_w_defect, &low_w_defect);
+        }
     } else {
         // open xtc file for reading
-        XDRFILE *xtc = xdrfile_open(xtc_file, "r");
+        xtc_reader_t *xtc = xtc_open(xtc_file);
         if (xtc == NULL) {
             fprintf(stderr, "File %s could not be read as an xtc file.\n", xtc_file);
             return_code = 1;
@@ -254,38 +686,90 @@ int main(int argc, char **argv)
         }
 
         // check that the gro file and the xtc file match each other
-        if (!validate_xtc(xtc_file, (int) system->n_atoms)) {
+        // (only the header of the first frame is read, so the xtc file can also be a pipe)
+        int xtc_atoms = 0;
+        if (xtc_peek_atoms(xtc, &xtc_atoms) != 0 || (size_t) xtc_atoms != frame->n_system_atoms) {
             fprintf(stderr, "Number of atoms in %s does not match %s.\n", xtc_file, gro_file);
-            xdrfile_close(xtc);
+            xtc_close(xtc);
+            return_code = 1;
+            goto function_end;
+        }
+
+        // only the water atoms close to the membrane are tested in every frame (if the skin is set)
+        // (the list must also cover the cylindrical maps)
+        float list_half_height = cylinder != NULL && max_dz > half_height ? max_dz : half_height;
+        slab_list_t *list = NULL;
+        if (skin > 0 && (list = slab_list_create(water_subset, list_half_height, skin, list_freq)) == NULL) {
+            fprintf(stderr, "Could not allocate memory.\n");
+            xtc_close(xtc);
             return_code = 1;
             goto function_end;
         }
 
         // read xtc
-        while (read_xtc_step(xtc, system) == 0) {
-            ++n_frames;
+        int status = 0;
+        while ((status = xtc_read_frame(xtc, frame)) == 0) {
             // print info about the progress of reading
-            if ((int) system->time % PROGRESS_FREQ == 0) {
-                printf("Step: %d. Time: %.0f\r", system->step, system->time);
+            if ((int) frame->time % PROGRESS_FREQ == 0) {
+                printf("Step: %d. Time: %.0f\r", frame->step, frame->time);
                 fflush(stdout);
             }
-            calc_wd_frame(system, membrane_atoms, protein_atoms, water_atoms, half_height, radius, &upp_w_defect, &low_w_defect);
+
+            // evaluate dynamic selections (frames without any lipids selected are skipped)
+            if (selector != NULL && selector_update(selector, frame) != 0) {
+                fprintf(stderr, "\nCould not allocate memory.\n");
+                return_code = 1;
+                break;
+            }
+            if (frame_membrane->n_atoms == 0) {
+                ++n_skipped;
+                continue;
+            }
+
+            if (calc_wd_frame(frame, frame_membrane, protein_subset, frame_water, half_height, radius, list, cylinder, &upp_w_defect, &low_w_defect) != 0) {
+                fprintf(stderr, "\n%zu water atoms entered the slab without being in the list of water atoms close to the membrane.\n", list->n_missed);
+                fprintf(stderr, "Increase the skin (flag -s) or update the list more often (flag -u).\n");
+                return_code = 1;
+                break;
+            }
+            ++n_frames;
         }
 
-        xdrfile_close(xtc);
+        if (status == 2) return_code = 1;
+
+        slab_list_destroy(list);
+        xtc_close(xtc);
     }
 
+    // results are never written from an incomplete analysis
+    if (return_code != 0) {
+        fprintf(stderr, "Analysis stopped, no results were written.\n");
+        goto function_end;
+    }
+
+    if (n_skipped > 0) printf("\n\nSkipped %zu frames without any lipid atoms selected.", n_skipped);
     printf("\n\nAverage upper-leaflet water defect: % 8.4f\n", (float) (upp_w_defect) / n_frames);
     printf("Average lower-leaflet water defect: % 8.4f\n", (float) (low_w_defect) / n_frames);
     printf("Average water defect:               % 8.4f\n", (float) (upp_w_defect + low_w_defect) / n_frames);
 
+    if (cylinder != NULL && cylinder_write(cylinder, output, output_file, n_frames, argc, argv) != 0) {
+        fprintf(stderr, "Could not write output file.\n");
+        return_code = 1;
+    }
+
     function_end:
-    dict_destroy(ndx_groups);
-    free(all);
-    free(membrane_atoms);
-    free(protein_atoms);
-    free(water_atoms);
-    free(system);
+    if (output != NULL) fclose(output);
+    cylinder_destroy(cylinder);
+    selector_destroy(selector);
+    dynamic_destroy(dynamic_membrane);
+    dynamic_destroy(dynamic_water);
+    free(membrane_reference_subset);
+    free(water_reference_subset);
+    frame_destroy(frame);
+    free(membrane_subset);
+    free(protein_subset);
+    free(water_subset);
+    free(phosphate_subset);
 
     return return_code;
 }
\ No newline at end of file
@@ -4,13 +4,38 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <groan.h>
+#include "frame.h"
+#include "xtc.h"
+#include "fit.h"
+#include "pool.h"
+#include "grid.h"
+#include "slab.h"
+#include "pore.h"
+#include "archive.h"
+#include "dynamic.h"
+#include "profile.h"
+#include "wdmaps.h"
 
 const char VERSION[] = "v2023/08/07";
 
 // frequency of printing during the calculation
 const int PROGRESS_FREQ = 10000;
+// frequency of reordering the analyzed atoms by their position in the xy-plane (in frames)
+const int SORT_FREQ = 100;
+// default maximal number of frames between two rebuilds of the list of water atoms close to the membrane
+const int LIST_FREQ = 10;
 // inverse size of a grid tile for water defect calculation
 const int GRID_TILE = 10;
+// maximal number of mapped channels (water and the additional channels)
+#define MAX_CHANNELS 32
+
+/*
+ * Named selection of atoms (e.g. ions) mapped in the same way as water.
+ */
+typedef struct channel {
+    char name[32];
+    const char *selection;
+} channel_t;
 
 /*
  * Parses command line arguments.
@@ -26,13 +51,26 @@ int get_arguments(
         char **lipids,
         char **water,
         float *height,
+        float *skin,
+        int   *list_freq,
         float *array_dimx,
-        float *array_dimy) 
+        float *array_dimy,
+        char **reference,
+        int   *rotate,
+        int   *n_threads,
+        int   *binary,
+        int   *n_levels,
+        channel_t *channels,
+        int   *n_channels,
+        char **pore_file,
+        float *voxel,
+        char **archive_file,
+        int   *profiling) 
 {
     int gro_specified = 0, xtc_specified = 0;
 
     int opt = 0;
-    while((opt = getopt(argc, argv, "c:f:n:o:l:w:e:x:y:h")) != -1) {
+    while((opt = getopt(argc, argv, "c:f:n:o:l:w:i:e:s:u:x:y:r:zt:bm:p:v:A:Ph")) != -1) {
         switch (opt) {
         // help
         case 'h':
@@ -63,6 +101,26 @@ int get_arguments(
         case 'w':
             *water = optarg;
             break;
+        // additional named channel
+        case 'i': {
+            const char *separator = strchr(optarg, '=');
+            if (separator == NULL || separator == optarg || separator[1] == '\0' ||
+                (size_t) (separator - optarg) >= sizeof(channels->name)) {
+                    fprintf(stderr, "Could not understand channel specifier '%s' (expected NAME=SELECTION).\n", optarg);
+                    return 1;
+                }
+
+            if (*n_channels == MAX_CHANNELS - 1) {
+                fprintf(stderr, "At most %d channels can be specified.\n", MAX_CHANNELS - 1);
+                return 1;
+            }
+
+            channel_t *channel = &channels[(*n_channels)++];
+            memcpy(channel->name, optarg, separator - optarg);
+            channel->name[separator - optarg] = '\0';
+            channel->selection = separator + 1;
+            break;
+        }
         // water defect height
         case 'e':
             *height = atof(optarg);
@@ -71,6 +129,22 @@ int get_arguments(
                 return 1;
             }
             break;
+        // skin of the list of water atoms close to the membrane
+        case 's':
+            *skin = atof(optarg);
+            if (*skin < 0) {
+                fprintf(stderr, "Skin must be >=0, not %f.\n", *skin);
+                return 1;
+            }
+            break;
+        // maximal number of frames between two rebuilds of the list
+        case 'u':
+            *list_freq = atoi(optarg);
+            if (*list_freq <= 0) {
+                fprintf(stderr, "List update frequency must be >0, not %d.\n", *list_freq);
+                return 1;
+            }
+            break;
         // specification of array dimensions (x axis)
         case 'x':
             if (sscanf(optarg, "%f-%f", &array_dimx[0], &array_dimx[1]) != 2 && 
@@ -89,6 +163,46 @@ int get_arguments(
                 return 1;
             }
             break;
+        // reference selection for centering
+        case 'r':
+            *reference = optarg;
+            break;
+        // fit rotation around the z-axis
+        case 'z':
+            *rotate = 1;
+            break;
+        // number of threads
+        case 't':
+            sscanf(optarg, "%d", n_threads);
+            break;
+        // binary output
+        case 'b':
+            *binary = 1;
+            break;
+        // number of coarser overview maps
+        case 'm':
+            sscanf(optarg, "%d", n_levels);
+            break;
+        // output file for the time series of pores
+        case 'p':
+            *pore_file = optarg;
+            break;
+        // size of a voxel for pore detection
+        case 'v':
+            *voxel = atof(optarg);
+            if (*voxel <= 0) {
+                fprintf(stderr, "Voxel size must be >0, not %f.\n", *voxel);
+                return 1;
+            }
+            break;
+        // output file for the per-frame archive of tile occupancies
+        case 'A':
+            *archive_file = optarg;
+            break;
+        // report the time spent in the phases of the analysis
+        case 'P':
+            *profiling = 1;
+            break;
         default:
             //fprintf(stderr, "Unknown command line option: %c.\n", opt);
             return 1;
@@ -99,6 +213,17 @@ int get_arguments(
         fprintf(stderr, "Gro file and xtc file must always be supplied.\n");
         return 1;
     }
+
+    if (*rotate && *reference == NULL) {
+        fprintf(stderr, "Reference selection must be supplied for fitting.\n");
+        return 1;
+    }
+
+    // both the skin and the channels require a fixed set of water atoms
+    if (dynamic_query(*water) && (*skin > 0 || *n_channels > 0)) {
+        fprintf(stderr, "Skin and additional channels can not be used with a dynamic water selection.\n");
+        return 1;
+    }
     return 0;
 }
 
@@ -108,14 +233,28 @@ void print_usage(const char *program_name)
     printf("\nOPTIONS\n");
     printf("-h               print this message and exit\n");
     printf("-c STRING        gro file to read\n");
-    printf("-f STRING        xtc file to read\n");
+    printf("-f STRING        xtc file to read (\"-\" for standard input)\n");
     printf("-n STRING        ndx file to read (optional, default: index.ndx)\n");
     printf("-o STRING        pattern for the output files (default: wd_map)\n");
     printf("-l STRING        specification of membrane lipids (default: Membrane)\n");
     printf("-w STRING        specification of water (default: name W)\n");
+    printf("                 (-l and -w can be dynamic, e.g. \"name W within 1.0 of Protein\")\n");
+    printf("-i NAME=STRING   additional channel mapped together with water (e.g. ions, can be used multiple times)\n");
     printf("-e FLOAT         water defect height (default: 4 nm)\n");
+    printf("-s FLOAT         only test water atoms closer than height/2 + skin to the membrane center\n");
+    printf("                 (default: 0 nm, all atoms are tested)\n");
+    printf("-u INTEGER       update the list of water atoms at least every INTEGER frames (default: %d)\n", LIST_FREQ);
     printf("-x FLOAT-FLOAT   grid dimensions in x axis (default: box size from gro file)\n");
     printf("-y FLOAT-FLOAT   grid dimensions in y axis (default: box size from gro file)\n");
+    printf("-r STRING        reference selection centered in the xy-plane in every frame (default: none)\n");
+    printf("-z               also rotate the system around the z-axis to fit the reference (requires -r)\n");
+    printf("-t INTEGER       number of threads used to analyze every frame (default: 1)\n");
+    printf("-b               write the output in binary format (can be converted to text using mapconv)\n");
+    printf("-m INTEGER       number of overview maps, each two times coarser than the previous one (default: 0)\n");
+    printf("-p STRING        output file for the per-frame time series of water pores spanning the water defect area (default: none)\n");
+    printf("-v FLOAT         size of a voxel for the detection of water pores (default: 0.5 nm)\n");
+    printf("-A STRING        output file for the per-frame archive of tile occupancies (can be re-analyzed using wdreplay)\n");
+    printf("-P               report the time spent in the phases of the analysis and the locality of binning\n");
     printf("\n");
 }
 
@@ -133,8 +272,21 @@ void print_arguments(
         const char *lipids,
         const char *water,
         const float height,
+        const float skin,
+        const int list_freq,
         const float *array_dimx,
-        const float *array_dimy)
+        const float *array_dimy,
+        const char *reference,
+        const int rotate,
+        const int n_threads,
+        const int binary,
+        const int n_levels,
+        const channel_t *channels,
+        const int n_channels,
+        const char *pore_file,
+        const float voxel,
+        const char *archive_file,
+        const int profiling)
 {
     fprintf(stream, "Parameters for Water Defect Map calculation:\n");
     fprintf(stream, ">>> gro file:         %s\n", gro_file);
@@ -143,73 +295,145 @@ void print_arguments(
     fprintf(stream, ">>> output files:     %s, %s, %s\n", output_file_upper, output_file_lower, output_file_full);
     fprintf(stream, ">>> lipids:           %s\n", lipids);
     fprintf(stream, ">>> water:            %s\n", water);
+    for (int i = 0; i < n_channels; ++i) fprintf(stream, ">>> channel:          %s (%s)\n", channels[i].name, channels[i].selection);
     fprintf(stream, ">>> wd height:        %f\n", height);
+    if (skin > 0) fprintf(stream, ">>> list skin:        %f (updated every %d frames)\n", skin, list_freq);
     fprintf(stream, ">>> grid dimensions:  x: %.1f - %.1f nm, y: %.1f - %.1f nm\n", array_dimx[0], array_dimx[1], array_dimy[0], array_dimy[1]);
+    if (reference != NULL) fprintf(stream, ">>> reference:        %s (centered in xy%s)\n", reference, rotate ? ", fitted around z" : "");
+    fprintf(stream, ">>> threads:          %d\n", n_threads);
+    if (binary) fprintf(stream, ">>> output format:    binary\n");
+    if (n_levels > 0) fprintf(stream, ">>> overview maps:    %d (up to %dx coarser)\n", n_levels, 1 << n_levels);
+    if (pore_file != NULL) fprintf(stream, ">>> pore output:      %s (voxel: %.3f nm)\n", pore_file, voxel);
+    if (archive_file != NULL) fprintf(stream, ">>> archive:          %s\n", archive_file);
+    if (profiling) fprintf(stream, ">>> profiling:        enabled\n");
     fprintf(stream, "\n");
 }
 
-/* 
- * Converts index of an array to coordinate.
- */
-static inline float index2coor(int x, float minx)
-{
-    return (float) x / GRID_TILE + minx;
-}
-
 /*
- * Converts coordinate to an index array.
+ * Data needed to assign the water atoms of a single frame to grid tiles.
  */
-static inline size_t coor2index(float x, float minx)
-{
-    return (size_t) roundf((x - minx) * GRID_TILE);
-}
+typedef struct frame_task {
+    const frame_t *frame;
+    const subset_t *water_subset;       // water atoms (and atoms of all channels)
+    const fit_t *fit;
+    const int_grid_t *grid;
+    const float *center_mem;
+    const float *array_dimx;
+    const float *array_dimy;
+    float half_height;
+    int use_fixed;              // 1 if the fixed-point coordinates should be used
+    int64_t center_fixed;       // membrane center (z), box size (z) and half of the water defect height
+    int64_t box_fixed;          // in fixed-point units (only valid if use_fixed is 1)
+    int64_t half_height_fixed;
+    const uint32_t *masks;      // channels of every resident atom (bit 0 is water; NULL if only water is mapped)
+    size_t n_threads;
+    grid_t **grids;             // one grid for every thread (followed by the same for every additional channel)
+} frame_task_t;
 
 /*
- * Write output file showing water defect map.
+ * Assigns a single water (or channel) atom to a grid tile, if it is located inside the water defect area.
  */
-static void write_output(
-        FILE *output, 
-        int argc, 
-        char **argv, 
-        const size_t n_rows, 
-        const size_t n_cols, 
-        const size_t n_frames,
-        const size_t *wd_map,
-        const float *array_dimx,
-        const float *array_dimy) 
+static inline void assign_water_atom(const frame_task_t *task, const size_t thread, const size_t id)
 {
-    // write header for the output file
-    fprintf(output, "# Generated with wdmap (C Water Defect Map Calculator) %s\n", VERSION);
-    fprintf(output, "# Command line: ");
-    for (int i = 0; i < argc; ++i) {
-        fprintf(output, "%s ", argv[i]);
-    }
-    fprintf(output, "\n# See average water defect at the end of this file.\n");
-    fprintf(output, "@ xlabel x coordinate [nm]\n");
-    fprintf(output, "@ ylabel y coordinate [nm]\n");
-    fprintf(output, "@ zlabel water defect [arb. u.]\n");
-    fprintf(output, "$ type colorbar\n");
-    fprintf(output, "$ colormap hot\n");
+    grid_t *thread_grid = task->grids[thread];
+    const frame_t *frame = task->frame;
+    const fit_t *fit = task->fit;
+    const float *array_dimx = task->array_dimx;
+    const float *array_dimy = task->array_dimy;
+
+    size_t x_index = 0, y_index = 0;
+    int upper = 0;
+
+    if (task->use_fixed) {
+        const int *coordinates = frame->coordinates + 3 * id;
+
+        int64_t rel_pos_z = coordinates[2] - task->center_fixed;
+        while (2 * rel_pos_z > task->box_fixed) rel_pos_z -= task->box_fixed;
+        while (2 * rel_pos_z < -task->box_fixed) rel_pos_z += task->box_fixed;
+
+        // if the atom is not inside the water defect area, ignore it
+        if (rel_pos_z > task->half_height_fixed || rel_pos_z < -task->half_height_fixed) return;
+
+        // get index of the tile to which the atom should be assigned
+        // (ignoring atoms that are outside of the specified grid)
+        int fitted[3] = {0};
+        if (fit != NULL) coordinates = fit_apply_fixed(fit, coordinates, fitted);
+        if (!int_grid_index(task->grid, coordinates, &x_index, &y_index)) return;
+        upper = rel_pos_z > 0;
 
-    float av_wd = 0;
-    size_t n_samples = 0;
+    } else {
+        const float *position = frame->positions[id];
 
-    // calculate the average water defect for each tile and write it into the output file
-    for (size_t y = 0; y < n_rows; ++y) {
-        for (size_t x = 0; x < n_cols; ++x) {
+        float rel_pos_z = distance1D(position, task->center_mem, z, frame->box);
 
-            float wd = (float) wd_map[y * n_cols + x] / n_frames;
-            
-            av_wd += wd;
-            ++n_samples;
+        // if the atom is not inside the water defect area, ignore it
+        if (fabsf(rel_pos_z) > task->half_height) return;
+
+        vec_t fitted = {0.0f};
+        if (fit != NULL) position = fit_apply(fit, position, fitted);
+
+        // ignore atoms that are outside of the specified grid
+        if (position[0] < array_dimx[0] || position[0] > array_dimx[1] ||
+            position[1] < array_dimy[0] || position[1] > array_dimy[1]) {
+                return;
+            }
+
+        // get index of the tile to which the atom should be assigned
+        x_index = grid_coor2index(thread_grid, position[0], 0);
+        y_index = grid_coor2index(thread_grid, position[1], 1);
+        upper = rel_pos_z > 0;
+    }
+
+    // assign the atom to a tile (the full map is the sum of both leaflets)
+    const int part = upper ? GRID_UPPER : GRID_LOWER;
+    if (task->masks == NULL) {
+        tile_add(grid_tile(thread_grid, x_index, y_index), part, 0);
+        return;
+    }
+
+    // the same tile is updated in the grid of every channel the atom belongs to
+    uint32_t mask = task->masks[id];
+    for (size_t channel = 0; mask != 0; ++channel, mask >>= 1) {
+        if (mask & 1) tile_add(grid_tile(task->grids[channel * task->n_threads + thread], x_index, y_index), part, 0);
+    }
+}
 
-            fprintf(output, "%f %f %.6f\n", index2coor(x, array_dimx[0]), index2coor(y, array_dimy[0]), wd);
+/*
+ * Assigns water atoms located inside the water defect area to grid tiles.
+ * Every thread processes a part of the water atoms and writes into its own grid.
+ */
+static void assign_water(void *data, const size_t thread, const size_t n_threads)
+{
+    const frame_task_t *task = data;
+    const subset_t *water_subset = task->water_subset;
+
+    size_t start = 0, end = 0;
+    pool_range(water_subset->n_atoms, thread, n_threads, &start, &end);
+
+    // contiguous ranges of water atoms are streamed directly
+    if (water_subset->n_ranges > 0) {
+        for (size_t r = 0; r < water_subset->n_ranges; ++r) {
+            size_t from = 0, to = 0;
+            if (!subset_range_window(water_subset, r, start, end, &from, &to)) continue;
+            for (size_t id = from; id < to; ++id) assign_water_atom(task, thread, id);
         }
+        return;
     }
 
-    av_wd /= n_samples;
-    //printf("\nAverage water defect per square Å : %.6f arb. u.\n", av_wd);
-    fprintf(output, "# Average water defect per square Å: %.6f arb. u.\n", av_wd);
+    for (size_t i = start; i < end; ++i) assign_water_atom(task, thread, water_subset->ids[i]);
+}
+
+/*
+ * Writes the header of the time series of water pores.
+ */
+static void write_pore_header(FILE *output, int argc, char **argv, const float voxel, const float height)
+{
+    fprintf(output, "# Generated with wdmap (C Water Defect Map Calculator)\n");
+    fprintf(output, "# Command line: ");
+    for (int i = 0; i < argc; ++i) fprintf(output, "%s ", argv[i]);
+    fprintf(output, "\n# Water pores spanning %.3f nm around the membrane center (voxel: %.3f nm).\n", height, voxel);
+    fprintf(output, "# Area is the cross-section of the pores at the membrane center, opened is 1 if no pore was open in the previous frame.\n");
+    fprintf(output, "# time [ps] pores total_area [nm^2] largest_area [nm^2] opened\n");
 }
 
 int main(int argc, char **argv)
@@ -223,13 +447,44 @@ int main(int argc, char **argv)
     char *lipids   = "Membrane";
     char *water = "name W";
     float height = 4.0f;
+    float skin = 0.0f;
+    int list_freq = LIST_FREQ;
     float array_dimx[2] = {0.};
     float array_dimy[2] = {0.};
-    if (get_arguments(argc, argv, &gro_file, &xtc_file, &ndx_file, &output_pattern, &lipids, &water, &height, array_dimx, array_dimy) != 0) {
+    char *reference = NULL;
+    int rotate = 0;
+    int n_threads = 1;
+    int binary = 0;
+    int n_levels = 0;
+    channel_t channels[MAX_CHANNELS] = {{{0}, NULL}};
+    int n_channels = 0;
+    char *pore_file = NULL;
+    float voxel = 0.5f;
+    char *archive_file = NULL;
+    int profiling = 0;
+    if (get_arguments(argc, argv, &gro_file, &xtc_file, &ndx_file, &output_pattern, &lipids, &water, &height, &skin, &list_freq, array_dimx, array_dimy, &reference, &rotate, &n_threads, &binary, &n_levels, channels, &n_channels, &pore_file, &voxel, &archive_file, &profiling) != 0) {
         print_usage(argv[0]);
         return 1;
     }
 
+    // check that the number of threads is > 0
+    if (n_threads <= 0) {
+        fprintf(stderr, "Number of threads must be higher than 0.\n");
+        return 1;
+    }
+
+    // check that the number of overview maps is sensible
+    if (n_levels < 0 || n_levels > MAP_MAX_LEVELS) {
+        fprintf(stderr, "Number of overview maps must be between 0 and %d.\n", MAP_MAX_LEVELS);
+        return 1;
+    }
+
+    // pores are only detected if the water defect area is at least three voxels high
+    if (pore_file != NULL && 3 * voxel > height) {
+        fprintf(stderr, "Voxel size must be at most a third of the water defect height.\n");
+        return 1;
+    }
+
     // get the names of the output files
     char *output_file_upper = calloc(strlen(output_pattern) + 20, 1);
     char *output_file_lower = calloc(strlen(output_pattern) + 20, 1);
@@ -244,7 +499,9 @@ int main(int argc, char **argv)
     FILE *output_upper = fopen(output_file_upper, "w");
     FILE *output_lower = fopen(output_file_lower, "w");
     FILE *output_full  = fopen(output_file_full, "w");
-    if (!output_upper || !output_lower || !output_full) {
+    FILE *output_pores = pore_file == NULL ? NULL : fopen(pore_file, "w");
+    FILE *output_archive = archive_file == NULL ? NULL : fopen(archive_file, "wb");
+    if (!output_upper || !output_lower || !output_full || (pore_file != NULL && !output_pores) || (archive_file != NULL && !output_archive)) {
         fprintf(stderr, "Some of the output files could not be opened.\n");
         return 1;
     }
@@ -268,23 +525,22 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    print_arguments(stdout, gro_file, xtc_file, ndx_file, output_file_upper, output_file_lower, output_file_full, lipids, water, height, array_dimx, array_dimy);
+    print_arguments(stdout, gro_file, xtc_file, ndx_file, output_file_upper, output_file_lower, output_file_full, lipids, water, height, skin, list_freq, array_dimx, array_dimy, reference, rotate, n_threads, binary, n_levels, channels, n_channels, pore_file, voxel, archive_file, profiling);
 
     // open xtc file for reading
-    XDRFILE *xtc = xdrfile_open(xtc_file, "r");
+    xtc_reader_t *xtc = xtc_open(xtc_file);
     if (xtc == NULL) {
         fprintf(stderr, "File %s could not be read as an xtc file.\n", xtc_file);
         free(system);
         return 1;
     }
 
-    // set all velocities of all particles to zero (xtc does not contain velocities)
-    reset_velocities(system);
-
     // check that the gro file and the xtc file match each other
-    if (!validate_xtc(xtc_file, (int) system->n_atoms)) {
+    // (only the header of the first frame is read, so the xtc file can also be a pipe)
+    int xtc_atoms = 0;
+    if (xtc_peek_atoms(xtc, &xtc_atoms) != 0 || (size_t) xtc_atoms != system->n_atoms) {
         fprintf(stderr, "Number of atoms in %s does not match %s.\n", xtc_file, gro_file);
-        xdrfile_close(xtc);
+        xtc_close(xtc);
         free(system);
         return 1;
     }
@@ -295,111 +551,373 @@ int main(int argc, char **argv)
     // select all atoms
     atom_selection_t *all = select_system(system);
 
-    // select membrane
-    atom_selection_t *membrane_atoms = smart_select(all, lipids, ndx_groups);
+    // select membrane (the selection can be re-evaluated in every frame)
+    atom_selection_t *membrane_reference = NULL;
+    float membrane_radius = 0.0f;
+    atom_selection_t *membrane_atoms = dynamic_select(all, lipids, ndx_groups, &membrane_reference, &membrane_radius);
     if (membrane_atoms == NULL || membrane_atoms->n_atoms == 0) {
         fprintf(stderr, "No lipid atoms detected.\n");
         dict_destroy(ndx_groups);
-        xdrfile_close(xtc);
+        xtc_close(xtc);
         free(all);
         free(membrane_atoms);
+        free(membrane_reference);
         free(system);
         return 1;
     }
 
-    // select water
-    atom_selection_t *water_atoms = smart_select(all, water, ndx_groups);
+    // select water (the selection can be re-evaluated in every frame)
+    atom_selection_t *water_reference = NULL;
+    float water_radius = 0.0f;
+    atom_selection_t *water_atoms = dynamic_select(all, water, ndx_groups, &water_reference, &water_radius);
     if (water_atoms == NULL || water_atoms->n_atoms == 0) {
         fprintf(stderr, "No water atoms detected.\n");
         dict_destroy(ndx_groups);
-        xdrfile_close(xtc);
+        xtc_close(xtc);
         free(all);
         free(membrane_atoms);
+        free(membrane_reference);
         free(water_atoms);
+        free(water_reference);
         free(system);
         return 1;
     }
 
-    // prepare array
-    size_t n_rows = (size_t) roundf( (array_dimy[1] - array_dimy[0]) * GRID_TILE ) + 1;
-    size_t n_cols = (size_t) roundf( (array_dimx[1] - array_dimx[0]) * GRID_TILE ) + 1;
-    size_t n_tiles = n_rows * n_cols;
-
-    size_t *wd_map_upper = calloc(n_tiles, sizeof(size_t));
-    size_t *wd_map_lower = calloc(n_tiles, sizeof(size_t));
-    size_t *wd_map_full  = calloc(n_tiles, sizeof(size_t));
+    // select atoms of the additional channels
+    atom_selection_t *channel_atoms[MAX_CHANNELS] = {NULL};
+    for (int c = 0; c < n_channels; ++c) {
+        channel_atoms[c] = smart_select(all, channels[c].selection, ndx_groups);
+        if (channel_atoms[c] == NULL || channel_atoms[c]->n_atoms == 0) {
+            fprintf(stderr, "No atoms of channel %s detected.\n", channels[c].name);
+            dict_destroy(ndx_groups);
+            xtc_close(xtc);
+            free(all);
+            free(membrane_atoms);
+            free(membrane_reference);
+            free(water_atoms);
+            free(water_reference);
+            for (int i = 0; i <= c; ++i) free(channel_atoms[i]);
+            free(system);
+            return 1;
+        }
+    }
 
-    if (wd_map_upper == NULL || wd_map_lower == NULL || wd_map_full == NULL) {
-        fprintf(stderr, "Could not allocate memory (grid too large?)\n");
+    // select reference atoms
+    atom_selection_t *reference_atoms = NULL;
+    if (reference != NULL) reference_atoms = smart_select(all, reference, ndx_groups);
+    if (reference != NULL && (reference_atoms == NULL || reference_atoms->n_atoms == 0)) {
+        fprintf(stderr, "No reference atoms detected.\n");
         dict_destroy(ndx_groups);
-        xdrfile_close(xtc);
-        fclose(output_upper);
-        fclose(output_lower);
-        fclose(output_full);
+        xtc_close(xtc);
         free(all);
         free(membrane_atoms);
+        free(membrane_reference);
         free(water_atoms);
+        free(water_reference);
+        for (int c = 0; c < n_channels; ++c) free(channel_atoms[c]);
+        free(reference_atoms);
         free(system);
         return 1;
     }
 
+    // only keep the lipid, water, channel (and reference) atoms and the references of dynamic selections in memory
+    atom_selection_t *selections[MAX_CHANNELS + 4] = {membrane_atoms, water_atoms};
+    for (int c = 0; c < n_channels; ++c) selections[2 + c] = channel_atoms[c];
+    size_t n_selections = 2 + n_channels;
+    if (reference_atoms != NULL) selections[n_selections++] = reference_atoms;
+    const size_t membrane_reference_index = n_selections;
+    if (membrane_reference != NULL) selections[n_selections++] = membrane_reference;
+    const size_t water_reference_index = n_selections;
+    if (water_reference != NULL) selections[n_selections++] = water_reference;
+    subset_t *subsets[MAX_CHANNELS + 4] = {NULL};
+    frame_t *frame = frame_create(system, selections, n_selections, subsets);
+
+    dict_destroy(ndx_groups);
+    free(all);
+    free(membrane_atoms);
+    free(membrane_reference);
+    free(water_atoms);
+    free(water_reference);
+    for (int c = 0; c < n_channels; ++c) free(channel_atoms[c]);
+    free(reference_atoms);
+    free(system);
+
+    if (frame == NULL) {
+        fprintf(stderr, "Could not allocate memory.\n");
+        xtc_close(xtc);
+        fclose(output_upper);
+        fclose(output_lower);
+        fclose(output_full);
+        if (output_pores != NULL) fclose(output_pores);
+        if (output_archive != NULL) fclose(output_archive);
+        return 1;
+    }
+
+    subset_t *membrane_subset = subsets[0];
+    subset_t *water_subset = subsets[1];
+    subset_t *reference_subset = reference_atoms != NULL ? subsets[2 + n_channels] : NULL;
+    subset_t *membrane_reference_subset = membrane_reference != NULL ? subsets[membrane_reference_index] : NULL;
+    subset_t *water_reference_subset = water_reference != NULL ? subsets[water_reference_index] : NULL;
+
+    // water and all the channels are analyzed in a single sweep over the union of their atoms
+    // (the channels of every atom are looked up in a table of bit masks)
+    uint32_t *masks = NULL;
+    subset_t *analyzed_subset = water_subset;
+    if (n_channels > 0) {
+        masks = malloc(frame->n_atoms * sizeof(uint32_t));
+        analyzed_subset = masks == NULL ? NULL : subset_union(frame, subsets + 1, 1 + n_channels, masks);
+        for (int c = 0; c < n_channels; ++c) free(subsets[2 + c]);
+    }
+
+    if (analyzed_subset == NULL) {
+        fprintf(stderr, "Could not allocate memory.\n");
+        xtc_close(xtc);
+        fclose(output_upper);
+        fclose(output_lower);
+        fclose(output_full);
+        if (output_pores != NULL) fclose(output_pores);
+        if (output_archive != NULL) fclose(output_archive);
+        frame_destroy(frame);
+        free(membrane_subset);
+        free(water_subset);
+        free(reference_subset);
+        free(membrane_reference_subset);
+        free(water_reference_subset);
+        free(masks);
+        return 1;
+    }
+
+    // prepare centering (and fitting) on the reference atoms
+    fit_t *fit = reference_subset == NULL ? NULL : fit_create(reference_subset, rotate);
+
     // get half of the water defect height --> used for later calculations
     float half_height = height / 2;
 
+    // only the water atoms close to the membrane are tested in every frame (if the skin is set)
+    slab_list_t *list = skin > 0 ? slab_list_create(analyzed_subset, half_height, skin, list_freq) : NULL;
+
+    // every thread collects the data into its own grid and the grids are merged at the end of the analysis
+    // (the same set of grids is used for every additional channel)
+    const size_t n_sets = 1 + n_channels;
+    grid_t **grids = grids_create(n_sets * n_threads, array_dimx, array_dimy, GRID_TILE);
+    pool_t *pool = pool_create(n_threads);
+
+    // voxel grid for the detection of water pores
+    pore_grid_t *pores = pore_file != NULL ? pore_grid_create(voxel, half_height) : NULL;
+
+    // the occupancies of all channels are archived in every frame
+    const char *channel_names[MAX_CHANNELS] = { "water" };
+    for (int c = 0; c < n_channels; ++c) channel_names[1 + c] = channels[c].name;
+    archive_t *archive = archive_file != NULL ? archive_create(output_archive, array_dimx, array_dimy, GRID_TILE, channel_names, n_sets, height, "wdmap (C Water Defect Map Calculator)", VERSION, argc, argv) : NULL;
+
+    // dynamic selections are re-evaluated in every frame using a cell list shared by both of them
+    dynamic_selection_t *dynamic_membrane = membrane_reference_subset == NULL ? NULL :
+            dynamic_create(membrane_subset, membrane_reference_subset, membrane_radius);
+    dynamic_selection_t *dynamic_water = water_reference_subset == NULL ? NULL :
+            dynamic_create(water_subset, water_reference_subset, water_radius);
+    dynamic_selection_t *dynamic[2] = {NULL};
+    size_t n_dynamic = 0;
+    if (dynamic_membrane != NULL) dynamic[n_dynamic++] = dynamic_membrane;
+    if (dynamic_water != NULL) dynamic[n_dynamic++] = dynamic_water;
+    selector_t *selector = n_dynamic > 0 ? selector_create(frame, dynamic, n_dynamic) : NULL;
+
+    // the locality of binning is only measured for a fixed set of water atoms
+    profile_t *profile = profiling ? profile_create(dynamic_water == NULL ? analyzed_subset : NULL, GRID_TILE) : NULL;
+
+    if (grids == NULL || pool == NULL ||
+        (reference_subset != NULL && fit == NULL) ||
+        (skin > 0 && list == NULL) ||
+        (pore_file != NULL && pores == NULL) ||
+        (archive_file != NULL && archive == NULL) ||
+        (membrane_reference_subset != NULL && dynamic_membrane == NULL) ||
+        (water_reference_subset != NULL && dynamic_water == NULL) ||
+        (n_dynamic > 0 && selector == NULL) ||
+        (profiling && profile == NULL)) {
+        fprintf(stderr, "Could not allocate memory (grid too large?)\n");
+        xtc_close(xtc);
+        fclose(output_upper);
+        fclose(output_lower);
+        fclose(output_full);
+        if (output_pores != NULL) fclose(output_pores);
+        if (output_archive != NULL) fclose(output_archive);
+        frame_destroy(frame);
+        free(membrane_subset);
+        free(water_subset);
+        free(reference_subset);
+        if (analyzed_subset != water_subset) free(analyzed_subset);
+        free(masks);
+        fit_destroy(fit);
+        slab_list_destroy(list);
+        grids_destroy(grids, n_sets * n_threads);
+        pool_destroy(pool);
+        pore_grid_destroy(pores);
+        archive_destroy(archive);
+        selector_destroy(selector);
+        dynamic_destroy(dynamic_membrane);
+        dynamic_destroy(dynamic_water);
+        free(membrane_reference_subset);
+        free(water_reference_subset);
+        profile_destroy(profile);
+        return 1;
+    }
+
+    // atoms analyzed in the current frame
+    const subset_t *frame_membrane = dynamic_membrane != NULL ? dynamic_membrane->selected : membrane_subset;
+    const subset_t *frame_water = dynamic_water != NULL ? dynamic_water->selected : analyzed_subset;
+
     int n_frames = 0;
+    size_t n_skipped = 0;
+
+    // number of frames with an open pore and number of pore openings
+    int n_open = 0, n_openings = 0, was_open = 0;
+    int return_code = 0, status = 0;
+    if (output_pores != NULL) write_pore_header(output_pores, argc, argv, voxel, height);
+
+    // grid in fixed-point coordinates (used if the trajectory precision allows it)
+    int_grid_t grid = {0};
+    frame_task_t task = { frame, analyzed_subset, fit, &grid, NULL, array_dimx, array_dimy, half_height, 0, 0, 0, 0, masks, n_threads, grids };
 
-    while (read_xtc_step(xtc, system) == 0) {
+    profile_start(profile);
+    while ((status = xtc_read_frame(xtc, frame)) == 0) {
+        profile_mark(profile, PROFILE_READ);
 
         // print info about the progress of reading
-        if ((int) system->time % PROGRESS_FREQ == 0) {
-            printf("Step: %d. Time: %.0f ps\r", system->step, system->time);
+        if ((int) frame->time % PROGRESS_FREQ == 0) {
+            printf("Step: %d. Time: %.0f ps\r", frame->step, frame->time);
             fflush(stdout);
         }
 
+        // evaluate dynamic selections before the system is centered (frames without any lipids selected are skipped)
+        if (selector != NULL && selector_update(selector, frame) != 0) {
+            fprintf(stderr, "\nCould not allocate memory.\n");
+            return_code = 1;
+            break;
+        }
+        if (selector != NULL) profile_mark(profile, PROFILE_SELECT);
+        if (frame_membrane->n_atoms == 0) {
+            ++n_skipped;
+            continue;
+        }
+
         // get membrane center
         vec_t center_mem = {0};
-        center_of_geometry(membrane_atoms, center_mem, system->box);
-
-        // loop through water atoms
-        for (size_t i = 0; i < water_atoms->n_atoms; ++i) {
-            atom_t *atom = water_atoms->atoms[i];
+        subset_center_of_geometry_parallel(frame, frame_membrane, pool, center_mem);
 
-            float rel_pos_z = distance1D(atom->position, center_mem, z, system->box);
+        int_grid_prepare(&grid, frame, array_dimx, array_dimy, GRID_TILE);
 
-            // if the atom is not inside the water defect area, continue with the next atom
-            if (fabsf(rel_pos_z) > half_height) continue;
-
-            // ignore atoms that are outside of the specified grid
-            if (atom->position[0] < array_dimx[0] || atom->position[0] > array_dimx[1] ||
-                atom->position[1] < array_dimy[0] || atom->position[1] > array_dimy[1]) {
-                    continue;
-                }
+        // center (and fit) the system using the reference atoms
+        if (fit != NULL) fit_frame(fit, frame);
 
-            // get index of the tile to which the atom should be assigned
-            size_t x_index = coor2index(atom->position[0], array_dimx[0]);
-            size_t y_index = coor2index(atom->position[1], array_dimy[0]);
-            
-            // assign the atom to a tile
-            if (rel_pos_z > 0) {
-                ++wd_map_upper[y_index * n_cols + x_index];
-            } else {
-                ++wd_map_lower[y_index * n_cols + x_index];
+        // membrane center, box size and water defect height in fixed-point units
+        // (fixed-point coordinates can not be used if the system is rotated)
+        task.use_fixed = grid.enabled && (fit == NULL || !fit->rotate);
+        if (task.use_fixed) {
+            task.center_fixed = llroundf(center_mem[2] * frame->precision);
+            task.box_fixed = llroundf(frame->box[2] * frame->precision);
+            task.half_height_fixed = llroundf(half_height * frame->precision);
+        }
+        profile_mark(profile, PROFILE_CENTER);
+
+        // water beads move little between frames, so keeping them sorted by tile
+        // makes the consecutive updates of the grid hit neighboring tiles
+        // (dynamically selected water atoms are kept in the order of the frame instead)
+        if (dynamic_water == NULL && n_frames % SORT_FREQ == 0) subset_sort_by_tile(frame, analyzed_subset, GRID_TILE);
+        profile_mark(profile, PROFILE_SORT);
+        profile_count(profile, frame, frame_water);
+
+        // assign water atoms to tiles using all threads
+        task.water_subset = list != NULL ? slab_list_update(list, frame, center_mem) : frame_water;
+        if (task.water_subset == NULL) {
+            fprintf(stderr, "\n%zu water atoms entered the slab without being in the list of water atoms close to the membrane.\n", list->n_missed);
+            fprintf(stderr, "Increase the skin (flag -s) or update the list more often (flag -u).\n");
+            return_code = 1;
+            break;
+        }
+        task.center_mem = center_mem;
+        pool_run(pool, assign_water, &task);
+        profile_mark(profile, PROFILE_BIN);
+
+        // find water pores spanning the water defect area
+        pore_stats_t stats = {0};
+        if (pores != NULL) {
+            if (pore_grid_fill(pores, frame, task.water_subset, masks, center_mem) != 0) {
+                fprintf(stderr, "\nCould not allocate memory for the detection of pores.\n");
+                return_code = 1;
+                break;
             }
+            pore_grid_label(pores, &stats);
 
-            ++wd_map_full[y_index * n_cols + x_index];
+            int opened = stats.n_pores > 0 && !was_open;
+            was_open = stats.n_pores > 0;
+            n_open += was_open;
+            n_openings += opened;
+            fprintf(output_pores, "%f %zu %.4f %.4f %d\n", frame->time, stats.n_pores, stats.total_area, stats.max_area, opened);
         }
 
+        // archive the occupancies of the tiles in this frame
+        if (archive != NULL && archive_write_frame(archive, grids, n_threads, frame, pores != NULL ? (int) stats.n_pores : -1) != 0) {
+            fprintf(stderr, "\nCould not write the archive %s.\n", archive_file);
+            return_code = 1;
+            break;
+        }
+
+        profile_mark(profile, PROFILE_OTHER);
+
         // increase the number of analyzed frames
         ++n_frames;
     }
+    if (status == 2) return_code = 1;
+
+    // maps are never written from an incomplete analysis
+    if (return_code != 0) {
+        fprintf(stderr, "Analysis stopped, no maps were written.\n");
+        goto analysis_end;
+    }
+
+    if (n_skipped > 0) printf("\nSkipped %zu frames without any lipid atoms selected.\n", n_skipped);
+    profile_write(profile, stdout, n_frames);
+
+    // merge the grids of all threads
+    for (size_t s = 0; s < n_sets; ++s) grids_merge(grids + s * n_threads, n_threads);
 
     // write output files
-    write_output(output_upper, argc, argv, n_rows, n_cols, n_frames, wd_map_upper, array_dimx, array_dimy);
-    write_output(output_lower, argc, argv, n_rows, n_cols, n_frames, wd_map_lower, array_dimx, array_dimy);
-    write_output(output_full,  argc, argv, n_rows, n_cols, n_frames, wd_map_full,  array_dimx, array_dimy);
+    const map_header_t header = {
+        "wdmap (C Water Defect Map Calculator)", VERSION,
+        "See average water defect at the end of this file.",
+        "water defect [arb. u.]", "hot", 0, 6,
+        "# Average water defect per square Å: %.6f arb. u.", n_frames };
+    const map_format_t format = binary ? MAP_BINARY : MAP_TEXT;
+    FILE *outputs[3] = { output_upper, output_lower, output_full };
+    const char *output_files[3] = { output_file_upper, output_file_lower, output_file_full };
+    if (wd_write_maps(grids[0], outputs, output_files, n_levels, &header, argc, argv, n_frames, format) != 0) {
+        fprintf(stderr, "Could not write output files.\n");
+        return_code = 1;
+    }
 
-    dict_destroy(ndx_groups);
-    xdrfile_close(xtc);
+    // write maps of the additional channels
+    for (int c = 0; c < n_channels; ++c) {
+        char note[48] = {0};
+        sprintf(note, "Channel: %.31s", channels[c].name);
+        map_header_t channel_header = header;
+        channel_header.note = note;
+
+        if (wd_write_channel_maps(grids[(c + 1) * n_threads], output_pattern, channels[c].name, n_levels, &channel_header, argc, argv, n_frames, format) != 0) {
+            fprintf(stderr, "Could not write output files for channel %s.\n", channels[c].name);
+            return_code = 1;
+        }
+    }
+
+    if (output_pores != NULL) {
+        fprintf(output_pores, "# Pores were open in %d of %d frames (%d openings).\n", n_open, n_frames, n_openings);
+        if (ferror(output_pores)) {
+            fprintf(stderr, "Could not write output file %s.\n", pore_file);
+            return_code = 1;
+        }
+    }
+
+    analysis_end:
+    if (output_pores != NULL) fclose(output_pores);
+    xtc_close(xtc);
     fclose(output_upper);
     fclose(output_lower);
     fclose(output_full);
@@ -408,14 +926,32 @@ int main(int argc, char **argv)
     free(output_file_lower);
     free(output_file_full);
 
-    free(all);
-    free(membrane_atoms);
-    free(water_atoms);
-    free(system);
-
-    free(wd_map_upper);
-    free(wd_map_lower);
-    free(wd_map_full);
+    frame_destroy(frame);
+    free(membrane_subset);
+    free(water_subset);
+    free(reference_subset);
+    if (analyzed_subset != water_subset) free(analyzed_subset);
+    free(masks);
+    fit_destroy(fit);
+    slab_list_destroy(list);
+
+    grids_destroy(grids, n_sets * n_threads);
+    pool_destroy(pool);
+    pore_grid_destroy(pores);
+    selector_destroy(selector);
+    dynamic_destroy(dynamic_membrane);
+    dynamic_destroy(dynamic_water);
+    free(membrane_reference_subset);
+    free(water_reference_subset);
+    profile_destroy(profile);
+
+    if (output_archive != NULL) {
+        if (fclose(output_archive) != 0) {
+            fprintf(stderr, "Could not write output file %s.\n", archive_file);
+            return_code = 1;
+        }
+        archive_destroy(archive);
+    }
 
-    return 0;
+    return return_code;
 }
\ No newline at end of file
@@ -0,0 +1,99 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#include "wdmaps.h"
+
+/*
+ * Part of the water defect map written into an output file.
+ */
+typedef struct wd_output {
+    int part;                   // GRID_UPPER, GRID_LOWER or -1 for the full map
+    int n_frames;
+    int n_tiles;                // number of original tiles merged into one tile (overview maps)
+} wd_output_t;
+
+/*
+ * Calculates the average water defect in a grid tile.
+ * Water defect of a merged tile is the average water defect of the original tiles.
+ */
+static int water_defect(const tile_t *tile, const void *data, double *wd)
+{
+    const wd_output_t *output = data;
+
+    uint64_t count = output->part < 0 ?
+            tile_count(tile, GRID_UPPER) + tile_count(tile, GRID_LOWER) :
+            tile_count(tile, output->part);
+
+    float value = (float) count / output->n_frames / output->n_tiles;
+    *wd = value;
+    return 1;
+}
+
+int wd_write_maps(
+        const grid_t *grid,
+        FILE *outputs[3],
+        const char *output_files[3],
+        const int n_levels,
+        const map_header_t *header,
+        int argc,
+        char **argv,
+        const int n_frames,
+        const map_format_t format)
+{
+    wd_output_t parts[3] = { { GRID_UPPER, n_frames, 1 }, { GRID_LOWER, n_frames, 1 }, { -1, n_frames, 1 } };
+    for (int i = 0; i < 3; ++i) {
+        float av_wd = 0.0f;
+        if (grid_write_map(outputs[i], grid, header, argc, argv, water_defect, &parts[i], format, &av_wd) != 0) return 1;
+    }
+
+    // write coarser overview maps
+    if (n_levels <= 0) return 0;
+
+    grid_t **levels = grid_pyramid(grid, n_levels);
+    int error = levels == NULL;
+    for (int i = 0; i < n_levels && !error; ++i) {
+        for (int j = 0; j < 3 && !error; ++j) {
+            parts[j].n_tiles = levels[i]->coarsening * levels[i]->coarsening;
+            error = grid_write_level(levels[i], output_files[j], header, argc, argv, water_defect, &parts[j], format);
+        }
+    }
+    grids_destroy(levels, n_levels);
+
+    return error;
+}
+
+int wd_write_channel_maps(
+        const grid_t *grid,
+        const char *output_pattern,
+        const char *channel,
+        const int n_levels,
+        const map_header_t *header,
+        int argc,
+        char **argv,
+        const int n_frames,
+        const map_format_t format)
+{
+    const char *suffixes[3] = { "_upper.dat", "_lower.dat", ".dat" };
+    char *output_files[3] = { NULL };
+    FILE *outputs[3] = { NULL };
+
+    int error = 0;
+    for (int i = 0; i < 3; ++i) {
+        output_files[i] = calloc(strlen(output_pattern) + (channel == NULL ? 0 : strlen(channel)) + 20, 1);
+        if (output_files[i] != NULL) {
+            if (channel == NULL) sprintf(output_files[i], "%s%s", output_pattern, suffixes[i]);
+            else sprintf(output_files[i], "%s_%s%s", output_pattern, channel, suffixes[i]);
+            outputs[i] = fopen(output_files[i], "w");
+        }
+        if (outputs[i] == NULL) error = 1;
+    }
+
+    if (!error) error = wd_write_maps(grid, outputs, (const char **) output_files, n_levels, header, argc, argv, n_frames, format);
+
+    for (int i = 0; i < 3; ++i) {
+        if (outputs[i] != NULL) fclose(outputs[i]);
+        free(output_files[i]);
+    }
+
+    return error;
+}
@@ -0,0 +1,44 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#ifndef WDMAPS_H
+#define WDMAPS_H
+
+#include <stdio.h>
+#include "grid.h"
+
+/*
+ * Writes the maps of water defect in the upper leaflet, the lower leaflet and the full membrane
+ * (and their coarser overview maps) into the opened output files.
+ * The names of the output files are used to name the overview maps.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+int wd_write_maps(
+        const grid_t *grid,
+        FILE *outputs[3],
+        const char *output_files[3],
+        const int n_levels,
+        const map_header_t *header,
+        int argc,
+        char **argv,
+        const int n_frames,
+        const map_format_t format);
+
+/*
+ * Writes the maps of water defect of a single channel into files named 'output_pattern'_upper.dat,
+ * 'output_pattern'_lower.dat and 'output_pattern'.dat. If the channel is not NULL, its name is inserted
+ * after the output pattern ('output_pattern'_'channel'_upper.dat etc.).
+ * Returns zero, if successful. Else returns non-zero.
+ */
+int wd_write_channel_maps(
+        const grid_t *grid,
+        const char *output_pattern,
+        const char *channel,
+        const int n_levels,
+        const map_header_t *header,
+        int argc,
+        char **argv,
+        const int n_frames,
+        const map_format_t format);
+
+#endif /* WDMAPS_H */
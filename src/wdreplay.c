@@ -0,0 +1,255 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#include <stdio.h>
+#include <unistd.h>
+#include <float.h>
+#include "grid.h"
+#include "archive.h"
+#include "wdmaps.h"
+
+const char VERSION[] = "v2023/08/07";
+
+/*
+ * Frames of the archive used to rebuild the maps depending on the water pores.
+ */
+typedef enum pore_condition {
+    PORES_ANY,                  // all frames
+    PORES_OPEN,                 // only frames with at least one open pore
+    PORES_CLOSED                // only frames without open pores
+} pore_condition_t;
+
+/*
+ * Parses command line arguments.
+ * Returns zero, if parsing has been successful. Else returns non-zero.
+ */
+int get_arguments(
+        int argc,
+        char **argv,
+        char **input_file,
+        char **output_pattern,
+        float *start_time,
+        float *end_time,
+        int   *stride,
+        pore_condition_t *condition,
+        int   *binary,
+        int   *n_levels)
+{
+    int input_specified = 0;
+
+    int opt = 0;
+    while((opt = getopt(argc, argv, "i:o:s:e:k:P:bm:h")) != -1) {
+        switch (opt) {
+        // help
+        case 'h':
+            return 1;
+        // archive to read
+        case 'i':
+            *input_file = optarg;
+            input_specified = 1;
+            break;
+        // output file name
+        case 'o':
+            *output_pattern = optarg;
+            break;
+        // time of the first used frame
+        case 's':
+            *start_time = atof(optarg);
+            break;
+        // time of the last used frame
+        case 'e':
+            *end_time = atof(optarg);
+            break;
+        // only use every n-th frame
+        case 'k':
+            sscanf(optarg, "%d", stride);
+            if (*stride <= 0) {
+                fprintf(stderr, "Stride must be >0, not %d.\n", *stride);
+                return 1;
+            }
+            break;
+        // use frames depending on the water pores
+        case 'P':
+            if (!strcmp(optarg, "open")) *condition = PORES_OPEN;
+            else if (!strcmp(optarg, "closed")) *condition = PORES_CLOSED;
+            else {
+                fprintf(stderr, "Could not understand pore condition '%s' (expected 'open' or 'closed').\n", optarg);
+                return 1;
+            }
+            break;
+        // binary output
+        case 'b':
+            *binary = 1;
+            break;
+        // number of coarser overview maps
+        case 'm':
+            sscanf(optarg, "%d", n_levels);
+            break;
+        default:
+            //fprintf(stderr, "Unknown command line option: %c.\n", opt);
+            return 1;
+        }
+    }
+
+    if (!input_specified) {
+        fprintf(stderr, "Archive file must always be supplied.\n");
+        return 1;
+    }
+
+    if (*start_time > *end_time) {
+        fprintf(stderr, "Start time must not be higher than end time.\n");
+        return 1;
+    }
+    return 0;
+}
+
+void print_usage(const char *program_name)
+{
+    printf("Usage: %s -i ARCHIVE [OPTION]...\n", program_name);
+    printf("\nOPTIONS\n");
+    printf("-h               print this message and exit\n");
+    printf("-i STRING        archive of tile occupancies written by wdmap (flag -A)\n");
+    printf("-o STRING        pattern for the output files (default: wd_map)\n");
+    printf("-s FLOAT         time of the first analyzed frame in ps (default: first frame)\n");
+    printf("-e FLOAT         time of the last analyzed frame in ps (default: last frame)\n");
+    printf("-k INTEGER       only analyze every n-th frame in the time window (default: 1)\n");
+    printf("-P STRING        only analyze frames with an open water pore (\"open\") or without it (\"closed\")\n");
+    printf("                 (requires an archive written with flag -p; default: all frames)\n");
+    printf("-b               write the output in binary format (can be converted to text using mapconv)\n");
+    printf("-m INTEGER       number of overview maps, each two times coarser than the previous one (default: 0)\n");
+    printf("\n");
+}
+
+/*
+ * Prints parameters that the program will use for rebuilding the water defect maps.
+ */
+void print_arguments(
+        FILE *stream,
+        const char *input_file,
+        const char *output_pattern,
+        const archive_t *archive,
+        const float start_time,
+        const float end_time,
+        const int stride,
+        const pore_condition_t condition,
+        const int binary,
+        const int n_levels)
+{
+    const archive_header_t *header = &archive->header;
+
+    fprintf(stream, "Parameters for Water Defect Map reconstruction:\n");
+    fprintf(stream, ">>> archive:          %s (%s %s)\n", input_file, header->program, header->version);
+    fprintf(stream, ">>> output pattern:   %s\n", output_pattern);
+    for (uint32_t c = 1; c < header->n_channels; ++c) fprintf(stream, ">>> channel:          %s\n", archive->names[c]);
+    fprintf(stream, ">>> wd height:        %f\n", header->height);
+    fprintf(stream, ">>> grid dimensions:  x: %.1f - %.1f nm, y: %.1f - %.1f nm\n", header->dimx[0], header->dimx[1], header->dimy[0], header->dimy[1]);
+    if (start_time > -FLT_MAX || end_time < FLT_MAX) fprintf(stream, ">>> time window:      %.1f - %.1f ps\n", start_time, end_time);
+    if (stride > 1) fprintf(stream, ">>> stride:           %d\n", stride);
+    if (condition != PORES_ANY) fprintf(stream, ">>> frames:           %s\n", condition == PORES_OPEN ? "open pores" : "closed pores");
+    if (binary) fprintf(stream, ">>> output format:    binary\n");
+    if (n_levels > 0) fprintf(stream, ">>> overview maps:    %d (up to %dx coarser)\n", n_levels, 1 << n_levels);
+    fprintf(stream, "\n");
+}
+
+int main(int argc, char **argv)
+{
+    printf("\n");
+    // get command line arguments
+    char *input_file = NULL;
+    char *output_pattern = "wd_map";
+    float start_time = -FLT_MAX;
+    float end_time = FLT_MAX;
+    int stride = 1;
+    pore_condition_t condition = PORES_ANY;
+    int binary = 0;
+    int n_levels = 0;
+    if (get_arguments(argc, argv, &input_file, &output_pattern, &start_time, &end_time, &stride, &condition, &binary, &n_levels) != 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    // check that the number of overview maps is sensible
+    if (n_levels < 0 || n_levels > MAP_MAX_LEVELS) {
+        fprintf(stderr, "Number of overview maps must be between 0 and %d.\n", MAP_MAX_LEVELS);
+        return 1;
+    }
+
+    FILE *input = fopen(input_file, "rb");
+    if (input == NULL) {
+        fprintf(stderr, "File %s could not be read.\n", input_file);
+        return 1;
+    }
+
+    archive_t *archive = archive_open(input);
+    if (archive == NULL) {
+        fprintf(stderr, "File %s is not a valid archive of tile occupancies.\n", input_file);
+        fclose(input);
+        return 1;
+    }
+
+    print_arguments(stdout, input_file, output_pattern, archive, start_time, end_time, stride, condition, binary, n_levels);
+
+    // one grid for every channel
+    const archive_header_t *archive_header = &archive->header;
+    grid_t **grids = grids_create(archive_header->n_channels, archive_header->dimx, archive_header->dimy, archive_header->tiles_per_nm);
+    if (grids == NULL) {
+        fprintf(stderr, "Could not allocate memory (grid too large?)\n");
+        archive_destroy(archive);
+        fclose(input);
+        return 1;
+    }
+
+    // frames outside of the selection are skipped without decoding their occupancies
+    int n_frames = 0;
+    size_t n_window = 0;
+    int status = 0;
+    while ((status = archive_read_frame(archive)) == 0) {
+        const archive_frame_t *frame = &archive->frame;
+        if (frame->time < start_time || frame->time > end_time) continue;
+        if (n_window++ % stride != 0) continue;
+
+        if (condition != PORES_ANY && frame->n_pores < 0) {
+            fprintf(stderr, "Archive %s does not contain information about water pores.\n", input_file);
+            status = 2;
+            break;
+        }
+        if ((condition == PORES_OPEN && frame->n_pores == 0) || (condition == PORES_CLOSED && frame->n_pores > 0)) continue;
+
+        if (archive_add_frame(archive, grids) != 0) {
+            status = 2;
+            break;
+        }
+        ++n_frames;
+    }
+
+    if (status == 2) fprintf(stderr, "Archive %s is corrupted or incomplete. Only the frames read before the error are used.\n", input_file);
+    printf("Frames used: %d\n", n_frames);
+
+    // write output files
+    map_header_t header = {
+        archive_header->program, archive_header->version,
+        "See average water defect at the end of this file.",
+        "water defect [arb. u.]", "hot", 0, 6,
+        "# Average water defect per square Å: %.6f arb. u.", n_frames };
+    const map_format_t format = binary ? MAP_BINARY : MAP_TEXT;
+
+    int return_code = status == 2;
+    for (uint32_t c = 0; c < archive_header->n_channels; ++c) {
+        char note[48] = {0};
+        if (c > 0) {
+            sprintf(note, "Channel: %.31s", archive->names[c]);
+            header.note = note;
+        }
+
+        if (wd_write_channel_maps(grids[c], output_pattern, c > 0 ? archive->names[c] : NULL, n_levels, &header, argc, argv, n_frames, format) != 0) {
+            fprintf(stderr, "Could not write output files for channel %s.\n", archive->names[c]);
+            return_code = 1;
+        }
+    }
+
+    grids_destroy(grids, archive_header->n_channels);
+    archive_destroy(archive);
+    fclose(input);
+
+    return return_code;
+}
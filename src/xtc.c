@@ -0,0 +1,884 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#include <fcntl.h>
+#include <glob.h>
+#include <sys/stat.h>
+#include "xtc.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// magic number at the start of every xtc frame
+static const int XTC_MAGIC = 1995;
+// number of zero bytes appended to the compressed coordinates
+// (reading a corrupted frame can never get outside of the buffer)
+static const size_t BUFFER_PADDING = 128;
+// size of the buffer used when reading from pipes
+static const size_t STREAM_BUFFER_SIZE = 1 << 20;
+// number of bytes at the start of the next part of a trajectory that the kernel is asked to read ahead
+static const off_t PREFETCH_SIZE = 1 << 26;
+
+// the following table and the decompression algorithm are taken from the xdrfile library
+static const int magicints[] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 8, 10, 12, 16, 20, 25, 32, 40, 50, 64,
+    80, 101, 128, 161, 203, 256, 322, 406, 512, 645, 812, 1024, 1290,
+    1625, 2048, 2580, 3250, 4096, 5060, 6501, 8192, 10321, 13003,
+    16384, 20642, 26007, 32768, 41285, 52015, 65536, 82570, 104031,
+    131072, 165140, 208063, 262144, 330280, 416127, 524287, 660561,
+    832255, 1048576, 1321122, 1664510, 2097152, 2642245, 3329021,
+    4194304, 5284491, 6658042, 8388607, 10568983, 13316085, 16777216 };
+
+#define FIRSTIDX 9
+#define LASTIDX XTC_N_MAGICINTS
+
+/*
+ * State of reading from the compressed bit stream.
+ */
+typedef struct bit_reader {
+    const unsigned char *data;
+    size_t position;            // number of bits consumed
+} bit_reader_t;
+
+/*
+ * Reads a big-endian 32-bit integer.
+ * Returns 1, if successful. Else returns 0.
+ */
+static int read_int(FILE *file, int *value)
+{
+    unsigned char bytes[4];
+    if (fread(bytes, 1, 4, file) != 4) return 0;
+
+    uint32_t u = ((uint32_t) bytes[0] << 24) | ((uint32_t) bytes[1] << 16) | ((uint32_t) bytes[2] << 8) | (uint32_t) bytes[3];
+    memcpy(value, &u, sizeof(int));
+    return 1;
+}
+
+/*
+ * Reads a big-endian 32-bit float.
+ * Returns 1, if successful. Else returns 0.
+ */
+static int read_float(FILE *file, float *value)
+{
+    int i = 0;
+    if (!read_int(file, &i)) return 0;
+
+    memcpy(value, &i, sizeof(float));
+    return 1;
+}
+
+/*
+ * Returns the number of bits needed to store an integer of given size.
+ */
+static int sizeofint(const unsigned int size)
+{
+    unsigned int num = 1;
+    int n_bits = 0;
+
+    while (size >= num && n_bits < 32) {
+        ++n_bits;
+        num <<= 1;
+    }
+
+    return n_bits;
+}
+
+/*
+ * Returns the number of bits needed to store three integers of given sizes.
+ */
+static int sizeofints(const unsigned int sizes[3])
+{
+    unsigned int bytes[32] = {0};
+    unsigned int n_bytes = 1;
+    bytes[0] = 1;
+
+    for (int i = 0; i < 3; ++i) {
+        unsigned int tmp = 0;
+        unsigned int bytecnt = 0;
+        for (bytecnt = 0; bytecnt < n_bytes; ++bytecnt) {
+            tmp = bytes[bytecnt] * sizes[i] + tmp;
+            bytes[bytecnt] = tmp & 0xff;
+            tmp >>= 8;
+        }
+        while (tmp != 0) {
+            bytes[bytecnt++] = tmp & 0xff;
+            tmp >>= 8;
+        }
+        n_bytes = bytecnt;
+    }
+
+    unsigned int num = 1;
+    int n_bits = 0;
+    --n_bytes;
+    while (bytes[n_bytes] >= num) {
+        ++n_bits;
+        num *= 2;
+    }
+
+    return n_bits + n_bytes * 8;
+}
+
+/*
+ * Reverses the order of bytes in a 64-bit integer.
+ */
+static inline uint64_t reverse_bytes(uint64_t value)
+{
+#if defined(__GNUC__)
+    return __builtin_bswap64(value);
+#else
+    value = ((value & 0x00000000ffffffffULL) << 32) | (value >> 32);
+    value = ((value & 0x0000ffff0000ffffULL) << 16) | ((value & 0xffff0000ffff0000ULL) >> 16);
+    value = ((value & 0x00ff00ff00ff00ffULL) << 8)  | ((value & 0xff00ff00ff00ff00ULL) >> 8);
+    return value;
+#endif
+}
+
+/*
+ * Reads an unsigned integer of n_bits (1 to 56) from the bit stream.
+ * The bits are extracted from a single 64-bit word loaded at the current position.
+ */
+static inline uint64_t receivebits(bit_reader_t *bits, const int n_bits)
+{
+    const unsigned char *bytes = bits->data + (bits->position >> 3);
+    uint64_t word = ((uint64_t) bytes[0] << 56) | ((uint64_t) bytes[1] << 48) |
+                    ((uint64_t) bytes[2] << 40) | ((uint64_t) bytes[3] << 32) |
+                    ((uint64_t) bytes[4] << 24) | ((uint64_t) bytes[5] << 16) |
+                    ((uint64_t) bytes[6] << 8)  |  (uint64_t) bytes[7];
+
+    word <<= bits->position & 7;
+    bits->position += n_bits;
+    return word >> (64 - n_bits);
+}
+
+/*
+ * Reads an integer packed into n_bits (at most 64) from the bit stream.
+ * The integer is stored as a sequence of bytes starting with the least significant one;
+ * the last (most significant) byte may be incomplete.
+ */
+static inline uint64_t receive_packed(bit_reader_t *bits, const int n_bits)
+{
+    const int n_full = (n_bits - 1) / 8;
+    const int last = n_bits - 8 * n_full;
+
+    if (n_bits <= 56) {
+        uint64_t word = receivebits(bits, n_bits);
+        uint64_t value = (word & ((1ULL << last) - 1)) << (8 * n_full);
+        if (n_full > 0) value |= reverse_bytes(word >> last) >> (64 - 8 * n_full);
+        return value;
+    }
+
+    uint64_t value = 0;
+    for (int i = 0; i < n_full; ++i) value |= receivebits(bits, 8) << (8 * i);
+    return value | (receivebits(bits, last) << (8 * n_full));
+}
+
+/*
+ * Prepares a divisor with a precomputed reciprocal value.
+ */
+static inline xtc_divisor_t make_divisor(const unsigned int value)
+{
+    xtc_divisor_t divisor = { value, 1.0 / value };
+    return divisor;
+}
+
+/*
+ * Divides an integer smaller than 2^52 using the reciprocal value of the divisor.
+ * The estimate of the quotient is off by at most one and is corrected using the remainder.
+ */
+static inline uint64_t divide(const uint64_t num, const xtc_divisor_t *divisor, unsigned int *remainder)
+{
+    uint64_t quotient = (uint64_t) ((double) num * divisor->inverse);
+    uint64_t product = quotient * divisor->value;
+
+    if (product > num) {
+        --quotient;
+        product -= divisor->value;
+    } else if (num - product >= divisor->value) {
+        ++quotient;
+        product += divisor->value;
+    }
+
+    *remainder = (unsigned int) (num - product);
+    return quotient;
+}
+
+/*
+ * Reads three integers packed into n_bits from the bit stream using byte-wise arithmetic.
+ * Only used for integers that do not fit into 64 bits.
+ */
+static void receiveints_wide(bit_reader_t *bits, int n_bits, const unsigned int sizes[3], int nums[3])
+{
+    unsigned int bytes[32];
+    int n_bytes = 0;
+    bytes[1] = bytes[2] = bytes[3] = 0;
+
+    while (n_bits > 8) {
+        bytes[n_bytes++] = receivebits(bits, 8);
+        n_bits -= 8;
+    }
+    if (n_bits > 0) {
+        bytes[n_bytes++] = receivebits(bits, n_bits);
+    }
+
+    for (int i = 2; i > 0; --i) {
+        unsigned int num = 0;
+        for (int j = n_bytes - 1; j >= 0; --j) {
+            num = (num << 8) | bytes[j];
+            unsigned int p = num / sizes[i];
+            bytes[j] = p;
+            num = num - p * sizes[i];
+        }
+        nums[i] = (int) num;
+    }
+
+    nums[0] = (int) (bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (bytes[3] << 24));
+}
+
+/*
+ * Reads three integers packed into n_bits from the bit stream.
+ */
+static inline void receiveints(
+        bit_reader_t *bits,
+        const int n_bits,
+        const unsigned int sizes[3],
+        const xtc_divisor_t *divisors,
+        int nums[3])
+{
+    if (n_bits > 64) {
+        receiveints_wide(bits, n_bits, sizes, nums);
+        return;
+    }
+
+    uint64_t num = receive_packed(bits, n_bits);
+
+    if (n_bits <= 52) {
+        unsigned int remainder = 0;
+        num = divide(num, &divisors[2], &remainder);
+        nums[2] = (int) remainder;
+        num = divide(num, &divisors[1], &remainder);
+        nums[1] = (int) remainder;
+        nums[0] = (int) num;
+    } else {
+        nums[2] = (int) (num % sizes[2]);
+        num /= sizes[2];
+        nums[1] = (int) (num % sizes[1]);
+        nums[0] = (int) (num / sizes[1]);
+    }
+}
+
+/*
+ * Stores integer coordinates of an atom, if the atom is resident.
+ * Atoms must be provided in ascending order.
+ */
+static inline void store_atom(const frame_t *frame, int *coordinates, size_t *cursor, const size_t atom, const int coord[3])
+{
+    if (*cursor >= frame->n_atoms || frame->system_ids[*cursor] != atom) return;
+
+    memcpy(coordinates + 3 * (*cursor), coord, 3 * sizeof(int));
+    ++(*cursor);
+}
+
+/*
+ * Converts integer coordinates to floats.
+ * Gives exactly the same results as the scalar conversion used by xdrfile.
+ */
+static void convert_coordinates(const int *coordinates, float *positions, const size_t n, const float inv_precision)
+{
+    size_t i = 0;
+
+#if defined(__AVX__)
+    const __m256 scale8 = _mm256_set1_ps(inv_precision);
+    for (; i + 8 <= n; i += 8) {
+        __m256i ints = _mm256_loadu_si256((const __m256i *) (coordinates + i));
+        _mm256_storeu_ps(positions + i, _mm256_mul_ps(_mm256_cvtepi32_ps(ints), scale8));
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128 scale4 = _mm_set1_ps(inv_precision);
+    for (; i + 4 <= n; i += 4) {
+        __m128i ints = _mm_loadu_si128((const __m128i *) (coordinates + i));
+        _mm_storeu_ps(positions + i, _mm_mul_ps(_mm_cvtepi32_ps(ints), scale4));
+    }
+#endif
+
+    for (; i < n; ++i) {
+        positions[i] = coordinates[i] * inv_precision;
+    }
+}
+
+/*
+ * Decodes the coordinates of a single frame.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+static int decode_coordinates(xtc_reader_t *xtc, frame_t *frame, const int n_atoms)
+{
+    int lsize = 0;
+    if (!read_int(xtc->file, &lsize) || lsize != n_atoms) return 1;
+
+    size_t cursor = 0;
+
+    // coordinates of very small systems are not compressed
+    if (n_atoms <= 9) {
+        for (int i = 0; i < n_atoms; ++i) {
+            vec_t position = {0.0f};
+            for (int dim = 0; dim < 3; ++dim) {
+                if (!read_float(xtc->file, &position[dim])) return 1;
+            }
+
+            if (cursor < frame->n_atoms && frame->system_ids[cursor] == (size_t) i) {
+                memcpy(frame->positions[cursor++], position, sizeof(vec_t));
+            }
+        }
+
+        frame->precision = 0.0f;
+        return 0;
+    }
+
+    int minint[3] = {0}, maxint[3] = {0};
+    int smallidx = 0, n_bytes = 0;
+    if (!read_float(xtc->file, &frame->precision)) return 1;
+    for (int dim = 0; dim < 3; ++dim) if (!read_int(xtc->file, &minint[dim])) return 1;
+    for (int dim = 0; dim < 3; ++dim) if (!read_int(xtc->file, &maxint[dim])) return 1;
+    if (!read_int(xtc->file, &smallidx) || !read_int(xtc->file, &n_bytes)) return 1;
+
+    if (smallidx < FIRSTIDX || smallidx >= LASTIDX || n_bytes < 0) return 1;
+
+    // read compressed coordinates (xdr pads them to a multiple of 4 bytes)
+    size_t padded_bytes = ((size_t) n_bytes + 3) & ~((size_t) 3);
+    if (xtc->capacity < padded_bytes + BUFFER_PADDING) {
+        unsigned char *new_buffer = realloc(xtc->buffer, padded_bytes + BUFFER_PADDING);
+        if (new_buffer == NULL) return 1;
+        xtc->buffer = new_buffer;
+        xtc->capacity = padded_bytes + BUFFER_PADDING;
+    }
+
+    if (fread(xtc->buffer, 1, padded_bytes, xtc->file) != padded_bytes) return 1;
+    memset(xtc->buffer + n_bytes, 0, padded_bytes - n_bytes + BUFFER_PADDING);
+
+    // fixed-point coordinates of the resident atoms are kept in the frame
+    int *coordinates = frame->coordinates;
+
+    unsigned int sizeint[3] = {0}, bitsizeint[3] = {0};
+    xtc_divisor_t divisors[3] = {{0}};
+    int bitsize = 0;
+    for (int dim = 0; dim < 3; ++dim) {
+        sizeint[dim] = (unsigned int) maxint[dim] - (unsigned int) minint[dim] + 1;
+        divisors[dim] = make_divisor(sizeint[dim] == 0 ? 1 : sizeint[dim]);
+    }
+
+    // if any of the sizes is too big to be multiplied, integers are stored separately
+    if ((sizeint[0] | sizeint[1] | sizeint[2]) > 0xffffff) {
+        for (int dim = 0; dim < 3; ++dim) {
+            bitsizeint[dim] = sizeofint(sizeint[dim]);
+            if (bitsizeint[dim] == 0) return 1;
+        }
+        bitsize = 0;
+    } else {
+        bitsize = sizeofints(sizeint);
+    }
+
+    int smaller = magicints[FIRSTIDX > smallidx - 1 ? FIRSTIDX : smallidx - 1] / 2;
+    int smallnum = magicints[smallidx] / 2;
+    unsigned int sizesmall[3] = { magicints[smallidx], magicints[smallidx], magicints[smallidx] };
+
+    bit_reader_t bits = { xtc->buffer, 0 };
+    const size_t n_bits_total = 8 * (size_t) n_bytes;
+    size_t atom = 0;
+    int run = 0;
+
+    // decoding stops once the last resident atom has been decoded
+    while (atom < (size_t) n_atoms && cursor < frame->n_atoms) {
+        if (bits.position > n_bits_total) return 1;
+
+        int thiscoord[3] = {0}, prevcoord[3] = {0};
+        if (bitsize == 0) {
+            thiscoord[0] = receivebits(&bits, bitsizeint[0]);
+            thiscoord[1] = receivebits(&bits, bitsizeint[1]);
+            thiscoord[2] = receivebits(&bits, bitsizeint[2]);
+        } else {
+            receiveints(&bits, bitsize, sizeint, divisors, thiscoord);
+        }
+
+        for (int dim = 0; dim < 3; ++dim) {
+            thiscoord[dim] += minint[dim];
+            prevcoord[dim] = thiscoord[dim];
+        }
+
+        int is_smaller = 0;
+        if (receivebits(&bits, 1) == 1) {
+            run = receivebits(&bits, 5);
+            is_smaller = run % 3;
+            run -= is_smaller;
+            --is_smaller;
+        }
+
+        if (atom + 1 + run / 3 > (size_t) n_atoms) return 1;
+
+        if (run > 0) {
+            const xtc_divisor_t small_divisors[3] = {
+                xtc->small_divisors[smallidx], xtc->small_divisors[smallidx], xtc->small_divisors[smallidx] };
+
+            for (int k = 0; k < run; k += 3) {
+                receiveints(&bits, smallidx, sizesmall, small_divisors, thiscoord);
+                for (int dim = 0; dim < 3; ++dim) thiscoord[dim] += prevcoord[dim] - smallnum;
+
+                if (k == 0) {
+                    // the first two atoms were interchanged for better compression of water molecules
+                    for (int dim = 0; dim < 3; ++dim) {
+                        int tmp = thiscoord[dim];
+                        thiscoord[dim] = prevcoord[dim];
+                        prevcoord[dim] = tmp;
+                    }
+                    store_atom(frame, coordinates, &cursor, atom++, prevcoord);
+                } else {
+                    memcpy(prevcoord, thiscoord, sizeof(prevcoord));
+                }
+                store_atom(frame, coordinates, &cursor, atom++, thiscoord);
+            }
+        } else {
+            store_atom(frame, coordinates, &cursor, atom++, thiscoord);
+        }
+
+        smallidx += is_smaller;
+        if (smallidx < FIRSTIDX || smallidx >= LASTIDX) return 1;
+
+        if (is_smaller < 0) {
+            smallnum = smaller;
+            smaller = smallidx > FIRSTIDX ? magicints[smallidx - 1] / 2 : 0;
+        } else if (is_smaller > 0) {
+            smaller = smallnum;
+            smallnum = magicints[smallidx] / 2;
+        }
+        sizesmall[0] = sizesmall[1] = sizesmall[2] = magicints[smallidx];
+    }
+
+    // convert the coordinates of all resident atoms to floats at once
+    const float inv_precision = 1.0 / frame->precision;
+    convert_coordinates(coordinates, (float *) frame->positions, 3 * frame->n_atoms, inv_precision);
+
+    return 0;
+}
+
+/*
+ * Appends a copy of a name to the list of parts of a trajectory.
+ * Returns non-zero if the memory could not be allocated.
+ */
+static int append_part(char ***parts, size_t *n_parts, const char *name)
+{
+    char **extended = realloc(*parts, (*n_parts + 1) * sizeof(char *));
+    if (extended == NULL) return 1;
+    *parts = extended;
+
+    if ((extended[*n_parts] = strdup(name)) == NULL) return 1;
+    ++*n_parts;
+    return 0;
+}
+
+/*
+ * Expands a comma-separated list of files and glob patterns into the names of the parts of a trajectory.
+ * Names of existing files are never treated as patterns. Patterns without any match are kept as they are.
+ * Returns NULL if the memory could not be allocated.
+ */
+static char **expand_parts(const char *filename, size_t *n_parts)
+{
+    char *list = strdup(filename);
+    if (list == NULL) return NULL;
+
+    char **parts = NULL;
+    *n_parts = 0;
+    int error = 0;
+    struct stat file_stat;
+    for (char *token = strtok(list, ","); token != NULL && !error; token = strtok(NULL, ",")) {
+        if (stat(token, &file_stat) == 0) {
+            error = append_part(&parts, n_parts, token);
+            continue;
+        }
+
+        glob_t matches;
+        if (glob(token, GLOB_NOCHECK, NULL, &matches) != 0) {
+            globfree(&matches);
+            error = 1;
+            break;
+        }
+        for (size_t i = 0; i < matches.gl_pathc && !error; ++i) error = append_part(&parts, n_parts, matches.gl_pathv[i]);
+        globfree(&matches);
+    }
+    free(list);
+
+    // empty list
+    if (*n_parts == 0) error = 1;
+
+    if (error) {
+        for (size_t i = 0; i < *n_parts; ++i) free(parts[i]);
+        free(parts);
+        *n_parts = 0;
+        return NULL;
+    }
+
+    return parts;
+}
+
+/*
+ * Opens the next part of the trajectory and asks the kernel to start reading it.
+ * Executed in the background while the current part is being read.
+ */
+static void *prefetch_part(void *arg)
+{
+    xtc_reader_t *xtc = arg;
+
+    FILE *file = fopen(xtc->parts[xtc->part + 1], "rb");
+    if (file != NULL) posix_fadvise(fileno(file), 0, PREFETCH_SIZE, POSIX_FADV_WILLNEED);
+
+    xtc->next_file = file;
+    return NULL;
+}
+
+/*
+ * Starts opening the next part of the trajectory in the background (if there is any).
+ */
+static void start_prefetch(xtc_reader_t *xtc)
+{
+    if (xtc->part + 1 >= xtc->n_parts) return;
+
+    xtc->next_file = NULL;
+    xtc->prefetching = pthread_create(&xtc->prefetch_thread, NULL, prefetch_part, xtc) == 0;
+
+    // opening the part in the background is only an optimization
+    if (!xtc->prefetching) prefetch_part(xtc);
+}
+
+/*
+ * Switches to the next part of the trajectory.
+ * Returns 0 if successful, 1 if there is no next part and 2 if the next part could not be opened.
+ */
+static int next_part(xtc_reader_t *xtc)
+{
+    if (xtc->part + 1 >= xtc->n_parts) return 1;
+
+    if (xtc->prefetching) {
+        pthread_join(xtc->prefetch_thread, NULL);
+        xtc->prefetching = 0;
+    }
+
+    if (xtc->next_file == NULL) {
+        fprintf(stderr, "\nPart %s of the trajectory could not be opened.\n", xtc->parts[xtc->part + 1]);
+        return 2;
+    }
+
+    fclose(xtc->file);
+    xtc->file = xtc->next_file;
+    xtc->next_file = NULL;
+    ++xtc->part;
+    xtc->skip_duplicates = 1;
+
+    start_prefetch(xtc);
+    return 0;
+}
+
+xtc_reader_t *xtc_open(const char *filename)
+{
+    // frames published by a frame server
+    if (strncmp(filename, RING_PREFIX, strlen(RING_PREFIX)) == 0) {
+        ring_t *ring = ring_attach(filename + strlen(RING_PREFIX));
+        if (ring == NULL) return NULL;
+
+        xtc_reader_t *xtc = calloc(1, sizeof(xtc_reader_t));
+        if (xtc == NULL) {
+            ring_close(ring);
+            return NULL;
+        }
+
+        xtc->ring = ring;
+        return xtc;
+    }
+
+    // trajectory split into several parts (an existing file is always read as it is, even if its name contains ',' or '[')
+    char **parts = NULL;
+    size_t n_parts = 0;
+    struct stat file_stat;
+    if (strcmp(filename, "-") != 0 && strpbrk(filename, ",*?[") != NULL && stat(filename, &file_stat) != 0) {
+        parts = expand_parts(filename, &n_parts);
+        if (parts == NULL) return NULL;
+        filename = parts[0];
+    }
+
+    int from_stdin = strcmp(filename, "-") == 0;
+    FILE *file = from_stdin ? stdin : fopen(filename, "rb");
+    xtc_reader_t *xtc = file == NULL ? NULL : calloc(1, sizeof(xtc_reader_t));
+    if (xtc == NULL) {
+        if (file != NULL && !from_stdin) fclose(file);
+        for (size_t i = 0; i < n_parts; ++i) free(parts[i]);
+        free(parts);
+        return NULL;
+    }
+
+    xtc->file = file;
+    xtc->from_stdin = from_stdin;
+    xtc->parts = parts;
+    xtc->n_parts = n_parts;
+    start_prefetch(xtc);
+
+    // larger buffer reduces the number of reads from pipes
+    if (xtc_is_stream(filename)) setvbuf(file, NULL, _IOFBF, STREAM_BUFFER_SIZE);
+
+    for (int i = FIRSTIDX; i < LASTIDX; ++i) {
+        xtc->small_divisors[i] = make_divisor(magicints[i]);
+    }
+
+    return xtc;
+}
+
+int xtc_is_stream(const char *filename)
+{
+    if (strcmp(filename, "-") == 0) return 1;
+    if (strncmp(filename, RING_PREFIX, strlen(RING_PREFIX)) == 0) return 1;
+
+    struct stat file_stat;
+    if (stat(filename, &file_stat) != 0) return 0;
+
+    return S_ISFIFO(file_stat.st_mode) || S_ISCHR(file_stat.st_mode) || S_ISSOCK(file_stat.st_mode);
+}
+
+/*
+ * Reads the magic number and the number of atoms at the start of a frame.
+ * Returns 0 if successful, 1 at the end of the file and 2 if the header is invalid.
+ */
+static int read_header(xtc_reader_t *xtc, int *n_atoms)
+{
+    if (xtc->header_pending) {
+        xtc->header_pending = 0;
+        *n_atoms = xtc->pending_atoms;
+        return 0;
+    }
+
+    int magic = 0;
+
+    // end of the file
+    if (!read_int(xtc->file, &magic)) return 1;
+
+    if (magic != XTC_MAGIC) {
+        fprintf(stderr, "\nInvalid xtc frame (magic number %d).\n", magic);
+        return 2;
+    }
+
+    if (!read_int(xtc->file, n_atoms)) {
+        fprintf(stderr, "\nXtc frame is truncated.\n");
+        return 2;
+    }
+
+    return 0;
+}
+
+int xtc_peek_atoms(xtc_reader_t *xtc, int *n_atoms)
+{
+    if (xtc->ring != NULL) {
+        *n_atoms = (int) xtc->ring->shared->n_atoms;
+        return 0;
+    }
+
+    if (read_header(xtc, n_atoms) != 0) return 1;
+
+    xtc->header_pending = 1;
+    xtc->pending_atoms = *n_atoms;
+    return 0;
+}
+
+/*
+ * Reads and discards the specified number of bytes.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+static int discard_bytes(FILE *file, size_t n_bytes)
+{
+    unsigned char discarded[4096];
+    while (n_bytes > 0) {
+        size_t chunk = n_bytes < sizeof(discarded) ? n_bytes : sizeof(discarded);
+        if (fread(discarded, 1, chunk, file) != chunk) return 1;
+        n_bytes -= chunk;
+    }
+
+    return 0;
+}
+
+/*
+ * Skips the rest of a frame (everything after the time) without decoding it.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+static int skip_frame(xtc_reader_t *xtc, const int n_atoms)
+{
+    // box and the number of atoms (repeated)
+    const size_t header_bytes = 4 * (9 + 1);
+    if (n_atoms <= 9) return discard_bytes(xtc->file, header_bytes + 12 * (size_t) n_atoms);
+
+    // precision, minint, maxint and smallidx precede the number of compressed bytes
+    int n_bytes = 0;
+    if (discard_bytes(xtc->file, header_bytes + 4 * (1 + 3 + 3 + 1)) != 0 ||
+        !read_int(xtc->file, &n_bytes) || n_bytes < 0) return 1;
+
+    return discard_bytes(xtc->file, ((size_t) n_bytes + 3) & ~((size_t) 3));
+}
+
+int xtc_read_frame(xtc_reader_t *xtc, frame_t *frame)
+{
+    if (xtc->ring != NULL) return ring_read(xtc->ring, frame);
+
+    int n_atoms = 0;
+    while (1) {
+        int status = read_header(xtc, &n_atoms);
+        // end of a part of the trajectory
+        if (status == 1) {
+            int next = next_part(xtc);
+            if (next == 0) continue;
+            return next;
+        }
+        if (status != 0) return 2;
+
+        if (!read_int(xtc->file, &frame->step) || !read_float(xtc->file, &frame->time)) {
+            fprintf(stderr, "\nXtc frame is truncated.\n");
+            return 2;
+        }
+
+        if (n_atoms < 0 || (size_t) n_atoms != frame->n_system_atoms) {
+            if (xtc->parts != NULL) fprintf(stderr, "\nNumber of atoms in xtc frame (%d) of %s does not match the system (%zu).\n", n_atoms, xtc->parts[xtc->part], frame->n_system_atoms);
+            else fprintf(stderr, "\nNumber of atoms in xtc frame (%d) does not match the system (%zu).\n", n_atoms, frame->n_system_atoms);
+            return 2;
+        }
+
+        // frames at the start of a part repeating the end of the previous part
+        if (xtc->skip_duplicates && frame->time <= xtc->last_time) {
+            if (skip_frame(xtc, n_atoms) != 0) {
+                fprintf(stderr, "\nXtc frame is truncated.\n");
+                return 2;
+            }
+            continue;
+        }
+
+        xtc->skip_duplicates = 0;
+        break;
+    }
+
+    float box[9] = {0.0f};
+
+    for (int i = 0; i < 9; ++i) {
+        if (!read_float(xtc->file, &box[i])) {
+            fprintf(stderr, "\nXtc frame is truncated.\n");
+            return 2;
+        }
+    }
+
+    // only rectangular boxes are supported
+    frame->box[0] = box[0];
+    frame->box[1] = box[4];
+    frame->box[2] = box[8];
+
+    if (decode_coordinates(xtc, frame, n_atoms) != 0) {
+        fprintf(stderr, "\nXtc frame at time %.0f ps is truncated or corrupted.\n", frame->time);
+        return 2;
+    }
+
+    xtc->last_time = frame->time;
+    return 0;
+}
+
+xtc_index_t *xtc_index_create(const char *filename)
+{
+    if (xtc_is_stream(filename)) return NULL;
+
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) return NULL;
+
+    struct stat file_stat;
+    if (fstat(fileno(file), &file_stat) != 0) {
+        fclose(file);
+        return NULL;
+    }
+
+    xtc_index_t *index = calloc(1, sizeof(xtc_index_t));
+    if (index == NULL) {
+        fclose(file);
+        return NULL;
+    }
+
+    size_t capacity = 0;
+    while (1) {
+        int64_t offset = (int64_t) ftello(file);
+
+        int magic = 0, n_atoms = 0;
+        // end of the file
+        if (!read_int(file, &magic)) break;
+
+        if (magic != XTC_MAGIC || !read_int(file, &n_atoms) || n_atoms < 0) {
+            xtc_index_destroy(index);
+            fclose(file);
+            return NULL;
+        }
+
+        // step, time, box and the number of atoms (repeated)
+        int n_bytes = 0;
+        int64_t end = offset + 4 * (2 + 1 + 1 + 9 + 1);
+
+        if (n_atoms <= 9) {
+            end += 12 * (int64_t) n_atoms;
+        } else {
+            // precision, minint, maxint and smallidx precede the number of compressed bytes
+            end += 4 * (1 + 3 + 3 + 1);
+            if (end + 4 > file_stat.st_size || fseeko(file, end, SEEK_SET) != 0 || !read_int(file, &n_bytes) || n_bytes < 0) break;
+            end += 4 + (((int64_t) n_bytes + 3) & ~((int64_t) 3));
+        }
+
+        // truncated frame
+        if (end > file_stat.st_size) break;
+
+        if (index->n_frames == capacity) {
+            capacity = capacity == 0 ? 1024 : 2 * capacity;
+            int64_t *new_offsets = realloc(index->offsets, capacity * sizeof(int64_t));
+            if (new_offsets == NULL) {
+                xtc_index_destroy(index);
+                fclose(file);
+                return NULL;
+            }
+            index->offsets = new_offsets;
+        }
+
+        if (index->n_frames == 0) index->n_atoms = n_atoms;
+        index->offsets[index->n_frames++] = offset;
+
+        if (fseeko(file, end, SEEK_SET) != 0) break;
+    }
+
+    fclose(file);
+    return index;
+}
+
+void xtc_index_destroy(xtc_index_t *index)
+{
+    if (index == NULL) return;
+
+    free(index->offsets);
+    free(index);
+}
+
+int xtc_seek(xtc_reader_t *xtc, const xtc_index_t *index, const size_t frame)
+{
+    if (xtc->ring != NULL || xtc->from_stdin || frame >= index->n_frames) return 1;
+    if (fseeko(xtc->file, (off_t) index->offsets[frame], SEEK_SET) != 0) return 1;
+
+    xtc->header_pending = 0;
+    return 0;
+}
+
+void xtc_close(xtc_reader_t *xtc)
+{
+    if (xtc == NULL) return;
+
+    if (xtc->ring != NULL) ring_close(xtc->ring);
+    else if (!xtc->from_stdin) fclose(xtc->file);
+
+    if (xtc->prefetching) pthread_join(xtc->prefetch_thread, NULL);
+    if (xtc->next_file != NULL) fclose(xtc->next_file);
+    for (size_t i = 0; i < xtc->n_parts; ++i) free(xtc->parts[i]);
+    free(xtc->parts);
+
+    free(xtc->buffer);
+    free(xtc);
+}
@@ -0,0 +1,111 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+#ifndef XTC_H
+#define XTC_H
+
+#include <pthread.h>
+#include "frame.h"
+#include "ring.h"
+
+// number of sizes of small integers used by the xtc compression algorithm
+#define XTC_N_MAGICINTS 73
+
+/*
+ * Divisor with a precomputed reciprocal value.
+ */
+typedef struct xtc_divisor {
+    uint64_t value;
+    double inverse;
+} xtc_divisor_t;
+
+/*
+ * Reader of xtc trajectories that decodes coordinates directly into a frame.
+ * Only coordinates of the atoms resident in the frame are stored; all other atoms
+ * are decoded (the xtc format requires it) but immediately discarded.
+ */
+typedef struct xtc_reader {
+    FILE *file;
+    int from_stdin;             // 1 if the trajectory is read from the standard input
+    int header_pending;         // 1 if the start of the next frame has already been read
+    int pending_atoms;          // number of atoms of the next frame (if header_pending)
+    unsigned char *buffer;      // compressed coordinates of the current frame
+    size_t capacity;            // allocated size of the buffer
+    xtc_divisor_t small_divisors[XTC_N_MAGICINTS];  // divisors for unpacking small integers
+    ring_t *ring;               // ring of a frame server the frames are read from (NULL if reading a file)
+    char **parts;               // names of all parts of a multi-part trajectory (NULL if reading a single file)
+    size_t n_parts;
+    size_t part;                // index of the part that is currently read
+    int prefetching;            // 1 if the next part is being opened in the background
+    pthread_t prefetch_thread;
+    FILE *next_file;            // next part opened in the background (NULL if it could not be opened)
+    int skip_duplicates;        // 1 if the frames repeating the end of the previous part should be skipped
+    float last_time;            // time of the last frame read
+} xtc_reader_t;
+
+/*
+ * Offsets of all frames of an xtc file, allowing the frames to be read in any order.
+ */
+typedef struct xtc_index {
+    size_t n_frames;
+    int n_atoms;                // number of atoms in the first frame (0 if there are no frames)
+    int64_t *offsets;           // offset of every frame from the start of the file
+} xtc_index_t;
+
+/*
+ * Opens an xtc file for reading.
+ * If filename is "-", the trajectory is read from the standard input.
+ * Named pipes and other non-seekable files are also supported as the file is only read sequentially.
+ * If filename is "shm:NAME", the already decoded frames are read from the ring NAME published by framesrv.
+ * If filename is a comma-separated list of files and/or contains a glob pattern (e.g. "md.part*.xtc"),
+ * all matching files are read as parts of a single trajectory (matches of each pattern in alphabetical order).
+ * Frames at the start of a part that are not newer than the last frame of the previous part are skipped.
+ * Returns NULL if the file (or the first part) could not be opened.
+ */
+xtc_reader_t *xtc_open(const char *filename);
+
+/*
+ * Returns 1 if the file is a stream that can only be read once (standard input, a named pipe or a frame server).
+ * Else returns 0.
+ */
+int xtc_is_stream(const char *filename);
+
+/*
+ * Gets the number of atoms from the header of the next frame without consuming the frame.
+ * Allows validating the trajectory without reading it twice.
+ * Returns zero, if successful. Returns non-zero if no valid frame header could be read.
+ */
+int xtc_peek_atoms(xtc_reader_t *xtc, int *n_atoms);
+
+/*
+ * Reads the next frame from the xtc file into the frame.
+ * Returns 0 if successful, 1 at the end of the trajectory and 2 if the frame could not be read
+ * (in that case, an error message is also printed).
+ */
+int xtc_read_frame(xtc_reader_t *xtc, frame_t *frame);
+
+/*
+ * Scans the xtc file and gets the offsets of all its frames.
+ * Only the headers of the frames are read, the compressed coordinates are skipped.
+ * A truncated frame at the end of the file is not indexed.
+ * Returns NULL if the file could not be indexed (e.g. if it is a stream or if it is not an xtc file).
+ */
+xtc_index_t *xtc_index_create(const char *filename);
+
+/*
+ * Frees all memory associated with the index.
+ */
+void xtc_index_destroy(xtc_index_t *index);
+
+/*
+ * Moves the reader to the specified frame of the file, so that it is read by the next call to xtc_read_frame.
+ * Returns zero, if successful. Else returns non-zero.
+ */
+int xtc_seek(xtc_reader_t *xtc, const xtc_index_t *index, const size_t frame);
+
+/*
+ * Closes the xtc file and frees all memory associated with the reader.
+ */
+void xtc_close(xtc_reader_t *xtc);
+
+#endif /* XTC_H */
@@ -0,0 +1,209 @@
+// Released under MIT License.
+// Copyright (c) 2023 Ladislav Bartos
+
+/*
+ * Fuzz-style equivalence test of the xtc decoder (xtc_read_frame) against the xdrfile reader of groan (read_xtc_step).
+ * Random trajectories are written using write_xtc and decoded by both readers. The positions must be bit-identical
+ * and the fixed-point coordinates must be exactly the integers written into the file.
+ *
+ * Usage: xtc_fuzz [ITERATIONS] [SEED]
+ */
+
+#include <stdio.h>
+#include <limits.h>
+#include <groan.h>
+#include "frame.h"
+#include "xtc.h"
+
+// temporary trajectory written and read by the test
+static const char TEST_FILE[] = "xtc_fuzz_test.xtc";
+// number of frames of every trajectory
+static const int N_FRAMES = 3;
+
+static uint64_t state = 0;
+
+/*
+ * Returns a pseudo-random 32-bit integer (xorshift64*).
+ */
+static uint32_t random_int(void)
+{
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return (uint32_t) ((state * 2685821657736338717ULL) >> 32);
+}
+
+/*
+ * Returns a pseudo-random float from [0, 1).
+ */
+static float random_float(void)
+{
+    return (random_int() >> 8) / 16777216.0f;
+}
+
+/*
+ * Calculates the integer written by xdrfile for a coordinate (the same float arithmetic as in xdrfile).
+ */
+static int xdr_integer(const float coordinate, const float precision)
+{
+    float lf = coordinate * precision;
+    if (lf >= 0.0f) lf += 0.5f;
+    else lf -= 0.5f;
+    return (int) lf;
+}
+
+/*
+ * Generates the positions of a random frame. Atoms are placed in runs: within a run, consecutive atoms
+ * are separated by small deltas (as in water or lipids), while runs start at random positions in the whole range
+ * (large deltas). The length of the runs and the size of the deltas vary between frames.
+ */
+static void generate_positions(rvec *positions, const int n_atoms, const float range, const float precision)
+{
+    const float small = (random_int() % 4 == 0 ? 100.0f : 3.0f) / precision;
+    const float run_probability = random_float() * 0.5f;
+
+    float current[3] = {0.0f};
+    for (int i = 0; i < n_atoms; ++i) {
+        if (i == 0 || random_float() < run_probability) {
+            for (int d = 0; d < 3; ++d) current[d] = (random_float() - 0.25f) * range;
+        } else {
+            for (int d = 0; d < 3; ++d) current[d] += (random_float() - 0.5f) * small * (1 + random_int() % 8);
+        }
+
+        memcpy(positions[i], current, sizeof(rvec));
+    }
+}
+
+/*
+ * Writes a random trajectory, decodes it with both readers and compares the results.
+ * Returns the number of compared atom positions or -1 if the readers disagree.
+ */
+static long test_trajectory(const int iteration)
+{
+    // tiny systems (up to 9 atoms are stored uncompressed), small and large systems
+    const int sizes[4] = { 1 + random_int() % 9, 10 + random_int() % 100, 100 + random_int() % 5000, 10000 + random_int() % 30000 };
+    const int n_atoms = sizes[random_int() % 4];
+    const float precisions[5] = { 10.0f, 100.0f, 1000.0f, 1000.0f, 10000.0f };
+    const float precision = precisions[random_int() % 5];
+    // ranges from a fraction of a nanometer up to coordinates close to the largest integers xdrfile can store
+    const float max_range = (float) (INT_MAX / 4) / precision;
+    const float ranges[4] = { 0.5f, 20.0f, 500.0f, max_range };
+    const float range = fminf(ranges[random_int() % 4], max_range);
+
+    rvec *written = malloc(N_FRAMES * n_atoms * sizeof(rvec));
+    system_t *system = calloc(1, sizeof(system_t) + n_atoms * sizeof(atom_t));
+    atom_selection_t *selection = malloc(sizeof(atom_selection_t) + n_atoms * sizeof(atom_t *));
+    if (written == NULL || system == NULL || selection == NULL) {
+        fprintf(stderr, "Could not allocate memory.\n");
+        free(written);
+        free(system);
+        free(selection);
+        return -1;
+    }
+
+    XDRFILE *output = xdrfile_open(TEST_FILE, "w");
+    if (output == NULL) {
+        fprintf(stderr, "Could not write %s.\n", TEST_FILE);
+        free(written);
+        free(system);
+        free(selection);
+        return -1;
+    }
+
+    for (int f = 0; f < N_FRAMES; ++f) {
+        matrix box = {{0.0f}};
+        for (int d = 0; d < 3; ++d) box[d][d] = 1.0f + random_float() * range;
+        generate_positions(written + f * n_atoms, n_atoms, range, precision);
+        write_xtc(output, n_atoms, 1000 * f, 20.0f * f, box, written + f * n_atoms, precision);
+    }
+    xdrfile_close(output);
+
+    // only a random part of the atoms is resident (or all of them)
+    system->n_atoms = n_atoms;
+    selection->n_atoms = 0;
+    const float keep = random_int() % 2 ? 1.0f : random_float();
+    for (int i = 0; i < n_atoms; ++i) {
+        if (random_float() < keep || i == n_atoms - 1) selection->atoms[selection->n_atoms++] = &system->atoms[i];
+    }
+
+    subset_t *subset = NULL;
+    frame_t *frame = frame_create(system, &selection, 1, &subset);
+    XDRFILE *reference = xdrfile_open(TEST_FILE, "r");
+    xtc_reader_t *xtc = xtc_open(TEST_FILE);
+
+    long n_compared = 0;
+    int error = frame == NULL || reference == NULL || xtc == NULL;
+    if (error) fprintf(stderr, "Could not open %s for reading.\n", TEST_FILE);
+
+    for (int f = 0; f < N_FRAMES && !error; ++f) {
+        if (read_xtc_step(reference, system) != 0 || xtc_read_frame(xtc, frame) != 0) {
+            fprintf(stderr, "Iteration %d (%d atoms, precision %.0f): frame %d could not be read.\n", iteration, n_atoms, precision, f);
+            error = 1;
+            break;
+        }
+
+        if (frame->step != system->step || frame->time != system->time ||
+            memcmp(frame->box, system->box, sizeof(box_t)) != 0) {
+                fprintf(stderr, "Iteration %d (%d atoms, precision %.0f): header of frame %d differs.\n", iteration, n_atoms, precision, f);
+                error = 1;
+                break;
+            }
+
+        for (size_t i = 0; i < frame->n_atoms && !error; ++i) {
+            const size_t id = frame->system_ids[i];
+            if (memcmp(frame->positions[i], system->atoms[id].position, sizeof(vec_t)) != 0) {
+                fprintf(stderr, "Iteration %d (%d atoms, precision %.0f): position of atom %zu in frame %d differs.\n", iteration, n_atoms, precision, id, f);
+                error = 1;
+            }
+
+            // fixed-point coordinates are only available for compressed frames
+            for (int d = 0; d < 3 && frame->precision != 0.0f && !error; ++d) {
+                const int expected = xdr_integer(written[f * n_atoms + id][d], precision);
+                if (frame->coordinates[3 * i + d] != expected) {
+                    fprintf(stderr, "Iteration %d (%d atoms, precision %.0f): fixed-point coordinate of atom %zu in frame %d is %d, not %d.\n",
+                            iteration, n_atoms, precision, id, f, frame->coordinates[3 * i + d], expected);
+                    error = 1;
+                }
+            }
+            ++n_compared;
+        }
+    }
+
+    // both readers must also agree that the trajectory has ended
+    if (!error && xtc_read_frame(xtc, frame) == 0) {
+        fprintf(stderr, "Iteration %d: frame read past the end of the trajectory.\n", iteration);
+        error = 1;
+    }
+
+    if (xtc != NULL) xtc_close(xtc);
+    if (reference != NULL) xdrfile_close(reference);
+    frame_destroy(frame);
+    free(subset);
+    free(selection);
+    free(system);
+    free(written);
+
+    return error ? -1 : n_compared;
+}
+
+int main(int argc, char **argv)
+{
+    const int n_iterations = argc > 1 ? atoi(argv[1]) : 300;
+    state = argc > 2 ? strtoull(argv[2], NULL, 10) : 88172645463325252ULL;
+    if (state == 0) state = 1;
+
+    long n_compared = 0;
+    for (int i = 0; i < n_iterations; ++i) {
+        const long n = test_trajectory(i);
+        if (n < 0) {
+            remove(TEST_FILE);
+            printf("xtc_fuzz: FAILED\n");
+            return 1;
+        }
+        n_compared += n;
+    }
+
+    remove(TEST_FILE);
+    printf("xtc_fuzz: %d trajectories, %ld atom positions identical to xdrfile\n", n_iterations, n_compared);
+    return 0;
+}